@@ -21,6 +21,9 @@
 #include "config.h"
 #include "ephy-filters-manager.h"
 
+#include "ephy-adblock-compiler.h"
+#include "ephy-adblock-image.h"
+#include "ephy-debug.h"
 #include "ephy-download.h"
 #include "ephy-prefs.h"
 #include "ephy-settings.h"
@@ -35,6 +38,15 @@ struct _EphyFiltersManager {
 
   char *filters_dir;
   GCancellable *cancellable;
+
+  guint pending_downloads;
+  GCancellable *compile_cancellable;
+
+  /* Remembers the lists it last compiled, so only the lists that changed
+   * are parsed again. Only used from compile threads, under the mutex,
+   * since a cancelled compile might still be running. */
+  EphyAdblockCompiler *compiler;
+  GMutex compiler_mutex;
 };
 
 G_DEFINE_TYPE (EphyFiltersManager, ephy_filters_manager, G_TYPE_OBJECT)
@@ -107,10 +119,24 @@ adblock_filter_retrieve_data_free (AdblockFilterRetrieveData *data)
   g_free (data);
 }
 
+static void compile_adblock_filters (EphyFiltersManager *manager);
+
+static void
+adblock_filter_retrieved (EphyFiltersManager *manager)
+{
+  g_assert (manager->pending_downloads > 0);
+
+  /* Compile once all the lists are here, rather than once per list. */
+  if (--manager->pending_downloads == 0)
+    compile_adblock_filters (manager);
+}
+
 static void
 download_completed_cb (EphyDownload              *download,
                        AdblockFilterRetrieveData *data)
 {
+  adblock_filter_retrieved (data->manager);
+
   g_signal_handlers_disconnect_by_data (download, data);
   adblock_filter_retrieve_data_free (data);
 }
@@ -133,6 +159,8 @@ download_error_cb (EphyDownload              *download,
   if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
     g_warning ("Error retrieving filter %s: %s\n", data->source_uri, error->message);
 
+  adblock_filter_retrieved (data->manager);
+
   g_signal_handlers_disconnect_by_data (download, data);
   adblock_filter_retrieve_data_free (data);
 }
@@ -157,6 +185,7 @@ start_retrieving_filter_file (EphyFiltersManager *manager,
   webkit_download_set_allow_overwrite (wk_download, TRUE);
 
   data = adblock_filter_retrieve_data_new (manager, download, filter_url);
+  manager->pending_downloads++;
 
   g_signal_connect (download, "completed",
                     G_CALLBACK (download_completed_cb), data);
@@ -171,11 +200,22 @@ remove_old_adblock_filters (EphyFiltersManager *manager,
 {
   GFile *file;
   GFile *filters_dir;
+  GFile *image_file;
   GFileEnumerator *enumerator;
   gboolean current_filter;
   char *path;
+  char *name;
+  char *temp_prefix;
   GError *error = NULL;
 
+  /* g_file_set_contents() writes the image to a temporary file next to it,
+   * named after it, and a compile thread might be doing so right now. */
+  image_file = ephy_uri_tester_get_adblock_image_file (manager->filters_dir);
+  name = g_file_get_basename (image_file);
+  temp_prefix = g_strconcat (name, ".", NULL);
+  g_free (name);
+  g_object_unref (image_file);
+
   filters_dir = g_file_new_for_path (manager->filters_dir);
   enumerator = g_file_enumerate_children (filters_dir,
                                           G_FILE_ATTRIBUTE_STANDARD_NAME,
@@ -186,6 +226,7 @@ remove_old_adblock_filters (EphyFiltersManager *manager,
     g_warning ("Failed to enumerate children of %s: %s", manager->filters_dir, error->message);
     g_error_free (error);
     g_object_unref (filters_dir);
+    g_free (temp_prefix);
     return;
   }
 
@@ -203,13 +244,12 @@ remove_old_adblock_filters (EphyFiltersManager *manager,
     if (file == NULL)
       break;
 
-    current_filter = FALSE;
-    for (GList *l = current_files; l != NULL; l = l->next) {
-      if (g_file_equal (l->data, file)) {
-        current_filter = TRUE;
-        break;
-      }
-    }
+    name = g_file_get_basename (file);
+    current_filter = g_str_has_prefix (name, temp_prefix);
+    g_free (name);
+
+    for (GList *l = current_files; l != NULL && !current_filter; l = l->next)
+      current_filter = g_file_equal (l->data, file);
 
     if (!current_filter) {
       g_file_delete (file, NULL, &error);
@@ -224,10 +264,221 @@ remove_old_adblock_filters (EphyFiltersManager *manager,
 
   g_object_unref (filters_dir);
   g_object_unref (enumerator);
+  g_free (temp_prefix);
 }
 
+typedef struct {
+  GPtrArray *filter_files;
+  char *image_path;
+  gboolean force;
+} CompileAdblockFiltersData;
+
 static void
-update_adblock_filter_files (EphyFiltersManager *manager)
+compile_adblock_filters_data_free (CompileAdblockFiltersData *data)
+{
+  g_ptr_array_unref (data->filter_files);
+  g_free (data->image_path);
+  g_free (data);
+}
+
+static guint64
+get_modification_time (GFile *file)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+
+  file_info = g_file_query_info (file,
+                                 G_FILE_ATTRIBUTE_TIME_MODIFIED,
+                                 G_FILE_QUERY_INFO_NONE,
+                                 NULL,
+                                 NULL);
+  if (!file_info)
+    return 0;
+
+  return g_file_info_get_attribute_uint64 (file_info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+}
+
+static EphyAdblockImage *
+load_up_to_date_adblock_image (CompileAdblockFiltersData *data)
+{
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GFile) image_file = NULL;
+  guint64 image_time;
+
+  image_file = g_file_new_for_path (data->image_path);
+  image_time = get_modification_time (image_file);
+  if (image_time == 0)
+    return NULL;
+
+  /* Also catches images written by older versions. */
+  image = ephy_adblock_image_new_from_file (data->image_path, NULL);
+  if (!image)
+    return NULL;
+
+  for (guint i = 0; i < data->filter_files->len; i++) {
+    if (get_modification_time (g_ptr_array_index (data->filter_files, i)) > image_time)
+      return NULL;
+  }
+
+  return g_steal_pointer (&image);
+}
+
+/* Called with compiler_mutex held. */
+static EphyAdblockImage *
+compile_adblock_image (EphyFiltersManager         *manager,
+                       CompileAdblockFiltersData  *data,
+                       GCancellable               *cancellable,
+                       GError                    **error)
+{
+  EphyAdblockImage *image;
+  gboolean changed;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  /* Lists that could not be downloaded are simply left out. */
+  if (!manager->compiler)
+    manager->compiler = ephy_adblock_compiler_new ();
+  if (!ephy_adblock_compiler_set_files (manager->compiler, data->filter_files, &changed, cancellable, error))
+    return NULL;
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  /* A refresh usually downloads the very same lists again. Don't replace
+   * the image then, or every web process would reload it for nothing. */
+  if (!changed) {
+    image = ephy_adblock_image_new_from_file (data->image_path, NULL);
+    if (image) {
+      LOG ("Adblock filters did not change, keeping %s", data->image_path);
+      return image;
+    }
+  }
+
+  /* Web processes monitor the image and pick up the new one on their own. */
+  if (!ephy_adblock_compiler_write (manager->compiler, data->image_path, error)) {
+    /* Start from scratch next time, the image does not match the lists. */
+    g_clear_pointer (&manager->compiler, ephy_adblock_compiler_free);
+    return NULL;
+  }
+
+  LOG ("Compiled adblock filters into %s", data->image_path);
+
+  return ephy_adblock_image_new_from_file (data->image_path, error);
+}
+
+/* Web processes wait for a valid image before loading their first page, so
+ * leave them one without any rules rather than none at all, like
+ * download_error_cb() does for the lists. An older image that is still
+ * valid is kept. */
+static void
+ensure_adblock_image (const char *image_path)
+{
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(GError) error = NULL;
+
+  image = ephy_adblock_image_new_from_file (image_path, NULL);
+  if (image)
+    return;
+
+  compiler = ephy_adblock_compiler_new ();
+  if (!ephy_adblock_compiler_write (compiler, image_path, &error))
+    g_warning ("Failed to write empty adblock filter image: %s", error->message);
+}
+
+static void
+compile_adblock_filters_thread (GTask                     *task,
+                                EphyFiltersManager        *manager,
+                                CompileAdblockFiltersData *data,
+                                GCancellable              *cancellable)
+{
+  g_autoptr(GMutexLocker) locker = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (!data->force) {
+    image = load_up_to_date_adblock_image (data);
+    if (image) {
+      g_task_return_pointer (task, g_steal_pointer (&image), (GDestroyNotify)ephy_adblock_image_unref);
+      return;
+    }
+  }
+
+  locker = g_mutex_locker_new (&manager->compiler_mutex);
+
+  image = compile_adblock_image (manager, data, cancellable, &error);
+  if (!image) {
+    /* A newer compilation replaces this one. */
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      ensure_adblock_image (data->image_path);
+    g_task_return_error (task, g_steal_pointer (&error));
+    return;
+  }
+
+  g_task_return_pointer (task, g_steal_pointer (&image), (GDestroyNotify)ephy_adblock_image_unref);
+}
+
+static void
+compile_adblock_filters_cb (EphyFiltersManager *manager,
+                            GAsyncResult       *result,
+                            gpointer            user_data)
+{
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GError) error = NULL;
+
+  image = g_task_propagate_pointer (G_TASK (result), &error);
+  if (!image) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_warning ("Failed to compile adblock filters: %s", error->message);
+    return;
+  }
+
+  /* Web processes monitor the image and apply its element hiding rules
+   * themselves, see ephy_uri_tester_get_style_sheet(). */
+  LOG ("Adblock filters compiled, %u network rules and element hiding rules for %u hosts",
+       ephy_adblock_image_get_n_rules (image), ephy_adblock_image_get_n_cosmetic_hosts (image));
+}
+
+static void
+compile_adblock_filters_full (EphyFiltersManager *manager,
+                              gboolean            force)
+{
+  CompileAdblockFiltersData *data;
+  g_autoptr(GFile) image_file = NULL;
+  g_autoptr(GTask) task = NULL;
+  char **filters;
+
+  /* Newest set of filters wins here too. */
+  g_cancellable_cancel (manager->compile_cancellable);
+  g_object_unref (manager->compile_cancellable);
+  manager->compile_cancellable = g_cancellable_new ();
+
+  data = g_new0 (CompileAdblockFiltersData, 1);
+  data->filter_files = g_ptr_array_new_with_free_func (g_object_unref);
+  data->force = force;
+
+  filters = g_settings_get_strv (EPHY_SETTINGS_MAIN, EPHY_PREFS_ADBLOCK_FILTERS);
+  for (guint i = 0; filters[i]; i++)
+    g_ptr_array_add (data->filter_files, ephy_uri_tester_get_adblock_filter_file (manager->filters_dir, filters[i]));
+  g_strfreev (filters);
+
+  image_file = ephy_uri_tester_get_adblock_image_file (manager->filters_dir);
+  data->image_path = g_file_get_path (image_file);
+
+  task = g_task_new (manager, manager->compile_cancellable, (GAsyncReadyCallback)compile_adblock_filters_cb, NULL);
+  g_task_set_task_data (task, data, (GDestroyNotify)compile_adblock_filters_data_free);
+  g_task_run_in_thread (task, (GTaskThreadFunc)compile_adblock_filters_thread);
+}
+
+static void
+compile_adblock_filters (EphyFiltersManager *manager)
+{
+  compile_adblock_filters_full (manager, TRUE);
+}
+
+static void
+update_adblock_filter_files (EphyFiltersManager *manager,
+                             gboolean            filters_changed)
 {
   char **filters;
   GList *files = NULL;
@@ -250,8 +501,13 @@ update_adblock_filter_files (EphyFiltersManager *manager)
     files = g_list_prepend (files, filter_file);
   }
 
+  files = g_list_prepend (files, ephy_uri_tester_get_adblock_image_file (manager->filters_dir));
   remove_old_adblock_filters (manager, files);
 
+  /* Otherwise the image is compiled when the last download finishes. */
+  if (manager->pending_downloads == 0)
+    compile_adblock_filters_full (manager, filters_changed);
+
   g_strfreev (filters);
   g_list_free_full (files, g_object_unref);
 }
@@ -261,7 +517,7 @@ adblock_filters_changed_cb (GSettings          *settings,
                             char               *key,
                             EphyFiltersManager *manager)
 {
-  update_adblock_filter_files (manager);
+  update_adblock_filter_files (manager, TRUE);
 }
 
 static void
@@ -269,7 +525,12 @@ enable_adblock_changed_cb (GSettings          *settings,
                            char               *key,
                            EphyFiltersManager *manager)
 {
-  update_adblock_filter_files (manager);
+  if (!g_settings_get_boolean (EPHY_SETTINGS_WEB, EPHY_PREFS_WEB_ENABLE_ADBLOCK)) {
+    g_cancellable_cancel (manager->compile_cancellable);
+    return;
+  }
+
+  update_adblock_filter_files (manager, FALSE);
 }
 
 static void
@@ -282,6 +543,11 @@ ephy_filters_manager_dispose (GObject *object)
     g_clear_object (&manager->cancellable);
   }
 
+  if (manager->compile_cancellable) {
+    g_cancellable_cancel (manager->compile_cancellable);
+    g_clear_object (&manager->compile_cancellable);
+  }
+
   G_OBJECT_CLASS (ephy_filters_manager_parent_class)->dispose (object);
 }
 
@@ -292,6 +558,9 @@ ephy_filters_manager_finalize (GObject *object)
 
   g_free (manager->filters_dir);
 
+  g_clear_pointer (&manager->compiler, ephy_adblock_compiler_free);
+  g_mutex_clear (&manager->compiler_mutex);
+
   G_OBJECT_CLASS (ephy_filters_manager_parent_class)->finalize (object);
 }
 
@@ -309,7 +578,7 @@ ephy_filters_manager_constructed (GObject *object)
                     G_CALLBACK (enable_adblock_changed_cb), manager);
 
   g_mkdir_with_parents (manager->filters_dir, 0700);
-  update_adblock_filter_files (manager);
+  update_adblock_filter_files (manager, FALSE);
 }
 
 static void
@@ -373,6 +642,8 @@ static void
 ephy_filters_manager_init (EphyFiltersManager *manager)
 {
   manager->cancellable = g_cancellable_new ();
+  manager->compile_cancellable = g_cancellable_new ();
+  g_mutex_init (&manager->compiler_mutex);
 }
 
 EphyFiltersManager *
@@ -649,6 +649,54 @@ js_exception_handler (JSCContext   *context,
   jsc_context_throw_exception (context, exception);
 }
 
+/* Adds the style sheet to the document as soon as it has a root element,
+ * which it usually does not have yet when the window object is cleared. */
+static const char hide_elements_script[] =
+  "(function (styleSheet) {"
+  "  function inject () {"
+  "    if (!document.documentElement)"
+  "      return false;"
+  "    let style = document.createElement ('style');"
+  "    style.textContent = styleSheet;"
+  "    document.documentElement.appendChild (style);"
+  "    return true;"
+  "  }"
+  "  if (!inject ()) {"
+  "    new MutationObserver (function (mutations, observer) {"
+  "      if (inject ())"
+  "        observer.disconnect ();"
+  "    }).observe (document, { childList: true });"
+  "  }"
+  "})";
+
+/* Whether the generic element hiding rules apply depends on the document,
+ * because of element hiding exceptions, and there are far too many hosts with
+ * rules of their own to give each one a user style sheet in the UI process.
+ * So the rules are looked up in the adblock image when a frame loads a
+ * document. */
+static void
+hide_adblock_elements (WebKitScriptWorld *world,
+                       WebKitFrame       *frame,
+                       EphyWebExtension  *extension)
+{
+  g_autofree char *style_sheet = NULL;
+  g_autoptr(JSCContext) js_context = NULL;
+  g_autoptr(JSCValue) js_function = NULL;
+  g_autoptr(JSCValue) js_result = NULL;
+
+  if (!g_settings_get_boolean (EPHY_SETTINGS_WEB_EXTENSION_WEB, EPHY_PREFS_WEB_ENABLE_ADBLOCK))
+    return;
+
+  ephy_uri_tester_load (extension->uri_tester);
+  style_sheet = ephy_uri_tester_get_style_sheet (extension->uri_tester, webkit_frame_get_uri (frame));
+  if (!style_sheet)
+    return;
+
+  js_context = webkit_frame_get_js_context_for_script_world (frame, world);
+  js_function = jsc_context_evaluate (js_context, hide_elements_script, -1);
+  js_result = jsc_value_function_call (js_function, G_TYPE_STRING, style_sheet, G_TYPE_NONE);
+}
+
 static void
 window_object_cleared_cb (WebKitScriptWorld *world,
                           WebKitWebPage     *page,
@@ -663,6 +711,8 @@ window_object_cleared_cb (WebKitScriptWorld *world,
   g_autoptr(JSCValue) js_function = NULL;
   g_autoptr(JSCValue) result = NULL;
 
+  hide_adblock_elements (world, frame, extension);
+
   if (!webkit_frame_is_main_frame (frame))
     return;
 
@@ -0,0 +1,256 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-adblock-cache.h"
+
+#include <string.h>
+
+/* Verdict cache for the URI tester. Pages keep requesting the same
+ * resources, so remembering recent verdicts saves matching them again, but
+ * pages that poll with cache-busting query strings produce an endless
+ * stream of new URLs, so the cache has a fixed size.
+ *
+ * Entries are keyed by a 64-bit hash of the request URL and the origin of
+ * the page, which is all the verdict depends on, and the URLs themselves
+ * are not kept. The cache is set associative: a key can only live in one
+ * set of EPHY_ADBLOCK_CACHE_WAYS entries, and each set evicts with the
+ * CLOCK algorithm, which approximates LRU with a single referenced bit per
+ * entry. Nothing is allocated after creation. */
+
+#define EPHY_ADBLOCK_CACHE_WAYS 8
+
+enum {
+  ENTRY_VALID      = 1 << 0,
+  ENTRY_REFERENCED = 1 << 1,
+  ENTRY_BLOCKED    = 1 << 2
+};
+
+struct _EphyAdblockCache {
+  guint64 *keys;
+  guint8  *entries; /* ENTRY_* flags */
+  guint8  *hands;   /* CLOCK hand of each set */
+  guint    n_sets;
+
+  guint64  hits;
+  guint64  misses;
+  guint64  evictions;
+};
+
+/**
+ * ephy_adblock_cache_new:
+ * @max_entries: the maximum number of verdicts to remember
+ *
+ * The size is rounded down to a power of two number of sets, but the cache
+ * always has at least one set.
+ *
+ * Returns: (transfer full): a new #EphyAdblockCache
+ **/
+EphyAdblockCache *
+ephy_adblock_cache_new (guint max_entries)
+{
+  EphyAdblockCache *cache;
+
+  cache = g_new0 (EphyAdblockCache, 1);
+
+  cache->n_sets = 1;
+  while (cache->n_sets * 2 * EPHY_ADBLOCK_CACHE_WAYS <= max_entries)
+    cache->n_sets *= 2;
+
+  cache->keys = g_new0 (guint64, cache->n_sets * EPHY_ADBLOCK_CACHE_WAYS);
+  cache->entries = g_new0 (guint8, cache->n_sets * EPHY_ADBLOCK_CACHE_WAYS);
+  cache->hands = g_new0 (guint8, cache->n_sets);
+
+  return cache;
+}
+
+void
+ephy_adblock_cache_free (EphyAdblockCache *cache)
+{
+  g_assert (cache);
+
+  g_free (cache->keys);
+  g_free (cache->entries);
+  g_free (cache->hands);
+
+  g_free (cache);
+}
+
+static inline guint64
+hash_append (guint64     hash,
+             const char *data,
+             gsize       length)
+{
+  /* FNV-1a */
+  for (gsize i = 0; i < length; i++)
+    hash = (hash ^ (guint8)data[i]) * G_GUINT64_CONSTANT (0x100000001b3);
+
+  return hash;
+}
+
+/**
+ * ephy_adblock_cache_get_key:
+ * @request_uri: the URI of the subresource
+ * @page_uri: (nullable): the URI of the page loading it
+ *
+ * Returns: the cache key for the verdict on @request_uri loaded from
+ * @page_uri, which only takes the origin of @page_uri into account
+ **/
+guint64
+ephy_adblock_cache_get_key (const char *request_uri,
+                            const char *page_uri)
+{
+  guint64 hash = G_GUINT64_CONSTANT (0xcbf29ce484222325);
+  gsize origin_length = 0;
+
+  g_assert (request_uri);
+
+  hash = hash_append (hash, request_uri, strlen (request_uri) + 1);
+
+  if (page_uri) {
+    const char *authority = strstr (page_uri, "://");
+
+    if (authority)
+      origin_length = authority + 3 - page_uri + strcspn (authority + 3, "/?#");
+    else
+      origin_length = strlen (page_uri);
+  }
+
+  return hash_append (hash, page_uri, origin_length);
+}
+
+static inline guint
+cache_get_set (EphyAdblockCache *cache,
+               guint64           key)
+{
+  /* The low bits of FNV are weak, so mix the high ones in. */
+  return (guint)((key * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32) & (cache->n_sets - 1);
+}
+
+static inline int
+cache_find (EphyAdblockCache *cache,
+            guint             set,
+            guint64           key)
+{
+  guint first = set * EPHY_ADBLOCK_CACHE_WAYS;
+
+  for (guint i = first; i < first + EPHY_ADBLOCK_CACHE_WAYS; i++) {
+    if ((cache->entries[i] & ENTRY_VALID) && cache->keys[i] == key)
+      return i;
+  }
+
+  return -1;
+}
+
+gboolean
+ephy_adblock_cache_lookup (EphyAdblockCache *cache,
+                           guint64           key,
+                           gboolean         *blocked)
+{
+  int i;
+
+  g_assert (cache);
+  g_assert (blocked);
+
+  i = cache_find (cache, cache_get_set (cache, key), key);
+  if (i < 0) {
+    cache->misses++;
+    return FALSE;
+  }
+
+  cache->hits++;
+  cache->entries[i] |= ENTRY_REFERENCED;
+  *blocked = !!(cache->entries[i] & ENTRY_BLOCKED);
+
+  return TRUE;
+}
+
+void
+ephy_adblock_cache_insert (EphyAdblockCache *cache,
+                           guint64           key,
+                           gboolean          blocked)
+{
+  guint set;
+  guint first;
+  int i;
+
+  g_assert (cache);
+
+  set = cache_get_set (cache, key);
+  first = set * EPHY_ADBLOCK_CACHE_WAYS;
+
+  i = cache_find (cache, set, key);
+  if (i < 0) {
+    for (guint j = first; j < first + EPHY_ADBLOCK_CACHE_WAYS && i < 0; j++) {
+      if (!(cache->entries[j] & ENTRY_VALID))
+        i = j;
+    }
+  }
+
+  if (i < 0) {
+    /* Give every recently used entry a second chance. This terminates after
+     * at most one turn, since the referenced bits are cleared on the way. */
+    for (;;) {
+      guint j = first + cache->hands[set];
+
+      cache->hands[set] = (cache->hands[set] + 1) % EPHY_ADBLOCK_CACHE_WAYS;
+      if (!(cache->entries[j] & ENTRY_REFERENCED)) {
+        i = j;
+        break;
+      }
+      cache->entries[j] &= ~ENTRY_REFERENCED;
+    }
+    cache->evictions++;
+  }
+
+  cache->keys[i] = key;
+  cache->entries[i] = ENTRY_VALID | (blocked ? ENTRY_BLOCKED : 0);
+}
+
+void
+ephy_adblock_cache_clear (EphyAdblockCache *cache)
+{
+  g_assert (cache);
+
+  memset (cache->entries, 0, cache->n_sets * EPHY_ADBLOCK_CACHE_WAYS);
+  memset (cache->hands, 0, cache->n_sets);
+}
+
+guint
+ephy_adblock_cache_get_size (EphyAdblockCache *cache)
+{
+  return cache->n_sets * EPHY_ADBLOCK_CACHE_WAYS;
+}
+
+void
+ephy_adblock_cache_get_stats (EphyAdblockCache *cache,
+                              guint64          *hits,
+                              guint64          *misses,
+                              guint64          *evictions)
+{
+  g_assert (cache);
+
+  if (hits)
+    *hits = cache->hits;
+  if (misses)
+    *misses = cache->misses;
+  if (evictions)
+    *evictions = cache->evictions;
+}
@@ -0,0 +1,51 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyAdblockCache EphyAdblockCache;
+
+EphyAdblockCache *ephy_adblock_cache_new       (guint             max_entries);
+void              ephy_adblock_cache_free      (EphyAdblockCache *cache);
+
+guint64           ephy_adblock_cache_get_key   (const char       *request_uri,
+                                                const char       *page_uri);
+
+gboolean          ephy_adblock_cache_lookup    (EphyAdblockCache *cache,
+                                                guint64           key,
+                                                gboolean         *blocked);
+void              ephy_adblock_cache_insert    (EphyAdblockCache *cache,
+                                                guint64           key,
+                                                gboolean          blocked);
+void              ephy_adblock_cache_clear     (EphyAdblockCache *cache);
+
+guint             ephy_adblock_cache_get_size  (EphyAdblockCache *cache);
+void              ephy_adblock_cache_get_stats (EphyAdblockCache *cache,
+                                                guint64          *hits,
+                                                guint64          *misses,
+                                                guint64          *evictions);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyAdblockCache, ephy_adblock_cache_free)
+
+G_END_DECLS
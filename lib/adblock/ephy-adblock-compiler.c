@@ -0,0 +1,1256 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  The filter syntax handling is based on the Midori's 'adblock' extension,
+ *  licensed with the GNU Lesser General Public License 2.1, Copyright
+ *  (C) 2009-2010 Christian Dywan <christian@twotoasts.de> and 2009
+ *  Alexander Butenko <a.butenka@gmail.com>. Check Midori's web site
+ *  at http://www.twotoasts.de
+ */
+
+#include "config.h"
+#include "ephy-adblock-compiler.h"
+
+#include "ephy-adblock-image-private.h"
+#include "ephy-debug.h"
+
+#include <string.h>
+
+typedef struct {
+  guint64 token;
+  guint32 rule;
+} TokenRule;
+
+/* Trie node; children form a sibling list sorted by byte. Node 0 is the
+ * root, so 0 also means "none" for first_child and next_sibling. */
+typedef struct {
+  guint32 first_child;
+  guint32 next_sibling;
+  guint8  byte;
+} TrieNode;
+
+typedef struct {
+  guint32 node;
+  guint32 rule;
+} TrieOutput;
+
+typedef struct {
+  GArray     *token_rules;      /* TokenRule */
+  GArray     *trie;             /* TrieNode */
+  GArray     *trie_outputs;     /* TrieOutput */
+  GArray     *fallback;         /* guint32 */
+  GHashTable *token_counts;     /* guint64 -> number of rules using it */
+} CompilerTable;
+
+typedef struct _ParsedRules ParsedRules;
+
+struct _EphyAdblockCompiler {
+  /* Parsed input, kept across builds. */
+  ParsedRules   *lines;          /* From ephy_adblock_compiler_add_line() */
+  GPtrArray     *lists;          /* CompilerList */
+
+  /* Tables of the image being built. */
+  GString       *strings;
+  GHashTable    *string_offsets; /* Interned pool strings */
+  GArray        *rules;          /* EphyAdblockRule */
+  GHashTable    *seen_rules;     /* Lists overlap a lot, so drop duplicates */
+  GArray        *domains;        /* EphyAdblockDomain */
+  GHashTable    *domain_lists;   /* domain= value -> index of its first domain */
+  CompilerTable  tables[EPHY_ADBLOCK_N_TABLES];
+  GArray        *cosmetic_generic; /* EphyAdblockString */
+  GHashTable    *cosmetic_hosts;   /* Host -> GArray of EphyAdblockString */
+  GHashTable    *cosmetic_exceptions; /* Host -> GArray of EphyAdblockString */
+  GHashTable    *generic_exceptions;  /* Offsets of the selectors of #@#selector */
+};
+
+/* Marks element hiding rules among the parsed rules. Their pattern is the
+ * selector and their options the domains before the '##', or before the
+ * '#@#' of exceptions. */
+#define PARSED_RULE_ELEMENT_HIDING           (1u << 31)
+#define PARSED_RULE_ELEMENT_HIDING_EXCEPTION (1u << 30)
+
+/* Rules of one list as they come out of the parser. Parsing does not touch
+ * the compiler, so that lists can be parsed in parallel; the rules are then
+ * added to the compiler one list at a time. */
+typedef struct {
+  const char *pattern;
+  const char *options;
+  guint32     flags;
+} ParsedRule;
+
+struct _ParsedRules {
+  GStringChunk *strings;
+  GArray       *rules; /* ParsedRule */
+};
+
+static ParsedRules *
+parsed_rules_new (void)
+{
+  ParsedRules *parsed;
+
+  parsed = g_new (ParsedRules, 1);
+  parsed->strings = g_string_chunk_new (64 * 1024);
+  parsed->rules = g_array_new (FALSE, FALSE, sizeof (ParsedRule));
+
+  return parsed;
+}
+
+static void
+parsed_rules_free (ParsedRules *parsed)
+{
+  g_string_chunk_free (parsed->strings);
+  g_array_unref (parsed->rules);
+  g_free (parsed);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ParsedRules, parsed_rules_free)
+
+static void
+parsed_rules_add (ParsedRules *parsed,
+                  const char  *pattern,
+                  const char  *options,
+                  guint32      flags)
+{
+  ParsedRule rule;
+
+  /* Lists repeat the same options over and over. */
+  rule.pattern = g_string_chunk_insert (parsed->strings, pattern);
+  rule.options = g_string_chunk_insert_const (parsed->strings, options);
+  rule.flags = flags;
+  g_array_append_val (parsed->rules, rule);
+}
+
+/* A filter list, with the rules parsed from it. The list is identified by
+ * the checksum of its contents, so that an unchanged list, which is the
+ * common case when the lists are refreshed, is never parsed again. */
+typedef struct {
+  GFile       *file;
+  char        *checksum;
+  ParsedRules *parsed;
+} CompilerList;
+
+static void
+compiler_list_free (CompilerList *list)
+{
+  g_object_unref (list->file);
+  g_free (list->checksum);
+  if (list->parsed)
+    parsed_rules_free (list->parsed);
+  g_free (list);
+}
+
+static void
+compiler_init_tables (EphyAdblockCompiler *compiler)
+{
+  /* Offset 0 is always the empty string. */
+  compiler->strings = g_string_new (NULL);
+  g_string_append_c (compiler->strings, '\0');
+  compiler->string_offsets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_hash_table_insert (compiler->string_offsets, g_strdup (""), GUINT_TO_POINTER (0));
+
+  compiler->rules = g_array_new (FALSE, FALSE, sizeof (EphyAdblockRule));
+  compiler->seen_rules = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  compiler->domains = g_array_new (FALSE, FALSE, sizeof (EphyAdblockDomain));
+  compiler->domain_lists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  compiler->cosmetic_generic = g_array_new (FALSE, FALSE, sizeof (EphyAdblockString));
+  compiler->cosmetic_hosts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+  compiler->cosmetic_exceptions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_array_unref);
+  compiler->generic_exceptions = g_hash_table_new (NULL, NULL);
+
+  for (guint i = 0; i < EPHY_ADBLOCK_N_TABLES; i++) {
+    TrieNode root = { 0, };
+
+    compiler->tables[i].token_rules = g_array_new (FALSE, FALSE, sizeof (TokenRule));
+    compiler->tables[i].trie = g_array_new (FALSE, FALSE, sizeof (TrieNode));
+    g_array_append_val (compiler->tables[i].trie, root);
+    compiler->tables[i].trie_outputs = g_array_new (FALSE, FALSE, sizeof (TrieOutput));
+    compiler->tables[i].fallback = g_array_new (FALSE, FALSE, sizeof (guint32));
+    compiler->tables[i].token_counts = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+  }
+}
+
+static void
+compiler_clear_tables (EphyAdblockCompiler *compiler)
+{
+  g_string_free (compiler->strings, TRUE);
+  g_hash_table_unref (compiler->string_offsets);
+  g_array_unref (compiler->rules);
+  g_hash_table_unref (compiler->seen_rules);
+  g_array_unref (compiler->domains);
+  g_hash_table_unref (compiler->domain_lists);
+  g_array_unref (compiler->cosmetic_generic);
+  g_hash_table_unref (compiler->cosmetic_hosts);
+  g_hash_table_unref (compiler->cosmetic_exceptions);
+  g_hash_table_unref (compiler->generic_exceptions);
+
+  for (guint i = 0; i < EPHY_ADBLOCK_N_TABLES; i++) {
+    g_array_unref (compiler->tables[i].token_rules);
+    g_array_unref (compiler->tables[i].trie);
+    g_array_unref (compiler->tables[i].trie_outputs);
+    g_array_unref (compiler->tables[i].fallback);
+    g_hash_table_unref (compiler->tables[i].token_counts);
+  }
+}
+
+/**
+ * ephy_adblock_compiler_new:
+ *
+ * Creates a compiler. It keeps the rules parsed from the lists it was
+ * given, so keeping it around spares parsing the unchanged lists again
+ * after some were refreshed. The image itself is always built from scratch.
+ *
+ * Returns: (transfer full): a new #EphyAdblockCompiler
+ **/
+EphyAdblockCompiler *
+ephy_adblock_compiler_new (void)
+{
+  EphyAdblockCompiler *compiler;
+
+  compiler = g_new0 (EphyAdblockCompiler, 1);
+  compiler->lines = parsed_rules_new ();
+  compiler->lists = g_ptr_array_new_with_free_func ((GDestroyNotify)compiler_list_free);
+  compiler_init_tables (compiler);
+
+  return compiler;
+}
+
+void
+ephy_adblock_compiler_free (EphyAdblockCompiler *compiler)
+{
+  g_assert (compiler);
+
+  parsed_rules_free (compiler->lines);
+  g_ptr_array_unref (compiler->lists);
+  compiler_clear_tables (compiler);
+
+  g_free (compiler);
+}
+
+static EphyAdblockString
+compiler_intern_string (EphyAdblockCompiler *compiler,
+                        const char          *string)
+{
+  EphyAdblockString retval;
+  gpointer offset;
+
+  retval.length = strlen (string);
+
+  if (g_hash_table_lookup_extended (compiler->string_offsets, string, NULL, &offset)) {
+    retval.offset = GPOINTER_TO_UINT (offset);
+    return retval;
+  }
+
+  retval.offset = compiler->strings->len;
+  g_string_append_len (compiler->strings, string, retval.length);
+  g_string_append_c (compiler->strings, '\0');
+  g_hash_table_insert (compiler->string_offsets, g_strdup (string), GUINT_TO_POINTER (retval.offset));
+
+  return retval;
+}
+
+static guint32
+trie_insert (GArray     *trie,
+             const char *fragment,
+             gsize       length)
+{
+  guint32 node = 0;
+
+  for (gsize i = 0; i < length; i++) {
+    guint8 byte = fragment[i];
+    guint32 *link = &g_array_index (trie, TrieNode, node).first_child;
+    TrieNode child = { 0, };
+
+    while (*link && g_array_index (trie, TrieNode, *link).byte < byte)
+      link = &g_array_index (trie, TrieNode, *link).next_sibling;
+
+    if (*link && g_array_index (trie, TrieNode, *link).byte == byte) {
+      node = *link;
+      continue;
+    }
+
+    child.next_sibling = *link;
+    child.byte = byte;
+    node = trie->len;
+    *link = node;
+    /* Appending may move the array, so don't touch link after this. */
+    g_array_append_val (trie, child);
+  }
+
+  return node;
+}
+
+/* Adds a rule that has no usable token to the automaton, keyed by its longest
+ * literal fragment. Any URL matched by the rule has to contain it. */
+static void
+compiler_add_fragment (EphyAdblockCompiler *compiler,
+                       CompilerTable       *table,
+                       const char          *pattern,
+                       gsize                length,
+                       guint32              rule)
+{
+  TrieOutput output;
+  gsize best_start = 0;
+  gsize best_length = 0;
+  gsize start = 0;
+
+  for (gsize pos = 0; pos <= length; pos++) {
+    if (pos < length && pattern[pos] != '*' && pattern[pos] != '^')
+      continue;
+
+    if (pos - start > best_length) {
+      best_start = start;
+      best_length = pos - start;
+    }
+    start = pos + 1;
+  }
+
+  if (best_length == 0) {
+    g_array_append_val (table->fallback, rule);
+    return;
+  }
+
+  output.node = trie_insert (table->trie, pattern + best_start, best_length);
+  output.rule = rule;
+  g_array_append_val (table->trie_outputs, output);
+}
+
+/* Picks the rarest token of the pattern that any matching URL has to contain
+ * as a whole token, so that buckets stay small. A token qualifies only when
+ * both of its ends are pinned by a literal separator or an anchor: next to a
+ * '*' or at an unanchored end, it may be part of a longer token in the URL. */
+static void
+compiler_add_token (EphyAdblockCompiler *compiler,
+                    CompilerTable       *table,
+                    const char          *pattern,
+                    gsize                length,
+                    guint32              flags,
+                    guint32              rule)
+{
+  TokenRule entry;
+  guint best_count = G_MAXUINT;
+  gsize best_length = 0;
+  gpointer count;
+  gsize pos = 0;
+
+  while (pos < length) {
+    gsize start;
+    guint64 token = EPHY_ADBLOCK_TOKEN_HASH_INIT;
+    guint current;
+
+    if (!ephy_adblock_is_token_char (pattern[pos])) {
+      pos++;
+      continue;
+    }
+
+    start = pos;
+    for (; pos < length && ephy_adblock_is_token_char (pattern[pos]); pos++)
+      token = ephy_adblock_token_hash_step (token, pattern[pos]);
+
+    if (start == 0 ? !(flags & (EPHY_ADBLOCK_RULE_ANCHOR_START | EPHY_ADBLOCK_RULE_ANCHOR_DOMAIN))
+                   : pattern[start - 1] == '*')
+      continue;
+    if (pos == length ? !(flags & EPHY_ADBLOCK_RULE_ANCHOR_END) : pattern[pos] == '*')
+      continue;
+
+    current = GPOINTER_TO_UINT (g_hash_table_lookup (table->token_counts, &token));
+    if (current < best_count || (current == best_count && pos - start > best_length)) {
+      entry.token = token;
+      best_count = current;
+      best_length = pos - start;
+    }
+  }
+
+  if (best_length == 0) {
+    compiler_add_fragment (compiler, table, pattern, length, rule);
+    return;
+  }
+
+  entry.rule = rule;
+  g_array_append_val (table->token_rules, entry);
+
+  if (g_hash_table_lookup_extended (table->token_counts, &entry.token, NULL, &count))
+    g_hash_table_replace (table->token_counts,
+                          g_memdup (&entry.token, sizeof (guint64)),
+                          GUINT_TO_POINTER (GPOINTER_TO_UINT (count) + 1));
+  else
+    g_hash_table_insert (table->token_counts,
+                         g_memdup (&entry.token, sizeof (guint64)),
+                         GUINT_TO_POINTER (1));
+}
+
+/* Stores the value of a domain= option, e.g. "example.com|~foo.example.com",
+ * reusing the entries of an identical list seen before. */
+static void
+compiler_add_domains (EphyAdblockCompiler *compiler,
+                      const char          *value,
+                      EphyAdblockRule     *rule)
+{
+  g_autofree char *list = g_ascii_strdown (value, -1);
+  g_auto(GStrv) names = NULL;
+  gpointer index;
+
+  names = g_strsplit (list, "|", -1);
+  rule->n_domains = 0;
+  for (guint i = 0; names[i]; i++) {
+    if (names[i][0] && strcmp (names[i], "~") != 0)
+      rule->n_domains++;
+  }
+
+  if (g_hash_table_lookup_extended (compiler->domain_lists, list, NULL, &index)) {
+    rule->domains = GPOINTER_TO_UINT (index);
+    return;
+  }
+
+  rule->domains = compiler->domains->len;
+  for (guint i = 0; names[i]; i++) {
+    EphyAdblockDomain domain = { { 0, }, };
+    const char *name = names[i];
+
+    if (name[0] == '~') {
+      domain.excluded = TRUE;
+      name++;
+    }
+    if (!name[0])
+      continue;
+
+    domain.name = compiler_intern_string (compiler, name);
+    g_array_append_val (compiler->domains, domain);
+  }
+
+  g_hash_table_insert (compiler->domain_lists, g_steal_pointer (&list), GUINT_TO_POINTER (rule->domains));
+}
+
+static void
+compiler_parse_options (EphyAdblockCompiler *compiler,
+                        const char          *options,
+                        EphyAdblockRule     *rule)
+{
+  g_auto(GStrv) items = g_strsplit (options, ",", -1);
+
+  for (guint i = 0; items[i]; i++) {
+    const char *item = items[i];
+
+    if (strcmp (item, "third-party") == 0)
+      rule->options |= EPHY_ADBLOCK_OPTION_THIRD_PARTY;
+    else if (strcmp (item, "~third-party") == 0 || strcmp (item, "first-party") == 0)
+      rule->options |= EPHY_ADBLOCK_OPTION_FIRST_PARTY;
+    else if (strcmp (item, "elemhide") == 0 || strcmp (item, "ehide") == 0)
+      rule->options |= EPHY_ADBLOCK_OPTION_ELEMHIDE;
+    else if (strcmp (item, "generichide") == 0 || strcmp (item, "ghide") == 0)
+      rule->options |= EPHY_ADBLOCK_OPTION_GENERICHIDE;
+    else if (g_str_has_prefix (item, "domain="))
+      compiler_add_domains (compiler, item + strlen ("domain="), rule);
+  }
+}
+
+static void
+compiler_add_rule (EphyAdblockCompiler *compiler,
+                   const char          *pattern,
+                   const char          *options,
+                   guint32              flags)
+{
+  EphyAdblockRule rule = { { 0, }, };
+  CompilerTable *table;
+  char *key;
+  guint32 id;
+
+  key = g_strdup_printf ("%u:%s$%s", flags, pattern, options);
+  if (!g_hash_table_add (compiler->seen_rules, key))
+    return;
+
+  rule.pattern = compiler_intern_string (compiler, pattern);
+  rule.flags = flags;
+  compiler_parse_options (compiler, options, &rule);
+
+  /* $elemhide and $generichide only make sense for exceptions, and those
+   * don't let any request through. */
+  if (rule.options & (EPHY_ADBLOCK_OPTION_ELEMHIDE | EPHY_ADBLOCK_OPTION_GENERICHIDE)) {
+    if (!(flags & EPHY_ADBLOCK_RULE_ALLOW))
+      return;
+    table = &compiler->tables[EPHY_ADBLOCK_TABLE_HIDING];
+  } else {
+    table = &compiler->tables[flags & EPHY_ADBLOCK_RULE_ALLOW ? EPHY_ADBLOCK_TABLE_ALLOW : EPHY_ADBLOCK_TABLE_BLOCK];
+  }
+
+  id = compiler->rules->len;
+  g_array_append_val (compiler->rules, rule);
+
+  if (flags & EPHY_ADBLOCK_RULE_REGEX)
+    g_array_append_val (table->fallback, id);
+  else
+    compiler_add_token (compiler, table, pattern, rule.pattern.length, flags, id);
+
+  LOG ("%s: %s opts %s", flags & EPHY_ADBLOCK_RULE_ALLOW ? "whitelist" : "blacklist", pattern, options);
+}
+
+static gboolean
+selector_is_supported (const char *selector)
+{
+  /* Don't let a selector escape its rule, and leave out the extended syntax
+   * of Adblock Plus, which no engine understands. */
+  return selector[0] &&
+         !strpbrk (selector, "{}") &&
+         !strstr (selector, "/*") &&
+         !strstr (selector, ":-abp-");
+}
+
+static void
+compiler_add_element_hiding_rule (EphyAdblockCompiler *compiler,
+                                  const char          *selector,
+                                  const char          *domains,
+                                  gboolean             exception)
+{
+  g_autofree char *list = NULL;
+  g_auto(GStrv) names = NULL;
+  EphyAdblockString string;
+  GHashTable *hosts;
+  const char *separator;
+  gboolean has_exclusions = FALSE;
+  guint n_hosts = 0;
+
+  if (!selector_is_supported (selector))
+    return;
+
+  list = g_ascii_strdown (domains, -1);
+  names = g_strsplit (list, ",", -1);
+  for (guint i = 0; names[i]; i++) {
+    if (names[i][0] == '~')
+      has_exclusions = TRUE;
+    else if (names[i][0])
+      n_hosts++;
+  }
+
+  /* A style sheet applies to a host and all of its subdomains, so there is
+   * no way to leave some of them out. Rather not hide anything than hide
+   * too much: drop such rules, and make such exceptions apply everywhere
+   * else too. */
+  if (has_exclusions && !exception)
+    return;
+
+  string = compiler_intern_string (compiler, selector);
+  separator = exception ? "#@#" : "##";
+
+  if (n_hosts == 0) {
+    if (!g_hash_table_add (compiler->seen_rules, g_strconcat (separator, selector, NULL)))
+      return;
+
+    if (exception)
+      g_hash_table_add (compiler->generic_exceptions, GUINT_TO_POINTER (string.offset));
+    else
+      g_array_append_val (compiler->cosmetic_generic, string);
+    return;
+  }
+
+  hosts = exception ? compiler->cosmetic_exceptions : compiler->cosmetic_hosts;
+  for (guint i = 0; names[i]; i++) {
+    GArray *selectors;
+
+    /* Hosts end up in URL patterns, so leave out wildcards and the like. */
+    if (!names[i][0] || names[i][strspn (names[i], "abcdefghijklmnopqrstuvwxyz0123456789.-")])
+      continue;
+
+    if (!g_hash_table_add (compiler->seen_rules, g_strconcat (names[i], separator, selector, NULL)))
+      continue;
+
+    selectors = g_hash_table_lookup (hosts, names[i]);
+    if (!selectors) {
+      selectors = g_array_new (FALSE, FALSE, sizeof (EphyAdblockString));
+      g_hash_table_insert (hosts, g_strdup (names[i]), selectors);
+    }
+    g_array_append_val (selectors, string);
+  }
+}
+
+static void
+parse_line (ParsedRules *parsed,
+            char        *line,
+            gboolean     allow)
+{
+  const char *options = "";
+  guint32 flags = allow ? EPHY_ADBLOCK_RULE_ALLOW : 0;
+  char *separator;
+  gsize length;
+
+  /* Ignore comments and new lines */
+  if (line[0] == '!')
+    return;
+  /* FIXME: No support for [include] and [exclude] tags */
+  if (line[0] == '[')
+    return;
+
+  /* Whitelisted exception rules */
+  if (!allow && g_str_has_prefix (line, "@@")) {
+    parse_line (parsed, line + 2, TRUE);
+    return;
+  }
+
+  /* Skip garbage */
+  if (line[0] == ' ' || !line[0])
+    return;
+
+  /* Element hiding exceptions: #@#selector or domain,domain#@#selector. */
+  separator = strstr (line, "#@#");
+  if (separator) {
+    if (!allow) {
+      *separator = '\0';
+      parsed_rules_add (parsed, separator + 3, line,
+                        PARSED_RULE_ELEMENT_HIDING | PARSED_RULE_ELEMENT_HIDING_EXCEPTION);
+    }
+    return;
+  }
+
+  /* Element hiding rules: ##selector or domain,domain##selector. */
+  separator = strstr (line, "##");
+  if (separator) {
+    if (!allow) {
+      *separator = '\0';
+      parsed_rules_add (parsed, separator + 2, line, PARSED_RULE_ELEMENT_HIDING);
+    }
+    return;
+  }
+
+  /* FIXME: No support for extended element hiding (#?#, #$#). */
+  if (strchr (line, '#'))
+    return;
+
+  length = strlen (line);
+
+  /* A regex rule without options may end in '$', so only split the options
+   * off when the rule is not a bare regex. */
+  if (!(length > 1 && line[0] == '/' && line[length - 1] == '/')) {
+    separator = strrchr (line, '$');
+    if (separator) {
+      *separator = '\0';
+      options = separator + 1;
+      length = separator - line;
+    }
+  }
+
+  /* FIXME: Subdocument rules can't be told apart from other requests. */
+  if (strstr (options, "subdocument"))
+    return;
+
+  if (line[0] == '|' && line[1] == '|') {
+    flags |= EPHY_ADBLOCK_RULE_ANCHOR_DOMAIN;
+    line += 2;
+    length -= 2;
+  } else if (line[0] == '|') {
+    flags |= EPHY_ADBLOCK_RULE_ANCHOR_START;
+    line++;
+    length--;
+  } else if (length > 1 && line[0] == '/' && line[length - 1] == '/') {
+    flags |= EPHY_ADBLOCK_RULE_REGEX;
+    line[length - 1] = '\0';
+    line++;
+    length -= 2;
+  }
+
+  if (!(flags & EPHY_ADBLOCK_RULE_REGEX)) {
+    if (length > 0 && line[length - 1] == '|') {
+      flags |= EPHY_ADBLOCK_RULE_ANCHOR_END;
+      line[--length] = '\0';
+    }
+
+    /* Leading and trailing wildcards are implied unless anchored. */
+    if (!(flags & (EPHY_ADBLOCK_RULE_ANCHOR_START | EPHY_ADBLOCK_RULE_ANCHOR_DOMAIN))) {
+      while (line[0] == '*') {
+        line++;
+        length--;
+      }
+    }
+    if (!(flags & EPHY_ADBLOCK_RULE_ANCHOR_END)) {
+      while (length > 0 && line[length - 1] == '*')
+        line[--length] = '\0';
+    }
+  }
+
+  /* An empty pattern would match every request. */
+  if (length == 0)
+    return;
+
+  parsed_rules_add (parsed, line, options, flags);
+}
+
+static void
+compiler_add_parsed_rules (EphyAdblockCompiler *compiler,
+                           ParsedRules         *parsed)
+{
+  for (guint i = 0; i < parsed->rules->len; i++) {
+    ParsedRule *rule = &g_array_index (parsed->rules, ParsedRule, i);
+
+    if (rule->flags & PARSED_RULE_ELEMENT_HIDING)
+      compiler_add_element_hiding_rule (compiler, rule->pattern, rule->options,
+                                        !!(rule->flags & PARSED_RULE_ELEMENT_HIDING_EXCEPTION));
+    else
+      compiler_add_rule (compiler, rule->pattern, rule->options, rule->flags);
+  }
+}
+
+void
+ephy_adblock_compiler_add_line (EphyAdblockCompiler *compiler,
+                                const char          *line)
+{
+  g_autofree char *copy = NULL;
+
+  g_assert (compiler);
+  g_assert (line);
+
+  copy = g_strdup (line);
+  parse_line (compiler->lines, g_strchomp (copy), FALSE);
+}
+
+static void
+parse_contents (const char  *contents,
+                gsize        length,
+                ParsedRules *parsed)
+{
+  g_autoptr(GString) line = g_string_sized_new (256);
+  const char *end = contents + length;
+
+  while (contents < end) {
+    const char *newline = memchr (contents, '\n', end - contents);
+    const char *line_end = newline ? newline : end;
+
+    /* The line is modified while it is parsed, and the mapping is not even
+     * NUL-terminated, so parse a copy. */
+    g_string_truncate (line, 0);
+    g_string_append_len (line, contents, line_end - contents);
+    parse_line (parsed, g_strchomp (line->str), FALSE);
+
+    contents = line_end + 1;
+  }
+}
+
+typedef struct {
+  GFile        *file;
+  const char   *old_checksum;
+  GCancellable *cancellable;
+
+  char         *checksum;
+  ParsedRules  *parsed; /* NULL if the list did not change */
+  GError       *error;
+} ParseJob;
+
+/* Reads a whole list from a read-only mapping of the file, which is a lot
+ * cheaper than reading it line by line through a stream, and parses it
+ * unless its checksum shows that it did not change. This only touches the
+ * job, so it is safe to run for several lists in parallel. */
+static void
+parse_job_run (ParseJob *job,
+               gpointer  user_data)
+{
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autofree char *path = NULL;
+  const char *contents;
+  gsize length;
+
+  if (g_cancellable_set_error_if_cancelled (job->cancellable, &job->error))
+    return;
+
+  path = g_file_get_path (job->file);
+  mapped_file = g_mapped_file_new (path, FALSE, &job->error);
+  if (!mapped_file)
+    return;
+
+  contents = g_mapped_file_get_contents (mapped_file);
+  length = g_mapped_file_get_length (mapped_file);
+
+  job->checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *)contents, length);
+  if (g_strcmp0 (job->checksum, job->old_checksum) == 0)
+    return;
+
+  job->parsed = parsed_rules_new ();
+  if (contents)
+    parse_contents (contents, length, job->parsed);
+}
+
+static CompilerList *
+compiler_find_list (EphyAdblockCompiler *compiler,
+                    GFile               *file)
+{
+  for (guint i = 0; i < compiler->lists->len; i++) {
+    CompilerList *list = g_ptr_array_index (compiler->lists, i);
+
+    if (g_file_equal (list->file, file))
+      return list;
+  }
+
+  return NULL;
+}
+
+/**
+ * ephy_adblock_compiler_set_files:
+ * @compiler: an #EphyAdblockCompiler
+ * @files: (element-type GFile): the filter lists
+ * @changed: (out) (optional): return location for whether the rules changed
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Replaces the lists to compile with @files. The lists are read and
+ * checksummed in parallel, and only the ones that are new or whose contents
+ * changed since the previous call are parsed again; the rules of the other
+ * ones are reused. The rules are always added in the order of @files, so
+ * the image does not depend on which list is read first.
+ *
+ * Lists that don't exist are skipped, and lists that can't be read are
+ * skipped with a warning. On cancellation, the previous lists are kept.
+ *
+ * Returns: %FALSE if @cancellable was cancelled
+ **/
+gboolean
+ephy_adblock_compiler_set_files (EphyAdblockCompiler  *compiler,
+                                 GPtrArray            *files,
+                                 gboolean             *changed,
+                                 GCancellable         *cancellable,
+                                 GError              **error)
+{
+  g_autoptr(GPtrArray) lists = NULL;
+  g_autofree ParseJob *jobs = NULL;
+  GThreadPool *pool;
+  guint n_parsed = 0;
+
+  g_assert (compiler);
+  g_assert (files);
+
+  jobs = g_new0 (ParseJob, MAX (files->len, 1));
+  pool = g_thread_pool_new ((GFunc)parse_job_run, NULL,
+                            MAX (MIN (files->len, g_get_num_processors ()), 1), FALSE, NULL);
+
+  for (guint i = 0; i < files->len; i++) {
+    CompilerList *old_list = compiler_find_list (compiler, g_ptr_array_index (files, i));
+
+    jobs[i].file = g_ptr_array_index (files, i);
+    jobs[i].old_checksum = old_list ? old_list->checksum : NULL;
+    jobs[i].cancellable = cancellable;
+    g_thread_pool_push (pool, &jobs[i], NULL);
+  }
+
+  /* Waits for all the jobs to finish. */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+    /* Keep the previous lists, so that nothing is lost. */
+    for (guint i = 0; i < files->len; i++) {
+      g_free (jobs[i].checksum);
+      g_clear_pointer (&jobs[i].parsed, parsed_rules_free);
+      g_clear_error (&jobs[i].error);
+    }
+    return FALSE;
+  }
+
+  lists = g_ptr_array_new_with_free_func ((GDestroyNotify)compiler_list_free);
+  for (guint i = 0; i < files->len; i++) {
+    ParseJob *job = &jobs[i];
+    CompilerList *list;
+
+    if (job->error) {
+      if (!g_error_matches (job->error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        g_autofree char *path = g_file_get_path (job->file);
+        g_warning ("Failed to read adblock filter %s: %s", path, job->error->message);
+      }
+      g_clear_error (&job->error);
+      continue;
+    }
+
+    list = g_new0 (CompilerList, 1);
+    list->file = g_object_ref (job->file);
+    list->checksum = job->checksum;
+
+    if (job->parsed) {
+      list->parsed = job->parsed;
+      n_parsed++;
+    } else {
+      /* Unchanged, so take the rules over from the previous list. */
+      CompilerList *old_list = compiler_find_list (compiler, job->file);
+
+      list->parsed = g_steal_pointer (&old_list->parsed);
+      if (!list->parsed) {
+        /* The same list was given twice. */
+        compiler_list_free (list);
+        continue;
+      }
+    }
+
+    g_ptr_array_add (lists, list);
+  }
+
+  LOG ("Parsed %u of %u adblock filter lists", n_parsed, lists->len);
+
+  if (changed) {
+    *changed = n_parsed > 0 || lists->len != compiler->lists->len;
+    for (guint i = 0; i < lists->len && !*changed; i++) {
+      CompilerList *list = g_ptr_array_index (lists, i);
+      CompilerList *old_list = g_ptr_array_index (compiler->lists, i);
+
+      *changed = !g_file_equal (list->file, old_list->file);
+    }
+  }
+
+  g_ptr_array_unref (compiler->lists);
+  compiler->lists = g_steal_pointer (&lists);
+
+  return TRUE;
+}
+
+static guint32
+append_section (GByteArray   *image,
+                gconstpointer data,
+                gsize         size)
+{
+  static const guint8 padding[EPHY_ADBLOCK_IMAGE_ALIGN] = { 0, };
+  guint32 offset;
+
+  if (image->len % EPHY_ADBLOCK_IMAGE_ALIGN)
+    g_byte_array_append (image, padding, EPHY_ADBLOCK_IMAGE_ALIGN - image->len % EPHY_ADBLOCK_IMAGE_ALIGN);
+
+  offset = image->len;
+  if (size > 0)
+    g_byte_array_append (image, data, size);
+
+  return offset;
+}
+
+static int
+token_rule_compare (gconstpointer a,
+                    gconstpointer b)
+{
+  const TokenRule *ra = a;
+  const TokenRule *rb = b;
+
+  if (ra->token != rb->token)
+    return ra->token < rb->token ? -1 : 1;
+  return ra->rule < rb->rule ? -1 : ra->rule > rb->rule;
+}
+
+static int
+trie_output_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  const TrieOutput *oa = a;
+  const TrieOutput *ob = b;
+
+  if (oa->node != ob->node)
+    return oa->node < ob->node ? -1 : 1;
+  return oa->rule < ob->rule ? -1 : oa->rule > ob->rule;
+}
+
+/* Lays the trie out in breadth-first order and computes the Aho-Corasick
+ * fail and output links. Since a fail link always points to a shallower
+ * node, it is known by the time the children of a node are visited. */
+static void
+build_automaton (CompilerTable    *table,
+                 GByteArray       *image,
+                 EphyAdblockTable *out)
+{
+  guint n_nodes = table->trie->len;
+  g_autofree guint32 *order = g_new (guint32, n_nodes);
+  g_autofree guint32 *new_ids = g_new (guint32, n_nodes);
+  g_autofree EphyAdblockNode *nodes = g_new0 (EphyAdblockNode, n_nodes);
+  g_autofree EphyAdblockEdge *edges = g_new0 (EphyAdblockEdge, MAX (n_nodes - 1, 1));
+  g_autofree guint32 *outputs = g_new (guint32, MAX (table->trie_outputs->len, 1));
+  guint n_edges = 0;
+  guint head = 0;
+  guint tail = 1;
+  guint i;
+
+  order[0] = 0;
+  new_ids[0] = 0;
+  while (head < tail) {
+    guint32 id = head;
+    guint32 child = g_array_index (table->trie, TrieNode, order[head++]).first_child;
+
+    nodes[id].edges = n_edges;
+    for (; child; child = g_array_index (table->trie, TrieNode, child).next_sibling) {
+      EphyAdblockEdge *edge = &edges[n_edges++];
+
+      new_ids[child] = tail;
+      order[tail++] = child;
+      edge->target = new_ids[child];
+      edge->byte = g_array_index (table->trie, TrieNode, child).byte;
+    }
+    nodes[id].n_edges = n_edges - nodes[id].edges;
+  }
+
+  for (i = 0; i < n_nodes; i++) {
+    for (guint j = nodes[i].edges; j < nodes[i].edges + nodes[i].n_edges; j++) {
+      guint32 child = edges[j].target;
+      guint32 fail = 0;
+
+      if (i != 0) {
+        guint32 state = nodes[i].fail;
+
+        for (;;) {
+          fail = ephy_adblock_node_get_child (edges, &nodes[state], edges[j].byte);
+          if (fail || state == 0)
+            break;
+          state = nodes[state].fail;
+        }
+      }
+
+      nodes[child].fail = fail;
+    }
+  }
+
+  for (i = 0; i < table->trie_outputs->len; i++) {
+    TrieOutput *output = &g_array_index (table->trie_outputs, TrieOutput, i);
+    output->node = new_ids[output->node];
+  }
+  g_array_sort (table->trie_outputs, trie_output_compare);
+
+  for (i = 0; i < table->trie_outputs->len; i++) {
+    TrieOutput *output = &g_array_index (table->trie_outputs, TrieOutput, i);
+
+    if (nodes[output->node].n_rules == 0)
+      nodes[output->node].rules = i;
+    nodes[output->node].n_rules++;
+    outputs[i] = output->rule;
+  }
+
+  /* Output links need the rules of the shallower nodes, so do them last. */
+  for (i = 1; i < n_nodes; i++) {
+    guint32 fail = nodes[i].fail;
+
+    nodes[i].output_link = nodes[fail].n_rules ? fail : nodes[fail].output_link;
+  }
+
+  out->n_nodes = n_nodes;
+  out->nodes = append_section (image, nodes, n_nodes * sizeof (EphyAdblockNode));
+  out->n_edges = n_edges;
+  out->edges = append_section (image, edges, n_edges * sizeof (EphyAdblockEdge));
+  out->n_outputs = table->trie_outputs->len;
+  out->outputs = append_section (image, outputs, out->n_outputs * sizeof (guint32));
+}
+
+static void
+build_table (CompilerTable    *table,
+             GByteArray       *image,
+             EphyAdblockTable *out)
+{
+  g_autofree EphyAdblockBucket *buckets = NULL;
+  g_autofree guint32 *postings = NULL;
+  guint n_tokens;
+  guint n_buckets = 0;
+  guint i;
+
+  g_array_sort (table->token_rules, token_rule_compare);
+
+  /* Keep the load factor at or below 50% so that probe sequences are short. */
+  n_tokens = g_hash_table_size (table->token_counts);
+  if (n_tokens > 0) {
+    n_buckets = 1;
+    while (n_buckets < n_tokens * 2)
+      n_buckets <<= 1;
+  }
+
+  buckets = g_new0 (EphyAdblockBucket, MAX (n_buckets, 1));
+  postings = g_new (guint32, MAX (table->token_rules->len, 1));
+
+  for (i = 0; i < table->token_rules->len;) {
+    TokenRule *first = &g_array_index (table->token_rules, TokenRule, i);
+    guint32 slot = ephy_adblock_token_slot (first->token) & (n_buckets - 1);
+    guint start = i;
+
+    while (buckets[slot].n_rules != 0)
+      slot = (slot + 1) & (n_buckets - 1);
+
+    for (; i < table->token_rules->len; i++) {
+      TokenRule *entry = &g_array_index (table->token_rules, TokenRule, i);
+
+      if (entry->token != first->token)
+        break;
+      postings[i] = entry->rule;
+    }
+
+    buckets[slot].token = first->token;
+    buckets[slot].rules = start;
+    buckets[slot].n_rules = i - start;
+  }
+
+  out->n_buckets = n_buckets;
+  out->buckets = append_section (image, buckets, n_buckets * sizeof (EphyAdblockBucket));
+  out->n_postings = table->token_rules->len;
+  out->postings = append_section (image, postings, out->n_postings * sizeof (guint32));
+  build_automaton (table, image, out);
+
+  out->n_fallback = table->fallback->len;
+  out->fallback = append_section (image, table->fallback->data, out->n_fallback * sizeof (guint32));
+}
+
+static int
+host_compare (gconstpointer a,
+              gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Appends the selectors that no generic exception (#@#selector) keeps from
+ * being hidden, and returns how many there were. */
+static guint32
+append_selectors (EphyAdblockCompiler *compiler,
+                  GArray              *out,
+                  GArray              *selectors)
+{
+  guint32 n_selectors = 0;
+
+  if (!selectors)
+    return 0;
+
+  for (guint i = 0; i < selectors->len; i++) {
+    EphyAdblockString *selector = &g_array_index (selectors, EphyAdblockString, i);
+
+    if (g_hash_table_contains (compiler->generic_exceptions, GUINT_TO_POINTER (selector->offset)))
+      continue;
+
+    g_array_append_val (out, *selector);
+    n_selectors++;
+  }
+
+  return n_selectors;
+}
+
+/**
+ * ephy_adblock_compiler_build:
+ * @compiler: an #EphyAdblockCompiler
+ *
+ * Serializes the rules of every line added so far and of the current lists
+ * into an image that can be loaded with ephy_adblock_image_new_from_bytes().
+ * Only parsing is cached; the tables and automata are rebuilt from all the
+ * rules every time, since merging them would cost about as much.
+ *
+ * Returns: (transfer full): the image data
+ **/
+GBytes *
+ephy_adblock_compiler_build (EphyAdblockCompiler *compiler)
+{
+  EphyAdblockImageHeader header = { 0, };
+  g_autoptr(GArray) cosmetic_generic = NULL;
+  g_autoptr(GArray) cosmetic_hosts = NULL;
+  g_autoptr(GArray) cosmetic_selectors = NULL;
+  g_autoptr(GPtrArray) hosts = NULL;
+  GHashTableIter iter;
+  gpointer host_name;
+  GByteArray *image;
+
+  g_assert (compiler);
+
+  compiler_clear_tables (compiler);
+  compiler_init_tables (compiler);
+
+  compiler_add_parsed_rules (compiler, compiler->lines);
+  for (guint i = 0; i < compiler->lists->len; i++)
+    compiler_add_parsed_rules (compiler, ((CompilerList *)g_ptr_array_index (compiler->lists, i))->parsed);
+
+  /* Generic exceptions apply to every host, so they are applied right away.
+   * Those of a host are applied by the web process, since they also apply
+   * to the generic rules and to the rules of its parent domains. */
+  cosmetic_generic = g_array_new (FALSE, FALSE, sizeof (EphyAdblockString));
+  append_selectors (compiler, cosmetic_generic, compiler->cosmetic_generic);
+
+  hosts = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, compiler->cosmetic_hosts);
+  while (g_hash_table_iter_next (&iter, &host_name, NULL))
+    g_ptr_array_add (hosts, host_name);
+  g_hash_table_iter_init (&iter, compiler->cosmetic_exceptions);
+  while (g_hash_table_iter_next (&iter, &host_name, NULL)) {
+    if (!g_hash_table_contains (compiler->cosmetic_hosts, host_name))
+      g_ptr_array_add (hosts, host_name);
+  }
+  g_ptr_array_sort (hosts, host_compare);
+
+  /* Hosts are interned here, before the string pool is written out. */
+  cosmetic_hosts = g_array_new (FALSE, FALSE, sizeof (EphyAdblockCosmeticHost));
+  cosmetic_selectors = g_array_new (FALSE, FALSE, sizeof (EphyAdblockString));
+  for (guint i = 0; i < hosts->len; i++) {
+    GArray *exceptions = g_hash_table_lookup (compiler->cosmetic_exceptions, hosts->pdata[i]);
+    EphyAdblockCosmeticHost host;
+
+    host.selectors = cosmetic_selectors->len;
+    host.n_selectors = append_selectors (compiler, cosmetic_selectors,
+                                         g_hash_table_lookup (compiler->cosmetic_hosts, hosts->pdata[i]));
+    host.exceptions = cosmetic_selectors->len;
+    host.n_exceptions = exceptions ? exceptions->len : 0;
+    if (exceptions)
+      g_array_append_vals (cosmetic_selectors, exceptions->data, exceptions->len);
+
+    if (host.n_selectors == 0 && host.n_exceptions == 0)
+      continue;
+
+    host.host = compiler_intern_string (compiler, hosts->pdata[i]);
+    g_array_append_val (cosmetic_hosts, host);
+  }
+
+  image = g_byte_array_new ();
+  append_section (image, &header, sizeof (header));
+
+  header.n_rules = compiler->rules->len;
+  header.rules = append_section (image, compiler->rules->data, header.n_rules * sizeof (EphyAdblockRule));
+  header.n_domains = compiler->domains->len;
+  header.domains = append_section (image, compiler->domains->data, header.n_domains * sizeof (EphyAdblockDomain));
+  header.strings_size = compiler->strings->len;
+  header.strings = append_section (image, compiler->strings->str, header.strings_size);
+  header.n_cosmetic_generic = cosmetic_generic->len;
+  header.cosmetic_generic = append_section (image, cosmetic_generic->data,
+                                            header.n_cosmetic_generic * sizeof (EphyAdblockString));
+  header.n_cosmetic_hosts = cosmetic_hosts->len;
+  header.cosmetic_hosts = append_section (image, cosmetic_hosts->data,
+                                          header.n_cosmetic_hosts * sizeof (EphyAdblockCosmeticHost));
+  header.n_cosmetic_selectors = cosmetic_selectors->len;
+  header.cosmetic_selectors = append_section (image, cosmetic_selectors->data,
+                                              header.n_cosmetic_selectors * sizeof (EphyAdblockString));
+
+  for (guint i = 0; i < EPHY_ADBLOCK_N_TABLES; i++)
+    build_table (&compiler->tables[i], image, &header.tables[i]);
+
+  /* Pad the end too, so the size of the image is a multiple of the alignment. */
+  append_section (image, NULL, 0);
+
+  memcpy (header.magic, EPHY_ADBLOCK_IMAGE_MAGIC, sizeof (header.magic));
+  header.version = EPHY_ADBLOCK_IMAGE_VERSION;
+  header.byte_order = EPHY_ADBLOCK_IMAGE_BYTE_ORDER;
+  header.size = image->len;
+  memcpy (image->data, &header, sizeof (header));
+
+  return g_byte_array_free_to_bytes (image);
+}
+
+/**
+ * ephy_adblock_compiler_write:
+ * @compiler: an #EphyAdblockCompiler
+ * @path: where to save the image
+ * @error: return location for a #GError
+ *
+ * Builds the image and atomically replaces @path with it, so that processes
+ * monitoring @path never see a partially written image.
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+ephy_adblock_compiler_write (EphyAdblockCompiler  *compiler,
+                             const char           *path,
+                             GError              **error)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  const char *data;
+  gsize size;
+
+  bytes = ephy_adblock_compiler_build (compiler);
+  data = g_bytes_get_data (bytes, &size);
+
+  return g_file_set_contents (path, data, size, error);
+}
@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyAdblockCompiler EphyAdblockCompiler;
+
+EphyAdblockCompiler *ephy_adblock_compiler_new       (void);
+void                 ephy_adblock_compiler_free      (EphyAdblockCompiler  *compiler);
+
+void                 ephy_adblock_compiler_add_line  (EphyAdblockCompiler  *compiler,
+                                                      const char           *line);
+gboolean             ephy_adblock_compiler_set_files (EphyAdblockCompiler  *compiler,
+                                                      GPtrArray            *files,
+                                                      gboolean             *changed,
+                                                      GCancellable         *cancellable,
+                                                      GError              **error);
+
+GBytes              *ephy_adblock_compiler_build     (EphyAdblockCompiler  *compiler);
+gboolean             ephy_adblock_compiler_write     (EphyAdblockCompiler  *compiler,
+                                                      const char           *path,
+                                                      GError              **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyAdblockCompiler, ephy_adblock_compiler_free)
+
+G_END_DECLS
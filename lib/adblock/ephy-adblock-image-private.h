@@ -0,0 +1,268 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "ephy-adblock-image.h"
+
+G_BEGIN_DECLS
+
+/* On-disk layout of a compiled filter image. The image is written by the UI
+ * process and mapped read-only by every web process, so it must not contain
+ * any pointers: all references are byte offsets from the start of the image,
+ * and every section starts at an offset aligned to EPHY_ADBLOCK_IMAGE_ALIGN.
+ * The image is only ever consumed on the machine that produced it, so values
+ * are stored in host byte order; the byte_order field rejects foreign images.
+ *
+ * Bump EPHY_ADBLOCK_IMAGE_VERSION whenever anything in this file changes.
+ */
+
+#define EPHY_ADBLOCK_IMAGE_MAGIC      "EPHYADB"
+#define EPHY_ADBLOCK_IMAGE_VERSION    6
+#define EPHY_ADBLOCK_IMAGE_BYTE_ORDER 0x01020304
+#define EPHY_ADBLOCK_IMAGE_ALIGN      8
+
+typedef enum {
+  EPHY_ADBLOCK_TABLE_BLOCK,
+  EPHY_ADBLOCK_TABLE_ALLOW,
+  EPHY_ADBLOCK_TABLE_HIDING, /* Exceptions with $elemhide or $generichide,
+                              * matched against the document instead */
+  EPHY_ADBLOCK_N_TABLES
+} EphyAdblockTableKind;
+
+typedef enum {
+  EPHY_ADBLOCK_RULE_ANCHOR_START  = 1 << 0, /* |pattern */
+  EPHY_ADBLOCK_RULE_ANCHOR_DOMAIN = 1 << 1, /* ||pattern */
+  EPHY_ADBLOCK_RULE_ANCHOR_END    = 1 << 2, /* pattern| */
+  EPHY_ADBLOCK_RULE_REGEX         = 1 << 3, /* /pattern/ */
+  EPHY_ADBLOCK_RULE_ALLOW         = 1 << 4  /* @@pattern */
+} EphyAdblockRuleFlags;
+
+/* Options after the '$' that the matcher understands. Request types can't
+ * be told apart, so those options are ignored. */
+typedef enum {
+  EPHY_ADBLOCK_OPTION_THIRD_PARTY = 1 << 0, /* third-party */
+  EPHY_ADBLOCK_OPTION_FIRST_PARTY = 1 << 1, /* ~third-party */
+  EPHY_ADBLOCK_OPTION_ELEMHIDE    = 1 << 2, /* elemhide: no element hiding at all */
+  EPHY_ADBLOCK_OPTION_GENERICHIDE = 1 << 3  /* generichide: no generic element hiding */
+} EphyAdblockRuleOptions;
+
+typedef struct {
+  guint32 offset; /* Into the string pool */
+  guint32 length; /* Not counting the trailing NUL */
+} EphyAdblockString;
+
+typedef struct {
+  EphyAdblockString pattern;   /* Without anchors, or the body of a regex rule */
+  guint32           flags;     /* EphyAdblockRuleFlags */
+  guint32           options;   /* EphyAdblockRuleOptions */
+  guint32           domains;   /* Index of the first EphyAdblockDomain of the domain= option */
+  guint32           n_domains;
+} EphyAdblockRule;
+
+/* Entry of a domain= option, in lower case. Rules share identical lists. */
+typedef struct {
+  EphyAdblockString name;
+  guint32           excluded; /* ~domain */
+} EphyAdblockDomain;
+
+/* Open-addressed hash table bucket mapping the hash of a token, a maximal
+ * run of alphanumeric characters, to the rules that contain it as a whole
+ * token. Empty buckets have n_rules 0. */
+typedef struct {
+  guint64 token;
+  guint32 rules;   /* Index of the first rule id in the table postings */
+  guint32 n_rules;
+} EphyAdblockBucket;
+
+/* Aho-Corasick automaton over the longest literal fragment of each rule that
+ * has no token. Nodes are numbered in breadth-first order, so the fail
+ * and output links of a node always point to a smaller index and its edges to
+ * a larger one. Node 0 is the root and never has any rules. */
+typedef struct {
+  guint32 edges;       /* Index of the first edge, sorted by byte */
+  guint32 n_edges;
+  guint32 fail;        /* Longest proper suffix that is also a trie node */
+  guint32 output_link; /* Nearest node on the fail chain with rules, or 0 */
+  guint32 rules;       /* Index of the first rule id in the table outputs */
+  guint32 n_rules;
+} EphyAdblockNode;
+
+typedef struct {
+  guint32 target;
+  guint8  byte;
+  guint8  padding[3];
+} EphyAdblockEdge;
+
+/* Element hiding selectors (example.com##selector) that apply to a host and
+ * its subdomains, and the ones that must not be hidden there, generic or not
+ * (example.com#@#selector). Selectors are interned, so the same selector
+ * always has the same offset. Hosts are in lower case and sorted with
+ * strcmp(). */
+typedef struct {
+  EphyAdblockString host;
+  guint32           selectors;    /* Index of the first selector in cosmetic_selectors */
+  guint32           n_selectors;
+  guint32           exceptions;   /* Index of the first exception in cosmetic_selectors */
+  guint32           n_exceptions;
+} EphyAdblockCosmeticHost;
+
+typedef struct {
+  guint32 buckets;    /* Offset of n_buckets EphyAdblockBucket, a power of two */
+  guint32 n_buckets;
+  guint32 postings;   /* Offset of n_postings guint32 rule ids */
+  guint32 n_postings;
+  guint32 nodes;      /* Offset of n_nodes EphyAdblockNode */
+  guint32 n_nodes;
+  guint32 edges;      /* Offset of n_edges EphyAdblockEdge */
+  guint32 n_edges;
+  guint32 outputs;    /* Offset of n_outputs guint32 rule ids */
+  guint32 n_outputs;
+  guint32 fallback;   /* Offset of n_fallback guint32 ids of regex rules and
+                       * rules without any literal character */
+  guint32 n_fallback;
+} EphyAdblockTable;
+
+typedef struct {
+  char             magic[8];
+  guint32          version;
+  guint32          byte_order;
+  guint64          size;
+  guint32          rules;   /* Offset of n_rules EphyAdblockRule */
+  guint32          n_rules;
+  guint32          strings; /* Offset of the NUL-separated string pool */
+  guint32          strings_size;
+  guint32          domains; /* Offset of n_domains EphyAdblockDomain */
+  guint32          n_domains;
+  guint32          cosmetic_generic;   /* Offset of n_cosmetic_generic EphyAdblockString
+                                        * selectors that apply to every page. Generic
+                                        * exceptions (#@#selector) are already applied. */
+  guint32          n_cosmetic_generic;
+  guint32          cosmetic_hosts;     /* Offset of n_cosmetic_hosts EphyAdblockCosmeticHost */
+  guint32          n_cosmetic_hosts;
+  guint32          cosmetic_selectors; /* Offset of n_cosmetic_selectors EphyAdblockString */
+  guint32          n_cosmetic_selectors;
+  EphyAdblockTable tables[EPHY_ADBLOCK_N_TABLES];
+} EphyAdblockImageHeader;
+
+struct _EphyAdblockImage {
+  int                           ref_count;
+  GBytes                       *bytes;
+
+  const EphyAdblockImageHeader *header;
+  const EphyAdblockRule        *rules;
+  const EphyAdblockDomain      *domains;
+  const EphyAdblockString       *cosmetic_generic;
+  const EphyAdblockCosmeticHost *cosmetic_hosts;
+  const EphyAdblockString       *cosmetic_selectors;
+  const char                   *strings;
+};
+
+#define EPHY_ADBLOCK_TOKEN_HASH_INIT G_GUINT64_CONSTANT (0xcbf29ce484222325)
+
+static inline gboolean
+ephy_adblock_is_token_char (char c)
+{
+  return g_ascii_isalnum (c);
+}
+
+/* FNV-1a, so that the hash of a token can be computed one character at a
+ * time while scanning a URL, without copying the token anywhere. */
+static inline guint64
+ephy_adblock_token_hash_step (guint64 hash,
+                              char    c)
+{
+  return (hash ^ (guint8)c) * G_GUINT64_CONSTANT (0x100000001b3);
+}
+
+static inline guint32
+ephy_adblock_token_slot (guint64 token)
+{
+  /* Fibonacci hashing: the high bits of the product are well mixed. */
+  return (guint32)((token * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32);
+}
+
+static inline const char *
+ephy_adblock_image_get_string (EphyAdblockImage        *image,
+                               const EphyAdblockString *string)
+{
+  /* Bounds were checked when the image was loaded. */
+  return image->strings + string->offset;
+}
+
+static inline const EphyAdblockTable *
+ephy_adblock_image_get_table (EphyAdblockImage     *image,
+                              EphyAdblockTableKind  kind)
+{
+  return &image->header->tables[kind];
+}
+
+static inline const guint32 *
+ephy_adblock_image_get_ids (EphyAdblockImage *image,
+                            guint32           offset)
+{
+  return (const guint32 *)((const guint8 *)image->header + offset);
+}
+
+static inline const EphyAdblockBucket *
+ephy_adblock_image_get_buckets (EphyAdblockImage       *image,
+                                const EphyAdblockTable *table)
+{
+  return (const EphyAdblockBucket *)((const guint8 *)image->header + table->buckets);
+}
+
+static inline const EphyAdblockNode *
+ephy_adblock_image_get_nodes (EphyAdblockImage       *image,
+                              const EphyAdblockTable *table)
+{
+  return (const EphyAdblockNode *)((const guint8 *)image->header + table->nodes);
+}
+
+static inline const EphyAdblockEdge *
+ephy_adblock_image_get_edges (EphyAdblockImage       *image,
+                              const EphyAdblockTable *table)
+{
+  return (const EphyAdblockEdge *)((const guint8 *)image->header + table->edges);
+}
+
+/* Returns the child of @node reached through @byte, or 0 if there is none. */
+static inline guint32
+ephy_adblock_node_get_child (const EphyAdblockEdge *edges,
+                             const EphyAdblockNode *node,
+                             guint8                 byte)
+{
+  guint32 low = node->edges;
+  guint32 high = node->edges + node->n_edges;
+
+  while (low < high) {
+    guint32 middle = low + (high - low) / 2;
+
+    if (edges[middle].byte == byte)
+      return edges[middle].target;
+    if (edges[middle].byte < byte)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return 0;
+}
+
+G_END_DECLS
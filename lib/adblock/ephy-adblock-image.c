@@ -0,0 +1,446 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-adblock-image.h"
+
+#include "ephy-adblock-image-private.h"
+
+#include <string.h>
+
+GQuark
+ephy_adblock_image_error_quark (void)
+{
+  return g_quark_from_static_string ("ephy-adblock-image-error-quark");
+}
+
+static gboolean
+section_is_valid (const EphyAdblockImageHeader *header,
+                  guint32                       offset,
+                  guint32                       n_items,
+                  gsize                         item_size)
+{
+  if (n_items == 0)
+    return TRUE;
+
+  if (offset % EPHY_ADBLOCK_IMAGE_ALIGN != 0 || offset < sizeof (EphyAdblockImageHeader))
+    return FALSE;
+
+  return offset + (guint64)n_items * item_size <= header->size;
+}
+
+static gboolean
+string_is_valid (const EphyAdblockImageHeader *header,
+                 const char                   *strings,
+                 const EphyAdblockString      *string)
+{
+  guint64 end = (guint64)string->offset + string->length;
+
+  return end < header->strings_size && strings[end] == '\0';
+}
+
+static gboolean
+strings_are_valid (const EphyAdblockImageHeader *header,
+                   const char                   *strings,
+                   guint32                       offset,
+                   guint32                       n_strings)
+{
+  const EphyAdblockString *array = (const EphyAdblockString *)((const guint8 *)header + offset);
+
+  for (guint32 i = 0; i < n_strings; i++) {
+    if (!string_is_valid (header, strings, &array[i]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+ids_are_valid (const EphyAdblockImageHeader *header,
+               guint32                       offset,
+               guint32                       n_ids)
+{
+  const guint32 *ids = (const guint32 *)((const guint8 *)header + offset);
+
+  for (guint32 i = 0; i < n_ids; i++) {
+    if (ids[i] >= header->n_rules)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Checks the invariants that guarantee that walking the automaton always
+ * terminates: links go backwards and edges go forwards. */
+static gboolean
+automaton_is_valid (const EphyAdblockImageHeader *header,
+                    const EphyAdblockTable       *table)
+{
+  const EphyAdblockNode *nodes;
+  const EphyAdblockEdge *edges;
+
+  if (!section_is_valid (header, table->nodes, table->n_nodes, sizeof (EphyAdblockNode)) ||
+      !section_is_valid (header, table->edges, table->n_edges, sizeof (EphyAdblockEdge)) ||
+      !section_is_valid (header, table->outputs, table->n_outputs, sizeof (guint32)))
+    return FALSE;
+
+  nodes = (const EphyAdblockNode *)((const guint8 *)header + table->nodes);
+  edges = (const EphyAdblockEdge *)((const guint8 *)header + table->edges);
+
+  if (table->n_nodes > 0 && nodes[0].n_rules != 0)
+    return FALSE;
+
+  for (guint32 i = 0; i < table->n_nodes; i++) {
+    const EphyAdblockNode *node = &nodes[i];
+
+    if ((guint64)node->edges + node->n_edges > table->n_edges ||
+        (guint64)node->rules + node->n_rules > table->n_outputs)
+      return FALSE;
+
+    if (i > 0 && (node->fail >= i || node->output_link >= i))
+      return FALSE;
+
+    for (guint32 j = node->edges; j < node->edges + node->n_edges; j++) {
+      if (edges[j].target <= i || edges[j].target >= table->n_nodes)
+        return FALSE;
+      if (j > node->edges && edges[j - 1].byte >= edges[j].byte)
+        return FALSE;
+    }
+  }
+
+  return ids_are_valid (header, table->outputs, table->n_outputs);
+}
+
+static gboolean
+table_is_valid (const EphyAdblockImageHeader *header,
+                const EphyAdblockTable       *table)
+{
+  const EphyAdblockBucket *buckets;
+  gboolean has_empty_bucket = FALSE;
+
+  if (table->n_buckets & (table->n_buckets - 1))
+    return FALSE;
+
+  if (!section_is_valid (header, table->buckets, table->n_buckets, sizeof (EphyAdblockBucket)) ||
+      !section_is_valid (header, table->postings, table->n_postings, sizeof (guint32)) ||
+      !section_is_valid (header, table->fallback, table->n_fallback, sizeof (guint32)))
+    return FALSE;
+
+  buckets = (const EphyAdblockBucket *)((const guint8 *)header + table->buckets);
+  for (guint32 i = 0; i < table->n_buckets; i++) {
+    if ((guint64)buckets[i].rules + buckets[i].n_rules > table->n_postings)
+      return FALSE;
+    if (buckets[i].n_rules == 0)
+      has_empty_bucket = TRUE;
+  }
+
+  /* Probing for a token stops at the first empty bucket. */
+  if (table->n_buckets > 0 && !has_empty_bucket)
+    return FALSE;
+
+  return ids_are_valid (header, table->postings, table->n_postings) &&
+         ids_are_valid (header, table->fallback, table->n_fallback) &&
+         automaton_is_valid (header, table);
+}
+
+/* The image comes from our own cache directory, but it may be truncated or
+ * left over from an older version, so check every offset once up front. The
+ * matcher can then follow them without any bounds checks. */
+static gboolean
+image_is_valid (const guint8 *data,
+                gsize         size)
+{
+  const EphyAdblockImageHeader *header = (const EphyAdblockImageHeader *)data;
+  const EphyAdblockRule *rules;
+  const EphyAdblockDomain *domains;
+  const EphyAdblockCosmeticHost *hosts;
+  const char *strings;
+
+  if (size < sizeof (EphyAdblockImageHeader))
+    return FALSE;
+
+  if (memcmp (header->magic, EPHY_ADBLOCK_IMAGE_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != EPHY_ADBLOCK_IMAGE_VERSION ||
+      header->byte_order != EPHY_ADBLOCK_IMAGE_BYTE_ORDER ||
+      header->size != size)
+    return FALSE;
+
+  if (header->strings_size == 0 ||
+      !section_is_valid (header, header->strings, header->strings_size, 1) ||
+      !section_is_valid (header, header->rules, header->n_rules, sizeof (EphyAdblockRule)) ||
+      !section_is_valid (header, header->domains, header->n_domains, sizeof (EphyAdblockDomain)) ||
+      !section_is_valid (header, header->cosmetic_generic, header->n_cosmetic_generic, sizeof (EphyAdblockString)) ||
+      !section_is_valid (header, header->cosmetic_hosts, header->n_cosmetic_hosts, sizeof (EphyAdblockCosmeticHost)) ||
+      !section_is_valid (header, header->cosmetic_selectors, header->n_cosmetic_selectors, sizeof (EphyAdblockString)))
+    return FALSE;
+
+  strings = (const char *)data + header->strings;
+  rules = (const EphyAdblockRule *)(data + header->rules);
+  for (guint32 i = 0; i < header->n_rules; i++) {
+    if (!string_is_valid (header, strings, &rules[i].pattern) ||
+        (guint64)rules[i].domains + rules[i].n_domains > header->n_domains)
+      return FALSE;
+  }
+
+  domains = (const EphyAdblockDomain *)(data + header->domains);
+  for (guint32 i = 0; i < header->n_domains; i++) {
+    if (!string_is_valid (header, strings, &domains[i].name))
+      return FALSE;
+  }
+
+  if (!strings_are_valid (header, strings, header->cosmetic_generic, header->n_cosmetic_generic) ||
+      !strings_are_valid (header, strings, header->cosmetic_selectors, header->n_cosmetic_selectors))
+    return FALSE;
+
+  /* Hosts must be sorted for the binary search. */
+  hosts = (const EphyAdblockCosmeticHost *)(data + header->cosmetic_hosts);
+  for (guint32 i = 0; i < header->n_cosmetic_hosts; i++) {
+    if (!string_is_valid (header, strings, &hosts[i].host) ||
+        (guint64)hosts[i].selectors + hosts[i].n_selectors > header->n_cosmetic_selectors ||
+        (guint64)hosts[i].exceptions + hosts[i].n_exceptions > header->n_cosmetic_selectors)
+      return FALSE;
+    if (i > 0 && strcmp (strings + hosts[i - 1].host.offset, strings + hosts[i].host.offset) >= 0)
+      return FALSE;
+  }
+
+  for (guint i = 0; i < EPHY_ADBLOCK_N_TABLES; i++) {
+    if (!table_is_valid (header, &header->tables[i]))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+EphyAdblockImage *
+ephy_adblock_image_new_from_bytes (GBytes  *bytes,
+                                   GError **error)
+{
+  EphyAdblockImage *image;
+  const guint8 *data;
+  gsize size;
+
+  g_assert (bytes);
+
+  data = g_bytes_get_data (bytes, &size);
+  if (!data || (gsize)data % EPHY_ADBLOCK_IMAGE_ALIGN != 0 || !image_is_valid (data, size)) {
+    g_set_error_literal (error,
+                         EPHY_ADBLOCK_IMAGE_ERROR,
+                         EPHY_ADBLOCK_IMAGE_ERROR_INVALID,
+                         "Adblock filter image is corrupted or was built by a different version");
+    return NULL;
+  }
+
+  image = g_new0 (EphyAdblockImage, 1);
+  image->ref_count = 1;
+  image->bytes = g_bytes_ref (bytes);
+  image->header = (const EphyAdblockImageHeader *)data;
+  image->rules = (const EphyAdblockRule *)(data + image->header->rules);
+  image->domains = (const EphyAdblockDomain *)(data + image->header->domains);
+  image->cosmetic_generic = (const EphyAdblockString *)(data + image->header->cosmetic_generic);
+  image->cosmetic_hosts = (const EphyAdblockCosmeticHost *)(data + image->header->cosmetic_hosts);
+  image->cosmetic_selectors = (const EphyAdblockString *)(data + image->header->cosmetic_selectors);
+  image->strings = (const char *)data + image->header->strings;
+
+  return image;
+}
+
+/**
+ * ephy_adblock_image_new_from_file:
+ * @path: the path of an image written by #EphyAdblockCompiler
+ * @error: return location for a #GError
+ *
+ * Maps the image at @path read-only. The pages are backed by the file, so
+ * they are shared between all the processes that map the same image.
+ *
+ * Returns: (transfer full): a new #EphyAdblockImage, or %NULL on error
+ **/
+EphyAdblockImage *
+ephy_adblock_image_new_from_file (const char  *path,
+                                  GError     **error)
+{
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  mapped_file = g_mapped_file_new (path, FALSE, error);
+  if (!mapped_file)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  return ephy_adblock_image_new_from_bytes (bytes, error);
+}
+
+EphyAdblockImage *
+ephy_adblock_image_ref (EphyAdblockImage *image)
+{
+  g_assert (image);
+
+  g_atomic_int_inc (&image->ref_count);
+
+  return image;
+}
+
+void
+ephy_adblock_image_unref (EphyAdblockImage *image)
+{
+  g_assert (image);
+
+  if (!g_atomic_int_dec_and_test (&image->ref_count))
+    return;
+
+  g_bytes_unref (image->bytes);
+  g_free (image);
+}
+
+guint
+ephy_adblock_image_get_n_rules (EphyAdblockImage *image)
+{
+  return image->header->n_rules;
+}
+
+guint
+ephy_adblock_image_get_n_cosmetic_hosts (EphyAdblockImage *image)
+{
+  return image->header->n_cosmetic_hosts;
+}
+
+/**
+ * ephy_adblock_image_get_cosmetic_host:
+ * @image: an #EphyAdblockImage
+ * @index: a number below ephy_adblock_image_get_n_cosmetic_hosts()
+ *
+ * Returns: a host with element hiding rules of its own. They also apply to
+ * its subdomains.
+ **/
+const char *
+ephy_adblock_image_get_cosmetic_host (EphyAdblockImage *image,
+                                      guint             index)
+{
+  g_assert (index < image->header->n_cosmetic_hosts);
+
+  return ephy_adblock_image_get_string (image, &image->cosmetic_hosts[index].host);
+}
+
+static const EphyAdblockCosmeticHost *
+find_cosmetic_host (EphyAdblockImage *image,
+                    const char       *host)
+{
+  guint32 low = 0;
+  guint32 high = image->header->n_cosmetic_hosts;
+
+  while (low < high) {
+    guint32 middle = low + (high - low) / 2;
+    int cmp = strcmp (host, ephy_adblock_image_get_string (image, &image->cosmetic_hosts[middle].host));
+
+    if (cmp == 0)
+      return &image->cosmetic_hosts[middle];
+    if (cmp < 0)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+
+  return NULL;
+}
+
+/**
+ * ephy_adblock_image_add_hiding_exceptions:
+ * @image: an #EphyAdblockImage
+ * @host: a host, in lower case
+ * @exceptions: (element-type utf8): a set created with
+ *   g_hash_table_new (NULL, NULL)
+ *
+ * Adds the selectors that element hiding exceptions (host#@#selector) keep
+ * from being hidden on @host, but not on its subdomains, to @exceptions.
+ * Selectors are interned in the image, so they are compared by address.
+ **/
+void
+ephy_adblock_image_add_hiding_exceptions (EphyAdblockImage *image,
+                                          const char       *host,
+                                          GHashTable       *exceptions)
+{
+  const EphyAdblockCosmeticHost *cosmetic_host;
+
+  g_assert (host);
+  g_assert (exceptions);
+
+  cosmetic_host = find_cosmetic_host (image, host);
+  if (!cosmetic_host)
+    return;
+
+  for (guint32 i = cosmetic_host->exceptions; i < cosmetic_host->exceptions + cosmetic_host->n_exceptions; i++)
+    g_hash_table_add (exceptions, (gpointer)ephy_adblock_image_get_string (image, &image->cosmetic_selectors[i]));
+}
+
+/**
+ * ephy_adblock_image_get_style_sheet:
+ * @image: an #EphyAdblockImage
+ * @host: (nullable): one of the hosts returned by
+ *   ephy_adblock_image_get_cosmetic_host(), or %NULL
+ * @exceptions: (nullable): selectors to leave out, as filled by
+ *   ephy_adblock_image_add_hiding_exceptions()
+ *
+ * Builds a style sheet hiding the elements selected by the element hiding
+ * rules of @host, or by the generic rules if @host is %NULL.
+ *
+ * Each selector gets a rule of its own, because a single selector that the
+ * engine does not understand would invalidate a whole selector list.
+ *
+ * Returns: (transfer full) (nullable): the style sheet, or %NULL if there are
+ *   no such rules
+ **/
+char *
+ephy_adblock_image_get_style_sheet (EphyAdblockImage *image,
+                                    const char       *host,
+                                    GHashTable       *exceptions)
+{
+  const EphyAdblockString *selectors;
+  guint32 n_selectors;
+  GString *style_sheet;
+
+  if (host) {
+    const EphyAdblockCosmeticHost *cosmetic_host = find_cosmetic_host (image, host);
+
+    if (!cosmetic_host)
+      return NULL;
+    selectors = image->cosmetic_selectors + cosmetic_host->selectors;
+    n_selectors = cosmetic_host->n_selectors;
+  } else {
+    selectors = image->cosmetic_generic;
+    n_selectors = image->header->n_cosmetic_generic;
+  }
+
+  style_sheet = g_string_sized_new (n_selectors * 64);
+  for (guint32 i = 0; i < n_selectors; i++) {
+    const char *selector = ephy_adblock_image_get_string (image, &selectors[i]);
+
+    if (exceptions && g_hash_table_contains (exceptions, selector))
+      continue;
+
+    g_string_append (style_sheet, selector);
+    g_string_append (style_sheet, " { display: none !important; }\n");
+  }
+
+  if (style_sheet->len == 0) {
+    g_string_free (style_sheet, TRUE);
+    return NULL;
+  }
+
+  return g_string_free (style_sheet, FALSE);
+}
@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EPHY_ADBLOCK_IMAGE_ERROR (ephy_adblock_image_error_quark ())
+
+typedef enum {
+  EPHY_ADBLOCK_IMAGE_ERROR_INVALID
+} EphyAdblockImageError;
+
+typedef struct _EphyAdblockImage EphyAdblockImage;
+
+GQuark            ephy_adblock_image_error_quark     (void);
+
+EphyAdblockImage *ephy_adblock_image_new_from_bytes  (GBytes           *bytes,
+                                                      GError          **error);
+EphyAdblockImage *ephy_adblock_image_new_from_file   (const char       *path,
+                                                      GError          **error);
+EphyAdblockImage *ephy_adblock_image_ref             (EphyAdblockImage *image);
+void              ephy_adblock_image_unref           (EphyAdblockImage *image);
+
+guint             ephy_adblock_image_get_n_rules     (EphyAdblockImage *image);
+
+guint             ephy_adblock_image_get_n_cosmetic_hosts  (EphyAdblockImage *image);
+const char       *ephy_adblock_image_get_cosmetic_host     (EphyAdblockImage *image,
+                                                            guint             index);
+void              ephy_adblock_image_add_hiding_exceptions (EphyAdblockImage *image,
+                                                            const char       *host,
+                                                            GHashTable       *exceptions);
+char             *ephy_adblock_image_get_style_sheet       (EphyAdblockImage *image,
+                                                            const char       *host,
+                                                            GHashTable       *exceptions);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyAdblockImage, ephy_adblock_image_unref)
+
+G_END_DECLS
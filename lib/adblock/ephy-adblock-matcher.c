@@ -0,0 +1,652 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-adblock-matcher.h"
+
+#include "ephy-adblock-image-private.h"
+#include "ephy-debug.h"
+
+#include <libsoup/soup.h>
+#include <string.h>
+
+typedef struct {
+  const char *uri;
+  gsize       length;
+  const char *page_uri;
+  guint32     options; /* Only rules with one of these options match */
+
+  /* Only computed when a rule with options needs them. */
+  const char *page_host;
+  gboolean    page_host_known;
+  char        page_host_buffer[256];
+  int         third_party; /* -1 until known */
+} MatchRequest;
+
+struct _EphyAdblockMatcher {
+  EphyAdblockImage *image;
+
+  /* Regex rules are rare, so they are compiled lazily in each process. */
+  GHashTable *regexes; /* rule id -> GRegex, or NULL if invalid */
+
+  /* Most documents get all the generic rules. */
+  char       *generic_style_sheet;
+};
+
+EphyAdblockMatcher *
+ephy_adblock_matcher_new (EphyAdblockImage *image)
+{
+  EphyAdblockMatcher *matcher;
+
+  g_assert (image);
+
+  matcher = g_new0 (EphyAdblockMatcher, 1);
+  matcher->image = ephy_adblock_image_ref (image);
+  matcher->regexes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                            (GDestroyNotify)g_regex_unref);
+
+  return matcher;
+}
+
+void
+ephy_adblock_matcher_free (EphyAdblockMatcher *matcher)
+{
+  g_assert (matcher);
+
+  ephy_adblock_image_unref (matcher->image);
+  g_hash_table_unref (matcher->regexes);
+  g_free (matcher->generic_style_sheet);
+
+  g_free (matcher);
+}
+
+EphyAdblockImage *
+ephy_adblock_matcher_get_image (EphyAdblockMatcher *matcher)
+{
+  return matcher->image;
+}
+
+/* Matches a separator character, defined as: "anything but a letter, a
+ * digit, or one of the following: _ - . %". */
+static inline gboolean
+is_separator (char c)
+{
+  return !g_ascii_isalnum (c) && c != '_' && c != '-' && c != '.' && c != '%';
+}
+
+/* Matches the adblock pattern [p, p_end) starting exactly at s. '*' matches
+ * any run of characters and '^' a separator or the end of the address. The
+ * pattern only has to match a prefix of [s, s_end) unless anchor_end is set. */
+static gboolean
+pattern_match_here (const char *p,
+                    const char *p_end,
+                    const char *s,
+                    const char *s_end,
+                    gboolean    anchor_end)
+{
+  const char *star_p = NULL;
+  const char *star_s = NULL;
+
+  for (;;) {
+    if (p < p_end) {
+      if (*p == '*') {
+        star_p = ++p;
+        star_s = s;
+        continue;
+      }
+
+      if (s < s_end) {
+        if (*p == '^' ? is_separator (*s) : *p == *s) {
+          p++;
+          s++;
+          continue;
+        }
+      } else if (*p == '^') {
+        p++;
+        continue;
+      }
+    } else if (!anchor_end || s == s_end) {
+      return TRUE;
+    }
+
+    /* Mismatch: let the last '*' swallow one more character. */
+    if (!star_p || star_s >= s_end)
+      return FALSE;
+    p = star_p;
+    s = ++star_s;
+  }
+}
+
+static gboolean
+uri_get_host (const char  *uri,
+              const char **host,
+              gsize       *length)
+{
+  const char *start;
+  const char *end;
+  const char *at;
+
+  start = strstr (uri, "://");
+  if (!start)
+    return FALSE;
+  start += 3;
+
+  end = start + strcspn (start, "/?#");
+  at = memchr (start, '@', end - start);
+  if (at)
+    start = at + 1;
+
+  *host = start;
+  *length = strcspn (start, ":/?#");
+
+  return TRUE;
+}
+
+static gboolean
+pattern_match (const char *pattern,
+               gsize       pattern_length,
+               guint32     flags,
+               const char *uri,
+               gsize       uri_length)
+{
+  const char *p_end = pattern + pattern_length;
+  const char *s_end = uri + uri_length;
+  gboolean anchor_end = !!(flags & EPHY_ADBLOCK_RULE_ANCHOR_END);
+  const char *s;
+
+  if (flags & EPHY_ADBLOCK_RULE_ANCHOR_START)
+    return pattern_match_here (pattern, p_end, uri, s_end, anchor_end);
+
+  if (flags & EPHY_ADBLOCK_RULE_ANCHOR_DOMAIN) {
+    const char *host;
+    gsize host_length;
+
+    /* The pattern must start at the host or at one of its subdomains. */
+    if (!uri_get_host (uri, &host, &host_length))
+      return FALSE;
+
+    for (s = host; s < host + host_length; s++) {
+      if ((s == host || s[-1] == '.') &&
+          pattern_match_here (pattern, p_end, s, s_end, anchor_end))
+        return TRUE;
+    }
+    return FALSE;
+  }
+
+  for (s = uri; s <= s_end; s++) {
+    /* Skip quickly to the next possible start when the pattern begins with
+     * a literal character, which is the common case. */
+    if (*pattern != '^' && *pattern != '*') {
+      s = memchr (s, *pattern, s_end - s);
+      if (!s)
+        return FALSE;
+    }
+
+    if (pattern_match_here (pattern, p_end, s, s_end, anchor_end))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static GRegex *
+matcher_get_regex (EphyAdblockMatcher    *matcher,
+                   guint32                id,
+                   const EphyAdblockRule *rule)
+{
+  GRegex *regex;
+  g_autoptr(GError) error = NULL;
+
+  if (g_hash_table_lookup_extended (matcher->regexes, GUINT_TO_POINTER (id), NULL, (gpointer *)&regex))
+    return regex;
+
+  regex = g_regex_new (ephy_adblock_image_get_string (matcher->image, &rule->pattern),
+                       G_REGEX_OPTIMIZE, 0, &error);
+  if (error)
+    g_warning ("%s: %s", G_STRFUNC, error->message);
+
+  g_hash_table_insert (matcher->regexes, GUINT_TO_POINTER (id), regex);
+
+  return regex;
+}
+
+static gboolean
+rule_match_uri (EphyAdblockMatcher    *matcher,
+                guint32                id,
+                const EphyAdblockRule *rule,
+                const char            *uri,
+                gsize                  uri_length)
+{
+  if (rule->flags & EPHY_ADBLOCK_RULE_REGEX) {
+    GRegex *regex = matcher_get_regex (matcher, id, rule);
+
+    return regex && g_regex_match_full (regex, uri, uri_length, 0, 0, NULL, NULL);
+  }
+
+  return pattern_match (ephy_adblock_image_get_string (matcher->image, &rule->pattern),
+                        rule->pattern.length,
+                        rule->flags,
+                        uri,
+                        uri_length);
+}
+
+static const char *
+request_get_host (const char *uri,
+                  char       *buffer,
+                  gsize       buffer_size)
+{
+  const char *host;
+  gsize length;
+
+  if (!uri_get_host (uri, &host, &length) || length == 0 || length >= buffer_size)
+    return NULL;
+
+  memcpy (buffer, host, length);
+  buffer[length] = '\0';
+
+  return buffer;
+}
+
+static const char *
+request_get_page_host (MatchRequest *request)
+{
+  if (!request->page_host_known) {
+    request->page_host = request->page_uri ? request_get_host (request->page_uri, request->page_host_buffer,
+                                                               sizeof (request->page_host_buffer)) : NULL;
+    request->page_host_known = TRUE;
+  }
+
+  return request->page_host;
+}
+
+static const char *
+get_registrable_domain (const char *host)
+{
+  const char *domain;
+
+  /* Fails for IP addresses and public suffixes, which stand for themselves. */
+  domain = soup_tld_get_base_domain (host, NULL);
+  return domain ? domain : host;
+}
+
+/* A request is third-party when it goes to a different registrable domain
+ * than the one of the page, e.g. cdn.example.com is first-party on
+ * www.example.com but ads.example.net isn't. Requests without a page, like
+ * the ones for the main resource, are first-party. */
+static gboolean
+request_is_third_party (MatchRequest *request)
+{
+  if (request->third_party < 0) {
+    const char *page_host = request_get_page_host (request);
+    char host_buffer[256];
+    const char *host;
+
+    host = page_host ? request_get_host (request->uri, host_buffer, sizeof (host_buffer)) : NULL;
+    if (!host)
+      request->third_party = FALSE;
+    else
+      request->third_party = g_ascii_strcasecmp (get_registrable_domain (host),
+                                                 get_registrable_domain (page_host)) != 0;
+  }
+
+  return request->third_party;
+}
+
+static gboolean
+host_is_in_domain (const char *host,
+                   gsize       host_length,
+                   const char *domain,
+                   gsize       domain_length)
+{
+  if (host_length < domain_length)
+    return FALSE;
+
+  if (g_ascii_strncasecmp (host + host_length - domain_length, domain, domain_length) != 0)
+    return FALSE;
+
+  return host_length == domain_length || host[host_length - domain_length - 1] == '.';
+}
+
+/* The most specific entry of the domain= option that covers the page
+ * decides; when none does, the rule only applies if the option has no
+ * included domains at all, like in "domain=~example.com". */
+static gboolean
+rule_applies_to_page (EphyAdblockMatcher    *matcher,
+                      const EphyAdblockRule *rule,
+                      MatchRequest          *request)
+{
+  const EphyAdblockDomain *best = NULL;
+  gboolean has_included = FALSE;
+  const char *page_host;
+  gsize page_host_length;
+
+  if (rule->n_domains == 0)
+    return TRUE;
+
+  page_host = request_get_page_host (request);
+  page_host_length = page_host ? strlen (page_host) : 0;
+
+  for (guint32 i = rule->domains; i < rule->domains + rule->n_domains; i++) {
+    const EphyAdblockDomain *domain = &matcher->image->domains[i];
+
+    if (!domain->excluded)
+      has_included = TRUE;
+
+    if (page_host &&
+        (!best || domain->name.length > best->name.length) &&
+        host_is_in_domain (page_host, page_host_length,
+                           ephy_adblock_image_get_string (matcher->image, &domain->name),
+                           domain->name.length))
+      best = domain;
+  }
+
+  if (best)
+    return !best->excluded;
+  return !has_included;
+}
+
+static gboolean
+matcher_check_rule (EphyAdblockMatcher *matcher,
+                    guint32             id,
+                    MatchRequest       *request)
+{
+  const EphyAdblockRule *rule = &matcher->image->rules[id];
+
+  if (request->options && !(rule->options & request->options))
+    return FALSE;
+
+  if (!rule_match_uri (matcher, id, rule, request->uri, request->length))
+    return FALSE;
+
+  if ((rule->options & EPHY_ADBLOCK_OPTION_THIRD_PARTY) && !request_is_third_party (request))
+    return FALSE;
+  if ((rule->options & EPHY_ADBLOCK_OPTION_FIRST_PARTY) && request_is_third_party (request))
+    return FALSE;
+
+  if (!rule_applies_to_page (matcher, rule, request))
+    return FALSE;
+
+  LOG ("%s by pattern %s -- %s",
+       rule->flags & EPHY_ADBLOCK_RULE_ALLOW ? "whitelisted" : "blocked",
+       ephy_adblock_image_get_string (matcher->image, &rule->pattern),
+       request->uri);
+  return TRUE;
+}
+
+static gboolean
+matcher_match_bucket (EphyAdblockMatcher      *matcher,
+                      const EphyAdblockBucket *buckets,
+                      guint32                  mask,
+                      const guint32           *postings,
+                      guint64                  token,
+                      MatchRequest            *request)
+{
+  for (guint32 slot = ephy_adblock_token_slot (token) & mask; buckets[slot].n_rules != 0; slot = (slot + 1) & mask) {
+    const EphyAdblockBucket *bucket = &buckets[slot];
+
+    if (bucket->token != token)
+      continue;
+
+    for (guint32 i = 0; i < bucket->n_rules; i++) {
+      if (matcher_check_rule (matcher, postings[bucket->rules + i], request))
+        return TRUE;
+    }
+    break;
+  }
+
+  return FALSE;
+}
+
+/* Splits the URL into tokens, hashing them on the fly, and checks the rules
+ * of each distinct token. Tokens repeat a lot in URLs ("http", the domain
+ * in redirect parameters...), so remember the last few already looked up. */
+static gboolean
+matcher_match_tokens (EphyAdblockMatcher     *matcher,
+                      const EphyAdblockTable *table,
+                      MatchRequest           *request)
+{
+  const EphyAdblockBucket *buckets;
+  const guint32 *postings;
+  guint64 seen[32];
+  guint n_seen = 0;
+  guint next_seen = 0;
+  guint32 mask;
+  gsize pos = 0;
+
+  if (table->n_buckets == 0)
+    return FALSE;
+
+  buckets = ephy_adblock_image_get_buckets (matcher->image, table);
+  postings = ephy_adblock_image_get_ids (matcher->image, table->postings);
+  mask = table->n_buckets - 1;
+
+  while (pos < request->length) {
+    guint64 token = EPHY_ADBLOCK_TOKEN_HASH_INIT;
+    gboolean repeated = FALSE;
+
+    if (!ephy_adblock_is_token_char (request->uri[pos])) {
+      pos++;
+      continue;
+    }
+
+    for (; pos < request->length && ephy_adblock_is_token_char (request->uri[pos]); pos++)
+      token = ephy_adblock_token_hash_step (token, request->uri[pos]);
+
+    for (guint i = 0; i < n_seen && !repeated; i++)
+      repeated = seen[i] == token;
+    if (repeated)
+      continue;
+    seen[next_seen++ % G_N_ELEMENTS (seen)] = token;
+    n_seen = MIN (n_seen + 1, G_N_ELEMENTS (seen));
+
+    if (matcher_match_bucket (matcher, buckets, mask, postings, token, request))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Runs the URL through the automaton once, verifying the rules of every
+ * fragment found along the way. */
+static gboolean
+matcher_match_automaton (EphyAdblockMatcher     *matcher,
+                         const EphyAdblockTable *table,
+                         MatchRequest           *request)
+{
+  const EphyAdblockNode *nodes;
+  const EphyAdblockEdge *edges;
+  const guint32 *outputs;
+  guint32 state = 0;
+
+  if (table->n_nodes <= 1)
+    return FALSE;
+
+  nodes = ephy_adblock_image_get_nodes (matcher->image, table);
+  edges = ephy_adblock_image_get_edges (matcher->image, table);
+  outputs = ephy_adblock_image_get_ids (matcher->image, table->outputs);
+
+  for (gsize pos = 0; pos < request->length; pos++) {
+    guint8 byte = request->uri[pos];
+    guint32 next;
+
+    for (;;) {
+      next = ephy_adblock_node_get_child (edges, &nodes[state], byte);
+      if (next || state == 0)
+        break;
+      state = nodes[state].fail;
+    }
+    state = next;
+
+    for (guint32 node = state; node; node = nodes[node].output_link) {
+      for (guint32 i = 0; i < nodes[node].n_rules; i++) {
+        if (matcher_check_rule (matcher, outputs[nodes[node].rules + i], request))
+          return TRUE;
+      }
+    }
+  }
+
+  return FALSE;
+}
+
+static gboolean
+matcher_match_fallback (EphyAdblockMatcher     *matcher,
+                        const EphyAdblockTable *table,
+                        MatchRequest           *request)
+{
+  const guint32 *ids = ephy_adblock_image_get_ids (matcher->image, table->fallback);
+
+  for (guint32 i = 0; i < table->n_fallback; i++) {
+    if (matcher_check_rule (matcher, ids[i], request))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+static gboolean
+matcher_match_table (EphyAdblockMatcher   *matcher,
+                     EphyAdblockTableKind  kind,
+                     const char           *request_uri,
+                     const char           *page_uri,
+                     guint32               options)
+{
+  const EphyAdblockTable *table = ephy_adblock_image_get_table (matcher->image, kind);
+  MatchRequest request;
+
+  request.uri = request_uri;
+  request.length = strlen (request_uri);
+  request.page_uri = page_uri;
+  request.options = options;
+  request.page_host = NULL;
+  request.page_host_known = FALSE;
+  request.third_party = -1;
+
+  if (matcher_match_tokens (matcher, table, &request))
+    return TRUE;
+
+  if (matcher_match_automaton (matcher, table, &request))
+    return TRUE;
+
+  /* Regex rules have to be tried one by one. */
+  return matcher_match_fallback (matcher, table, &request);
+}
+
+/**
+ * ephy_adblock_matcher_match:
+ * @matcher: an #EphyAdblockMatcher
+ * @request_uri: the URI of the subresource
+ * @page_uri: (nullable): the URI of the page loading it
+ * @whitelist: whether to check the exception rules instead of the blocking ones
+ *
+ * Returns: %TRUE if any rule of the requested kind matches @request_uri
+ **/
+gboolean
+ephy_adblock_matcher_match (EphyAdblockMatcher *matcher,
+                            const char         *request_uri,
+                            const char         *page_uri,
+                            gboolean            whitelist)
+{
+  g_assert (matcher);
+  g_assert (request_uri);
+
+  return matcher_match_table (matcher,
+                              whitelist ? EPHY_ADBLOCK_TABLE_ALLOW : EPHY_ADBLOCK_TABLE_BLOCK,
+                              request_uri, page_uri, 0);
+}
+
+/**
+ * ephy_adblock_matcher_get_style_sheet:
+ * @matcher: an #EphyAdblockMatcher
+ * @document_uri: the URI of the document loaded in a frame
+ *
+ * Builds the style sheet hiding the elements selected by the generic element
+ * hiding rules and by the rules of the host of @document_uri and of its
+ * parent domains, leaving out the selectors of the exceptions of those
+ * hosts. Exception rules with the generichide option that match
+ * @document_uri leave the generic rules out, and the ones with the elemhide
+ * option leave everything out.
+ *
+ * Returns: (transfer full) (nullable): the style sheet, or %NULL if there are
+ *   no such rules
+ **/
+char *
+ephy_adblock_matcher_get_style_sheet (EphyAdblockMatcher *matcher,
+                                      const char         *document_uri)
+{
+  g_autoptr(GHashTable) exceptions = NULL;
+  g_autofree char *host = NULL;
+  char host_buffer[256];
+  GString *style_sheet;
+
+  g_assert (matcher);
+  g_assert (document_uri);
+
+  if (matcher_match_table (matcher, EPHY_ADBLOCK_TABLE_HIDING, document_uri, document_uri,
+                           EPHY_ADBLOCK_OPTION_ELEMHIDE))
+    return NULL;
+
+  if (request_get_host (document_uri, host_buffer, sizeof (host_buffer)))
+    host = g_ascii_strdown (host_buffer, -1);
+
+  /* The rules and exceptions of a host also apply to its subdomains. */
+  exceptions = g_hash_table_new (NULL, NULL);
+  for (const char *domain = host; domain; domain = strchr (domain, '.')) {
+    if (*domain == '.')
+      domain++;
+    ephy_adblock_image_add_hiding_exceptions (matcher->image, domain, exceptions);
+  }
+
+  style_sheet = g_string_new (NULL);
+
+  if (!matcher_match_table (matcher, EPHY_ADBLOCK_TABLE_HIDING, document_uri, document_uri,
+                            EPHY_ADBLOCK_OPTION_GENERICHIDE)) {
+    if (g_hash_table_size (exceptions) == 0) {
+      if (!matcher->generic_style_sheet) {
+        matcher->generic_style_sheet = ephy_adblock_image_get_style_sheet (matcher->image, NULL, NULL);
+        if (!matcher->generic_style_sheet)
+          matcher->generic_style_sheet = g_strdup ("");
+      }
+      g_string_append (style_sheet, matcher->generic_style_sheet);
+    } else {
+      g_autofree char *generic = ephy_adblock_image_get_style_sheet (matcher->image, NULL, exceptions);
+
+      if (generic)
+        g_string_append (style_sheet, generic);
+    }
+  }
+
+  for (const char *domain = host; domain; domain = strchr (domain, '.')) {
+    g_autofree char *source = NULL;
+
+    if (*domain == '.')
+      domain++;
+
+    source = ephy_adblock_image_get_style_sheet (matcher->image, domain, exceptions);
+    if (source)
+      g_string_append (style_sheet, source);
+  }
+
+  if (style_sheet->len == 0) {
+    g_string_free (style_sheet, TRUE);
+    return NULL;
+  }
+
+  return g_string_free (style_sheet, FALSE);
+}
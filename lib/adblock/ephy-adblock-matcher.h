@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "ephy-adblock-image.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EphyAdblockMatcher EphyAdblockMatcher;
+
+EphyAdblockMatcher *ephy_adblock_matcher_new             (EphyAdblockImage   *image);
+void                ephy_adblock_matcher_free            (EphyAdblockMatcher *matcher);
+
+EphyAdblockImage   *ephy_adblock_matcher_get_image       (EphyAdblockMatcher *matcher);
+
+gboolean            ephy_adblock_matcher_match           (EphyAdblockMatcher *matcher,
+                                                          const char         *request_uri,
+                                                          const char         *page_uri,
+                                                          gboolean            whitelist);
+char               *ephy_adblock_matcher_get_style_sheet (EphyAdblockMatcher *matcher,
+                                                          const char         *document_uri);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyAdblockMatcher, ephy_adblock_matcher_free)
+
+G_END_DECLS
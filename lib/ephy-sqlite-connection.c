@@ -27,12 +27,30 @@
 #include <glib/gstdio.h>
 #include <sqlite3.h>
 
+/* Prepared statements are kept once their EphySQLiteStatement is released,
+ * so that running the same SQL again does not need to compile it again.
+ * Cached statements are keyed by their SQL text; the least recently used ones
+ * are finalized when there are too many.
+ */
+#define MAX_CACHED_STATEMENTS 64
+
+typedef struct {
+  char *sql;
+  sqlite3_stmt *statement;
+} CachedStatement;
+
 struct _EphySQLiteConnection {
   GObject parent_instance;
 
   char *database_path;
   sqlite3 *database;
   EphySQLiteConnectionMode mode;
+
+  GMutex statement_cache_lock;
+  GHashTable *statement_cache;
+  GQueue statement_cache_lru;
+  guint statement_cache_hits;
+  guint statement_prepares;
 };
 
 G_DEFINE_TYPE (EphySQLiteConnection, ephy_sqlite_connection, G_TYPE_OBJECT);
@@ -51,6 +69,8 @@ ephy_sqlite_connection_finalize (GObject *self)
 {
   g_free (EPHY_SQLITE_CONNECTION (self)->database_path);
   ephy_sqlite_connection_close (EPHY_SQLITE_CONNECTION (self));
+  g_hash_table_unref (EPHY_SQLITE_CONNECTION (self)->statement_cache);
+  g_mutex_clear (&EPHY_SQLITE_CONNECTION (self)->statement_cache_lock);
   G_OBJECT_CLASS (ephy_sqlite_connection_parent_class)->finalize (self);
 }
 
@@ -105,6 +125,30 @@ static void
 ephy_sqlite_connection_init (EphySQLiteConnection *self)
 {
   self->database = NULL;
+
+  g_mutex_init (&self->statement_cache_lock);
+  self->statement_cache = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&self->statement_cache_lru);
+}
+
+static void
+cached_statement_free (CachedStatement *cached)
+{
+  sqlite3_finalize (cached->statement);
+  g_free (cached->sql);
+  g_free (cached);
+}
+
+static void
+ephy_sqlite_connection_clear_statement_cache (EphySQLiteConnection *self)
+{
+  CachedStatement *cached;
+
+  g_mutex_lock (&self->statement_cache_lock);
+  g_hash_table_remove_all (self->statement_cache);
+  while ((cached = g_queue_pop_head (&self->statement_cache_lru)))
+    cached_statement_free (cached);
+  g_mutex_unlock (&self->statement_cache_lock);
 }
 
 GQuark ephy_sqlite_error_quark (void)
@@ -153,7 +197,11 @@ void
 ephy_sqlite_connection_close (EphySQLiteConnection *self)
 {
   if (self->database) {
-    sqlite3_close (self->database);
+    /* The database is only closed once the statements still in use are
+     * finalized, so do not keep any in the cache.
+     */
+    ephy_sqlite_connection_clear_statement_cache (self);
+    sqlite3_close_v2 (self->database);
     self->database = NULL;
   }
 }
@@ -161,18 +209,22 @@ ephy_sqlite_connection_close (EphySQLiteConnection *self)
 void
 ephy_sqlite_connection_delete_database (EphySQLiteConnection *self)
 {
-  char *journal;
+  /* The rollback journal, and the write-ahead log with its index. */
+  static const char * const journal_suffixes[] = { "-journal", "-wal", "-shm" };
 
   g_assert (EPHY_IS_SQLITE_CONNECTION (self));
 
   if (g_file_test (self->database_path, G_FILE_TEST_EXISTS) && g_unlink (self->database_path) == -1)
     g_warning ("Failed to delete database at %s: %s", self->database_path, g_strerror (errno));
 
-  journal = g_strdup_printf ("%s-journal", self->database_path);
-  if (g_file_test (journal, G_FILE_TEST_EXISTS) && g_unlink (journal) == -1)
-    g_warning ("Failed to delete database journal at %s: %s", journal, g_strerror (errno));
+  for (guint i = 0; i < G_N_ELEMENTS (journal_suffixes); i++) {
+    char *journal = g_strconcat (self->database_path, journal_suffixes[i], NULL);
 
-  g_free (journal);
+    if (g_file_test (journal, G_FILE_TEST_EXISTS) && g_unlink (journal) == -1)
+      g_warning ("Failed to delete database journal at %s: %s", journal, g_strerror (errno));
+
+    g_free (journal);
+  }
 }
 
 void
@@ -200,14 +252,33 @@ ephy_sqlite_connection_execute (EphySQLiteConnection *self, const char *sql, GEr
 EphySQLiteStatement *
 ephy_sqlite_connection_create_statement (EphySQLiteConnection *self, const char *sql, GError **error)
 {
-  sqlite3_stmt *prepared_statement;
+  sqlite3_stmt *prepared_statement = NULL;
+  GList *link;
 
   if (self->database == NULL) {
     set_error_from_string ("Connection not open.", error);
     return NULL;
   }
 
-  if (sqlite3_prepare_v2 (self->database, sql, -1, &prepared_statement, NULL) != SQLITE_OK) {
+  /* A cached statement is taken out of the cache while it is in use. */
+  g_mutex_lock (&self->statement_cache_lock);
+  link = g_hash_table_lookup (self->statement_cache, sql);
+  if (link) {
+    CachedStatement *cached = link->data;
+
+    g_hash_table_remove (self->statement_cache, sql);
+    g_queue_delete_link (&self->statement_cache_lru, link);
+    prepared_statement = cached->statement;
+    g_free (cached->sql);
+    g_free (cached);
+    self->statement_cache_hits++;
+  } else {
+    self->statement_prepares++;
+  }
+  g_mutex_unlock (&self->statement_cache_lock);
+
+  if (!prepared_statement &&
+      sqlite3_prepare_v2 (self->database, sql, -1, &prepared_statement, NULL) != SQLITE_OK) {
     ephy_sqlite_connection_get_error (self, error);
     return NULL;
   }
@@ -215,9 +286,83 @@ ephy_sqlite_connection_create_statement (EphySQLiteConnection *self, const char
   return EPHY_SQLITE_STATEMENT (g_object_new (EPHY_TYPE_SQLITE_STATEMENT,
                                               "prepared-statement", prepared_statement,
                                               "connection", self,
+                                              "sql", sql,
                                               NULL));
 }
 
+/**
+ * ephy_sqlite_connection_release_statement:
+ * @self: an #EphySQLiteConnection
+ * @sql: the SQL text @statement was prepared from
+ * @statement: (transfer full): a prepared statement of @self
+ *
+ * Resets @statement and clears its bindings, and keeps it for the next
+ * ephy_sqlite_connection_create_statement() with the same @sql. This is
+ * called when an #EphySQLiteStatement is finalized.
+ **/
+void
+ephy_sqlite_connection_release_statement (EphySQLiteConnection *self,
+                                          const char           *sql,
+                                          sqlite3_stmt         *statement)
+{
+  CachedStatement *cached;
+  CachedStatement *evicted = NULL;
+
+  sqlite3_reset (statement);
+  sqlite3_clear_bindings (statement);
+
+  /* The statement may outlive the database it was prepared for. */
+  if (!self->database || sqlite3_db_handle (statement) != self->database) {
+    sqlite3_finalize (statement);
+    return;
+  }
+
+  g_mutex_lock (&self->statement_cache_lock);
+  if (g_hash_table_contains (self->statement_cache, sql)) {
+    g_mutex_unlock (&self->statement_cache_lock);
+    sqlite3_finalize (statement);
+    return;
+  }
+
+  cached = g_new (CachedStatement, 1);
+  cached->sql = g_strdup (sql);
+  cached->statement = statement;
+  g_queue_push_head (&self->statement_cache_lru, cached);
+  g_hash_table_insert (self->statement_cache, cached->sql, self->statement_cache_lru.head);
+
+  if (self->statement_cache_lru.length > MAX_CACHED_STATEMENTS) {
+    evicted = g_queue_pop_tail (&self->statement_cache_lru);
+    g_hash_table_remove (self->statement_cache, evicted->sql);
+  }
+  g_mutex_unlock (&self->statement_cache_lock);
+
+  if (evicted)
+    cached_statement_free (evicted);
+}
+
+/**
+ * ephy_sqlite_connection_get_statement_cache_stats:
+ * @self: an #EphySQLiteConnection
+ * @hits: (out) (optional): return location for the number of statements
+ *   that were taken from the cache
+ * @prepares: (out) (optional): return location for the number of statements
+ *   that had to be prepared
+ *
+ * Gets how well the prepared statement cache of @self is doing.
+ **/
+void
+ephy_sqlite_connection_get_statement_cache_stats (EphySQLiteConnection *self,
+                                                  guint                *hits,
+                                                  guint                *prepares)
+{
+  g_mutex_lock (&self->statement_cache_lock);
+  if (hits)
+    *hits = self->statement_cache_hits;
+  if (prepares)
+    *prepares = self->statement_prepares;
+  g_mutex_unlock (&self->statement_cache_lock);
+}
+
 gint64
 ephy_sqlite_connection_get_last_insert_id (EphySQLiteConnection *self)
 {
@@ -288,3 +433,52 @@ ephy_sqlite_connection_table_exists (EphySQLiteConnection *self, const char *tab
   g_object_unref (statement);
   return table_exists;
 }
+
+/**
+ * ephy_sqlite_connection_get_user_version:
+ * @self: an #EphySQLiteConnection
+ * @error: return location for a #GError
+ *
+ * Gets the version number that the user of the database stored in it with
+ * ephy_sqlite_connection_set_user_version(), usually the version of its
+ * schema. It is 0 for a new database.
+ *
+ * Returns: the user version, or -1 on error
+ **/
+int
+ephy_sqlite_connection_get_user_version (EphySQLiteConnection *self, GError **error)
+{
+  EphySQLiteStatement *statement;
+  GError *local_error = NULL;
+  int version;
+
+  statement = ephy_sqlite_connection_create_statement (self, "PRAGMA user_version", error);
+  if (!statement)
+    return -1;
+
+  ephy_sqlite_statement_step (statement, &local_error);
+  if (local_error) {
+    g_propagate_error (error, local_error);
+    g_object_unref (statement);
+    return -1;
+  }
+
+  version = ephy_sqlite_statement_get_column_as_int (statement, 0);
+  g_object_unref (statement);
+
+  return version;
+}
+
+gboolean
+ephy_sqlite_connection_set_user_version (EphySQLiteConnection *self, int version, GError **error)
+{
+  char *sql;
+  gboolean success;
+
+  /* Pragmas cannot take bound parameters. */
+  sql = g_strdup_printf ("PRAGMA user_version=%d", version);
+  success = ephy_sqlite_connection_execute (self, sql, error);
+  g_free (sql);
+
+  return success;
+}
@@ -46,6 +46,8 @@ void                    ephy_sqlite_connection_get_error               (EphySQLi
 
 gboolean                ephy_sqlite_connection_execute                 (EphySQLiteConnection *self, const char *sql, GError **error);
 EphySQLiteStatement *   ephy_sqlite_connection_create_statement        (EphySQLiteConnection *self, const char *sql, GError **error);
+void                    ephy_sqlite_connection_release_statement       (EphySQLiteConnection *self, const char *sql, sqlite3_stmt *statement);
+void                    ephy_sqlite_connection_get_statement_cache_stats (EphySQLiteConnection *self, guint *hits, guint *prepares);
 gint64                  ephy_sqlite_connection_get_last_insert_id      (EphySQLiteConnection *self);
 void                    ephy_sqlite_connection_enable_foreign_keys     (EphySQLiteConnection *self);
 
@@ -54,6 +56,9 @@ gboolean                ephy_sqlite_connection_commit_transaction      (EphySQLi
 
 gboolean                ephy_sqlite_connection_table_exists            (EphySQLiteConnection *self, const char *table_name);
 
+int                     ephy_sqlite_connection_get_user_version        (EphySQLiteConnection *self, GError **error);
+gboolean                ephy_sqlite_connection_set_user_version        (EphySQLiteConnection *self, int version, GError **error);
+
 GQuark                  ephy_sqlite_error_quark                        (void);
 
 #define EPHY_SQLITE_ERROR ephy_sqlite_error_quark ()
@@ -28,6 +28,7 @@ enum {
   PROP_0,
   PROP_PREPARED_STATEMENT,
   PROP_CONNECTION,
+  PROP_SQL,
   LAST_PROP
 };
 
@@ -37,6 +38,7 @@ struct _EphySQLiteStatement {
   GObject parent_instance;
   sqlite3_stmt *prepared_statement;
   EphySQLiteConnection *connection;
+  char *sql;
 };
 
 G_DEFINE_TYPE (EphySQLiteStatement, ephy_sqlite_statement, G_TYPE_OBJECT);
@@ -53,6 +55,9 @@ ephy_sqlite_statement_set_property (GObject *object, guint property_id, const GV
     case PROP_CONNECTION:
       self->connection = EPHY_SQLITE_CONNECTION (g_object_ref (g_value_get_object (value)));
       break;
+    case PROP_SQL:
+      self->sql = g_value_dup_string (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (self, property_id, pspec);
       break;
@@ -64,11 +69,14 @@ ephy_sqlite_statement_finalize (GObject *object)
 {
   EphySQLiteStatement *self = EPHY_SQLITE_STATEMENT (object);
 
+  /* The connection keeps the statement to run the same SQL again. */
   if (self->prepared_statement) {
-    sqlite3_finalize (self->prepared_statement);
+    ephy_sqlite_connection_release_statement (self->connection, self->sql, self->prepared_statement);
     self->prepared_statement = NULL;
   }
 
+  g_clear_pointer (&self->sql, g_free);
+
   if (self->connection) {
     g_object_unref (self->connection);
     self->connection = NULL;
@@ -97,6 +105,13 @@ ephy_sqlite_statement_class_init (EphySQLiteStatementClass *klass)
                          EPHY_TYPE_SQLITE_CONNECTION,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
 
+  obj_properties[PROP_SQL] =
+    g_param_spec_string ("sql",
+                         "SQL",
+                         "The SQL text the statement was prepared from",
+                         NULL,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_WRITABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (gobject_class, LAST_PROP, obj_properties);
 }
 
@@ -105,6 +120,7 @@ ephy_sqlite_statement_init (EphySQLiteStatement *self)
 {
   self->prepared_statement = NULL;
   self->connection = NULL;
+  self->sql = NULL;
 }
 
 gboolean
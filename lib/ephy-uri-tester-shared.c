@@ -21,6 +21,8 @@
 #include "config.h"
 #include "ephy-uri-tester-shared.h"
 
+#define ADBLOCK_IMAGE_FILENAME "compiled-filters"
+
 GFile *
 ephy_uri_tester_get_adblock_filter_file (const char *adblock_data_dir,
                                          const char *filter_url)
@@ -36,3 +38,16 @@ ephy_uri_tester_get_adblock_filter_file (const char *adblock_data_dir,
 
   return filter_file;
 }
+
+GFile *
+ephy_uri_tester_get_adblock_image_file (const char *adblock_data_dir)
+{
+  char *image_path;
+  GFile *image_file;
+
+  image_path = g_build_filename (adblock_data_dir, ADBLOCK_IMAGE_FILENAME, NULL);
+  image_file = g_file_new_for_path (image_path);
+  g_free (image_path);
+
+  return image_file;
+}
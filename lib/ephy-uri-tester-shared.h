@@ -29,5 +29,6 @@ G_BEGIN_DECLS
 
 GFile *ephy_uri_tester_get_adblock_filter_file (const char *adblock_data_dir,
                                                 const char *filter_url);
+GFile *ephy_uri_tester_get_adblock_image_file  (const char *adblock_data_dir);
 
 G_END_DECLS
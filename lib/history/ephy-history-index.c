@@ -0,0 +1,650 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-history-index.h"
+
+#include <string.h>
+
+/* The index answers address bar completions without going to the database.
+ * Every entry is reachable from the postings of the trigrams of its case
+ * folded title and URL, which narrow the search for terms of three bytes or
+ * more down to the entries that may contain them. Shorter terms are looked up
+ * as prefixes of the URLs, without their scheme and "www.", which is what the
+ * user is most likely typing. The candidates are then checked against all the
+ * terms and ranked by frecency.
+ *
+ * Postings are kept sorted by slot, so that an entry is found in them by
+ * binary search. Clearing many entries at once rebuilds the postings of the
+ * ones that are left instead.
+ */
+
+/* Added to the frecency of bookmarks, as much as a visit today. */
+#define BOOKMARK_FRECENCY 100
+
+struct _EphyHistoryIndex {
+  GHashTable *strings;
+  GPtrArray *entries;
+  GArray *free_slots;
+  GHashTable *urls;
+  GHashTable *bookmarks;
+  GHashTable *trigrams;
+  GSequence *prefixes;
+};
+
+typedef struct {
+  EphyHistoryIndexMatch match;
+  EphyHistoryIndexKind kind;
+  guint32 slot;
+  const char *folded_url;
+  const char *folded_title;
+  const char *prefix_key;
+  GSequenceIter *prefix_iter;
+  double frecency;
+} IndexEntry;
+
+/* Titles and URLs are shared between the history and bookmark entries and
+ * their folded forms often are the same strings, so all of them are interned
+ * and reference counted.
+ */
+static const char *
+intern_string (EphyHistoryIndex *index,
+               const char       *string)
+{
+  gpointer key, value;
+
+  if (g_hash_table_lookup_extended (index->strings, string, &key, &value)) {
+    g_hash_table_insert (index->strings, key, GUINT_TO_POINTER (GPOINTER_TO_UINT (value) + 1));
+    return key;
+  }
+
+  key = g_strdup (string);
+  g_hash_table_insert (index->strings, key, GUINT_TO_POINTER (1));
+
+  return key;
+}
+
+static const char *
+intern_folded_string (EphyHistoryIndex *index,
+                      const char       *string)
+{
+  g_autofree char *folded = g_utf8_casefold (string, -1);
+
+  return intern_string (index, folded);
+}
+
+static void
+release_string (EphyHistoryIndex *index,
+                const char       *string)
+{
+  gpointer key, value;
+  guint count;
+
+  if (!g_hash_table_lookup_extended (index->strings, string, &key, &value))
+    g_assert_not_reached ();
+
+  count = GPOINTER_TO_UINT (value) - 1;
+  if (count > 0) {
+    g_hash_table_insert (index->strings, key, GUINT_TO_POINTER (count));
+    return;
+  }
+
+  g_hash_table_remove (index->strings, key);
+  g_free (key);
+}
+
+static inline guint32
+trigram_at (const char *text)
+{
+  return ((guint32)(guint8)text[0] << 16) | ((guint32)(guint8)text[1] << 8) | (guint8)text[2];
+}
+
+/* Returns the position of @slot in @posting, or where it would go. */
+static guint
+posting_search (GArray  *posting,
+                guint32  slot)
+{
+  guint low = 0;
+  guint high = posting->len;
+
+  /* New entries mostly get the highest slot. */
+  if (high > 0 && g_array_index (posting, guint32, high - 1) < slot)
+    return high;
+
+  while (low < high) {
+    guint mid = low + (high - low) / 2;
+
+    if (g_array_index (posting, guint32, mid) < slot)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+static void
+add_trigrams (EphyHistoryIndex *index,
+              const char       *text,
+              guint32           slot)
+{
+  gsize len = strlen (text);
+
+  for (gsize i = 0; i + 2 < len; i++) {
+    guint32 trigram = trigram_at (text + i);
+    GArray *posting;
+    guint position;
+
+    posting = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (trigram));
+    if (!posting) {
+      posting = g_array_new (FALSE, FALSE, sizeof (guint32));
+      g_hash_table_insert (index->trigrams, GUINT_TO_POINTER (trigram), posting);
+    }
+
+    position = posting_search (posting, slot);
+    if (position < posting->len && g_array_index (posting, guint32, position) == slot)
+      continue;
+
+    g_array_insert_val (posting, position, slot);
+  }
+}
+
+static void
+remove_trigrams (EphyHistoryIndex *index,
+                 const char       *text,
+                 guint32           slot)
+{
+  gsize len = strlen (text);
+
+  for (gsize i = 0; i + 2 < len; i++) {
+    guint32 trigram = trigram_at (text + i);
+    GArray *posting;
+    guint position;
+
+    posting = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (trigram));
+    if (!posting)
+      continue;
+
+    /* A repeated trigram has been removed already. */
+    position = posting_search (posting, slot);
+    if (position < posting->len && g_array_index (posting, guint32, position) == slot)
+      g_array_remove_index (posting, position);
+
+    if (posting->len == 0)
+      g_hash_table_remove (index->trigrams, GUINT_TO_POINTER (trigram));
+  }
+}
+
+static void
+add_entry_trigrams (EphyHistoryIndex *index,
+                    IndexEntry       *entry)
+{
+  add_trigrams (index, entry->folded_title, entry->slot);
+  add_trigrams (index, entry->folded_url, entry->slot);
+}
+
+static void
+remove_entry_trigrams (EphyHistoryIndex *index,
+                       IndexEntry       *entry)
+{
+  remove_trigrams (index, entry->folded_title, entry->slot);
+  remove_trigrams (index, entry->folded_url, entry->slot);
+}
+
+static const char *
+get_prefix_key (const char *folded_url)
+{
+  const char *key = folded_url;
+  const char *scheme_end;
+
+  scheme_end = strstr (key, "://");
+  if (scheme_end)
+    key = scheme_end + strlen ("://");
+
+  if (g_str_has_prefix (key, "www."))
+    key += strlen ("www.");
+
+  return key;
+}
+
+static int
+compare_prefix_keys (gconstpointer a,
+                     gconstpointer b,
+                     gpointer      user_data)
+{
+  const IndexEntry *entry_a = a;
+  const IndexEntry *entry_b = b;
+  int cmp;
+
+  cmp = strcmp (entry_a->prefix_key, entry_b->prefix_key);
+  if (cmp != 0)
+    return cmp;
+
+  return entry_a < entry_b ? -1 : entry_a > entry_b;
+}
+
+static IndexEntry *
+index_entry_new (EphyHistoryIndex     *index,
+                 EphyHistoryIndexKind  kind,
+                 const char           *url,
+                 const char           *title)
+{
+  IndexEntry *entry;
+
+  entry = g_new0 (IndexEntry, 1);
+  entry->kind = kind;
+  entry->match.url = intern_string (index, url);
+  entry->match.title = intern_string (index, title ? title : "");
+  entry->folded_url = intern_folded_string (index, entry->match.url);
+  entry->folded_title = intern_folded_string (index, entry->match.title);
+  entry->prefix_key = get_prefix_key (entry->folded_url);
+
+  if (index->free_slots->len > 0) {
+    entry->slot = g_array_index (index->free_slots, guint32, index->free_slots->len - 1);
+    g_array_set_size (index->free_slots, index->free_slots->len - 1);
+    g_ptr_array_index (index->entries, entry->slot) = entry;
+  } else {
+    entry->slot = index->entries->len;
+    g_ptr_array_add (index->entries, entry);
+  }
+
+  entry->prefix_iter = g_sequence_insert_sorted (index->prefixes, entry, compare_prefix_keys, NULL);
+  add_entry_trigrams (index, entry);
+
+  return entry;
+}
+
+static void
+index_entry_set_title (EphyHistoryIndex *index,
+                       IndexEntry       *entry,
+                       const char       *title)
+{
+  if (!title)
+    title = "";
+
+  if (strcmp (entry->match.title, title) == 0)
+    return;
+
+  /* The trigrams of the URL go as well, or the ones it shares with the new
+   * title would be added twice.
+   */
+  remove_entry_trigrams (index, entry);
+
+  release_string (index, entry->match.title);
+  release_string (index, entry->folded_title);
+  entry->match.title = intern_string (index, title);
+  entry->folded_title = intern_folded_string (index, title);
+
+  add_entry_trigrams (index, entry);
+}
+
+/* Leaves the trigrams of @entry to the caller. */
+static void
+index_entry_free (EphyHistoryIndex *index,
+                  IndexEntry       *entry)
+{
+  g_sequence_remove (entry->prefix_iter);
+
+  g_ptr_array_index (index->entries, entry->slot) = NULL;
+  g_array_append_val (index->free_slots, entry->slot);
+
+  release_string (index, entry->match.url);
+  release_string (index, entry->match.title);
+  release_string (index, entry->folded_url);
+  release_string (index, entry->folded_title);
+
+  g_free (entry);
+}
+
+static void
+clear_entries (EphyHistoryIndex *index,
+               GHashTable       *table)
+{
+  GHashTableIter iter;
+  IndexEntry *entry;
+  guint length = 0;
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&entry)) {
+    g_hash_table_iter_remove (&iter);
+    index_entry_free (index, entry);
+  }
+
+  /* Renumber the entries that are left from zero, so that new entries are
+   * appended to the postings again, and index them anew.
+   */
+  g_hash_table_remove_all (index->trigrams);
+  for (guint i = 0; i < index->entries->len; i++) {
+    entry = g_ptr_array_index (index->entries, i);
+    if (!entry)
+      continue;
+
+    entry->slot = length;
+    g_ptr_array_index (index->entries, length++) = entry;
+    add_entry_trigrams (index, entry);
+  }
+  g_ptr_array_set_size (index->entries, length);
+  g_array_set_size (index->free_slots, 0);
+}
+
+static double
+compute_frecency (int    visit_count,
+                  gint64 last_visit_time,
+                  gint64 now)
+{
+  gint64 days = (now - last_visit_time) / G_TIME_SPAN_DAY;
+  int weight;
+
+  /* Recent visits count for more, in the same buckets as Firefox. */
+  if (days <= 4)
+    weight = 100;
+  else if (days <= 14)
+    weight = 70;
+  else if (days <= 31)
+    weight = 50;
+  else if (days <= 90)
+    weight = 30;
+  else
+    weight = 10;
+
+  return (double)visit_count * weight;
+}
+
+EphyHistoryIndex *
+ephy_history_index_new (void)
+{
+  EphyHistoryIndex *index;
+
+  index = g_new0 (EphyHistoryIndex, 1);
+  index->strings = g_hash_table_new (g_str_hash, g_str_equal);
+  index->entries = g_ptr_array_new ();
+  index->free_slots = g_array_new (FALSE, FALSE, sizeof (guint32));
+  index->urls = g_hash_table_new (g_str_hash, g_str_equal);
+  index->bookmarks = g_hash_table_new (g_str_hash, g_str_equal);
+  index->trigrams = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_array_unref);
+  index->prefixes = g_sequence_new (NULL);
+
+  return index;
+}
+
+void
+ephy_history_index_free (EphyHistoryIndex *index)
+{
+  GHashTableIter iter;
+  gpointer string;
+
+  g_assert (index);
+
+  /* Everything goes, so nothing needs to be unlinked. */
+  for (guint i = 0; i < index->entries->len; i++)
+    g_free (g_ptr_array_index (index->entries, i));
+
+  g_hash_table_iter_init (&iter, index->strings);
+  while (g_hash_table_iter_next (&iter, &string, NULL))
+    g_free (string);
+
+  g_hash_table_unref (index->strings);
+  g_ptr_array_unref (index->entries);
+  g_array_unref (index->free_slots);
+  g_hash_table_unref (index->urls);
+  g_hash_table_unref (index->bookmarks);
+  g_hash_table_unref (index->trigrams);
+  g_sequence_free (index->prefixes);
+
+  g_free (index);
+}
+
+/**
+ * ephy_history_index_add_url:
+ * @index: an #EphyHistoryIndex
+ * @url: a URL read from the history
+ * @now: the current time, in microseconds
+ *
+ * Adds @url to @index, or updates its title and frecency if it is already
+ * there.
+ **/
+void
+ephy_history_index_add_url (EphyHistoryIndex *index,
+                            EphyHistoryURL   *url,
+                            gint64            now)
+{
+  IndexEntry *entry;
+
+  g_assert (index);
+  g_assert (url && url->url);
+
+  entry = g_hash_table_lookup (index->urls, url->url);
+  if (!entry) {
+    entry = index_entry_new (index, EPHY_HISTORY_INDEX_HISTORY, url->url, url->title);
+    g_hash_table_insert (index->urls, (gpointer)entry->match.url, entry);
+  } else {
+    index_entry_set_title (index, entry, url->title);
+  }
+
+  entry->frecency = compute_frecency (url->visit_count, url->last_visit_time, now);
+}
+
+void
+ephy_history_index_set_url_title (EphyHistoryIndex *index,
+                                  const char       *url,
+                                  const char       *title)
+{
+  IndexEntry *entry;
+
+  g_assert (index);
+  g_assert (url);
+
+  entry = g_hash_table_lookup (index->urls, url);
+  if (entry)
+    index_entry_set_title (index, entry, title);
+}
+
+void
+ephy_history_index_remove_url (EphyHistoryIndex *index,
+                               const char       *url)
+{
+  IndexEntry *entry;
+
+  g_assert (index);
+  g_assert (url);
+
+  entry = g_hash_table_lookup (index->urls, url);
+  if (!entry)
+    return;
+
+  g_hash_table_remove (index->urls, url);
+  remove_entry_trigrams (index, entry);
+  index_entry_free (index, entry);
+}
+
+void
+ephy_history_index_clear_urls (EphyHistoryIndex *index)
+{
+  g_assert (index);
+
+  clear_entries (index, index->urls);
+}
+
+void
+ephy_history_index_add_bookmark (EphyHistoryIndex *index,
+                                 const char       *url,
+                                 const char       *title)
+{
+  IndexEntry *entry;
+
+  g_assert (index);
+  g_assert (url);
+
+  entry = g_hash_table_lookup (index->bookmarks, url);
+  if (!entry) {
+    entry = index_entry_new (index, EPHY_HISTORY_INDEX_BOOKMARKS, url, title);
+    g_hash_table_insert (index->bookmarks, (gpointer)entry->match.url, entry);
+  } else {
+    index_entry_set_title (index, entry, title);
+  }
+}
+
+void
+ephy_history_index_clear_bookmarks (EphyHistoryIndex *index)
+{
+  g_assert (index);
+
+  clear_entries (index, index->bookmarks);
+}
+
+guint
+ephy_history_index_get_size (EphyHistoryIndex *index)
+{
+  g_assert (index);
+
+  return g_hash_table_size (index->urls) + g_hash_table_size (index->bookmarks);
+}
+
+static void
+add_match (EphyHistoryIndex      *index,
+           IndexEntry            *entry,
+           EphyHistoryIndexKind   kind,
+           char                 **terms,
+           GPtrArray             *matches)
+{
+  if (entry->kind != kind)
+    return;
+
+  for (guint i = 0; terms[i]; i++) {
+    if (*terms[i] == '\0')
+      continue;
+
+    if (!strstr (entry->folded_title, terms[i]) && !strstr (entry->folded_url, terms[i]))
+      return;
+  }
+
+  /* Bookmarks rank by how often their URL is visited too. */
+  if (entry->kind == EPHY_HISTORY_INDEX_BOOKMARKS) {
+    IndexEntry *history_entry = g_hash_table_lookup (index->urls, entry->match.url);
+
+    entry->frecency = BOOKMARK_FRECENCY + (history_entry ? history_entry->frecency : 0);
+  }
+
+  g_ptr_array_add (matches, entry);
+}
+
+static int
+compare_frecency (gconstpointer a,
+                  gconstpointer b)
+{
+  const IndexEntry *entry_a = *(IndexEntry **)a;
+  const IndexEntry *entry_b = *(IndexEntry **)b;
+
+  if (entry_a->frecency != entry_b->frecency)
+    return entry_a->frecency < entry_b->frecency ? 1 : -1;
+
+  return strcmp (entry_a->match.url, entry_b->match.url);
+}
+
+/**
+ * ephy_history_index_query:
+ * @index: an #EphyHistoryIndex
+ * @text: what the user typed
+ * @kind: whether to look for history or bookmark entries
+ * @max_results: the maximum number of matches, or 0 for all of them
+ *
+ * Finds the entries of @kind whose title or URL contain all the space
+ * separated terms of @text, ignoring case, from the highest frecency.
+ *
+ * Returns: (transfer container) (element-type EphyHistoryIndexMatch): the
+ * matches, valid until @index is next modified
+ **/
+GPtrArray *
+ephy_history_index_query (EphyHistoryIndex     *index,
+                          const char           *text,
+                          EphyHistoryIndexKind  kind,
+                          guint                 max_results)
+{
+  GPtrArray *matches;
+  g_autofree char *folded = NULL;
+  g_auto(GStrv) terms = NULL;
+  GArray *posting = NULL;
+  const char *first_term = NULL;
+
+  g_assert (index);
+  g_assert (text);
+
+  matches = g_ptr_array_new ();
+
+  folded = g_utf8_casefold (text, -1);
+  terms = g_strsplit (folded, " ", -1);
+
+  /* Any term of three bytes or more narrows the candidates down to the
+   * shortest posting of its trigrams, and a trigram that is nowhere means
+   * there is no match at all.
+   */
+  for (guint i = 0; terms[i]; i++) {
+    gsize len = strlen (terms[i]);
+
+    if (len > 0 && !first_term)
+      first_term = terms[i];
+
+    for (gsize j = 0; j + 2 < len; j++) {
+      GArray *candidates;
+
+      candidates = g_hash_table_lookup (index->trigrams, GUINT_TO_POINTER (trigram_at (terms[i] + j)));
+      if (!candidates)
+        return matches;
+
+      if (!posting || candidates->len < posting->len)
+        posting = candidates;
+    }
+  }
+
+  if (!first_term)
+    return matches;
+
+  if (posting) {
+    for (guint i = 0; i < posting->len; i++)
+      add_match (index, g_ptr_array_index (index->entries, g_array_index (posting, guint32, i)),
+                 kind, terms, matches);
+  } else {
+    IndexEntry probe = { .prefix_key = first_term };
+    GSequenceIter *iter;
+
+    iter = g_sequence_search (index->prefixes, &probe, compare_prefix_keys, NULL);
+    while (!g_sequence_iter_is_begin (iter)) {
+      IndexEntry *entry = g_sequence_get (g_sequence_iter_prev (iter));
+
+      if (!g_str_has_prefix (entry->prefix_key, first_term))
+        break;
+      iter = g_sequence_iter_prev (iter);
+    }
+
+    for (; !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter)) {
+      IndexEntry *entry = g_sequence_get (iter);
+
+      if (!g_str_has_prefix (entry->prefix_key, first_term))
+        break;
+      add_match (index, entry, kind, terms, matches);
+    }
+  }
+
+  g_ptr_array_sort (matches, compare_frecency);
+  if (max_results > 0 && matches->len > max_results)
+    g_ptr_array_set_size (matches, max_results);
+
+  return matches;
+}
@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "ephy-history-types.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  EPHY_HISTORY_INDEX_HISTORY,
+  EPHY_HISTORY_INDEX_BOOKMARKS
+} EphyHistoryIndexKind;
+
+typedef struct {
+  const char *url;
+  const char *title;
+} EphyHistoryIndexMatch;
+
+typedef struct _EphyHistoryIndex EphyHistoryIndex;
+
+EphyHistoryIndex *ephy_history_index_new             (void);
+void              ephy_history_index_free            (EphyHistoryIndex     *index);
+
+void              ephy_history_index_add_url         (EphyHistoryIndex     *index,
+                                                      EphyHistoryURL       *url,
+                                                      gint64                now);
+void              ephy_history_index_set_url_title   (EphyHistoryIndex     *index,
+                                                      const char           *url,
+                                                      const char           *title);
+void              ephy_history_index_remove_url      (EphyHistoryIndex     *index,
+                                                      const char           *url);
+void              ephy_history_index_clear_urls      (EphyHistoryIndex     *index);
+
+void              ephy_history_index_add_bookmark    (EphyHistoryIndex     *index,
+                                                      const char           *url,
+                                                      const char           *title);
+void              ephy_history_index_clear_bookmarks (EphyHistoryIndex     *index);
+
+guint             ephy_history_index_get_size        (EphyHistoryIndex     *index);
+GPtrArray        *ephy_history_index_query           (EphyHistoryIndex     *index,
+                                                      const char           *text,
+                                                      EphyHistoryIndexKind  kind,
+                                                      guint                 max_results);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyHistoryIndex, ephy_history_index_free)
+
+G_END_DECLS
@@ -138,11 +138,12 @@ ephy_history_service_update_host_row (EphyHistoryService *self, EphyHistoryHost
 EphyHistoryHost *
 ephy_history_service_get_host_row (EphyHistoryService *self, const gchar *host_string, EphyHistoryHost *host)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   if (host_string == NULL && host != NULL)
     host_string = host->url;
@@ -150,11 +151,11 @@ ephy_history_service_get_host_row (EphyHistoryService *self, const gchar *host_s
   g_assert (host_string || (host != NULL && host->id != -1));
 
   if (host != NULL && host->id != -1) {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
+    statement = ephy_sqlite_connection_create_statement (database,
                                                          "SELECT id, url, title, visit_count, zoom_level FROM hosts "
                                                          "WHERE id=?", &error);
   } else {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
+    statement = ephy_sqlite_connection_create_statement (database,
                                                          "SELECT id, url, title, visit_count, zoom_level FROM hosts "
                                                          "WHERE url=?", &error);
   }
@@ -219,14 +220,15 @@ create_host_from_statement (EphySQLiteStatement *statement)
 GList *
 ephy_history_service_get_all_hosts (EphyHistoryService *self)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *hosts = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        "SELECT id, url, title, visit_count, zoom_level FROM hosts", &error);
 
   if (error) {
@@ -252,6 +254,7 @@ ephy_history_service_get_all_hosts (EphyHistoryService *self)
 GList *
 ephy_history_service_find_host_rows (EphyHistoryService *self, EphyHistoryQuery *query)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
@@ -269,8 +272,8 @@ ephy_history_service_find_host_rows (EphyHistoryService *self, EphyHistoryQuery
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   statement_str = g_string_new (base_statement);
 
@@ -295,7 +298,7 @@ ephy_history_service_find_host_rows (EphyHistoryService *self, EphyHistoryQuery
 
   statement_str = g_string_append (statement_str, "1 ");
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -33,11 +33,21 @@ struct _EphyHistoryService {
   GCond history_thread_initialized_condition;
   GThread *history_thread;
   GAsyncQueue *queue;
+  GThreadPool *reader_pool;
+  GAsyncQueue *reader_connections;
+  GMutex write_sequence_mutex;
+  GCond write_committed_condition;
+  guint last_sent_write;
+  guint last_committed_write;
+  GHashTable *committed_writes;
+  GPtrArray *pending_signals;
   gboolean scheduled_to_quit;
   gboolean read_only;
-  int queue_urls_visited_id;
+  gboolean has_urls_fts;
 };
 
+EphySQLiteConnection *   ephy_history_service_get_database            (EphyHistoryService *self);
+
 gboolean                 ephy_history_service_initialize_urls_table   (EphyHistoryService *self);
 EphyHistoryURL *         ephy_history_service_get_url_row             (EphyHistoryService *self, const char *url_string, EphyHistoryURL *url);
 void                     ephy_history_service_add_url_row             (EphyHistoryService *self, EphyHistoryURL *url);
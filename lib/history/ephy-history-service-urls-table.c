@@ -22,6 +22,9 @@
 
 #include "ephy-history-service.h"
 #include "ephy-history-service-private.h"
+#include "ephy-sqlite.h"
+
+#include <string.h>
 
 gboolean
 ephy_history_service_initialize_urls_table (EphyHistoryService *self)
@@ -55,11 +58,12 @@ ephy_history_service_initialize_urls_table (EphyHistoryService *self)
 EphyHistoryURL *
 ephy_history_service_get_url_row (EphyHistoryService *self, const char *url_string, EphyHistoryURL *url)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GError *error = NULL;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   if (url_string == NULL && url != NULL)
     url_string = url->url;
@@ -67,11 +71,11 @@ ephy_history_service_get_url_row (EphyHistoryService *self, const char *url_stri
   g_assert (url_string || (url != NULL && url->id != -1));
 
   if (url != NULL && url->id != -1) {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
+    statement = ephy_sqlite_connection_create_statement (database,
                                                          "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
                                                          "WHERE id=?", &error);
   } else {
-    statement = ephy_sqlite_connection_create_statement (self->history_database,
+    statement = ephy_sqlite_connection_create_statement (database,
                                                          "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
                                                          "WHERE url=?", &error);
   }
@@ -221,14 +225,52 @@ create_url_from_statement (EphySQLiteStatement *statement)
   return url;
 }
 
+/* The trigram index can only look up substrings of at least three
+ * characters. The ones it cannot look up, or that contain LIKE wildcards,
+ * are left to the LIKE conditions, which are kept for all substrings since
+ * the index matches some more rows than they do.
+ */
+static char *
+create_fts_match_expression (GList *substring_list)
+{
+  GString *expression = NULL;
+
+  for (GList *l = substring_list; l != NULL; l = l->next) {
+    const char *substring = l->data;
+
+    if (g_utf8_strlen (substring, -1) < 3 ||
+        strlen (substring) > EPHY_SQLITE_LIMIT_LIKE_PATTERN_LENGTH - 2 ||
+        strpbrk (substring, "%_"))
+      continue;
+
+    if (expression == NULL)
+      expression = g_string_new (NULL);
+    else
+      g_string_append (expression, " AND ");
+
+    /* Quoted, so that the substring is one phrase. */
+    g_string_append_c (expression, '"');
+    for (const char *c = substring; *c; c++) {
+      if (*c == '"')
+        g_string_append_c (expression, '"');
+      g_string_append_c (expression, *c);
+    }
+    g_string_append_c (expression, '"');
+  }
+
+  return expression ? g_string_free (expression, FALSE) : NULL;
+}
+
 GList *
 ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *query)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
   GList *urls = NULL;
   GError *error = NULL;
+  g_autofree char *fts_expression = NULL;
   const char *base_statement = ""
                                "SELECT "
                                "DISTINCT urls.id, "
@@ -245,8 +287,8 @@ ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   statement_str = g_string_new (base_statement);
 
@@ -269,6 +311,28 @@ ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *
   if (query->host > 0)
     statement_str = g_string_append (statement_str, "urls.host = ? AND ");
 
+  /* Pages are found from the last URL of the previous one, which the index
+   * on last_visit_time can seek to. The id breaks the ties.
+   */
+  if (query->after_id > 0) {
+    if (query->sort_type == EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED) {
+      statement_str = g_string_append (statement_str, "urls.last_visit_time <= ? AND "
+                                       "(urls.last_visit_time < ? OR urls.id < ?) AND ");
+    } else if (query->sort_type == EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED) {
+      statement_str = g_string_append (statement_str, "urls.last_visit_time >= ? AND "
+                                       "(urls.last_visit_time > ? OR urls.id > ?) AND ");
+    } else {
+      g_warning ("Only the results of the recency sorts can be paged through.");
+      g_string_free (statement_str, TRUE);
+      return NULL;
+    }
+  }
+
+  if (self->has_urls_fts)
+    fts_expression = create_fts_match_expression (query->substring_list);
+  if (fts_expression)
+    statement_str = g_string_append (statement_str, "urls.id IN (SELECT rowid FROM urls_fts WHERE urls_fts MATCH ?) AND ");
+
   for (substring = query->substring_list; substring != NULL; substring = substring->next)
     statement_str = g_string_append (statement_str, "(urls.url LIKE ? OR urls.title LIKE ?) AND ");
 
@@ -282,10 +346,10 @@ ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *
       statement_str = g_string_append (statement_str, "ORDER BY urls.visit_count ");
       break;
     case EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time DESC ");
+      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time DESC, urls.id DESC ");
       break;
     case EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED:
-      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time ");
+      statement_str = g_string_append (statement_str, "ORDER BY urls.last_visit_time, urls.id ");
       break;
     case EPHY_HISTORY_SORT_TITLE_ASCENDING:
       statement_str = g_string_append (statement_str, "ORDER BY LOWER(urls.title) ");
@@ -308,7 +372,7 @@ ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *
     statement_str = g_string_append (statement_str, "LIMIT ? ");
   }
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -342,6 +406,24 @@ ephy_history_service_find_url_rows (EphyHistoryService *self, EphyHistoryQuery *
       return NULL;
     }
   }
+  if (query->after_id > 0) {
+    if (ephy_sqlite_statement_bind_int64 (statement, i++, query->after_last_visit_time, &error) == FALSE ||
+        ephy_sqlite_statement_bind_int64 (statement, i++, query->after_last_visit_time, &error) == FALSE ||
+        ephy_sqlite_statement_bind_int (statement, i++, query->after_id, &error) == FALSE) {
+      g_warning ("Could not build urls table query statement: %s", error->message);
+      g_error_free (error);
+      g_object_unref (statement);
+      return NULL;
+    }
+  }
+  if (fts_expression) {
+    if (ephy_sqlite_statement_bind_string (statement, i++, fts_expression, &error) == FALSE) {
+      g_warning ("Could not build urls table query statement: %s", error->message);
+      g_error_free (error);
+      g_object_unref (statement);
+      return NULL;
+    }
+  }
   for (substring = query->substring_list; substring != NULL; substring = substring->next) {
     char *string = ephy_sqlite_create_match_pattern (substring->data);
     if (ephy_sqlite_statement_bind_string (statement, i++, string, &error) == FALSE) {
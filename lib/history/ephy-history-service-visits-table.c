@@ -101,6 +101,7 @@ create_page_visit_from_statement (EphySQLiteStatement *statement)
 GList *
 ephy_history_service_find_visit_rows (EphyHistoryService *self, EphyHistoryQuery *query)
 {
+  EphySQLiteConnection *database;
   EphySQLiteStatement *statement = NULL;
   GList *substring;
   GString *statement_str;
@@ -120,8 +121,8 @@ ephy_history_service_find_visit_rows (EphyHistoryService *self, EphyHistoryQuery
 
   int i = 0;
 
-  g_assert (self->history_thread == g_thread_self ());
-  g_assert (self->history_database != NULL);
+  database = ephy_history_service_get_database (self);
+  g_assert (database != NULL);
 
   statement_str = g_string_new (base_statement);
 
@@ -146,7 +147,7 @@ ephy_history_service_find_visit_rows (EphyHistoryService *self, EphyHistoryQuery
 
   statement_str = g_string_append (statement_str, "1");
 
-  statement = ephy_sqlite_connection_create_statement (self->history_database,
+  statement = ephy_sqlite_connection_create_statement (database,
                                                        statement_str->str, &error);
   g_string_free (statement_str, TRUE);
 
@@ -21,6 +21,7 @@
 #include "config.h"
 #include "ephy-history-service.h"
 
+#include "ephy-debug.h"
 #include "ephy-history-service-private.h"
 #include "ephy-history-types.h"
 #include "ephy-lib-type-builtins.h"
@@ -76,10 +77,31 @@ typedef struct _EphyHistoryServiceMessage {
   GCancellable *cancellable;
   GDestroyNotify method_argument_cleanup;
   EphyHistoryJobCallback callback;
+  guint write_sequence;
 } EphyHistoryServiceMessage;
 
+/* Reads run on a few threads of their own, each with a read-only connection
+ * to the database. It is in WAL mode, so they do not hold up the history
+ * thread, which does all the writing. They only wait for it to commit the
+ * writes that were sent before them.
+ */
+#define N_READER_CONNECTIONS 2
+
+/* The writes waiting in the queue are committed together, which costs a
+ * single sync to disk. The batch is bounded so that the callbacks of its
+ * first writes are not held back for too long.
+ */
+#define WRITE_BATCH_MAX_MESSAGES 500
+#define WRITE_BATCH_MAX_TIME     100 /* milliseconds */
+
+static GPrivate reader_database;
+
 static gpointer run_history_service_thread (EphyHistoryService *self);
 static void ephy_history_service_process_message (EphyHistoryService *self, EphyHistoryServiceMessage *message);
+static EphyHistoryServiceMessage *ephy_history_service_process_writes (EphyHistoryService *self, EphyHistoryServiceMessage *message);
+static gboolean ephy_history_service_message_is_write (EphyHistoryServiceMessage *message);
+static void ephy_history_service_process_read_message (EphyHistoryServiceMessage *message, EphyHistoryService *self);
+static gboolean ephy_history_service_message_is_read_only (EphyHistoryServiceMessage *message);
 static gboolean ephy_history_service_execute_quit (EphyHistoryService *self, gpointer data, gpointer *result);
 static void ephy_history_service_quit (EphyHistoryService *self, EphyHistoryJobCallback callback, gpointer user_data);
 
@@ -132,29 +154,26 @@ ephy_history_service_finalize (GObject *object)
 {
   EphyHistoryService *self = EPHY_HISTORY_SERVICE (object);
 
+  /* Like the history thread, finish the reads that have been queued before
+   * quitting, while the reader connections are still open.
+   */
+  if (self->reader_pool) {
+    g_thread_pool_free (self->reader_pool, FALSE, TRUE);
+    self->reader_pool = NULL;
+  }
+
   ephy_history_service_quit (self, NULL, NULL);
 
   if (self->history_thread)
     g_thread_join (self->history_thread);
 
   g_free (self->history_filename);
+  g_hash_table_unref (self->committed_writes);
+  g_ptr_array_free (self->pending_signals, TRUE);
 
   G_OBJECT_CLASS (ephy_history_service_parent_class)->finalize (object);
 }
 
-static void
-ephy_history_service_dispose (GObject *object)
-{
-  EphyHistoryService *self = EPHY_HISTORY_SERVICE (object);
-
-  if (self->queue_urls_visited_id) {
-    g_source_remove (self->queue_urls_visited_id);
-    self->queue_urls_visited_id = 0;
-  }
-
-  G_OBJECT_CLASS (ephy_history_service_parent_class)->dispose (object);
-}
-
 static void
 ephy_history_service_constructed (GObject *object)
 {
@@ -163,6 +182,8 @@ ephy_history_service_constructed (GObject *object)
   G_OBJECT_CLASS (ephy_history_service_parent_class)->constructed (object);
 
   self->queue = g_async_queue_new ();
+  self->committed_writes = g_hash_table_new (NULL, NULL);
+  self->pending_signals = g_ptr_array_new ();
 
   /* This value is checked in several functions to verify that they are only
    * ever run on the history thread. Accordingly, we'd better be sure it's set
@@ -183,25 +204,10 @@ ephy_history_service_constructed (GObject *object)
     g_cond_wait (&self->history_thread_initialized_condition, &self->history_thread_mutex);
 
   g_mutex_unlock (&self->history_thread_mutex);
-}
-
-static gboolean
-emit_urls_visited (EphyHistoryService *self)
-{
-  g_signal_emit (self, signals[URLS_VISITED], 0);
-  self->queue_urls_visited_id = 0;
-
-  return FALSE;
-}
-
-static void
-ephy_history_service_queue_urls_visited (EphyHistoryService *self)
-{
-  if (self->queue_urls_visited_id)
-    return;
 
-  self->queue_urls_visited_id =
-    g_idle_add_full (G_PRIORITY_LOW, (GSourceFunc)emit_urls_visited, self, NULL);
+  if (self->reader_connections)
+    self->reader_pool = g_thread_pool_new ((GFunc)ephy_history_service_process_read_message, self,
+                                           N_READER_CONNECTIONS, FALSE, NULL);
 }
 
 static void
@@ -210,7 +216,6 @@ ephy_history_service_class_init (EphyHistoryServiceClass *klass)
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
 
   gobject_class->finalize = ephy_history_service_finalize;
-  gobject_class->dispose = ephy_history_service_dispose;
   gobject_class->constructed = ephy_history_service_constructed;
   gobject_class->get_property = ephy_history_service_get_property;
   gobject_class->set_property = ephy_history_service_set_property;
@@ -229,7 +234,7 @@ ephy_history_service_class_init (EphyHistoryServiceClass *klass)
  * @service: the #EphyHistoryService that received the signal
  *
  * The ::urls-visited signal is emitted after one or more visits to
- * URLS have taken place. This signal is intended for use-cases when
+ * URLS have been committed to the database. This signal is intended for use-cases when
  * precise information of the actual URLS visited is not important and
  * there is only interest in the fact that there have been changes in
  * the history. For more precise information, you can use ::visit-url
@@ -353,7 +358,20 @@ ephy_history_service_message_free (EphyHistoryServiceMessage *message)
 static void
 ephy_history_service_send_message (EphyHistoryService *self, EphyHistoryServiceMessage *message)
 {
-  g_async_queue_push_sorted (self->queue, message, (GCompareDataFunc)sort_messages, NULL);
+  /* Writes are numbered as they are sent. A read remembers the last of them,
+   * so that it sees all the writes sent before it.
+   */
+  g_mutex_lock (&self->write_sequence_mutex);
+  if (ephy_history_service_message_is_write (message))
+    message->write_sequence = ++self->last_sent_write;
+  else
+    message->write_sequence = self->last_sent_write;
+  g_mutex_unlock (&self->write_sequence_mutex);
+
+  if (self->reader_pool && ephy_history_service_message_is_read_only (message))
+    g_thread_pool_push (self->reader_pool, message, NULL);
+  else
+    g_async_queue_push_sorted (self->queue, message, (GCompareDataFunc)sort_messages, NULL);
 }
 
 static void
@@ -390,6 +408,142 @@ ephy_history_service_commit_transaction (EphyHistoryService *self)
   }
 }
 
+/* The version of the schema of the history database is kept in its
+ * user_version. Each migration brings the schema from the version before it
+ * to its own, so append new migrations and never change existing ones.
+ */
+typedef gboolean (*EphyHistorySchemaMigration) (EphyHistoryService *self, GError **error);
+
+static gboolean
+migrate_add_indexes (EphyHistoryService *self, GError **error)
+{
+  /* URLs and hosts are looked up by address, URLs are deleted along with
+   * their host, and visits are found by URL or by time range.
+   */
+  return ephy_sqlite_connection_execute (self->history_database,
+                                         "CREATE INDEX IF NOT EXISTS urls_url_index ON urls (url);"
+                                         "CREATE INDEX IF NOT EXISTS urls_host_index ON urls (host);"
+                                         "CREATE INDEX IF NOT EXISTS visits_url_time_index ON visits (url, visit_time);"
+                                         "CREATE INDEX IF NOT EXISTS visits_time_index ON visits (visit_time);"
+                                         "CREATE INDEX IF NOT EXISTS hosts_url_index ON hosts (url);", error);
+}
+
+/* Substring searches of URLs and titles cannot use a regular index. The
+ * trigram tokenizer needs SQLite 3.34 built with FTS5. Without it, the
+ * searches keep scanning the urls table, and the index is created on a later
+ * start, once SQLite supports it. This can be run again on a database that
+ * already has the index.
+ */
+static gboolean
+ephy_history_service_create_urls_fts (EphyHistoryService *self, GError **error)
+{
+  GError *local_error = NULL;
+
+  if (!ephy_sqlite_connection_execute (self->history_database,
+                                       "CREATE VIRTUAL TABLE IF NOT EXISTS urls_fts USING fts5 ("
+                                       "url, title, content='urls', content_rowid='id', tokenize='trigram')",
+                                       &local_error)) {
+    LOG ("Not indexing URLs and titles: %s", local_error->message);
+    g_error_free (local_error);
+    return TRUE;
+  }
+
+  /* The urls table holds the text, the triggers keep the index in sync. */
+  return ephy_sqlite_connection_execute (self->history_database,
+                                         "DROP TRIGGER IF EXISTS urls_fts_insert;"
+                                         "DROP TRIGGER IF EXISTS urls_fts_delete;"
+                                         "DROP TRIGGER IF EXISTS urls_fts_update;"
+                                         "CREATE TRIGGER urls_fts_insert AFTER INSERT ON urls BEGIN "
+                                         "INSERT INTO urls_fts (rowid, url, title) VALUES (new.id, new.url, new.title); "
+                                         "END;"
+                                         "CREATE TRIGGER urls_fts_delete AFTER DELETE ON urls BEGIN "
+                                         "INSERT INTO urls_fts (urls_fts, rowid, url, title) VALUES ('delete', old.id, old.url, old.title); "
+                                         "END;"
+                                         "CREATE TRIGGER urls_fts_update AFTER UPDATE OF url, title ON urls "
+                                         "WHEN old.url IS NOT new.url OR old.title IS NOT new.title BEGIN "
+                                         "INSERT INTO urls_fts (urls_fts, rowid, url, title) VALUES ('delete', old.id, old.url, old.title); "
+                                         "INSERT INTO urls_fts (rowid, url, title) VALUES (new.id, new.url, new.title); "
+                                         "END;"
+                                         "INSERT INTO urls_fts (urls_fts) VALUES ('rebuild');", error);
+}
+
+static gboolean
+migrate_add_urls_fts (EphyHistoryService *self, GError **error)
+{
+  return ephy_history_service_create_urls_fts (self, error);
+}
+
+static gboolean
+migrate_add_last_visit_time_index (EphyHistoryService *self, GError **error)
+{
+  /* The history is paged through from the most recently visited URLs. */
+  return ephy_sqlite_connection_execute (self->history_database,
+                                         "CREATE INDEX IF NOT EXISTS urls_last_visit_time_index ON urls (last_visit_time)",
+                                         error);
+}
+
+static const EphyHistorySchemaMigration schema_migrations[] = {
+  migrate_add_indexes,
+  migrate_add_urls_fts,
+  migrate_add_last_visit_time_index,
+};
+
+static gboolean
+ephy_history_service_migrate_schema (EphyHistoryService *self)
+{
+  GError *error = NULL;
+  int version;
+
+  g_assert (self->history_thread == g_thread_self ());
+
+  version = ephy_sqlite_connection_get_user_version (self->history_database, &error);
+  if (error) {
+    g_warning ("Could not get history database schema version: %s", error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+
+  /* A newer version has been run on this profile. Its migrations must keep
+   * the schema usable by older versions.
+   */
+  if (version > (int)G_N_ELEMENTS (schema_migrations))
+    return TRUE;
+
+  for (guint i = version; i < G_N_ELEMENTS (schema_migrations); i++) {
+    if (!ephy_sqlite_connection_begin_transaction (self->history_database, &error) ||
+        !schema_migrations[i] (self, &error) ||
+        !ephy_sqlite_connection_set_user_version (self->history_database, i + 1, &error) ||
+        !ephy_sqlite_connection_commit_transaction (self->history_database, &error)) {
+      g_warning ("Could not migrate history database schema to version %u: %s", i + 1, error->message);
+      g_error_free (error);
+      ephy_sqlite_connection_execute (self->history_database, "ROLLBACK", NULL);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Creates the index of URLs and titles if the migration had to skip it. */
+static void
+ephy_history_service_ensure_urls_fts (EphyHistoryService *self)
+{
+  GError *error = NULL;
+
+  g_assert (self->history_thread == g_thread_self ());
+
+  if (ephy_sqlite_connection_table_exists (self->history_database, "urls_fts"))
+    return;
+
+  if (!ephy_sqlite_connection_begin_transaction (self->history_database, &error) ||
+      !ephy_history_service_create_urls_fts (self, &error) ||
+      !ephy_sqlite_connection_commit_transaction (self->history_database, &error)) {
+    g_warning ("Could not index history URLs and titles: %s", error->message);
+    g_error_free (error);
+    ephy_sqlite_connection_execute (self->history_database, "ROLLBACK", NULL);
+  }
+}
+
 static gboolean
 ephy_history_service_open_database_connections (EphyHistoryService *self)
 {
@@ -421,10 +575,63 @@ ephy_history_service_open_database_connections (EphyHistoryService *self)
     ephy_sqlite_connection_enable_foreign_keys (self->history_database);
   }
 
-  return self->read_only ||
-          (ephy_history_service_initialize_hosts_table (self) &&
-           ephy_history_service_initialize_urls_table (self) &&
-           ephy_history_service_initialize_visits_table (self));
+  if (!self->read_only &&
+      !ephy_sqlite_connection_execute (self->history_database, "PRAGMA journal_mode=WAL", &error)) {
+    g_warning ("Could not enable write-ahead logging for history database: %s", error->message);
+    g_clear_error (&error);
+  }
+
+  if (!self->read_only &&
+      (!ephy_history_service_initialize_hosts_table (self) ||
+       !ephy_history_service_initialize_urls_table (self) ||
+       !ephy_history_service_initialize_visits_table (self) ||
+       !ephy_history_service_migrate_schema (self)))
+    return FALSE;
+
+  if (!self->read_only)
+    ephy_history_service_ensure_urls_fts (self);
+
+  self->has_urls_fts = ephy_sqlite_connection_table_exists (self->history_database, "urls_fts");
+
+  return TRUE;
+}
+
+static void
+ephy_history_service_open_reader_connections (EphyHistoryService *self)
+{
+  g_assert (self->history_thread == g_thread_self ());
+
+  if (!self->reader_connections)
+    self->reader_connections = g_async_queue_new ();
+
+  for (guint i = 0; i < N_READER_CONNECTIONS; i++) {
+    EphySQLiteConnection *database;
+    GError *error = NULL;
+
+    database = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READ_ONLY, self->history_filename);
+    ephy_sqlite_connection_open (database, &error);
+    if (error) {
+      g_warning ("Could not open history database at %s for reading: %s", self->history_filename, error->message);
+      g_error_free (error);
+    }
+
+    g_async_queue_push (self->reader_connections, database);
+  }
+}
+
+static void
+ephy_history_service_close_reader_connections (EphyHistoryService *self)
+{
+  g_assert (self->history_thread == g_thread_self ());
+
+  if (!self->reader_connections)
+    return;
+
+  /* Taking every connection out of the queue waits for the reads that are
+   * running and holds back the others.
+   */
+  for (guint i = 0; i < N_READER_CONNECTIONS; i++)
+    g_object_unref (g_async_queue_pop (self->reader_connections));
 }
 
 static void
@@ -432,6 +639,10 @@ ephy_history_service_close_database_connections (EphyHistoryService *self)
 {
   g_assert (self->history_thread == g_thread_self ());
 
+  /* Close the writer last, so that it can checkpoint the write-ahead log. */
+  ephy_history_service_close_reader_connections (self);
+  g_clear_pointer (&self->reader_connections, g_async_queue_unref);
+
   ephy_sqlite_connection_close (self->history_database);
   g_object_unref (self->history_database);
   self->history_database = NULL;
@@ -452,7 +663,7 @@ ephy_history_service_execute_quit (EphyHistoryService *self, gpointer data, gpoi
 static gpointer
 run_history_service_thread (EphyHistoryService *self)
 {
-  EphyHistoryServiceMessage *message;
+  EphyHistoryServiceMessage *message = NULL;
   gboolean success;
 
   /* Note that self->history_thread is only written once, and that's guaranteed
@@ -464,6 +675,8 @@ run_history_service_thread (EphyHistoryService *self)
   g_assert (self->history_thread == g_thread_self ());
 
   success = ephy_history_service_open_database_connections (self);
+  if (success)
+    ephy_history_service_open_reader_connections (self);
 
   self->history_thread_initialized = TRUE;
   g_cond_signal (&self->history_thread_initialized_condition);
@@ -473,14 +686,20 @@ run_history_service_thread (EphyHistoryService *self)
     return NULL;
 
   do {
-    message = g_async_queue_try_pop (self->queue);
+    if (!message)
+      message = g_async_queue_try_pop (self->queue);
     if (!message) {
       /* Block the thread until there's data in the queue. */
       message = g_async_queue_pop (self->queue);
     }
 
-    /* Process item. */
-    ephy_history_service_process_message (self, message);
+    /* Process item. A batch of writes returns the message that ended it. */
+    if (ephy_history_service_message_is_write (message)) {
+      message = ephy_history_service_process_writes (self, message);
+    } else {
+      ephy_history_service_process_message (self, message);
+      message = NULL;
+    }
   } while (!self->scheduled_to_quit);
 
   ephy_history_service_close_database_connections (self);
@@ -513,6 +732,7 @@ ephy_history_service_execute_job_callback (gpointer data)
 
 typedef struct {
   EphyHistoryService *service;
+  GSourceFunc emit_func;
   gpointer user_data;
   GDestroyNotify destroy_func;
 } SignalEmissionContext;
@@ -526,18 +746,47 @@ signal_emission_context_free (SignalEmissionContext *ctx)
   g_free (ctx);
 }
 
-static SignalEmissionContext *
-signal_emission_context_new (EphyHistoryService *service,
-                             gpointer            user_data,
-                             GDestroyNotify      destroy_func)
+/* Signals about a write are only emitted once it has been committed, so that
+ * their handlers can read the change back from the database.
+ */
+static void
+ephy_history_service_queue_signal (EphyHistoryService *self,
+                                   GSourceFunc         emit_func,
+                                   gpointer            user_data,
+                                   GDestroyNotify      destroy_func)
 {
   SignalEmissionContext *ctx = g_new0 (SignalEmissionContext, 1);
 
-  ctx->service = g_object_ref (service);
+  g_assert (self->history_thread == g_thread_self ());
+
+  ctx->service = g_object_ref (self);
+  ctx->emit_func = emit_func;
   ctx->user_data = user_data;
   ctx->destroy_func = destroy_func;
 
-  return ctx;
+  g_ptr_array_add (self->pending_signals, ctx);
+}
+
+static void
+ephy_history_service_emit_pending_signals (EphyHistoryService *self)
+{
+  g_assert (self->history_thread == g_thread_self ());
+
+  for (guint i = 0; i < self->pending_signals->len; i++) {
+    SignalEmissionContext *ctx = self->pending_signals->pdata[i];
+
+    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, ctx->emit_func, ctx,
+                     (GDestroyNotify)signal_emission_context_free);
+  }
+  g_ptr_array_set_size (self->pending_signals, 0);
+}
+
+static gboolean
+urls_visited_signal_emit (SignalEmissionContext *ctx)
+{
+  g_signal_emit (ctx->service, signals[URLS_VISITED], 0);
+
+  return FALSE;
 }
 
 static gboolean
@@ -810,18 +1059,13 @@ ephy_history_service_execute_set_url_title (EphyHistoryService *self,
     g_free (title);
     return FALSE;
   } else {
-    SignalEmissionContext *ctx;
-
     g_free (url->title);
     url->title = title;
     ephy_history_service_update_url_row (self, url);
 
-    ctx = signal_emission_context_new (self,
+    ephy_history_service_queue_signal (self, (GSourceFunc)set_url_title_signal_emit,
                                        ephy_history_url_copy (url),
                                        (GDestroyNotify)ephy_history_url_free);
-    g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                     (GSourceFunc)set_url_title_signal_emit,
-                     ctx, (GDestroyNotify)signal_emission_context_free);
     return TRUE;
   }
 }
@@ -1023,7 +1267,6 @@ ephy_history_service_execute_delete_urls (EphyHistoryService *self,
 {
   GList *l;
   EphyHistoryURL *url;
-  SignalEmissionContext *ctx;
 
   if (self->read_only)
     return FALSE;
@@ -1032,14 +1275,10 @@ ephy_history_service_execute_delete_urls (EphyHistoryService *self,
     url = l->data;
     ephy_history_service_delete_url (self, url);
 
-    if (url->notify_delete) {
-      ctx = signal_emission_context_new (self, ephy_history_url_copy (url),
+    if (url->notify_delete)
+      ephy_history_service_queue_signal (self, (GSourceFunc)delete_urls_signal_emit,
+                                         ephy_history_url_copy (url),
                                          (GDestroyNotify)ephy_history_url_free);
-      g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                       (GSourceFunc)delete_urls_signal_emit,
-                       ctx,
-                       (GDestroyNotify)signal_emission_context_free);
-    }
   }
 
   ephy_history_service_delete_orphan_hosts (self);
@@ -1063,19 +1302,13 @@ ephy_history_service_execute_delete_host (EphyHistoryService    *self,
                                           EphyHistoryJobCallback callback,
                                           gpointer               user_data)
 {
-  SignalEmissionContext *ctx;
-
   if (self->read_only)
     return FALSE;
 
   ephy_history_service_delete_host_row (self, host);
 
-  ctx = signal_emission_context_new (self, g_strdup (host->url),
-                                     (GDestroyNotify)g_free);
-  g_idle_add_full (G_PRIORITY_DEFAULT_IDLE,
-                   (GSourceFunc)delete_host_signal_emit,
-                   ctx,
-                   (GDestroyNotify)signal_emission_context_free);
+  ephy_history_service_queue_signal (self, (GSourceFunc)delete_host_signal_emit,
+                                     g_strdup (host->url), (GDestroyNotify)g_free);
 
   return TRUE;
 }
@@ -1090,10 +1323,13 @@ ephy_history_service_execute_clear (EphyHistoryService *self,
     return FALSE;
 
   ephy_history_service_commit_transaction (self);
+  ephy_history_service_close_reader_connections (self);
   ephy_sqlite_connection_close (self->history_database);
   ephy_sqlite_connection_delete_database (self->history_database);
 
   ephy_history_service_open_database_connections (self);
+  if (self->reader_connections)
+    ephy_history_service_open_reader_connections (self);
   ephy_history_service_open_transaction (self);
 
   return TRUE;
@@ -1183,6 +1419,22 @@ ephy_history_service_message_is_write (EphyHistoryServiceMessage *message)
   return message->type < QUIT;
 }
 
+static gboolean
+ephy_history_service_message_is_read_only (EphyHistoryServiceMessage *message)
+{
+  /* Getting the host for a URL adds the host if it is not known yet. */
+  return message->type > QUIT && message->type != GET_HOST_FOR_URL;
+}
+
+static void
+ephy_history_service_complete_message (EphyHistoryServiceMessage *message)
+{
+  if (message->callback || message->type == CLEAR)
+    g_idle_add ((GSourceFunc)ephy_history_service_execute_job_callback, message);
+  else
+    ephy_history_service_message_free (message);
+}
+
 static void
 ephy_history_service_process_message (EphyHistoryService        *self,
                                       EphyHistoryServiceMessage *message)
@@ -1207,12 +1459,134 @@ ephy_history_service_process_message (EphyHistoryService        *self,
     message->success = FALSE;
   }
 
-  if (message->callback || message->type == CLEAR)
-    g_idle_add ((GSourceFunc)ephy_history_service_execute_job_callback, message);
-  else
+  ephy_history_service_complete_message (message);
+}
+
+static void
+ephy_history_service_writes_committed (EphyHistoryService *self,
+                                       GPtrArray          *batch)
+{
+  g_mutex_lock (&self->write_sequence_mutex);
+
+  /* The queue is sorted by type, so writes are not always committed in the
+   * order they were sent. Those that come early are set aside until the ones
+   * before them have been committed too.
+   */
+  for (guint i = 0; i < batch->len; i++) {
+    EphyHistoryServiceMessage *message = batch->pdata[i];
+    g_hash_table_add (self->committed_writes, GUINT_TO_POINTER (message->write_sequence));
+  }
+  while (g_hash_table_remove (self->committed_writes, GUINT_TO_POINTER (self->last_committed_write + 1)))
+    self->last_committed_write++;
+
+  g_cond_broadcast (&self->write_committed_condition);
+  g_mutex_unlock (&self->write_sequence_mutex);
+}
+
+static EphyHistoryServiceMessage *
+ephy_history_service_process_writes (EphyHistoryService        *self,
+                                     EphyHistoryServiceMessage *message)
+{
+  GPtrArray *batch = g_ptr_array_new ();
+  gint64 deadline = g_get_monotonic_time () + WRITE_BATCH_MAX_TIME * 1000;
+  gboolean visited = FALSE;
+
+  g_assert (self->history_thread == g_thread_self ());
+
+  /* Messages are sorted with the writes first, so the batch ends with the
+   * first message that is not a write, which is returned to the caller.
+   */
+  ephy_history_service_open_transaction (self);
+  do {
+    message->result = NULL;
+    if (self->history_database)
+      message->success = methods[message->type] (self, message->method_argument, &message->result);
+    else
+      message->success = FALSE;
+    g_ptr_array_add (batch, message);
+
+    if (message->success && (message->type == ADD_VISIT || message->type == ADD_VISITS))
+      visited = TRUE;
+
+    if (batch->len == WRITE_BATCH_MAX_MESSAGES || g_get_monotonic_time () >= deadline)
+      message = NULL;
+    else
+      message = g_async_queue_try_pop (self->queue);
+  } while (message && ephy_history_service_message_is_write (message));
+  ephy_history_service_commit_transaction (self);
+  ephy_history_service_writes_committed (self, batch);
+
+  if (visited)
+    ephy_history_service_queue_signal (self, (GSourceFunc)urls_visited_signal_emit, NULL, NULL);
+  ephy_history_service_emit_pending_signals (self);
+
+  /* Only report the writes once they have been committed. */
+  for (guint i = 0; i < batch->len; i++)
+    ephy_history_service_complete_message (batch->pdata[i]);
+  g_ptr_array_free (batch, TRUE);
+
+  return message;
+}
+
+static void
+ephy_history_service_process_read_message (EphyHistoryServiceMessage *message,
+                                           EphyHistoryService        *self)
+{
+  EphySQLiteConnection *database;
+  GError *error = NULL;
+
+  if (g_cancellable_is_cancelled (message->cancellable)) {
     ephy_history_service_message_free (message);
+    return;
+  }
+
+  /* Wait before taking a connection, as clearing the history closes them. */
+  g_mutex_lock (&self->write_sequence_mutex);
+  while (self->last_committed_write < message->write_sequence)
+    g_cond_wait (&self->write_committed_condition, &self->write_sequence_mutex);
+  g_mutex_unlock (&self->write_sequence_mutex);
+
+  database = g_async_queue_pop (self->reader_connections);
+  g_private_set (&reader_database, database);
+
+  /* The transaction keeps all the statements of a read on one snapshot. */
+  message->result = NULL;
+  if (ephy_sqlite_connection_execute (database, "BEGIN TRANSACTION", &error)) {
+    message->success = methods[message->type] (self, message->method_argument, &message->result);
+    ephy_sqlite_connection_execute (database, "COMMIT", NULL);
+  } else {
+    g_warning ("Could not open history database read transaction: %s", error->message);
+    g_error_free (error);
+    message->success = FALSE;
+  }
 
-  return;
+  g_private_set (&reader_database, NULL);
+  g_async_queue_push (self->reader_connections, database);
+
+  ephy_history_service_complete_message (message);
+}
+
+/**
+ * ephy_history_service_get_database:
+ * @self: an #EphyHistoryService
+ *
+ * Gets the connection to use for the message being processed on the
+ * current thread: the reader connection on a reader thread, or the
+ * read/write connection on the history thread.
+ *
+ * Returns: (transfer none): an #EphySQLiteConnection
+ **/
+EphySQLiteConnection *
+ephy_history_service_get_database (EphyHistoryService *self)
+{
+  EphySQLiteConnection *database = g_private_get (&reader_database);
+
+  if (database)
+    return database;
+
+  g_assert (self->history_thread == g_thread_self ());
+
+  return self->history_database;
 }
 
 /* Public API. */
@@ -1266,8 +1640,6 @@ ephy_history_service_visit_url (EphyHistoryService       *self,
   visit->url->notify_visit = should_notify;
   ephy_history_service_add_visit (self, visit, NULL, NULL, NULL);
   ephy_history_page_visit_free (visit);
-
-  ephy_history_service_queue_urls_visited (self);
 }
 
 void
@@ -221,6 +221,8 @@ ephy_history_query_copy (EphyHistoryQuery *query)
   copy->ignore_hidden = query->ignore_hidden;
   copy->ignore_local = query->ignore_local;
   copy->host = query->host;
+  copy->after_last_visit_time = query->after_last_visit_time;
+  copy->after_id = query->after_id;
 
   for (iter = query->substring_list; iter != NULL; iter = iter->next) {
     copy->substring_list = g_list_prepend (copy->substring_list, g_strdup (iter->data));
@@ -92,6 +92,10 @@ typedef struct _EphyHistoryQuery
   gboolean ignore_local;
   gint host;
   EphyHistorySortType sort_type;
+  /* For the recency sorts, only the URLs after the one with this last visit
+   * time and id, to page through the results. Unused when after_id is 0. */
+  gint64 after_last_visit_time;
+  int after_id;
 } EphyHistoryQuery;
 
 EphyHistoryPageVisit *          ephy_history_page_visit_new (const char *url, gint64 visit_time, EphyHistoryPageVisitType visit_type);
@@ -0,0 +1,374 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-prefix-set.h"
+
+#include "ephy-gsb-utils.h"
+
+#include <string.h>
+
+/* The set holds the 4 byte cues of all local hash prefixes. Most of them are
+ * random, so consecutive cues are close enough to store only the difference
+ * as a 16 bit delta. Every run of deltas starts with a full 32 bit value in the
+ * index, which is what the binary search looks at. The in-memory layout is
+ * the same as the file layout, so loading the set is a single mmap().
+ */
+#define PREFIX_SET_MAGIC      "EPHYGSB"
+#define PREFIX_SET_VERSION    1
+#define PREFIX_SET_BYTE_ORDER G_BYTE_ORDER
+#define PREFIX_SET_ALIGN      8
+
+/* Bounds the linear walk that follows the binary search. */
+#define MAX_RUN 100
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint64 serial;
+  guint64 size;
+  guint32 n_cues;
+  guint32 n_index;
+  guint32 n_deltas;
+  guint32 padding;
+} PrefixSetHeader;
+
+typedef struct {
+  guint32 value;
+  guint32 deltas;
+} PrefixSetIndex;
+
+struct _EphyGSBPrefixSet {
+  int ref_count;
+  GBytes *bytes;
+  const PrefixSetHeader *header;
+  const PrefixSetIndex *index;
+  const guint16 *deltas;
+};
+
+GQuark
+ephy_gsb_prefix_set_error_quark (void)
+{
+  return g_quark_from_static_string ("ephy-gsb-prefix-set-error-quark");
+}
+
+static inline guint32
+cue_to_uint32 (const guint8 *cue)
+{
+  /* Big endian, so that the numeric order matches the order of the blobs. */
+  return ((guint32)cue[0] << 24) | ((guint32)cue[1] << 16) | ((guint32)cue[2] << 8) | cue[3];
+}
+
+static inline gsize
+prefix_set_size (guint32 n_index,
+                 guint32 n_deltas)
+{
+  gsize size;
+
+  size = sizeof (PrefixSetHeader) + n_index * sizeof (PrefixSetIndex) + n_deltas * sizeof (guint16);
+  return (size + PREFIX_SET_ALIGN - 1) & ~(gsize)(PREFIX_SET_ALIGN - 1);
+}
+
+static int
+compare_cues (gconstpointer a,
+              gconstpointer b)
+{
+  guint32 cue_a = *(const guint32 *)a;
+  guint32 cue_b = *(const guint32 *)b;
+
+  return cue_a < cue_b ? -1 : cue_a > cue_b;
+}
+
+static inline gboolean
+starts_run (guint32 cue,
+            guint32 previous,
+            guint   run_length)
+{
+  return cue - previous > G_MAXUINT16 || run_length == MAX_RUN;
+}
+
+static gboolean
+prefix_set_is_valid (const guint8 *data,
+                     gsize         size)
+{
+  const PrefixSetHeader *header = (const PrefixSetHeader *)data;
+  const PrefixSetIndex *index;
+
+  if (size < sizeof (PrefixSetHeader))
+    return FALSE;
+
+  if (memcmp (header->magic, PREFIX_SET_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != PREFIX_SET_VERSION ||
+      header->byte_order != PREFIX_SET_BYTE_ORDER ||
+      header->size != size ||
+      prefix_set_size (header->n_index, header->n_deltas) != size ||
+      (guint64)header->n_index + header->n_deltas != header->n_cues)
+    return FALSE;
+
+  /* The lookup relies on both the values and the delta offsets growing. */
+  index = (const PrefixSetIndex *)(data + sizeof (PrefixSetHeader));
+  for (guint32 i = 0; i < header->n_index; i++) {
+    if (index[i].deltas > header->n_deltas)
+      return FALSE;
+    if (i > 0 && (index[i - 1].value >= index[i].value || index[i - 1].deltas > index[i].deltas))
+      return FALSE;
+  }
+
+  return header->n_index > 0 || header->n_deltas == 0;
+}
+
+static EphyGSBPrefixSet *
+prefix_set_new_from_bytes (GBytes  *bytes,
+                           GError **error)
+{
+  EphyGSBPrefixSet *set;
+  const guint8 *data;
+  gsize size;
+
+  data = g_bytes_get_data (bytes, &size);
+  if (!data || (gsize)data % PREFIX_SET_ALIGN != 0 || !prefix_set_is_valid (data, size)) {
+    g_set_error_literal (error,
+                         EPHY_GSB_PREFIX_SET_ERROR,
+                         EPHY_GSB_PREFIX_SET_ERROR_INVALID,
+                         "Hash prefix set is corrupted or was written by a different version");
+    return NULL;
+  }
+
+  set = g_new0 (EphyGSBPrefixSet, 1);
+  set->ref_count = 1;
+  set->bytes = g_bytes_ref (bytes);
+  set->header = (const PrefixSetHeader *)data;
+  set->index = (const PrefixSetIndex *)(data + sizeof (PrefixSetHeader));
+  set->deltas = (const guint16 *)(set->index + set->header->n_index);
+
+  return set;
+}
+
+/**
+ * ephy_gsb_prefix_set_new:
+ * @cues: @n_cues hash cues of GSB_HASH_CUE_LEN bytes each, back to back
+ * @n_cues: the number of cues in @cues
+ * @serial: a number identifying this version of the set
+ *
+ * Builds a set from @cues, which need not be sorted. Duplicates are ignored.
+ *
+ * Returns: (transfer full): a new #EphyGSBPrefixSet
+ **/
+EphyGSBPrefixSet *
+ephy_gsb_prefix_set_new (const guint8 *cues,
+                         gsize         n_cues,
+                         guint64       serial)
+{
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree guint32 *values = NULL;
+  PrefixSetHeader *header;
+  PrefixSetIndex *index;
+  guint16 *deltas;
+  guint32 n_index = 0;
+  guint32 n_deltas = 0;
+  guint run_length = 0;
+  guint8 *data;
+  gsize size;
+
+  g_assert (cues || n_cues == 0);
+  g_assert (n_cues <= G_MAXUINT32);
+
+  values = g_new (guint32, n_cues);
+  for (gsize i = 0; i < n_cues; i++)
+    values[i] = cue_to_uint32 (cues + i * GSB_HASH_CUE_LEN);
+  qsort (values, n_cues, sizeof (guint32), compare_cues);
+
+  /* Count first, so that the set can be built in one allocation. */
+  for (gsize i = 0; i < n_cues; i++) {
+    if (i > 0 && values[i] == values[i - 1])
+      continue;
+
+    if (i == 0 || starts_run (values[i], values[i - 1], run_length)) {
+      n_index++;
+      run_length = 0;
+    } else {
+      n_deltas++;
+      run_length++;
+    }
+  }
+
+  size = prefix_set_size (n_index, n_deltas);
+  data = g_malloc0 (size);
+
+  header = (PrefixSetHeader *)data;
+  memcpy (header->magic, PREFIX_SET_MAGIC, sizeof (header->magic));
+  header->version = PREFIX_SET_VERSION;
+  header->byte_order = PREFIX_SET_BYTE_ORDER;
+  header->serial = serial;
+  header->size = size;
+  header->n_cues = n_index + n_deltas;
+  header->n_index = n_index;
+  header->n_deltas = n_deltas;
+
+  index = (PrefixSetIndex *)(data + sizeof (PrefixSetHeader));
+  deltas = (guint16 *)(index + n_index);
+  n_index = 0;
+  n_deltas = 0;
+  run_length = 0;
+
+  for (gsize i = 0; i < n_cues; i++) {
+    if (i > 0 && values[i] == values[i - 1])
+      continue;
+
+    if (i == 0 || starts_run (values[i], values[i - 1], run_length)) {
+      index[n_index].value = values[i];
+      index[n_index].deltas = n_deltas;
+      n_index++;
+      run_length = 0;
+    } else {
+      deltas[n_deltas++] = values[i] - values[i - 1];
+      run_length++;
+    }
+  }
+
+  bytes = g_bytes_new_take (data, size);
+  return prefix_set_new_from_bytes (bytes, NULL);
+}
+
+/**
+ * ephy_gsb_prefix_set_new_from_file:
+ * @path: the path of a set written by ephy_gsb_prefix_set_write()
+ * @error: return location for a #GError
+ *
+ * Maps the set at @path read-only.
+ *
+ * Returns: (transfer full): a new #EphyGSBPrefixSet, or %NULL on error
+ **/
+EphyGSBPrefixSet *
+ephy_gsb_prefix_set_new_from_file (const char  *path,
+                                   GError     **error)
+{
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  mapped_file = g_mapped_file_new (path, FALSE, error);
+  if (!mapped_file)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  return prefix_set_new_from_bytes (bytes, error);
+}
+
+EphyGSBPrefixSet *
+ephy_gsb_prefix_set_ref (EphyGSBPrefixSet *set)
+{
+  g_assert (set);
+
+  g_atomic_int_inc (&set->ref_count);
+
+  return set;
+}
+
+void
+ephy_gsb_prefix_set_unref (EphyGSBPrefixSet *set)
+{
+  g_assert (set);
+
+  if (!g_atomic_int_dec_and_test (&set->ref_count))
+    return;
+
+  g_bytes_unref (set->bytes);
+  g_free (set);
+}
+
+guint64
+ephy_gsb_prefix_set_get_serial (EphyGSBPrefixSet *set)
+{
+  return set->header->serial;
+}
+
+gsize
+ephy_gsb_prefix_set_get_size (EphyGSBPrefixSet *set)
+{
+  return set->header->n_cues;
+}
+
+/**
+ * ephy_gsb_prefix_set_contains:
+ * @set: an #EphyGSBPrefixSet
+ * @cue: the first GSB_HASH_CUE_LEN bytes of a hash
+ *
+ * Checks whether any hash prefix in @set starts with @cue. This neither
+ * allocates nor locks, so it is safe to call from several threads at once.
+ *
+ * Returns: %TRUE if @cue is in @set
+ **/
+gboolean
+ephy_gsb_prefix_set_contains (EphyGSBPrefixSet *set,
+                              const guint8     *cue)
+{
+  guint32 target = cue_to_uint32 (cue);
+  guint32 value;
+  guint32 low = 0;
+  guint32 high = set->header->n_index;
+  guint32 end;
+
+  g_assert (cue);
+
+  /* Find the last run that starts at or before the target. */
+  while (low < high) {
+    guint32 middle = low + (high - low) / 2;
+
+    if (set->index[middle].value <= target)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  if (low == 0)
+    return FALSE;
+
+  value = set->index[low - 1].value;
+  end = low < set->header->n_index ? set->index[low].deltas : set->header->n_deltas;
+
+  for (guint32 i = set->index[low - 1].deltas; i < end && value < target; i++)
+    value += set->deltas[i];
+
+  return value == target;
+}
+
+/**
+ * ephy_gsb_prefix_set_write:
+ * @set: an #EphyGSBPrefixSet
+ * @path: where to write @set
+ * @error: return location for a #GError
+ *
+ * Writes @set atomically to @path, to be mapped later by
+ * ephy_gsb_prefix_set_new_from_file().
+ *
+ * Returns: %TRUE on success
+ **/
+gboolean
+ephy_gsb_prefix_set_write (EphyGSBPrefixSet  *set,
+                           const char        *path,
+                           GError           **error)
+{
+  const char *data;
+  gsize size;
+
+  data = g_bytes_get_data (set->bytes, &size);
+  return g_file_set_contents (path, data, size, error);
+}
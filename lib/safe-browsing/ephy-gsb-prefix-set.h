@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EPHY_GSB_PREFIX_SET_ERROR (ephy_gsb_prefix_set_error_quark ())
+
+typedef enum {
+  EPHY_GSB_PREFIX_SET_ERROR_INVALID
+} EphyGSBPrefixSetError;
+
+typedef struct _EphyGSBPrefixSet EphyGSBPrefixSet;
+
+GQuark            ephy_gsb_prefix_set_error_quark   (void);
+
+EphyGSBPrefixSet *ephy_gsb_prefix_set_new           (const guint8     *cues,
+                                                     gsize             n_cues,
+                                                     guint64           serial);
+EphyGSBPrefixSet *ephy_gsb_prefix_set_new_from_file (const char       *path,
+                                                     GError          **error);
+EphyGSBPrefixSet *ephy_gsb_prefix_set_ref           (EphyGSBPrefixSet *set);
+void              ephy_gsb_prefix_set_unref         (EphyGSBPrefixSet *set);
+
+guint64           ephy_gsb_prefix_set_get_serial    (EphyGSBPrefixSet *set);
+gsize             ephy_gsb_prefix_set_get_size      (EphyGSBPrefixSet *set);
+gboolean          ephy_gsb_prefix_set_contains      (EphyGSBPrefixSet *set,
+                                                     const guint8     *cue);
+gboolean          ephy_gsb_prefix_set_write         (EphyGSBPrefixSet *set,
+                                                     const char       *path,
+                                                     GError          **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyGSBPrefixSet, ephy_gsb_prefix_set_unref)
+
+G_END_DECLS
@@ -23,6 +23,7 @@
 
 #include "ephy-debug.h"
 #include "ephy-gsb-storage.h"
+#include "ephy-gsb-verdict-cache.h"
 #include "ephy-user-agent.h"
 
 #include <libsoup/soup.h>
@@ -37,10 +38,16 @@
 #define CURRENT_TIME      (g_get_real_time () / 1000000)  /* seconds */
 #define DEFAULT_WAIT_TIME (30 * 60)                       /* seconds */
 
+/* How long to gather hash prefixes from concurrent verifications before
+ * sending them in a single fullHashes:find request.
+ */
+#define FULL_HASHES_BATCH_WINDOW 50                       /* milliseconds */
+
 struct _EphyGSBService {
   GObject parent_instance;
 
   char           *api_key;
+  char           *api_prefix;
   EphyGSBStorage *storage;
 
   gboolean        is_updating;
@@ -52,13 +59,53 @@ struct _EphyGSBService {
   gint64          back_off_num_fails;
 
   SoupSession    *session;
+
+  /* Responses to fullHashes:find requests, saved next to the database. */
+  EphyGSBVerdictCache *verdict_cache;
+  char                *verdict_cache_path;
+
+  /* Verifications in progress, by URL, with the tasks waiting on each. */
+  GHashTable     *verifications;
+
+  /* Hash prefixes that need full hashes. Prefixes in @pending_prefixes go
+   * into batch @next_batch, the ones in @in_flight_prefixes are part of the
+   * request being sent. One of the waiting threads gathers and sends the
+   * batches, the others wait on @full_hashes_cond until theirs is done.
+   */
+  GMutex          full_hashes_lock;
+  GCond           full_hashes_cond;
+  GHashTable     *pending_prefixes;
+  GHashTable     *in_flight_prefixes;
+  guint64         next_batch;
+  guint64         done_batch;
+  gboolean        has_batch_sender;
+
+  /* The update thread keeps transactions open on the database connection
+   * while it updates the lists, so the full hashes that verifications get
+   * from the server wait in @deferred_writes until it is done, rather than
+   * end up in those transactions.
+   */
+  GMutex          deferred_writes_lock;
+  gboolean        defer_writes;
+  GPtrArray      *deferred_writes; /* FullHashWrite */
+  gboolean        has_deferred_next_full_hashes_time;
 };
 
+/* A full hash from a fullHashes:find response, or, if @list is %NULL, the
+ * negative cache duration of a hash prefix.
+ */
+typedef struct {
+  EphyGSBThreatList *list;
+  GBytes            *hash;
+  gint64             duration;
+} FullHashWrite;
+
 G_DEFINE_TYPE (EphyGSBService, ephy_gsb_service, G_TYPE_OBJECT);
 
 enum {
   PROP_0,
   PROP_API_KEY,
+  PROP_API_PREFIX,
   PROP_GSB_STORAGE,
   LAST_PROP
 };
@@ -163,6 +210,115 @@ ephy_gsb_service_schedule_update (EphyGSBService *self)
   LOG ("Next update scheduled in %ld seconds", interval);
 }
 
+static void
+ephy_gsb_service_save_verdict_cache (EphyGSBService *self)
+{
+  GError *error = NULL;
+  gint64 serial;
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+  g_assert (ephy_gsb_storage_is_operable (self->storage));
+
+  /* The verdicts are only valid for the hash prefixes they were given for,
+   * which are identified by the serial of the prefix set.
+   */
+  serial = ephy_gsb_storage_get_metadata (self->storage, "prefix_set_serial", 0);
+  if (serial == 0)
+    return;
+
+  if (!ephy_gsb_verdict_cache_save (self->verdict_cache, self->verdict_cache_path,
+                                    serial, CURRENT_TIME, &error)) {
+    g_warning ("Failed to save verdict cache to %s: %s", self->verdict_cache_path, error->message);
+    g_error_free (error);
+  }
+}
+
+static FullHashWrite *
+full_hash_write_new (EphyGSBThreatList *list,
+                     GBytes            *hash,
+                     gint64             duration)
+{
+  FullHashWrite *write = g_new (FullHashWrite, 1);
+
+  write->list = list;
+  write->hash = g_bytes_ref (hash);
+  write->duration = duration;
+
+  return write;
+}
+
+static void
+full_hash_write_free (FullHashWrite *write)
+{
+  if (write->list)
+    ephy_gsb_threat_list_free (write->list);
+  g_bytes_unref (write->hash);
+  g_free (write);
+}
+
+static void
+ephy_gsb_service_apply_full_hash_write (EphyGSBService *self,
+                                        FullHashWrite  *write)
+{
+  if (write->list)
+    ephy_gsb_storage_insert_full_hash (self->storage, write->list,
+                                       g_bytes_get_data (write->hash, NULL), write->duration);
+  else
+    ephy_gsb_storage_update_hash_prefix_expiration (self->storage, write->hash, write->duration);
+}
+
+/* Takes ownership of the writes in @writes. */
+static void
+ephy_gsb_service_save_full_hashes (EphyGSBService *self,
+                                   GPtrArray      *writes,
+                                   gboolean        save_next_full_hashes_time)
+{
+  g_mutex_lock (&self->deferred_writes_lock);
+
+  for (guint i = 0; i < writes->len; i++) {
+    FullHashWrite *write = g_ptr_array_index (writes, i);
+
+    if (self->defer_writes) {
+      g_ptr_array_add (self->deferred_writes, write);
+    } else {
+      ephy_gsb_service_apply_full_hash_write (self, write);
+      full_hash_write_free (write);
+    }
+  }
+
+  if (save_next_full_hashes_time) {
+    if (self->defer_writes)
+      self->has_deferred_next_full_hashes_time = TRUE;
+    else
+      ephy_gsb_storage_set_metadata (self->storage, "next_full_hashes_time", self->next_full_hashes_time);
+  }
+
+  g_mutex_unlock (&self->deferred_writes_lock);
+}
+
+static void
+ephy_gsb_service_set_defer_writes (EphyGSBService *self,
+                                   gboolean        defer_writes)
+{
+  g_mutex_lock (&self->deferred_writes_lock);
+
+  if (!defer_writes) {
+    LOG ("Saving %u full hash changes received during the update", self->deferred_writes->len);
+
+    for (guint i = 0; i < self->deferred_writes->len; i++)
+      ephy_gsb_service_apply_full_hash_write (self, g_ptr_array_index (self->deferred_writes, i));
+    g_ptr_array_set_size (self->deferred_writes, 0);
+
+    if (self->has_deferred_next_full_hashes_time)
+      ephy_gsb_storage_set_metadata (self->storage, "next_full_hashes_time", self->next_full_hashes_time);
+    self->has_deferred_next_full_hashes_time = FALSE;
+  }
+
+  self->defer_writes = defer_writes;
+
+  g_mutex_unlock (&self->deferred_writes_lock);
+}
+
 static void
 ephy_gsb_service_update_thread (GTask          *task,
                                 EphyGSBService *self,
@@ -185,6 +341,8 @@ ephy_gsb_service_update_thread (GTask          *task,
    */
   self->next_list_updates_time = CURRENT_TIME + DEFAULT_WAIT_TIME;
 
+  ephy_gsb_service_set_defer_writes (self, TRUE);
+
   ephy_gsb_storage_delete_old_full_hashes (self->storage);
 
   threat_lists = ephy_gsb_storage_get_threat_lists (self->storage);
@@ -194,7 +352,7 @@ ephy_gsb_service_update_thread (GTask          *task,
   }
 
   body = ephy_gsb_utils_make_list_updates_request (threat_lists);
-  url = g_strdup_printf ("%sthreatListUpdates:fetch?key=%s", API_PREFIX, self->api_key);
+  url = g_strdup_printf ("%sthreatListUpdates:fetch?key=%s", self->api_prefix, self->api_key);
   msg = soup_message_new (SOUP_METHOD_POST, url);
   soup_message_set_request (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen (body));
   soup_session_send_message (self->session, msg);
@@ -216,6 +374,11 @@ ephy_gsb_service_update_thread (GTask          *task,
     goto out;
   }
 
+  /* A full update can be tens of megabytes. The parsed tree holds copies of
+   * all the strings, so drop the raw body before decoding the lists.
+   */
+  soup_message_body_truncate (msg->response_body);
+
   body_obj = json_node_get_object (body_node);
   responses = json_object_get_array_member (body_obj, "listUpdateResponses");
 
@@ -291,7 +454,13 @@ out:
     json_node_unref (body_node);
   g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
 
+  /* Cached verdicts may not hold for new hash prefixes. */
+  if (ephy_gsb_storage_update_prefix_set (self->storage))
+    ephy_gsb_verdict_cache_clear (self->verdict_cache);
+  ephy_gsb_service_save_verdict_cache (self);
   ephy_gsb_storage_set_metadata (self->storage, "next_list_updates_time", self->next_list_updates_time);
+
+  ephy_gsb_service_set_defer_writes (self, FALSE);
 }
 
 static void
@@ -335,6 +504,10 @@ ephy_gsb_service_set_property (GObject      *object,
       g_free (self->api_key);
       self->api_key = g_value_dup_string (value);
       break;
+    case PROP_API_PREFIX:
+      g_free (self->api_prefix);
+      self->api_prefix = g_value_dup_string (value);
+      break;
     case PROP_GSB_STORAGE:
       if (self->storage)
         g_object_unref (self->storage);
@@ -357,6 +530,9 @@ ephy_gsb_service_get_property (GObject    *object,
     case PROP_API_KEY:
       g_value_set_string (value, self->api_key);
       break;
+    case PROP_API_PREFIX:
+      g_value_set_string (value, self->api_prefix);
+      break;
     case PROP_GSB_STORAGE:
       g_value_set_object (value, self->storage);
       break;
@@ -371,6 +547,16 @@ ephy_gsb_service_finalize (GObject *object)
   EphyGSBService *self = EPHY_GSB_SERVICE (object);
 
   g_free (self->api_key);
+  g_free (self->api_prefix);
+  g_free (self->verdict_cache_path);
+  ephy_gsb_verdict_cache_free (self->verdict_cache);
+  g_hash_table_unref (self->verifications);
+  g_hash_table_unref (self->pending_prefixes);
+  g_hash_table_unref (self->in_flight_prefixes);
+  g_mutex_clear (&self->full_hashes_lock);
+  g_cond_clear (&self->full_hashes_cond);
+  g_ptr_array_unref (self->deferred_writes);
+  g_mutex_clear (&self->deferred_writes_lock);
 
   G_OBJECT_CLASS (ephy_gsb_service_parent_class)->finalize (object);
 }
@@ -380,6 +566,9 @@ ephy_gsb_service_dispose (GObject *object)
 {
   EphyGSBService *self = EPHY_GSB_SERVICE (object);
 
+  if (self->storage && self->verdict_cache_path)
+    ephy_gsb_service_save_verdict_cache (self);
+
   g_clear_object (&self->storage);
   g_clear_object (&self->session);
 
@@ -395,12 +584,29 @@ static void
 ephy_gsb_service_constructed (GObject *object)
 {
   EphyGSBService *self = EPHY_GSB_SERVICE (object);
+  GError *error = NULL;
+  char *db_path;
+  gint64 serial;
 
   G_OBJECT_CLASS (ephy_gsb_service_parent_class)->constructed (object);
 
   if (!ephy_gsb_storage_is_operable (self->storage))
     return;
 
+  /* Restore the verdicts of previous sessions. */
+  g_object_get (self->storage, "db-path", &db_path, NULL);
+  self->verdict_cache_path = g_strconcat (db_path, ".verdicts", NULL);
+  g_free (db_path);
+
+  serial = ephy_gsb_storage_get_metadata (self->storage, "prefix_set_serial", 0);
+  if (serial != 0 &&
+      g_file_test (self->verdict_cache_path, G_FILE_TEST_EXISTS) &&
+      !ephy_gsb_verdict_cache_load (self->verdict_cache, self->verdict_cache_path,
+                                    serial, CURRENT_TIME, &error)) {
+    LOG ("Failed to load verdict cache: %s", error->message);
+    g_error_free (error);
+  }
+
   /* Restore back-off parameters. */
   self->back_off_exit_time = ephy_gsb_storage_get_metadata (self->storage,
                                                             "back_off_exit_time",
@@ -435,6 +641,21 @@ ephy_gsb_service_init (EphyGSBService *self)
 {
   self->session = soup_session_new ();
   g_object_set (self->session, "user-agent", ephy_user_agent_get_internal (), NULL);
+
+  self->verifications = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)g_ptr_array_unref);
+  self->verdict_cache = ephy_gsb_verdict_cache_new ();
+
+  g_mutex_init (&self->full_hashes_lock);
+  g_cond_init (&self->full_hashes_cond);
+  self->pending_prefixes = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                  (GDestroyNotify)g_bytes_unref, NULL);
+  self->in_flight_prefixes = g_hash_table_new_full (g_bytes_hash, g_bytes_equal,
+                                                    (GDestroyNotify)g_bytes_unref, NULL);
+  self->next_batch = 1;
+
+  g_mutex_init (&self->deferred_writes_lock);
+  self->deferred_writes = g_ptr_array_new_with_free_func ((GDestroyNotify)full_hash_write_free);
 }
 
 static void
@@ -455,6 +676,14 @@ ephy_gsb_service_class_init (EphyGSBServiceClass *klass)
                          NULL,
                          G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
+  /* Lets tests and benchmarks talk to a local stand-in of the API. */
+  obj_properties[PROP_API_PREFIX] =
+    g_param_spec_string ("api-prefix",
+                         "API prefix",
+                         "The URL that the Google Safe Browsing API methods are relative to",
+                         API_PREFIX,
+                         G_PARAM_CONSTRUCT_ONLY | G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
+
   obj_properties[PROP_GSB_STORAGE] =
     g_param_spec_object ("gsb-storage",
                          "GSB filename",
@@ -498,6 +727,8 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
   JsonNode *body_node;
   JsonObject *body_obj;
   JsonArray *matches;
+  GArray *verdict_matches = NULL;
+  GPtrArray *writes = NULL;
   const char *duration_str;
   char *url;
   char *body;
@@ -524,7 +755,7 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
     return;
 
   body = ephy_gsb_utils_make_full_hashes_request (threat_lists, prefixes);
-  url = g_strdup_printf ("%sfullHashes:find?key=%s", API_PREFIX, self->api_key);
+  url = g_strdup_printf ("%sfullHashes:find?key=%s", self->api_prefix, self->api_key);
   msg = soup_message_new (SOUP_METHOD_POST, url);
   soup_message_set_request (msg, "application/json", SOUP_MEMORY_TAKE, body, strlen (body));
   soup_session_send_message (self->session, msg);
@@ -546,6 +777,8 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
   }
 
   body_obj = json_node_get_object (body_node);
+  verdict_matches = g_array_new (FALSE, FALSE, sizeof (EphyGSBVerdictMatch));
+  writes = g_ptr_array_new ();
 
   if (json_object_has_non_null_array_member (body_obj, "matches")) {
     matches = json_object_get_array_member (body_obj, "matches");
@@ -569,10 +802,21 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
       /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
       duration = g_ascii_strtod (positive_duration, NULL);
 
-      ephy_gsb_storage_insert_full_hash (self->storage, list, hash, floor (duration));
+      if (length == GSB_HASH_SIZE) {
+        g_autoptr(GBytes) hash_bytes = g_bytes_new (hash, length);
+        EphyGSBVerdictMatch verdict_match;
+
+        g_ptr_array_add (writes, full_hash_write_new (g_steal_pointer (&list), hash_bytes, floor (duration)));
+
+        memcpy (verdict_match.hash, hash, GSB_HASH_SIZE);
+        verdict_match.threat_type = threat_type;
+        verdict_match.expires_at = CURRENT_TIME + (gint64)floor (duration);
+        g_array_append_val (verdict_matches, verdict_match);
+      }
 
       g_free (hash);
-      ephy_gsb_threat_list_free (list);
+      if (list)
+        ephy_gsb_threat_list_free (list);
     }
   }
 
@@ -580,8 +824,17 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
   duration_str = json_object_get_string_member (body_obj, "negativeCacheDuration");
   /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
   duration = g_ascii_strtod (duration_str, NULL);
-  for (GList *l = prefixes; l && l->data; l = l->next)
-    ephy_gsb_storage_update_hash_prefix_expiration (self->storage, l->data, floor (duration));
+  for (GList *l = prefixes; l && l->data; l = l->next) {
+    gsize prefix_len;
+    const guint8 *prefix = g_bytes_get_data (l->data, &prefix_len);
+
+    g_ptr_array_add (writes, full_hash_write_new (NULL, l->data, floor (duration)));
+    ephy_gsb_verdict_cache_insert (self->verdict_cache, prefix, prefix_len,
+                                   CURRENT_TIME + (gint64)floor (duration),
+                                   (const EphyGSBVerdictMatch *)verdict_matches->data,
+                                   verdict_matches->len,
+                                   CURRENT_TIME);
+  }
 
   /* Handle minimum wait duration. */
   if (json_object_has_non_null_string_member (body_obj, "minimumWaitDuration")) {
@@ -589,16 +842,91 @@ ephy_gsb_service_update_full_hashes_sync (EphyGSBService *self,
     /* g_ascii_strtod() ignores trailing characters, i.e. 's' character. */
     duration = g_ascii_strtod (duration_str, NULL);
     self->next_full_hashes_time = CURRENT_TIME + (gint64)ceil (duration);
-    ephy_gsb_storage_set_metadata (self->storage, "next_full_hashes_time", self->next_full_hashes_time);
   }
 
+  ephy_gsb_service_save_full_hashes (self, writes,
+                                     json_object_has_non_null_string_member (body_obj, "minimumWaitDuration"));
+
   json_node_unref (body_node);
 out:
   g_free (url);
+  if (verdict_matches)
+    g_array_free (verdict_matches, TRUE);
+  if (writes)
+    g_ptr_array_free (writes, TRUE);
   g_list_free_full (threat_lists, (GDestroyNotify)ephy_gsb_threat_list_free);
   g_object_unref (msg);
 }
 
+/* Gets fresh full hashes for @prefixes, sharing the fullHashes:find request
+ * with all the verifications that run at about the same time. Prefixes that
+ * are already part of a request are not asked for again. Blocks until the
+ * full hashes of all of @prefixes are in the database.
+ */
+static void
+ephy_gsb_service_update_full_hashes_batched (EphyGSBService *self,
+                                             GList          *prefixes)
+{
+  guint64 batch = 0;
+
+  g_assert (EPHY_IS_GSB_SERVICE (self));
+  g_assert (prefixes);
+
+  g_mutex_lock (&self->full_hashes_lock);
+
+  for (GList *l = prefixes; l && l->data; l = l->next) {
+    if (g_hash_table_contains (self->in_flight_prefixes, l->data)) {
+      batch = MAX (batch, self->next_batch - 1);
+    } else {
+      g_hash_table_add (self->pending_prefixes, g_bytes_ref (l->data));
+      batch = self->next_batch;
+    }
+  }
+
+  if (self->has_batch_sender) {
+    while (self->done_batch < batch)
+      g_cond_wait (&self->full_hashes_cond, &self->full_hashes_lock);
+
+    g_mutex_unlock (&self->full_hashes_lock);
+    return;
+  }
+
+  /* Nobody is sending yet, so this thread sends batches until none is left,
+   * which includes its own.
+   */
+  self->has_batch_sender = TRUE;
+
+  while (g_hash_table_size (self->pending_prefixes) > 0) {
+    GHashTable *swap;
+    GList *batch_prefixes;
+
+    g_mutex_unlock (&self->full_hashes_lock);
+    g_usleep (FULL_HASHES_BATCH_WINDOW * 1000);
+    g_mutex_lock (&self->full_hashes_lock);
+
+    swap = self->in_flight_prefixes;
+    self->in_flight_prefixes = self->pending_prefixes;
+    self->pending_prefixes = swap;
+    batch = self->next_batch++;
+    batch_prefixes = g_hash_table_get_keys (self->in_flight_prefixes);
+
+    LOG ("Requesting full hashes for %u hash prefixes", g_list_length (batch_prefixes));
+
+    g_mutex_unlock (&self->full_hashes_lock);
+    ephy_gsb_service_update_full_hashes_sync (self, batch_prefixes);
+    g_mutex_lock (&self->full_hashes_lock);
+
+    g_list_free (batch_prefixes);
+    g_hash_table_remove_all (self->in_flight_prefixes);
+    self->done_batch = batch;
+    g_cond_broadcast (&self->full_hashes_cond);
+  }
+
+  self->has_batch_sender = FALSE;
+
+  g_mutex_unlock (&self->full_hashes_lock);
+}
+
 static void
 ephy_gsb_service_verify_url_thread (GTask          *task,
                                     EphyGSBService *self,
@@ -617,20 +945,17 @@ ephy_gsb_service_verify_url_thread (GTask          *task,
   gpointer value;
   gboolean has_matching_expired_hashes = FALSE;
   gboolean has_matching_expired_prefixes = FALSE;
+  GList *matching_cue_hashes = NULL;
+  gboolean has_unknown_verdicts = FALSE;
   GList *threats = NULL;
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
   g_assert (G_IS_TASK (task));
   g_assert (url);
 
-  /* If the local database is broken or an update is in course, we cannot
-   * really verify the URL, so we have no choice other than to consider it safe.
+  /* If the local database is broken, we cannot really verify the URL, so we
+   * have no choice other than to consider it safe.
    */
-  if (g_atomic_int_get (&self->is_updating)) {
-    LOG ("Local GSB database is being updated, cannot verify URL");
-    goto out;
-  }
-
   if (!ephy_gsb_storage_is_operable (self->storage)) {
     LOG ("Local GSB database is broken, cannot verify URL");
     goto out;
@@ -640,9 +965,63 @@ ephy_gsb_service_verify_url_thread (GTask          *task,
   if (!hashes)
     goto out;
 
+  /* Most URLs have no hash prefix at all, which the in-memory prefix set can
+   * tell without going to the database. The set stays usable while the lists
+   * are being updated.
+   */
+  for (GList *l = hashes; l && l->data; l = l->next) {
+    if (ephy_gsb_storage_has_hash_cue (self->storage, g_bytes_get_data (l->data, NULL)))
+      matching_cue_hashes = g_list_prepend (matching_cue_hashes, l->data);
+  }
+
+  if (!matching_cue_hashes) {
+    LOG ("No prefix set match, URL is safe");
+    goto out;
+  }
+
+  /* Sites visited again within the cache durations get their verdict from
+   * the responses to previous fullHashes:find requests. As with the database,
+   * a positive cache hit is enough, but a negative one is needed for every
+   * hash.
+   */
+  for (GList *l = matching_cue_hashes; l && l->data; l = l->next) {
+    EphyGSBVerdict verdict = ephy_gsb_verdict_cache_lookup (self->verdict_cache,
+                                                            g_bytes_get_data (l->data, NULL),
+                                                            CURRENT_TIME,
+                                                            &threats);
+    if (verdict == EPHY_GSB_VERDICT_UNKNOWN)
+      has_unknown_verdicts = TRUE;
+  }
+
+  if (threats) {
+    LOG ("Verdict cache positive hit, URL is not safe");
+    goto out;
+  }
+
+  if (!has_unknown_verdicts) {
+    LOG ("Verdict cache negative hit, URL is safe");
+    goto out;
+  }
+
   matching_prefixes_set = g_hash_table_new (g_bytes_hash, g_bytes_equal);
   matching_hashes_set = g_hash_table_new (g_bytes_hash, g_bytes_equal);
 
+  /* The hash prefixes are being rewritten during an update, so skip them and
+   * their negative cache. Treat the cues as expired prefixes instead, which
+   * sends them to the server unless a full hash is cached.
+   */
+  if (g_atomic_int_get (&self->is_updating)) {
+    LOG ("Local GSB database is being updated, verifying matching cues with the server");
+
+    cues = ephy_gsb_utils_get_hash_cues (matching_cue_hashes);
+    for (GList *c = cues, *h = matching_cue_hashes; c && h; c = c->next, h = h->next) {
+      g_hash_table_replace (matching_prefixes_set, c->data, GINT_TO_POINTER (TRUE));
+      g_hash_table_add (matching_hashes_set, h->data);
+    }
+
+    goto check_full_hashes;
+  }
+
   /* Check for hash prefixes in database that match any of the full hashes. */
   cues = ephy_gsb_utils_get_hash_cues (hashes);
   prefixes_lookup = ephy_gsb_storage_lookup_hash_prefixes (self->storage, cues);
@@ -668,6 +1047,7 @@ ephy_gsb_service_verify_url_thread (GTask          *task,
     goto out;
   }
 
+check_full_hashes:
   /* Check for full hashes matches.
    * All unexpired full hash matches are added directly to the result set.
    */
@@ -712,9 +1092,15 @@ ephy_gsb_service_verify_url_thread (GTask          *task,
    * server and re-checking for positive cache hits.
    */
   matching_prefixes = g_hash_table_get_keys (matching_prefixes_set);
-  ephy_gsb_service_update_full_hashes_sync (self, matching_prefixes);
+  ephy_gsb_service_update_full_hashes_batched (self, matching_prefixes);
+
+  /* Repeat the full hash verification. During an update, the fresh full
+   * hashes only reach the database once the update is done, but the verdict
+   * cache has them right away.
+   */
+  for (GList *l = matching_hashes; l && l->data; l = l->next)
+    ephy_gsb_verdict_cache_lookup (self->verdict_cache, g_bytes_get_data (l->data, NULL), CURRENT_TIME, &threats);
 
-  /* Repeat the full hash verification. */
   g_list_free_full (hashes_lookup, (GDestroyNotify)ephy_gsb_hash_full_lookup_free);
   hashes_lookup = ephy_gsb_storage_lookup_full_hashes (self->storage, matching_hashes);
   for (GList *l = hashes_lookup; l && l->data; l = l->next) {
@@ -730,6 +1116,7 @@ out:
 
   g_list_free (matching_prefixes);
   g_list_free (matching_hashes);
+  g_list_free (matching_cue_hashes);
   g_list_free_full (hashes, (GDestroyNotify)g_bytes_unref);
   g_list_free_full (cues, (GDestroyNotify)g_bytes_unref);
   g_list_free_full (prefixes_lookup, (GDestroyNotify)ephy_gsb_hash_prefix_lookup_free);
@@ -740,12 +1127,39 @@ out:
     g_hash_table_unref (matching_hashes_set);
 }
 
+static void
+ephy_gsb_service_verify_url_cb (EphyGSBService *self,
+                                GAsyncResult   *result,
+                                gpointer        user_data)
+{
+  const char *url = g_task_get_task_data (G_TASK (result));
+  GPtrArray *tasks;
+  GList *threats;
+
+  threats = g_task_propagate_pointer (G_TASK (result), NULL);
+
+  /* Drop the entry before returning, in case a callback verifies the URL again. */
+  tasks = g_ptr_array_ref (g_hash_table_lookup (self->verifications, url));
+  g_hash_table_remove (self->verifications, url);
+
+  /* Every tab that asked for the URL meanwhile gets its own copy of the result. */
+  for (guint i = 0; i < tasks->len; i++) {
+    GTask *task = g_ptr_array_index (tasks, i);
+
+    g_task_return_pointer (task, g_list_copy_deep (threats, (GCopyFunc)g_strdup, NULL), NULL);
+  }
+
+  g_list_free_full (threats, g_free);
+  g_ptr_array_unref (tasks);
+}
+
 void
 ephy_gsb_service_verify_url (EphyGSBService      *self,
                              const char          *url,
                              GAsyncReadyCallback  callback,
                              gpointer             user_data)
 {
+  GPtrArray *tasks;
   GTask *task;
 
   g_assert (EPHY_IS_GSB_SERVICE (self));
@@ -753,6 +1167,21 @@ ephy_gsb_service_verify_url (EphyGSBService      *self,
   g_assert (callback);
 
   task = g_task_new (self, NULL, callback, user_data);
+
+  /* Session restore and popups often verify the same URL many times at once,
+   * so wait for the verification in progress rather than repeating it.
+   */
+  tasks = g_hash_table_lookup (self->verifications, url);
+  if (tasks) {
+    g_ptr_array_add (tasks, task);
+    return;
+  }
+
+  tasks = g_ptr_array_new_with_free_func (g_object_unref);
+  g_ptr_array_add (tasks, task);
+  g_hash_table_insert (self->verifications, g_strdup (url), tasks);
+
+  task = g_task_new (self, NULL, (GAsyncReadyCallback)ephy_gsb_service_verify_url_cb, NULL);
   g_task_set_task_data (task, g_strdup (url), g_free);
   g_task_run_in_thread (task, (GTaskThreadFunc)ephy_gsb_service_verify_url_thread);
   g_object_unref (task);
@@ -22,6 +22,7 @@
 #include "ephy-gsb-storage.h"
 
 #include "ephy-debug.h"
+#include "ephy-gsb-prefix-set.h"
 #include "ephy-sqlite-connection.h"
 
 #include <string.h>
@@ -38,7 +39,7 @@
  * 1) Modify the database table structure.
  * 2) Modify the threat lists below.
  */
-#define SCHEMA_VERSION 3
+#define SCHEMA_VERSION 4
 
 /* The available Linux threat lists of Google Safe Browsing API v4.
  * The format is {THREAT_TYPE, PLATFORM_TYPE, THREAT_ENTRY_TYPE}.
@@ -57,6 +58,15 @@ struct _EphyGSBStorage {
   EphySQLiteConnection *db;
 
   gboolean is_operable;
+
+  /* Sorted hash prefixes of the threat lists seen by updates, by list. */
+  GHashTable *list_prefixes;
+
+  /* Shared with the verify threads, see ephy_gsb_storage_set_prefix_set(). */
+  GMutex prefix_set_lock;
+  EphyGSBPrefixSet *prefix_set;
+  char *prefix_set_path;
+  gboolean prefix_set_dirty;
 };
 
 G_DEFINE_TYPE (EphyGSBStorage, ephy_gsb_storage, G_TYPE_OBJECT);
@@ -118,6 +128,143 @@ bind_threat_list_params (EphySQLiteStatement *statement,
   return TRUE;
 }
 
+/* The hash prefixes of a threat list, in the order their checksum is computed
+ * over. The prefixes are stored back to back in @data, and @ends holds the
+ * offset just past each one.
+ */
+typedef struct {
+  GByteArray *data;
+  GArray *ends;
+} EphyGSBListPrefixes;
+
+static EphyGSBListPrefixes *
+ephy_gsb_list_prefixes_new (void)
+{
+  EphyGSBListPrefixes *prefixes;
+
+  prefixes = g_new (EphyGSBListPrefixes, 1);
+  prefixes->data = g_byte_array_new ();
+  prefixes->ends = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  return prefixes;
+}
+
+static void
+ephy_gsb_list_prefixes_free (EphyGSBListPrefixes *prefixes)
+{
+  g_byte_array_free (prefixes->data, TRUE);
+  g_array_free (prefixes->ends, TRUE);
+  g_free (prefixes);
+}
+
+static inline const guint8 *
+ephy_gsb_list_prefixes_get (EphyGSBListPrefixes *prefixes,
+                            guint                index,
+                            gsize               *size)
+{
+  guint32 start = index > 0 ? g_array_index (prefixes->ends, guint32, index - 1) : 0;
+
+  *size = g_array_index (prefixes->ends, guint32, index) - start;
+  return prefixes->data->data + start;
+}
+
+static inline void
+ephy_gsb_list_prefixes_append (EphyGSBListPrefixes *prefixes,
+                               const guint8        *prefix,
+                               gsize                size)
+{
+  guint32 end;
+
+  g_byte_array_append (prefixes->data, prefix, size);
+  end = prefixes->data->len;
+  g_array_append_val (prefixes->ends, end);
+}
+
+/* The order SQLite sorts blobs in. */
+static int
+compare_blobs (const guint8 *a,
+               gsize         a_size,
+               const guint8 *b,
+               gsize         b_size)
+{
+  int retval = memcmp (a, b, MIN (a_size, b_size));
+
+  return retval ? retval : (a_size > b_size) - (a_size < b_size);
+}
+
+/* Merges @num_added sorted prefixes of @added_size bytes into @prefixes. */
+static void
+ephy_gsb_list_prefixes_merge (EphyGSBListPrefixes *prefixes,
+                              const guint8        *added,
+                              gsize                num_added,
+                              gsize                added_size)
+{
+  EphyGSBListPrefixes merged;
+  guint num_prefixes = prefixes->ends->len;
+  guint i = 0;
+  gsize k = 0;
+
+  merged.data = g_byte_array_sized_new (prefixes->data->len + num_added * added_size);
+  merged.ends = g_array_sized_new (FALSE, FALSE, sizeof (guint32), num_prefixes + num_added);
+
+  while (i < num_prefixes || k < num_added) {
+    const guint8 *prefix = NULL;
+    gsize size = 0;
+
+    if (i < num_prefixes)
+      prefix = ephy_gsb_list_prefixes_get (prefixes, i, &size);
+
+    if (k < num_added &&
+        (!prefix || compare_blobs (added + k * added_size, added_size, prefix, size) < 0)) {
+      ephy_gsb_list_prefixes_append (&merged, added + k * added_size, added_size);
+      k++;
+    } else {
+      ephy_gsb_list_prefixes_append (&merged, prefix, size);
+      i++;
+    }
+  }
+
+  g_byte_array_free (prefixes->data, TRUE);
+  g_array_free (prefixes->ends, TRUE);
+  *prefixes = merged;
+}
+
+/* Removes the prefixes at the sorted, unique positions in @indices. */
+static void
+ephy_gsb_list_prefixes_remove (EphyGSBListPrefixes *prefixes,
+                               const guint32       *indices,
+                               gsize                num_indices)
+{
+  guint num_prefixes = prefixes->ends->len;
+  guint32 data_len = 0;
+  guint kept = 0;
+  gsize k = 0;
+
+  for (guint i = 0; i < num_prefixes; i++) {
+    const guint8 *prefix;
+    gsize size;
+
+    if (k < num_indices && indices[k] == i) {
+      k++;
+      continue;
+    }
+
+    prefix = ephy_gsb_list_prefixes_get (prefixes, i, &size);
+    memmove (prefixes->data->data + data_len, prefix, size);
+    data_len += size;
+    g_array_index (prefixes->ends, guint32, kept++) = data_len;
+  }
+
+  g_byte_array_set_size (prefixes->data, data_len);
+  g_array_set_size (prefixes->ends, kept);
+}
+
+static char *
+threat_list_key (EphyGSBThreatList *list)
+{
+  return g_strjoin ("/", list->threat_type, list->platform_type, list->threat_entry_type, NULL);
+}
+
 static void
 ephy_gsb_storage_start_transaction (EphyGSBStorage *self)
 {
@@ -177,7 +324,8 @@ ephy_gsb_storage_init_metadata_table (EphyGSBStorage *self)
         "('next_list_updates_time', (CAST(strftime('%s', 'now') AS INT))),"
         "('next_full_hashes_time', (CAST(strftime('%s', 'now') AS INT))),"
         "('back_off_exit_time', 0),"
-        "('back_off_num_fails', 0)";
+        "('back_off_num_fails', 0),"
+        "('prefix_set_serial', 0)";
   statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
   if (error) {
     g_warning ("Failed to create metadata insert statement: %s", error->message);
@@ -416,6 +564,131 @@ ephy_gsb_storage_check_schema_version (EphyGSBStorage *self)
   return schema_version == SCHEMA_VERSION;
 }
 
+/* Publishes a new version of the prefix set. Readers hold the lock only to
+ * take a reference on the current set, and look it up after releasing it,
+ * so neither side ever waits for more than a pointer swap. The old set goes
+ * away with the last reader still using it.
+ */
+static void
+ephy_gsb_storage_set_prefix_set (EphyGSBStorage   *self,
+                                 EphyGSBPrefixSet *prefix_set)
+{
+  EphyGSBPrefixSet *old_prefix_set;
+
+  g_mutex_lock (&self->prefix_set_lock);
+  old_prefix_set = self->prefix_set;
+  self->prefix_set = prefix_set;
+  g_mutex_unlock (&self->prefix_set_lock);
+
+  g_clear_pointer (&old_prefix_set, ephy_gsb_prefix_set_unref);
+}
+
+static void
+ephy_gsb_storage_build_prefix_set (EphyGSBStorage *self)
+{
+  EphySQLiteStatement *statement;
+  EphyGSBPrefixSet *prefix_set;
+  GByteArray *cues;
+  GError *error = NULL;
+  gint64 serial;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (self->is_operable);
+
+  statement = ephy_sqlite_connection_create_statement (self->db, "SELECT cue FROM hash_prefix", &error);
+  if (error) {
+    g_warning ("Failed to create select hash prefix cue statement: %s", error->message);
+    g_error_free (error);
+    ephy_gsb_storage_set_prefix_set (self, NULL);
+    return;
+  }
+
+  cues = g_byte_array_new ();
+  while (ephy_sqlite_statement_step (statement, &error)) {
+    const guint8 *blob = ephy_sqlite_statement_get_column_as_blob (statement, 0);
+
+    if (ephy_sqlite_statement_get_column_size (statement, 0) == GSB_HASH_CUE_LEN)
+      g_byte_array_append (cues, blob, GSB_HASH_CUE_LEN);
+  }
+  g_object_unref (statement);
+
+  /* Without a complete set, every lookup has to go to the database. */
+  if (error) {
+    g_warning ("Failed to execute select hash prefix cue statement: %s", error->message);
+    g_error_free (error);
+    g_byte_array_free (cues, TRUE);
+    ephy_gsb_storage_set_prefix_set (self, NULL);
+    return;
+  }
+
+  serial = g_get_real_time ();
+  prefix_set = ephy_gsb_prefix_set_new (cues->data, cues->len / GSB_HASH_CUE_LEN, serial);
+  g_byte_array_free (cues, TRUE);
+  LOG ("Built hash prefix set with %" G_GSIZE_FORMAT " cues", ephy_gsb_prefix_set_get_size (prefix_set));
+
+  /* The serial ties the file to the database, so that a stale file left over
+   * by a crash in the middle of an update is never used.
+   */
+  if (ephy_gsb_prefix_set_write (prefix_set, self->prefix_set_path, &error)) {
+    ephy_gsb_storage_set_metadata (self, "prefix_set_serial", serial);
+  } else {
+    g_warning ("Failed to write hash prefix set to %s: %s", self->prefix_set_path, error->message);
+    g_error_free (error);
+  }
+
+  ephy_gsb_storage_set_prefix_set (self, prefix_set);
+}
+
+static void
+ephy_gsb_storage_load_prefix_set (EphyGSBStorage *self)
+{
+  EphyGSBPrefixSet *prefix_set;
+  GError *error = NULL;
+  gint64 serial;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (self->is_operable);
+
+  serial = ephy_gsb_storage_get_metadata (self, "prefix_set_serial", 0);
+  if (serial == 0) {
+    LOG ("Hash prefix set is out of date, rebuilding...");
+    ephy_gsb_storage_build_prefix_set (self);
+    return;
+  }
+
+  prefix_set = ephy_gsb_prefix_set_new_from_file (self->prefix_set_path, &error);
+  if (!prefix_set) {
+    LOG ("Failed to load hash prefix set, rebuilding: %s", error->message);
+    g_error_free (error);
+    ephy_gsb_storage_build_prefix_set (self);
+    return;
+  }
+
+  if ((gint64)ephy_gsb_prefix_set_get_serial (prefix_set) != serial) {
+    LOG ("Hash prefix set does not match the database, rebuilding...");
+    ephy_gsb_prefix_set_unref (prefix_set);
+    ephy_gsb_storage_build_prefix_set (self);
+    return;
+  }
+
+  ephy_gsb_storage_set_prefix_set (self, prefix_set);
+}
+
+static void
+ephy_gsb_storage_invalidate_prefix_set (EphyGSBStorage *self)
+{
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+
+  if (self->prefix_set_dirty)
+    return;
+
+  /* Forget the file before touching the hash prefixes, it is rebuilt by
+   * ephy_gsb_storage_update_prefix_set() once the update is done.
+   */
+  ephy_gsb_storage_set_metadata (self, "prefix_set_serial", 0);
+  self->prefix_set_dirty = TRUE;
+}
+
 static void
 ephy_gsb_storage_set_property (GObject      *object,
                                guint         prop_id,
@@ -462,6 +735,11 @@ ephy_gsb_storage_finalize (GObject *object)
     g_object_unref (self->db);
   }
 
+  g_hash_table_unref (self->list_prefixes);
+  g_clear_pointer (&self->prefix_set, ephy_gsb_prefix_set_unref);
+  g_mutex_clear (&self->prefix_set_lock);
+  g_free (self->prefix_set_path);
+
   G_OBJECT_CLASS (ephy_gsb_storage_parent_class)->finalize (object);
 }
 
@@ -489,11 +767,19 @@ ephy_gsb_storage_constructed (GObject *object)
   }
 
   self->is_operable = success;
+
+  if (self->is_operable) {
+    self->prefix_set_path = g_strconcat (self->db_path, ".prefixes", NULL);
+    ephy_gsb_storage_load_prefix_set (self);
+  }
 }
 
 static void
 ephy_gsb_storage_init (EphyGSBStorage *self)
 {
+  g_mutex_init (&self->prefix_set_lock);
+  self->list_prefixes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify)ephy_gsb_list_prefixes_free);
 }
 
 static void
@@ -700,34 +986,31 @@ ephy_gsb_storage_get_threat_lists (EphyGSBStorage *self)
   return g_list_reverse (threat_lists);
 }
 
-/**
- * ephy_gsb_storage_compute_checksum:
- * @self: an #EphyGSBSTorage
- * @list: an #EphyGSBThreatList
- *
- * Compute the SHA256 checksum of the lexicographically sorted list of all the
- * hash prefixes belonging to @list in the local database.
- *
- * https://developers.google.com/safe-browsing/v4/local-databases#validation-checks
- *
- * Return value: (transfer full): the base64 encoded checksum or %NULL if error
- **/
-char *
-ephy_gsb_storage_compute_checksum (EphyGSBStorage    *self,
-                                   EphyGSBThreatList *list)
+/* Returns the sorted prefixes of @list, loading them from the database the
+ * first time. Updates keep them sorted from then on, so the database only
+ * sorts each list once.
+ */
+static EphyGSBListPrefixes *
+ephy_gsb_storage_get_list_prefixes (EphyGSBStorage    *self,
+                                    EphyGSBThreatList *list)
 {
+  EphyGSBListPrefixes *prefixes;
   EphySQLiteStatement *statement;
   GError *error = NULL;
   const char *sql;
-  char *retval = NULL;
-  GChecksum *checksum ;
-  guint8 *digest;
-  gsize digest_len = GSB_HASH_SIZE;
+  char *key;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (self->is_operable);
   g_assert (list);
 
+  key = threat_list_key (list);
+  prefixes = g_hash_table_lookup (self->list_prefixes, key);
+  if (prefixes) {
+    g_free (key);
+    return prefixes;
+  }
+
   sql = "SELECT value FROM hash_prefix WHERE "
         "threat_type=? AND platform_type=? AND threat_entry_type=? "
         "ORDER BY value";
@@ -735,34 +1018,90 @@ ephy_gsb_storage_compute_checksum (EphyGSBStorage    *self,
   if (error) {
     g_warning ("Failed to create select hash prefix statement: %s", error->message);
     g_error_free (error);
+    g_free (key);
     return NULL;
   }
 
   if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
     g_object_unref (statement);
+    g_free (key);
     return NULL;
   }
 
-  checksum = g_checksum_new (GSB_HASH_TYPE);
+  prefixes = ephy_gsb_list_prefixes_new ();
   while (ephy_sqlite_statement_step (statement, &error)) {
-    g_checksum_update (checksum,
-                       ephy_sqlite_statement_get_column_as_blob (statement, 0),
-                       ephy_sqlite_statement_get_column_size (statement, 0));
+    ephy_gsb_list_prefixes_append (prefixes,
+                                   ephy_sqlite_statement_get_column_as_blob (statement, 0),
+                                   ephy_sqlite_statement_get_column_size (statement, 0));
   }
 
+  g_object_unref (statement);
+
   if (error) {
     g_warning ("Failed to execute select hash prefix statement: %s", error->message);
     g_error_free (error);
-    goto out;
+    ephy_gsb_list_prefixes_free (prefixes);
+    g_free (key);
+    return NULL;
   }
 
+  g_hash_table_insert (self->list_prefixes, key, prefixes);
+
+  return prefixes;
+}
+
+/* Drops the sorted prefixes of @list after a failed write, so that they are
+ * loaded again from the database instead of going out of sync with it.
+ */
+static void
+ephy_gsb_storage_forget_list_prefixes (EphyGSBStorage    *self,
+                                       EphyGSBThreatList *list)
+{
+  char *key = threat_list_key (list);
+
+  g_hash_table_remove (self->list_prefixes, key);
+  g_free (key);
+}
+
+/**
+ * ephy_gsb_storage_compute_checksum:
+ * @self: an #EphyGSBSTorage
+ * @list: an #EphyGSBThreatList
+ *
+ * Compute the SHA256 checksum of the lexicographically sorted list of all the
+ * hash prefixes belonging to @list in the local database.
+ *
+ * https://developers.google.com/safe-browsing/v4/local-databases#validation-checks
+ *
+ * Return value: (transfer full): the base64 encoded checksum or %NULL if error
+ **/
+char *
+ephy_gsb_storage_compute_checksum (EphyGSBStorage    *self,
+                                   EphyGSBThreatList *list)
+{
+  EphyGSBListPrefixes *prefixes;
+  GChecksum *checksum;
+  char *retval;
+  guint8 *digest;
+  gsize digest_len = GSB_HASH_SIZE;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (self->is_operable);
+  g_assert (list);
+
+  prefixes = ephy_gsb_storage_get_list_prefixes (self, list);
+  if (!prefixes)
+    return NULL;
+
+  /* The prefixes are already sorted and contiguous. */
+  checksum = g_checksum_new (GSB_HASH_TYPE);
+  g_checksum_update (checksum, prefixes->data->data, prefixes->data->len);
+
   digest = g_malloc (digest_len);
   g_checksum_get_digest (checksum, digest, &digest_len);
   retval = g_base64_encode (digest, digest_len);
 
   g_free (digest);
-out:
-  g_object_unref (statement);
   g_checksum_free (checksum);
 
   return retval;
@@ -845,6 +1184,8 @@ ephy_gsb_storage_clear_hash_prefixes (EphyGSBStorage    *self,
   g_assert (self->is_operable);
   g_assert (list);
 
+  ephy_gsb_storage_invalidate_prefix_set (self);
+
   sql = "DELETE FROM hash_prefix WHERE "
         "threat_type=? AND platform_type=? AND threat_entry_type=?";
   statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
@@ -863,65 +1204,14 @@ ephy_gsb_storage_clear_hash_prefixes (EphyGSBStorage    *self,
   if (error) {
     g_warning ("Failed to execute clear hash prefix statement: %s", error->message);
     g_error_free (error);
+    ephy_gsb_storage_forget_list_prefixes (self, list);
+  } else {
+    g_hash_table_replace (self->list_prefixes, threat_list_key (list), ephy_gsb_list_prefixes_new ());
   }
 
   g_object_unref (statement);
 }
 
-static GList *
-ephy_gsb_storage_get_hash_prefixes_to_delete (EphyGSBStorage    *self,
-                                              EphyGSBThreatList *list,
-                                              GHashTable        *indices,
-                                              gsize             *num_prefixes)
-{
-  EphySQLiteStatement *statement;
-  GError *error = NULL;
-  GList *prefixes = NULL;
-  const char *sql;
-  guint index = 0;
-
-  g_assert (EPHY_IS_GSB_STORAGE (self));
-  g_assert (self->is_operable);
-  g_assert (list);
-  g_assert (indices);
-
-  *num_prefixes = 0;
-
-  sql = "SELECT value FROM hash_prefix WHERE "
-        "threat_type=? AND platform_type=? AND threat_entry_type=? "
-        "ORDER BY value";
-  statement = ephy_sqlite_connection_create_statement (self->db, sql, &error);
-  if (error) {
-    g_warning ("Failed to create select prefix value statement: %s", error->message);
-    g_error_free (error);
-    return NULL;
-  }
-
-  if (!bind_threat_list_params (statement, list, 0, 1, 2, -1)) {
-    g_object_unref (statement);
-    return NULL;
-  }
-
-  while (ephy_sqlite_statement_step (statement, &error)) {
-    if (g_hash_table_contains (indices, GUINT_TO_POINTER (index))) {
-      const guint8 *blob = ephy_sqlite_statement_get_column_as_blob (statement, 0);
-      gsize size = ephy_sqlite_statement_get_column_size (statement, 0);
-      prefixes = g_list_prepend (prefixes, g_bytes_new (blob, size));
-      *num_prefixes += 1;
-    }
-    index++;
-  }
-
-  if (error) {
-    g_warning ("Failed to execute select prefix value statement: %s", error->message);
-    g_error_free (error);
-  }
-
-  g_object_unref (statement);
-
-  return prefixes;
-}
-
 static EphySQLiteStatement *
 ephy_gsb_storage_make_delete_hash_prefix_statement (EphyGSBStorage *self,
                                                     gsize           num_prefixes)
@@ -952,21 +1242,22 @@ ephy_gsb_storage_make_delete_hash_prefix_statement (EphyGSBStorage *self,
   return statement;
 }
 
-static GList *
+static gboolean
 ephy_gsb_storage_delete_hash_prefixes_batch (EphyGSBStorage      *self,
                                              EphyGSBThreatList   *list,
-                                             GList               *prefixes,
+                                             GList              **prefixes,
                                              gsize                num_prefixes,
                                              EphySQLiteStatement *stmt)
 {
   EphySQLiteStatement *statement = NULL;
   GError *error = NULL;
   gboolean free_statement = TRUE;
+  gboolean success = FALSE;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (self->is_operable);
   g_assert (list);
-  g_assert (prefixes);
+  g_assert (*prefixes);
 
   if (stmt) {
     statement = stmt;
@@ -975,14 +1266,14 @@ ephy_gsb_storage_delete_hash_prefixes_batch (EphyGSBStorage      *self,
   } else {
     statement = ephy_gsb_storage_make_delete_hash_prefix_statement (self, num_prefixes);
     if (!statement)
-      return prefixes;
+      return FALSE;
   }
 
   if (!bind_threat_list_params (statement, list, 0, 1, 2, -1))
     goto out;
 
   for (gsize i = 0; i < num_prefixes; i++) {
-    GBytes *prefix = (GBytes *)prefixes->data;
+    GBytes *prefix = (GBytes *)(*prefixes)->data;
     if (!ephy_sqlite_statement_bind_blob (statement, i + 3,
                                           g_bytes_get_data (prefix, NULL),
                                           g_bytes_get_size (prefix),
@@ -990,21 +1281,34 @@ ephy_gsb_storage_delete_hash_prefixes_batch (EphyGSBStorage      *self,
       g_warning ("Failed to bind values in delete hash prefix statement");
       goto out;
     }
-    prefixes = prefixes->next;
+    /* Move on to where the next batch starts. */
+    *prefixes = (*prefixes)->next;
   }
 
   ephy_sqlite_statement_step (statement, &error);
   if (error) {
     g_warning ("Failed to execute delete hash prefix statement: %s", error->message);
     g_error_free (error);
+    goto out;
   }
 
+  success = TRUE;
+
 out:
   if (free_statement && statement)
     g_object_unref (statement);
 
-  /* Return where we left off. */
-  return prefixes;
+  return success;
+}
+
+static int
+compare_indices (gconstpointer a,
+                 gconstpointer b)
+{
+  guint32 index_a = *(const guint32 *)a;
+  guint32 index_b = *(const guint32 *)b;
+
+  return index_a < index_b ? -1 : index_a > index_b;
 }
 
 static void
@@ -1014,10 +1318,11 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
                                                 gsize              num_indices)
 {
   EphySQLiteStatement *statement = NULL;
+  EphyGSBListPrefixes *list_prefixes;
   GList *prefixes = NULL;
   GList *head = NULL;
-  GHashTable *set;
-  gsize num_prefixes;
+  gsize num_prefixes = 0;
+  gboolean success = TRUE;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (self->is_operable);
@@ -1026,12 +1331,26 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
 
   LOG ("Deleting %lu hash prefixes...", num_indices);
 
-  /* Move indices from the array to a hash table set. */
-  set = g_hash_table_new (g_direct_hash, g_direct_equal);
-  for (gsize i = 0; i < num_indices; i++)
-    g_hash_table_add (set, GUINT_TO_POINTER (indices[i]));
+  list_prefixes = ephy_gsb_storage_get_list_prefixes (self, list);
+  if (!list_prefixes)
+    return;
+
+  /* The indices are positions in the sorted prefixes of the list, so look the
+   * prefixes up directly. Out of range and repeated indices are ignored.
+   */
+  qsort (indices, num_indices, sizeof (guint32), compare_indices);
+  for (gsize i = 0; i < num_indices; i++) {
+    const guint8 *prefix;
+    gsize size;
+
+    if (indices[i] >= list_prefixes->ends->len || (num_prefixes > 0 && indices[num_prefixes - 1] == indices[i]))
+      continue;
+
+    indices[num_prefixes++] = indices[i];
+    prefix = ephy_gsb_list_prefixes_get (list_prefixes, indices[i], &size);
+    prefixes = g_list_prepend (prefixes, g_bytes_new (prefix, size));
+  }
 
-  prefixes = ephy_gsb_storage_get_hash_prefixes_to_delete (self, list, set, &num_prefixes);
   head = prefixes;
 
   ephy_gsb_storage_start_transaction (self);
@@ -1040,22 +1359,27 @@ ephy_gsb_storage_delete_hash_prefixes_internal (EphyGSBStorage    *self,
     /* Reuse statement to increase performance. */
     statement = ephy_gsb_storage_make_delete_hash_prefix_statement (self, BATCH_SIZE);
 
-    for (gsize i = 0; i < num_prefixes / BATCH_SIZE; i++) {
-      head = ephy_gsb_storage_delete_hash_prefixes_batch (self, list,
-                                                          head, BATCH_SIZE,
-                                                          statement);
+    for (gsize i = 0; i < num_prefixes / BATCH_SIZE && success; i++) {
+      success = statement &&
+                ephy_gsb_storage_delete_hash_prefixes_batch (self, list,
+                                                             &head, BATCH_SIZE,
+                                                             statement);
     }
   }
 
-  if (num_prefixes % BATCH_SIZE != 0) {
-    ephy_gsb_storage_delete_hash_prefixes_batch (self, list,
-                                                 head, num_prefixes % BATCH_SIZE,
-                                                 NULL);
+  if (num_prefixes % BATCH_SIZE != 0 && success) {
+    success = ephy_gsb_storage_delete_hash_prefixes_batch (self, list,
+                                                           &head, num_prefixes % BATCH_SIZE,
+                                                           NULL);
   }
 
   ephy_gsb_storage_end_transaction (self);
 
-  g_hash_table_unref (set);
+  if (success)
+    ephy_gsb_list_prefixes_remove (list_prefixes, indices, num_prefixes);
+  else
+    ephy_gsb_storage_forget_list_prefixes (self, list);
+
   g_list_free_full (prefixes, (GDestroyNotify)g_bytes_unref);
   if (statement)
     g_object_unref (statement);
@@ -1087,6 +1411,8 @@ ephy_gsb_storage_delete_hash_prefixes (EphyGSBStorage    *self,
   g_assert (list);
   g_assert (tes);
 
+  ephy_gsb_storage_invalidate_prefix_set (self);
+
   compression = json_object_get_string_member (tes, "compressionType");
   if (!g_strcmp0 (compression, GSB_COMPRESSION_TYPE_RICE)) {
     rice_indices = json_object_get_object_member (tes, "riceIndices");
@@ -1135,7 +1461,7 @@ ephy_gsb_storage_make_insert_hash_prefix_statement (EphyGSBStorage *self,
   return statement;
 }
 
-static void
+static gboolean
 ephy_gsb_storage_insert_hash_prefixes_batch (EphyGSBStorage      *self,
                                              EphyGSBThreatList   *list,
                                              const guint8        *prefixes,
@@ -1148,6 +1474,7 @@ ephy_gsb_storage_insert_hash_prefixes_batch (EphyGSBStorage      *self,
   GError *error = NULL;
   gsize id = 0;
   gboolean free_statement = TRUE;
+  gboolean success = FALSE;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (self->is_operable);
@@ -1161,7 +1488,7 @@ ephy_gsb_storage_insert_hash_prefixes_batch (EphyGSBStorage      *self,
   } else {
     statement = ephy_gsb_storage_make_insert_hash_prefix_statement (self, (end - start + 1) / len);
     if (!statement)
-      return;
+      return FALSE;
   }
 
   for (gsize k = start; k < end; k += len) {
@@ -1178,14 +1505,19 @@ ephy_gsb_storage_insert_hash_prefixes_batch (EphyGSBStorage      *self,
   if (error) {
     g_warning ("Failed to execute insert hash prefix statement: %s", error->message);
     g_error_free (error);
+    goto out;
   }
 
+  success = TRUE;
+
 out:
   if (free_statement && statement)
     g_object_unref (statement);
+
+  return success;
 }
 
-static void
+static gboolean
 ephy_gsb_storage_insert_hash_prefixes_internal (EphyGSBStorage    *self,
                                                 EphyGSBThreatList *list,
                                                 const guint8      *prefixes,
@@ -1194,6 +1526,7 @@ ephy_gsb_storage_insert_hash_prefixes_internal (EphyGSBStorage    *self,
 {
   EphySQLiteStatement *statement = NULL;
   gsize num_batches;
+  gboolean success = TRUE;
 
   g_assert (EPHY_IS_GSB_STORAGE (self));
   g_assert (self->is_operable);
@@ -1209,27 +1542,38 @@ ephy_gsb_storage_insert_hash_prefixes_internal (EphyGSBStorage    *self,
     /* Reuse statement to increase performance. */
     statement = ephy_gsb_storage_make_insert_hash_prefix_statement (self, BATCH_SIZE);
 
-    for (gsize i = 0; i < num_batches; i++) {
-      ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
-                                                   i * prefix_len * BATCH_SIZE,
-                                                   (i + 1) * prefix_len * BATCH_SIZE,
-                                                   prefix_len,
-                                                   statement);
+    for (gsize i = 0; i < num_batches && success; i++) {
+      success = statement &&
+                ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
+                                                             i * prefix_len * BATCH_SIZE,
+                                                             (i + 1) * prefix_len * BATCH_SIZE,
+                                                             prefix_len,
+                                                             statement);
     }
   }
 
-  if (num_prefixes % BATCH_SIZE != 0) {
-    ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
-                                                 num_batches * prefix_len * BATCH_SIZE,
-                                                 num_prefixes * prefix_len - 1,
-                                                 prefix_len,
-                                                 NULL);
+  if (num_prefixes % BATCH_SIZE != 0 && success) {
+    success = ephy_gsb_storage_insert_hash_prefixes_batch (self, list, prefixes,
+                                                           num_batches * prefix_len * BATCH_SIZE,
+                                                           num_prefixes * prefix_len - 1,
+                                                           prefix_len,
+                                                           NULL);
   }
 
   ephy_gsb_storage_end_transaction (self);
 
   if (statement)
     g_object_unref (statement);
+
+  return success;
+}
+
+static int
+compare_hash_prefixes (const guint8 *a,
+                       const guint8 *b,
+                       gpointer      user_data)
+{
+  return memcmp (a, b, GPOINTER_TO_SIZE (user_data));
 }
 
 /**
@@ -1246,11 +1590,12 @@ ephy_gsb_storage_insert_hash_prefixes (EphyGSBStorage    *self,
                                        EphyGSBThreatList *list,
                                        JsonObject        *tes)
 {
+  EphyGSBListPrefixes *list_prefixes;
   JsonObject *raw_hashes;
   JsonObject *rice_hashes;
   const char *compression;
   const char *prefixes_b64;
-  guint32 *items = NULL;
+  guint32 *items;
   guint8 *prefixes;
   gsize prefixes_len;
   gsize prefix_len;
@@ -1261,28 +1606,52 @@ ephy_gsb_storage_insert_hash_prefixes (EphyGSBStorage    *self,
   g_assert (list);
   g_assert (tes);
 
+  ephy_gsb_storage_invalidate_prefix_set (self);
+
   compression = json_object_get_string_member (tes, "compressionType");
   if (!g_strcmp0 (compression, GSB_COMPRESSION_TYPE_RICE)) {
     rice_hashes = json_object_get_object_member (tes, "riceHashes");
     items = ephy_gsb_utils_rice_delta_decode (rice_hashes, &num_prefixes);
 
-    prefixes = g_malloc (num_prefixes * GSB_RICE_PREFIX_LEN);
+    /* The decoded values are the prefixes read as little endian integers, so
+     * turn them back into prefixes in place rather than copying them.
+     */
     for (gsize i = 0; i < num_prefixes; i++)
-      memcpy (prefixes + i * GSB_RICE_PREFIX_LEN, &items[i], GSB_RICE_PREFIX_LEN);
+      items[i] = GUINT32_TO_LE (items[i]);
 
+    prefixes = (guint8 *)items;
     prefix_len = GSB_RICE_PREFIX_LEN;
   } else {
     raw_hashes = json_object_get_object_member (tes, "rawHashes");
     prefix_len = json_object_get_int_member (raw_hashes, "prefixSize");
     prefixes_b64 = json_object_get_string_member (raw_hashes, "rawHashes");
 
+    if (prefix_len < GSB_HASH_CUE_LEN || prefix_len > (gsize)GSB_HASH_SIZE) {
+      g_warning ("Invalid hash prefix size %" G_GSIZE_FORMAT, prefix_len);
+      return;
+    }
+
     prefixes = g_base64_decode (prefixes_b64, &prefixes_len);
     num_prefixes = prefixes_len / prefix_len;
   }
 
-  ephy_gsb_storage_insert_hash_prefixes_internal (self, list, prefixes, num_prefixes, prefix_len);
+  /* Insert in primary key order, so that SQLite appends to the end of the
+   * index instead of splitting pages all over it.
+   */
+  g_qsort_with_data (prefixes, num_prefixes, prefix_len,
+                     (GCompareDataFunc)compare_hash_prefixes, GSIZE_TO_POINTER (prefix_len));
+
+  /* Keep the sorted prefixes of the list in step with the database. Load them
+   * before inserting, or the new prefixes would be merged in twice.
+   */
+  list_prefixes = ephy_gsb_storage_get_list_prefixes (self, list);
+  if (ephy_gsb_storage_insert_hash_prefixes_internal (self, list, prefixes, num_prefixes, prefix_len)) {
+    if (list_prefixes)
+      ephy_gsb_list_prefixes_merge (list_prefixes, prefixes, num_prefixes, prefix_len);
+  } else {
+    ephy_gsb_storage_forget_list_prefixes (self, list);
+  }
 
-  g_free (items);
   g_free (prefixes);
 }
 
@@ -1362,6 +1731,67 @@ ephy_gsb_storage_lookup_hash_prefixes (EphyGSBStorage *self,
   return g_list_reverse (retval);
 }
 
+/**
+ * ephy_gsb_storage_update_prefix_set:
+ * @self: an #EphyGSBStorage
+ *
+ * Rebuild the in-memory set of hash prefix cues if the hash prefixes changed
+ * since it was last built, and persist it next to the local database. Call
+ * this once all threat lists are updated.
+ *
+ * Return value: %TRUE if the hash prefixes changed
+ **/
+gboolean
+ephy_gsb_storage_update_prefix_set (EphyGSBStorage *self)
+{
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (self->is_operable);
+
+  if (!self->prefix_set_dirty)
+    return FALSE;
+
+  ephy_gsb_storage_build_prefix_set (self);
+  self->prefix_set_dirty = FALSE;
+
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_storage_has_hash_cue:
+ * @self: an #EphyGSBStorage
+ * @hash: a full hash, or any hash at least GSB_HASH_CUE_LEN bytes long
+ *
+ * Check whether the local database may have hash prefixes that begin with the
+ * cue of @hash, without querying the database. This does not allocate and
+ * only holds a lock for a pointer read, so it is cheap enough to run on every
+ * URL before ephy_gsb_storage_lookup_hash_prefixes(). While the threat lists are being
+ * updated, the answer comes from the set as it was before the update.
+ *
+ * Return value: %FALSE if the local database has no hash prefix for @hash
+ **/
+gboolean
+ephy_gsb_storage_has_hash_cue (EphyGSBStorage *self,
+                               const guint8   *hash)
+{
+  EphyGSBPrefixSet *prefix_set;
+  gboolean retval;
+
+  g_assert (EPHY_IS_GSB_STORAGE (self));
+  g_assert (self->is_operable);
+  g_assert (hash);
+
+  g_mutex_lock (&self->prefix_set_lock);
+  prefix_set = self->prefix_set ? ephy_gsb_prefix_set_ref (self->prefix_set) : NULL;
+  g_mutex_unlock (&self->prefix_set_lock);
+
+  /* Fall back to the database if the set could not be built. */
+  retval = !prefix_set || ephy_gsb_prefix_set_contains (prefix_set, hash);
+
+  g_clear_pointer (&prefix_set, ephy_gsb_prefix_set_unref);
+
+  return retval;
+}
+
 /**
  * ephy_gsb_storage_lookup_full_hashes:
  * @self: an #EphyGSBStorage
@@ -52,6 +52,9 @@ void            ephy_gsb_storage_delete_hash_prefixes           (EphyGSBStorage
 void            ephy_gsb_storage_insert_hash_prefixes           (EphyGSBStorage    *self,
                                                                  EphyGSBThreatList *list,
                                                                  JsonObject        *tes);
+gboolean        ephy_gsb_storage_update_prefix_set              (EphyGSBStorage *self);
+gboolean        ephy_gsb_storage_has_hash_cue                   (EphyGSBStorage *self,
+                                                                 const guint8   *hash);
 GList          *ephy_gsb_storage_lookup_hash_prefixes           (EphyGSBStorage *self,
                                                                  GList          *cues);
 GList          *ephy_gsb_storage_lookup_full_hashes             (EphyGSBStorage *self,
@@ -34,119 +34,141 @@
 #define MAX_UNESCAPE_STEP 1024
 
 typedef struct {
-  guint8 *data;     /* The bit stream as an array of bytes */
-  gsize   data_len; /* The number of bytes in the array */
-  guint8 *curr;     /* The current byte in the bit stream */
-  guint8  mask;     /* Bit mask to read a bit within a byte */
-  gsize   num_read; /* The number of bits read so far */
+  const guint8 *data; /* The next byte of the bit stream to buffer */
+  const guint8 *end;  /* One past the last byte of the bit stream */
+  guint64       bits; /* Buffered bits, the next one is the least significant */
+  guint         count; /* The number of buffered bits */
 } EphyGSBBitReader;
 
 typedef struct {
-  EphyGSBBitReader *reader;
-  guint             parameter; /* Golomb-Rice parameter, between 2 and 28 */
+  EphyGSBBitReader reader;
+  guint            parameter; /* Golomb-Rice parameter, between 2 and 28 */
 } EphyGSBRiceDecoder;
 
-static inline EphyGSBBitReader *
-ephy_gsb_bit_reader_new (const guint8 *data,
-                         gsize         data_len)
+static inline void
+ephy_gsb_bit_reader_init (EphyGSBBitReader *reader,
+                          const guint8     *data,
+                          gsize             data_len)
 {
-  EphyGSBBitReader *reader;
-
-  g_assert (data);
-  g_assert (data_len > 0);
+  reader->data = data;
+  reader->end = data + data_len;
+  reader->bits = 0;
+  reader->count = 0;
+}
 
-  reader = g_new (EphyGSBBitReader, 1);
-  reader->curr = reader->data = g_malloc (data_len);
-  memcpy (reader->data, data, data_len);
-  reader->data_len = data_len;
-  reader->mask = 0x01;
-  reader->num_read = 0;
+/*
+ * https://developers.google.com/safe-browsing/v4/compression#bit-encoderdecoder
+ *
+ * Within a byte, the least-significant bits come before the most-significant
+ * bits in the bit stream, so the stream reads like a little endian integer.
+ * That lets the buffer be topped up a whole word at a time.
+ */
+static inline void
+ephy_gsb_bit_reader_refill (EphyGSBBitReader *reader)
+{
+  if (reader->end - reader->data >= 8) {
+    guint64 word;
+    guint num_bytes = (64 - reader->count) / 8;
+
+    memcpy (&word, reader->data, sizeof (word));
+    reader->bits |= GUINT64_FROM_LE (word) << reader->count;
+    reader->data += num_bytes;
+    reader->count += num_bytes * 8;
+    return;
+  }
 
-  return reader;
+  while (reader->count <= 56 && reader->data < reader->end) {
+    reader->bits |= (guint64)*reader->data++ << reader->count;
+    reader->count += 8;
+  }
 }
 
 static inline void
-ephy_gsb_bit_reader_free (EphyGSBBitReader *reader)
+ephy_gsb_bit_reader_consume (EphyGSBBitReader *reader,
+                             guint             num_bits)
 {
-  g_assert (reader);
-
-  g_free (reader->data);
-  g_free (reader);
+  reader->bits = num_bits < 64 ? reader->bits >> num_bits : 0;
+  reader->count -= num_bits;
 }
 
-/*
- * https://developers.google.com/safe-browsing/v4/compression#bit-encoderdecoder
- */
-static guint32
+static gboolean
 ephy_gsb_bit_reader_read (EphyGSBBitReader *reader,
-                          guint             num_bits)
+                          guint             num_bits,
+                          guint32          *value)
 {
-  guint32 retval = 0;
-
   /* Cannot read more than 4 bytes at once. */
   g_assert (num_bits <= 32);
-  /* Cannot read more bits than the buffer has left. */
-  g_assert (reader->num_read + num_bits <= reader->data_len * 8);
-
-  /* Within a byte, the least-significant bits come before the most-significant
-   * bits in the bit stream. */
-  for (guint i = 0; i < num_bits; i++) {
-    if (*reader->curr & reader->mask)
-      retval |= 1 << i;
-
-    reader->mask <<= 1;
-    if (reader->mask == 0) {
-      reader->curr++;
-      reader->mask = 0x01;
-    }
-  }
 
-  reader->num_read += num_bits;
+  if (reader->count < num_bits)
+    ephy_gsb_bit_reader_refill (reader);
+  if (reader->count < num_bits)
+    return FALSE;
 
-  return retval;
+  *value = reader->bits & (((guint64)1 << num_bits) - 1);
+  ephy_gsb_bit_reader_consume (reader, num_bits);
+
+  return TRUE;
 }
 
-static inline EphyGSBRiceDecoder *
-ephy_gsb_rice_decoder_new (const guint8 *data,
-                           gsize         data_len,
-                           guint         parameter)
+/* Reads a run of 1 bits and the 0 bit that ends it. */
+static gboolean
+ephy_gsb_bit_reader_read_unary (EphyGSBBitReader *reader,
+                                guint32           max_value,
+                                guint32          *value)
 {
-  EphyGSBRiceDecoder *decoder;
+  guint64 run = 0;
 
-  g_assert (data);
-  g_assert (data_len > 0);
+  for (;;) {
+    guint length;
 
-  decoder = g_new (EphyGSBRiceDecoder, 1);
-  decoder->reader = ephy_gsb_bit_reader_new (data, data_len);
-  decoder->parameter = parameter;
+    if (reader->count == 0)
+      ephy_gsb_bit_reader_refill (reader);
+    if (reader->count == 0)
+      return FALSE;
+
+    length = ~reader->bits ? __builtin_ctzll (~reader->bits) : 64;
+    if (length < reader->count) {
+      run += length;
+      ephy_gsb_bit_reader_consume (reader, length + 1);
+      break;
+    }
+
+    run += reader->count;
+    ephy_gsb_bit_reader_consume (reader, reader->count);
+  }
+
+  if (run > max_value)
+    return FALSE;
 
-  return decoder;
+  *value = run;
+  return TRUE;
 }
 
 static inline void
-ephy_gsb_rice_decoder_free (EphyGSBRiceDecoder *decoder)
+ephy_gsb_rice_decoder_init (EphyGSBRiceDecoder *decoder,
+                            const guint8       *data,
+                            gsize               data_len,
+                            guint               parameter)
 {
-  g_assert (decoder);
-
-  ephy_gsb_bit_reader_free (decoder->reader);
-  g_free (decoder);
+  ephy_gsb_bit_reader_init (&decoder->reader, data, data_len);
+  decoder->parameter = parameter;
 }
 
-static guint32
-ephy_gsb_rice_decoder_next (EphyGSBRiceDecoder *decoder)
+static gboolean
+ephy_gsb_rice_decoder_next (EphyGSBRiceDecoder *decoder,
+                            guint32            *value)
 {
-  guint32 quotient = 0;
+  guint32 quotient;
   guint32 remainder;
-  guint32 bit;
 
   g_assert (decoder);
 
-  while ((bit = ephy_gsb_bit_reader_read (decoder->reader, 1)) != 0)
-    quotient += bit;
-
-  remainder = ephy_gsb_bit_reader_read (decoder->reader, decoder->parameter);
+  if (!ephy_gsb_bit_reader_read_unary (&decoder->reader, G_MAXUINT32 >> decoder->parameter, &quotient) ||
+      !ephy_gsb_bit_reader_read (&decoder->reader, decoder->parameter, &remainder))
+    return FALSE;
 
-  return (quotient << decoder->parameter) + remainder;
+  *value = (quotient << decoder->parameter) + remainder;
+  return TRUE;
 }
 
 EphyGSBThreatList *
@@ -451,7 +473,8 @@ ephy_gsb_utils_make_full_hashes_request (GList *threat_lists,
  * ephy_gsb_utils_rice_delta_decode:
  * @rde: a RiceDeltaEncoding object as a #JsonObject
  * @num_items: out parameter for the length of the returned array. This will be
- *             equal to 1 + RiceDeltaEncoding.numEntries
+ *             equal to 1 + RiceDeltaEncoding.numEntries, unless the encoded
+ *             data is malformed
  *
  * Decompress the Rice-encoded data of a ThreatEntrySet received from a
  * threatListUpdates:fetch response.
@@ -465,7 +488,7 @@ guint32 *
 ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
                                   gsize      *num_items)
 {
-  EphyGSBRiceDecoder *decoder;
+  EphyGSBRiceDecoder decoder;
   const char *data_b64 = NULL;
   const char *first_value_str = NULL;
   guint32 *items;
@@ -486,8 +509,9 @@ ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
   if (json_object_has_member (rde, "encodedData"))
     data_b64 = json_object_get_string_member (rde, "encodedData");
 
-  *num_items = 1 + num_entries;
-  items = g_malloc (*num_items * sizeof (guint32));
+  /* Decode straight into the array, sized up front from numEntries. */
+  *num_items = 1;
+  items = g_malloc ((1 + num_entries) * sizeof (guint32));
   items[0] = first_value_str ? g_ascii_strtoull (first_value_str, NULL, 10) : 0;
 
   if (num_entries == 0)
@@ -498,13 +522,22 @@ ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
     return items;
 
   data = g_base64_decode (data_b64, &data_len);
-  decoder = ephy_gsb_rice_decoder_new (data, data_len, parameter);
+  ephy_gsb_rice_decoder_init (&decoder, data, data_len, parameter);
+
+  for (; *num_items <= num_entries; (*num_items)++) {
+    guint32 delta;
+
+    if (!ephy_gsb_rice_decoder_next (&decoder, &delta)) {
+      /* The checksum of the list will not match, so it gets cleared anyway. */
+      g_warning ("Rice-encoded data ends after %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " entries",
+                 *num_items - 1, num_entries);
+      break;
+    }
 
-  for (gsize i = 1; i <= num_entries; i++)
-    items[i] = items[i - 1] + ephy_gsb_rice_decoder_next (decoder);
+    items[*num_items] = items[*num_items - 1] + delta;
+  }
 
   g_free (data);
-  ephy_gsb_rice_decoder_free (decoder);
 
   return items;
 }
@@ -512,31 +545,37 @@ ephy_gsb_utils_rice_delta_decode (JsonObject *rde,
 static char *
 ephy_gsb_utils_full_unescape (const char *part)
 {
-  char *prev;
-  char *prev_prev;
   char *retval;
-  int attempts = 0;
 
   g_assert (part);
 
-  prev = g_strdup (part);
-  retval = soup_uri_decode (part);
+  retval = g_strdup (part);
 
   /* Iteratively unescape the string until it cannot be unescaped anymore.
    * This is useful for strings that have been escaped multiple times.
+   * Decoding never changes a string without escapes, so stop as soon as
+   * there are none left.
    */
-  while (g_strcmp0 (prev, retval) != 0 && attempts++ < MAX_UNESCAPE_STEP) {
-    prev_prev = prev;
-    prev = retval;
-    retval = soup_uri_decode (retval);
-    g_free (prev_prev);
-  }
+  for (int attempts = 0; attempts <= MAX_UNESCAPE_STEP && strchr (retval, '%'); attempts++) {
+    char *decoded = soup_uri_decode (retval);
+    gboolean done = strcmp (decoded, retval) == 0;
+
+    g_free (retval);
+    retval = decoded;
 
-  g_free (prev);
+    if (done)
+      break;
+  }
 
   return retval;
 }
 
+static inline gboolean
+ephy_gsb_utils_needs_escape (guchar c)
+{
+  return c < 0x20 || c >= 0x7f || c == ' ' || c == '#' || c == '%';
+}
+
 static char *
 ephy_gsb_utils_escape (const char *part)
 {
@@ -545,13 +584,13 @@ ephy_gsb_utils_escape (const char *part)
 
   g_assert (part);
 
-  str = g_string_new (NULL);
+  str = g_string_sized_new (strlen (part));
 
   /* Use this instead of soup_uri_encode() because that escapes other
    * characters that we don't want to be escaped.
    */
   while (*s) {
-    if (*s < 0x20 || *s >= 0x7f || *s == ' ' || *s == '#' || *s == '%')
+    if (ephy_gsb_utils_needs_escape (*s))
       g_string_append_printf (str, "%%%02X", *s++);
     else
       g_string_append_c (str, *s++);
@@ -563,11 +602,21 @@ ephy_gsb_utils_escape (const char *part)
 static char *
 ephy_gsb_utils_normalize_escape (const char *part)
 {
+  const guchar *s;
   char *tmp;
   char *retval;
 
   g_assert (part);
 
+  /* Most hosts and paths are plain ASCII without escapes, and those are
+   * already normalized. Since '%' itself needs escaping, this also means
+   * there is nothing to unescape.
+   */
+  for (s = (const guchar *)part; *s && !ephy_gsb_utils_needs_escape (*s); s++)
+    ;
+  if (!*s)
+    return g_strdup (part);
+
   /* Perform a full unescape and then escape the string exactly once. */
   tmp = ephy_gsb_utils_full_unescape (part);
   retval = ephy_gsb_utils_escape (tmp);
@@ -581,18 +630,27 @@ static char *
 ephy_gsb_utils_canonicalize_host (const char *host)
 {
   struct in_addr addr;
-  char *tmp;
-  char *trimmed;
+  const char *start;
+  const char *end;
   char *retval;
+  char *p;
 
   g_assert (host);
 
-  trimmed = g_strdup (host);
-  ephy_string_remove_leading (trimmed, '.');
-  ephy_string_remove_trailing (trimmed, '.');
-
-  /* This actually replaces groups of consecutive dots with a single dot. */
-  tmp = ephy_string_find_and_replace (trimmed, "..", ".");
+  /* Remove leading and trailing dots and replace groups of consecutive dots
+   * with a single dot, all in one pass over a single copy.
+   */
+  for (start = host; *start == '.'; start++)
+    ;
+  for (end = start + strlen (start); end > start && end[-1] == '.'; end--)
+    ;
+
+  retval = p = g_malloc (end - start + 1);
+  for (const char *s = start; s < end; s++) {
+    if (*s != '.' || s[-1] != '.')
+      *p++ = *s;
+  }
+  *p = '\0';
 
   /* If host is as an IP address, normalize it to 4 dot-separated decimal values.
    * If host is not an IP address, then it's a string and needs to be lowercased.
@@ -600,14 +658,13 @@ ephy_gsb_utils_canonicalize_host (const char *host)
    * inet_aton() handles octal, hex and fewer than 4 components addresses.
    * See https://linux.die.net/man/3/inet_network
    */
-  if (inet_aton (tmp, &addr) != 0) {
-    retval = g_strdup (inet_ntoa (addr));
-  } else {
-    retval = g_ascii_strdown (tmp, -1);
+  if (inet_aton (retval, &addr) != 0) {
+    g_free (retval);
+    return g_strdup (inet_ntoa (addr));
   }
 
-  g_free (trimmed);
-  g_free (tmp);
+  for (p = retval; *p; p++)
+    *p = g_ascii_tolower (*p);
 
   return retval;
 }
@@ -680,7 +737,10 @@ ephy_gsb_utils_canonicalize (const char  *url,
 
   /* Canonicalize path. "/../" and "/./" have already been resolved by soup_uri_new(). */
   path = ephy_gsb_utils_normalize_escape (soup_uri_get_path (uri));
-  path_canonical = ephy_string_find_and_replace (path, "//", "/");
+  if (strstr (path, "//"))
+    path_canonical = ephy_string_find_and_replace (path, "//", "/");
+  else
+    path_canonical = g_steal_pointer (&path);
 
   /* Combine all parts. */
   query = soup_uri_get_query (uri);
@@ -713,86 +773,96 @@ ephy_gsb_utils_canonicalize (const char  *url,
 
 /*
  * https://developers.google.com/safe-browsing/v4/urls-hashing#suffixprefix-expressions
+ *
+ * Every host suffix is a tail of @host, so @suffixes points into @host
+ * instead of holding copies. Returns the number of suffixes.
  */
-static GList *
-ephy_gsb_utils_compute_host_suffixes (const char *host)
+static guint
+ephy_gsb_utils_compute_host_suffixes (const char *host,
+                                      const char *suffixes[MAX_HOST_SUFFIXES])
 {
-  GList *retval = NULL;
   struct in_addr addr;
-  char **tokens;
-  int steps;
-  int start;
-  int num_tokens;
+  const char *tails[MAX_HOST_SUFFIXES - 1];
+  guint num_tails = 0;
+  guint num_suffixes = 0;
+  gboolean skipped_last = FALSE;
 
   g_assert (host);
 
-  retval = g_list_prepend (retval, g_strdup (host));
+  suffixes[num_suffixes++] = host;
 
   /* If host is an IP address, return immediately. */
   if (inet_aton (host, &addr) != 0)
-    return retval;
+    return num_suffixes;
 
-  tokens = g_strsplit (host, ".", -1);
-  num_tokens = g_strv_length (tokens);
-  start = MAX (num_tokens - MAX_HOST_SUFFIXES, 1);
-  steps = MIN (num_tokens - 1 - start, MAX_HOST_SUFFIXES - 1);
+  /* Walk back over the last dots. The one before the top-level domain is
+   * skipped, since the top-level domain alone is not a valid suffix.
+   */
+  for (const char *p = host + strlen (host); p > host && num_tails < G_N_ELEMENTS (tails); p--) {
+    if (p[-1] != '.')
+      continue;
 
-  for (int i = start; i < start + steps; i++)
-    retval = g_list_prepend (retval, g_strjoinv (".", tokens + i));
+    if (skipped_last)
+      tails[num_tails++] = p;
+    skipped_last = TRUE;
+  }
 
-  g_strfreev (tokens);
+  /* Longer suffixes come first. */
+  while (num_tails > 0)
+    suffixes[num_suffixes++] = tails[--num_tails];
 
-  return g_list_reverse (retval);
+  return num_suffixes;
 }
 
+typedef struct {
+  gsize len;
+  gboolean with_query;
+} EphyGSBPathPrefix;
+
 /*
  * https://developers.google.com/safe-browsing/v4/urls-hashing#suffixprefix-expressions
+ *
+ * Every path prefix is a head of @path, optionally followed by the query, so
+ * only its length is stored in @prefixes. Returns the number of prefixes.
  */
-static GList *
-ephy_gsb_utils_compute_path_prefixes (const char *path,
-                                      const char *query)
+static guint
+ephy_gsb_utils_compute_path_prefixes (const char        *path,
+                                      gboolean           has_query,
+                                      EphyGSBPathPrefix  prefixes[MAX_PATH_PREFIXES])
 {
-  GList *retval = NULL;
-  char *no_trailing;
-  char **tokens;
-  int steps;
-  int num_tokens;
-  int no_trailing_len;
-  gboolean has_trailing;
+  const char *p;
+  gsize path_len;
+  guint num_prefixes = 0;
+  guint num_dirs = 0;
 
   g_assert (path);
 
-  if (query)
-    retval = g_list_prepend (retval, g_strjoin ("?", path, query, NULL));
-  retval = g_list_prepend (retval, g_strdup (path));
-
-  if (!g_strcmp0 (path, "/"))
-    return retval;
+  path_len = strlen (path);
 
-  has_trailing = path[strlen (path) - 1] == '/';
-  no_trailing = ephy_string_remove_trailing (g_strdup (path), '/');
-  no_trailing_len = strlen (no_trailing);
-
-  tokens = g_strsplit (no_trailing, "/", -1);
-  num_tokens = g_strv_length (tokens);
-  steps = MIN (num_tokens, MAX_PATH_PREFIXES - 2);
+  if (!g_strcmp0 (path, "/")) {
+    prefixes[num_prefixes++] = (EphyGSBPathPrefix){ path_len, FALSE };
+    if (has_query)
+      prefixes[num_prefixes++] = (EphyGSBPathPrefix){ path_len, TRUE };
+    return num_prefixes;
+  }
 
-  for (int i = 0; i < steps; i++) {
-    char *value = g_strconcat (i > 0 ? retval->data : "", tokens[i], "/", NULL);
+  if (has_query)
+    prefixes[num_prefixes++] = (EphyGSBPathPrefix){ path_len, TRUE };
+  prefixes[num_prefixes++] = (EphyGSBPathPrefix){ path_len, FALSE };
 
-    if ((has_trailing && !g_strcmp0 (value, path)) ||
-        (!has_trailing && !strncmp (value, no_trailing, no_trailing_len))) {
-      g_free (value);
+  /* The directories are the heads of the path up to each slash. A slash at
+   * the very end gives the path itself, which is already there.
+   */
+  for (p = path; num_dirs < MAX_PATH_PREFIXES - 2; p++) {
+    p = memchr (p, '/', path_len - 1 - (p - path));
+    if (!p)
       break;
-    }
 
-    retval = g_list_prepend (retval, value);
+    prefixes[num_prefixes++] = (EphyGSBPathPrefix){ p - path + 1, FALSE };
+    num_dirs++;
   }
 
-  g_free (no_trailing);
-  g_strfreev (tokens);
-
-  return g_list_reverse (retval);
+  return num_prefixes;
 }
 
 /**
@@ -813,13 +883,15 @@ ephy_gsb_utils_compute_hashes (const char *url)
 {
   GChecksum *checksum;
   GList *retval = NULL;
-  GList *host_suffixes;
-  GList *path_prefixes;
+  const char *host_suffixes[MAX_HOST_SUFFIXES];
+  EphyGSBPathPrefix path_prefixes[MAX_PATH_PREFIXES];
+  guint num_host_suffixes;
+  guint num_path_prefixes;
   char *url_canonical;
   char *host = NULL;
   char *path = NULL;
   char *query = NULL;
-  gsize hash_len = GSB_HASH_SIZE;
+  gsize query_len = 0;
 
   g_assert (url);
 
@@ -827,25 +899,34 @@ ephy_gsb_utils_compute_hashes (const char *url)
   if (!url_canonical)
     return NULL;
 
-  host_suffixes = ephy_gsb_utils_compute_host_suffixes (host);
-  path_prefixes = ephy_gsb_utils_compute_path_prefixes (path, query);
+  if (query)
+    query_len = strlen (query);
+
+  num_host_suffixes = ephy_gsb_utils_compute_host_suffixes (host, host_suffixes);
+  num_path_prefixes = ephy_gsb_utils_compute_path_prefixes (path, !!query, path_prefixes);
   checksum = g_checksum_new (G_CHECKSUM_SHA256);
 
   /* Get the hash of every host-path combination.
    * The maximum number of combinations is MAX_HOST_SUFFIXES * MAX_PATH_PREFIXES.
+   * The expressions are fed to the checksum piece by piece, so they never
+   * need to be put together in memory.
    */
-  for (GList *h = host_suffixes; h && h->data; h = h->next) {
-    for (GList *p = path_prefixes; p && p->data; p = p->next) {
-      char *value = g_strconcat (h->data, p->data, NULL);
-      guint8 *hash = g_malloc (hash_len);
+  for (guint h = 0; h < num_host_suffixes; h++) {
+    gsize host_suffix_len = strlen (host_suffixes[h]);
+
+    for (guint p = 0; p < num_path_prefixes; p++) {
+      guint8 hash[GSB_HASH_LEN];
+      gsize hash_len = GSB_HASH_LEN;
 
       g_checksum_reset (checksum);
-      g_checksum_update (checksum, (const guint8 *)value, strlen (value));
+      g_checksum_update (checksum, (const guint8 *)host_suffixes[h], host_suffix_len);
+      g_checksum_update (checksum, (const guint8 *)path, path_prefixes[p].len);
+      if (path_prefixes[p].with_query) {
+        g_checksum_update (checksum, (const guint8 *)"?", 1);
+        g_checksum_update (checksum, (const guint8 *)query, query_len);
+      }
       g_checksum_get_digest (checksum, hash, &hash_len);
       retval = g_list_prepend (retval, g_bytes_new (hash, hash_len));
-
-      g_free (hash);
-      g_free (value);
     }
   }
 
@@ -854,8 +935,6 @@ ephy_gsb_utils_compute_hashes (const char *url)
   g_free (query);
   g_free (url_canonical);
   g_checksum_free (checksum);
-  g_list_free_full (host_suffixes, g_free);
-  g_list_free_full (path_prefixes, g_free);
 
   return g_list_reverse (retval);
 }
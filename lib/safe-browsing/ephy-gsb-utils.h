@@ -30,6 +30,8 @@ G_BEGIN_DECLS
 
 #define GSB_HASH_TYPE G_CHECKSUM_SHA256
 #define GSB_HASH_SIZE (g_checksum_type_get_length (GSB_HASH_TYPE))
+/* The same as GSB_HASH_SIZE, but usable as an array size. */
+#define GSB_HASH_LEN  32
 
 #define GSB_COMPRESSION_TYPE_RAW         "RAW"
 #define GSB_COMPRESSION_TYPE_RICE        "RICE"
@@ -0,0 +1,627 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-gsb-verdict-cache.h"
+
+#include <string.h>
+
+/* The cache remembers the answers to fullHashes:find requests, by the hash
+ * prefix that was asked for: the full hashes that begin with the prefix, each
+ * with its positive cache expiration time, and how long no other full hash
+ * begins with the prefix, which is the negative cache expiration time.
+ *
+ * Entries are dropped once both have expired, using a timing wheel: every
+ * entry sits in the slot of the tick it expires in, so expiring entries only
+ * looks at the slots of the ticks that went by since the last time.
+ */
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK  16 /* seconds */
+
+#define VERDICT_CACHE_MAGIC      "EPHYGSBV"
+#define VERDICT_CACHE_VERSION    1
+#define VERDICT_CACHE_BYTE_ORDER G_BYTE_ORDER
+
+/* Matches are stored as an index into this table, which holds every threat
+ * type of the threat lists in ephy-gsb-storage.c.
+ */
+static const char * const threat_types[] = {
+  GSB_THREAT_TYPE_MALWARE,
+  GSB_THREAT_TYPE_SOCIAL_ENGINEERING,
+  GSB_THREAT_TYPE_UNWANTED_SOFTWARE,
+};
+
+typedef struct {
+  guint8 hash[GSB_HASH_LEN];
+  guint8 threat_type;
+  gint64 expires_at;
+} CacheMatch;
+
+typedef struct {
+  guint8 prefix[GSB_HASH_LEN];
+  guint8 prefix_len;
+  guint8 n_matches;
+  CacheMatch *matches;
+  gint64 negative_expires_at;
+  gint64 expires_at;
+  GList link;
+} CacheEntry;
+
+typedef struct {
+  char magic[8];
+  guint32 version;
+  guint32 byte_order;
+  guint64 serial;
+  guint32 n_entries;
+  guint32 padding;
+} CacheHeader;
+
+struct _EphyGSBVerdictCache {
+  GMutex lock;
+  GHashTable *entries;
+
+  /* Bit n is set if an entry may have a prefix of n bytes, so that lookups
+   * only try those lengths.
+   */
+  guint64 prefix_lens;
+
+  GQueue wheel[WHEEL_SLOTS];
+  gint64 wheel_tick;
+};
+
+GQuark
+ephy_gsb_verdict_cache_error_quark (void)
+{
+  return g_quark_from_static_string ("ephy-gsb-verdict-cache-error-quark");
+}
+
+static guint
+cache_entry_hash (gconstpointer key)
+{
+  const CacheEntry *entry = key;
+  guint32 value;
+
+  /* Hash prefixes are random, their first bytes are as good a hash as any. */
+  memcpy (&value, entry->prefix, sizeof (value));
+  return value ^ entry->prefix_len;
+}
+
+static gboolean
+cache_entry_equal (gconstpointer a,
+                   gconstpointer b)
+{
+  const CacheEntry *entry_a = a;
+  const CacheEntry *entry_b = b;
+
+  return entry_a->prefix_len == entry_b->prefix_len &&
+         memcmp (entry_a->prefix, entry_b->prefix, entry_a->prefix_len) == 0;
+}
+
+static void
+cache_entry_free (CacheEntry *entry)
+{
+  g_free (entry->matches);
+  g_free (entry);
+}
+
+static inline GQueue *
+wheel_slot (EphyGSBVerdictCache *cache,
+            gint64               time)
+{
+  return &cache->wheel[(guint64)(time / WHEEL_TICK) % WHEEL_SLOTS];
+}
+
+static void
+ephy_gsb_verdict_cache_remove_entry (EphyGSBVerdictCache *cache,
+                                     CacheEntry          *entry)
+{
+  g_queue_unlink (wheel_slot (cache, entry->expires_at), &entry->link);
+  g_hash_table_remove (cache->entries, entry);
+}
+
+static void
+ephy_gsb_verdict_cache_add_entry (EphyGSBVerdictCache *cache,
+                                  CacheEntry          *entry)
+{
+  CacheEntry *old_entry;
+
+  old_entry = g_hash_table_lookup (cache->entries, entry);
+  if (old_entry)
+    ephy_gsb_verdict_cache_remove_entry (cache, old_entry);
+
+  entry->link.data = entry;
+  g_queue_push_tail_link (wheel_slot (cache, entry->expires_at), &entry->link);
+  g_hash_table_add (cache->entries, entry);
+  cache->prefix_lens |= G_GUINT64_CONSTANT (1) << entry->prefix_len;
+}
+
+/* Drops the entries that expired before the current tick. Entries that
+ * expire later in the current tick are kept for now, lookups check the
+ * expiration times anyway.
+ */
+static void
+ephy_gsb_verdict_cache_expire (EphyGSBVerdictCache *cache,
+                               gint64               now)
+{
+  gint64 tick = now / WHEEL_TICK;
+  gint64 first_tick = cache->wheel_tick;
+
+  if (first_tick >= tick)
+    return;
+
+  /* Every slot is swept at most once. */
+  if (tick - first_tick > WHEEL_SLOTS)
+    first_tick = tick - WHEEL_SLOTS;
+
+  for (gint64 t = first_tick; t < tick; t++) {
+    GList *l = cache->wheel[(guint64)t % WHEEL_SLOTS].head;
+
+    while (l) {
+      CacheEntry *entry = l->data;
+
+      /* Entries of later turns of the wheel share the slot. */
+      l = l->next;
+      if (entry->expires_at < tick * WHEEL_TICK)
+        ephy_gsb_verdict_cache_remove_entry (cache, entry);
+    }
+  }
+
+  cache->wheel_tick = tick;
+}
+
+static void
+ephy_gsb_verdict_cache_clear_locked (EphyGSBVerdictCache *cache)
+{
+  for (guint i = 0; i < WHEEL_SLOTS; i++)
+    g_queue_init (&cache->wheel[i]);
+  g_hash_table_remove_all (cache->entries);
+  cache->prefix_lens = 0;
+}
+
+EphyGSBVerdictCache *
+ephy_gsb_verdict_cache_new (void)
+{
+  EphyGSBVerdictCache *cache;
+
+  cache = g_new0 (EphyGSBVerdictCache, 1);
+  g_mutex_init (&cache->lock);
+  cache->entries = g_hash_table_new_full (cache_entry_hash, cache_entry_equal,
+                                          (GDestroyNotify)cache_entry_free, NULL);
+  for (guint i = 0; i < WHEEL_SLOTS; i++)
+    g_queue_init (&cache->wheel[i]);
+
+  return cache;
+}
+
+void
+ephy_gsb_verdict_cache_free (EphyGSBVerdictCache *cache)
+{
+  g_assert (cache);
+
+  g_hash_table_unref (cache->entries);
+  g_mutex_clear (&cache->lock);
+  g_free (cache);
+}
+
+static int
+threat_type_index (const char *threat_type)
+{
+  for (guint i = 0; i < G_N_ELEMENTS (threat_types); i++) {
+    if (!g_strcmp0 (threat_types[i], threat_type))
+      return i;
+  }
+
+  return -1;
+}
+
+/**
+ * ephy_gsb_verdict_cache_insert:
+ * @cache: an #EphyGSBVerdictCache
+ * @prefix: the hash prefix that full hashes were requested for
+ * @prefix_len: the length of @prefix
+ * @negative_expires_at: until when no full hash other than @matches begins
+ *   with @prefix
+ * @matches: the full hashes of the response
+ * @n_matches: the number of elements in @matches
+ * @now: the current time, in seconds
+ *
+ * Remember the response of a fullHashes:find request for @prefix, replacing
+ * any previous one. Only the elements of @matches that begin with @prefix are
+ * kept, so @matches can be the full hashes returned for a whole request.
+ **/
+void
+ephy_gsb_verdict_cache_insert (EphyGSBVerdictCache       *cache,
+                               const guint8              *prefix,
+                               gsize                      prefix_len,
+                               gint64                     negative_expires_at,
+                               const EphyGSBVerdictMatch *matches,
+                               guint                      n_matches,
+                               gint64                     now)
+{
+  CacheEntry *entry;
+  GArray *entry_matches;
+
+  g_assert (cache);
+  g_assert (prefix);
+  g_assert (matches || n_matches == 0);
+
+  if (prefix_len < GSB_HASH_CUE_LEN || prefix_len > GSB_HASH_LEN)
+    return;
+
+  entry = g_new0 (CacheEntry, 1);
+  memcpy (entry->prefix, prefix, prefix_len);
+  entry->prefix_len = prefix_len;
+  entry->negative_expires_at = negative_expires_at;
+  entry->expires_at = negative_expires_at;
+
+  entry_matches = g_array_new (FALSE, FALSE, sizeof (CacheMatch));
+  for (guint i = 0; i < n_matches; i++) {
+    CacheMatch match;
+    int threat_type;
+
+    if (memcmp (matches[i].hash, prefix, prefix_len) != 0)
+      continue;
+
+    /* Without the threat type, the verdict must come from the database. */
+    threat_type = threat_type_index (matches[i].threat_type);
+    if (threat_type < 0 || entry_matches->len == G_MAXUINT8) {
+      entry->expires_at = 0;
+      break;
+    }
+
+    memcpy (match.hash, matches[i].hash, GSB_HASH_LEN);
+    match.threat_type = threat_type;
+    match.expires_at = matches[i].expires_at;
+    g_array_append_val (entry_matches, match);
+    entry->expires_at = MAX (entry->expires_at, match.expires_at);
+  }
+
+  entry->n_matches = entry_matches->len;
+  entry->matches = (CacheMatch *)g_array_free (entry_matches, entry->n_matches == 0);
+
+  g_mutex_lock (&cache->lock);
+
+  ephy_gsb_verdict_cache_expire (cache, now);
+
+  if (entry->expires_at > now) {
+    ephy_gsb_verdict_cache_add_entry (cache, entry);
+  } else {
+    CacheEntry *old_entry = g_hash_table_lookup (cache->entries, entry);
+
+    if (old_entry)
+      ephy_gsb_verdict_cache_remove_entry (cache, old_entry);
+    cache_entry_free (entry);
+  }
+
+  g_mutex_unlock (&cache->lock);
+}
+
+/**
+ * ephy_gsb_verdict_cache_lookup:
+ * @cache: an #EphyGSBVerdictCache
+ * @hash: a full hash
+ * @now: the current time, in seconds
+ * @threats: (inout): a #GList of threat types
+ *
+ * Look for the verdict on @hash in the responses to previous fullHashes:find
+ * requests. If @hash is unsafe, the threat types of its unexpired full hash
+ * matches are added to @threats, unless already there.
+ *
+ * Return value: %EPHY_GSB_VERDICT_UNKNOWN if the server has to be asked
+ **/
+EphyGSBVerdict
+ephy_gsb_verdict_cache_lookup (EphyGSBVerdictCache  *cache,
+                               const guint8         *hash,
+                               gint64                now,
+                               GList               **threats)
+{
+  CacheEntry key;
+  gboolean is_safe = FALSE;
+  gboolean is_unsafe = FALSE;
+  gboolean has_expired_match = FALSE;
+
+  g_assert (cache);
+  g_assert (hash);
+  g_assert (threats);
+
+  memcpy (key.prefix, hash, GSB_HASH_LEN);
+
+  g_mutex_lock (&cache->lock);
+
+  ephy_gsb_verdict_cache_expire (cache, now);
+
+  for (guint len = GSB_HASH_CUE_LEN; len <= GSB_HASH_LEN; len++) {
+    CacheEntry *entry;
+    gboolean has_match = FALSE;
+
+    if (!(cache->prefix_lens & (G_GUINT64_CONSTANT (1) << len)))
+      continue;
+
+    key.prefix_len = len;
+    entry = g_hash_table_lookup (cache->entries, &key);
+    if (!entry)
+      continue;
+
+    for (guint i = 0; i < entry->n_matches; i++) {
+      const CacheMatch *match = &entry->matches[i];
+      const char *threat_type = threat_types[match->threat_type];
+
+      if (memcmp (match->hash, hash, GSB_HASH_LEN) != 0)
+        continue;
+
+      has_match = TRUE;
+      if (match->expires_at <= now) {
+        has_expired_match = TRUE;
+      } else {
+        is_unsafe = TRUE;
+        if (!g_list_find_custom (*threats, threat_type, (GCompareFunc)g_strcmp0))
+          *threats = g_list_append (*threats, g_strdup (threat_type));
+      }
+    }
+
+    if (!has_match && entry->negative_expires_at > now)
+      is_safe = TRUE;
+  }
+
+  g_mutex_unlock (&cache->lock);
+
+  if (is_unsafe)
+    return EPHY_GSB_VERDICT_UNSAFE;
+
+  if (is_safe && !has_expired_match)
+    return EPHY_GSB_VERDICT_SAFE;
+
+  return EPHY_GSB_VERDICT_UNKNOWN;
+}
+
+guint
+ephy_gsb_verdict_cache_get_size (EphyGSBVerdictCache *cache)
+{
+  guint size;
+
+  g_assert (cache);
+
+  g_mutex_lock (&cache->lock);
+  size = g_hash_table_size (cache->entries);
+  g_mutex_unlock (&cache->lock);
+
+  return size;
+}
+
+/**
+ * ephy_gsb_verdict_cache_clear:
+ * @cache: an #EphyGSBVerdictCache
+ *
+ * Forget all responses. Use this when the hash prefixes of the threat lists
+ * change, since a cached verdict may not hold for the new ones.
+ **/
+void
+ephy_gsb_verdict_cache_clear (EphyGSBVerdictCache *cache)
+{
+  g_assert (cache);
+
+  g_mutex_lock (&cache->lock);
+  ephy_gsb_verdict_cache_clear_locked (cache);
+  g_mutex_unlock (&cache->lock);
+}
+
+static inline gboolean
+read_data (const guint8 **data,
+           const guint8  *end,
+           gpointer       dest,
+           gsize          size)
+{
+  if ((gsize)(end - *data) < size)
+    return FALSE;
+
+  memcpy (dest, *data, size);
+  *data += size;
+
+  return TRUE;
+}
+
+static gboolean
+ephy_gsb_verdict_cache_read_entry (EphyGSBVerdictCache  *cache,
+                                   const guint8        **data,
+                                   const guint8         *end,
+                                   gint64                now)
+{
+  CacheEntry *entry;
+
+  entry = g_new0 (CacheEntry, 1);
+
+  if (!read_data (data, end, &entry->prefix_len, 1) ||
+      !read_data (data, end, &entry->n_matches, 1) ||
+      entry->prefix_len < GSB_HASH_CUE_LEN || entry->prefix_len > GSB_HASH_LEN ||
+      !read_data (data, end, entry->prefix, entry->prefix_len) ||
+      !read_data (data, end, &entry->negative_expires_at, sizeof (gint64))) {
+    cache_entry_free (entry);
+    return FALSE;
+  }
+
+  entry->expires_at = entry->negative_expires_at;
+  if (entry->n_matches > 0)
+    entry->matches = g_new (CacheMatch, entry->n_matches);
+
+  for (guint i = 0; i < entry->n_matches; i++) {
+    CacheMatch *match = &entry->matches[i];
+
+    if (!read_data (data, end, match->hash, GSB_HASH_LEN) ||
+        !read_data (data, end, &match->threat_type, 1) ||
+        !read_data (data, end, &match->expires_at, sizeof (gint64)) ||
+        match->threat_type >= G_N_ELEMENTS (threat_types)) {
+      cache_entry_free (entry);
+      return FALSE;
+    }
+
+    entry->expires_at = MAX (entry->expires_at, match->expires_at);
+  }
+
+  if (entry->expires_at > now)
+    ephy_gsb_verdict_cache_add_entry (cache, entry);
+  else
+    cache_entry_free (entry);
+
+  return TRUE;
+}
+
+/**
+ * ephy_gsb_verdict_cache_load:
+ * @cache: an #EphyGSBVerdictCache
+ * @path: the path of a cache written by ephy_gsb_verdict_cache_save()
+ * @serial: the serial @path must have been saved with
+ * @now: the current time, in seconds
+ * @error: return location for a #GError
+ *
+ * Replace the content of @cache with the responses saved at @path that have
+ * not expired yet. On error, @cache is left empty.
+ *
+ * Return value: %TRUE on success
+ **/
+gboolean
+ephy_gsb_verdict_cache_load (EphyGSBVerdictCache  *cache,
+                             const char           *path,
+                             guint64               serial,
+                             gint64                now,
+                             GError              **error)
+{
+  CacheHeader header;
+  const guint8 *data;
+  const guint8 *end;
+  char *contents;
+  gsize length;
+  gboolean retval = TRUE;
+
+  g_assert (cache);
+  g_assert (path);
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return FALSE;
+
+  data = (const guint8 *)contents;
+  end = data + length;
+
+  g_mutex_lock (&cache->lock);
+
+  ephy_gsb_verdict_cache_clear_locked (cache);
+  cache->wheel_tick = now / WHEEL_TICK;
+
+  if (!read_data (&data, end, &header, sizeof (header)) ||
+      memcmp (header.magic, VERDICT_CACHE_MAGIC, sizeof (header.magic)) != 0 ||
+      header.version != VERDICT_CACHE_VERSION ||
+      header.byte_order != VERDICT_CACHE_BYTE_ORDER ||
+      header.serial != serial) {
+    g_set_error_literal (error,
+                         EPHY_GSB_VERDICT_CACHE_ERROR,
+                         EPHY_GSB_VERDICT_CACHE_ERROR_INVALID,
+                         "Verdict cache is out of date or was written by a different version");
+    retval = FALSE;
+    goto out;
+  }
+
+  for (guint32 i = 0; i < header.n_entries; i++) {
+    if (!ephy_gsb_verdict_cache_read_entry (cache, &data, end, now)) {
+      g_set_error_literal (error,
+                           EPHY_GSB_VERDICT_CACHE_ERROR,
+                           EPHY_GSB_VERDICT_CACHE_ERROR_INVALID,
+                           "Verdict cache is corrupted");
+      ephy_gsb_verdict_cache_clear_locked (cache);
+      retval = FALSE;
+      goto out;
+    }
+  }
+
+out:
+  g_mutex_unlock (&cache->lock);
+  g_free (contents);
+
+  return retval;
+}
+
+/**
+ * ephy_gsb_verdict_cache_save:
+ * @cache: an #EphyGSBVerdictCache
+ * @path: where to save @cache
+ * @serial: a number identifying the threat lists the responses apply to
+ * @now: the current time, in seconds
+ * @error: return location for a #GError
+ *
+ * Write the responses in @cache that have not expired yet atomically to
+ * @path, to be read by ephy_gsb_verdict_cache_load().
+ *
+ * Return value: %TRUE on success
+ **/
+gboolean
+ephy_gsb_verdict_cache_save (EphyGSBVerdictCache  *cache,
+                             const char           *path,
+                             guint64               serial,
+                             gint64                now,
+                             GError              **error)
+{
+  CacheHeader header = { { 0 } };
+  GHashTableIter iter;
+  CacheEntry *entry;
+  GByteArray *data;
+  gboolean retval;
+
+  g_assert (cache);
+  g_assert (path);
+
+  memcpy (header.magic, VERDICT_CACHE_MAGIC, sizeof (header.magic));
+  header.version = VERDICT_CACHE_VERSION;
+  header.byte_order = VERDICT_CACHE_BYTE_ORDER;
+  header.serial = serial;
+
+  data = g_byte_array_new ();
+  g_byte_array_append (data, (const guint8 *)&header, sizeof (header));
+
+  g_mutex_lock (&cache->lock);
+
+  ephy_gsb_verdict_cache_expire (cache, now);
+
+  g_hash_table_iter_init (&iter, cache->entries);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&entry, NULL)) {
+    if (entry->expires_at <= now)
+      continue;
+
+    g_byte_array_append (data, &entry->prefix_len, 1);
+    g_byte_array_append (data, &entry->n_matches, 1);
+    g_byte_array_append (data, entry->prefix, entry->prefix_len);
+    g_byte_array_append (data, (const guint8 *)&entry->negative_expires_at, sizeof (gint64));
+
+    for (guint i = 0; i < entry->n_matches; i++) {
+      const CacheMatch *match = &entry->matches[i];
+
+      g_byte_array_append (data, match->hash, GSB_HASH_LEN);
+      g_byte_array_append (data, &match->threat_type, 1);
+      g_byte_array_append (data, (const guint8 *)&match->expires_at, sizeof (gint64));
+    }
+
+    header.n_entries++;
+  }
+
+  g_mutex_unlock (&cache->lock);
+
+  memcpy (data->data + G_STRUCT_OFFSET (CacheHeader, n_entries), &header.n_entries, sizeof (guint32));
+  retval = g_file_set_contents (path, (const char *)data->data, data->len, error);
+  g_byte_array_free (data, TRUE);
+
+  return retval;
+}
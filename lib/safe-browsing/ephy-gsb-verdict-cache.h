@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "ephy-gsb-utils.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EPHY_GSB_VERDICT_CACHE_ERROR (ephy_gsb_verdict_cache_error_quark ())
+
+typedef enum {
+  EPHY_GSB_VERDICT_CACHE_ERROR_INVALID
+} EphyGSBVerdictCacheError;
+
+typedef enum {
+  EPHY_GSB_VERDICT_UNKNOWN,
+  EPHY_GSB_VERDICT_SAFE,
+  EPHY_GSB_VERDICT_UNSAFE
+} EphyGSBVerdict;
+
+typedef struct {
+  guint8      hash[GSB_HASH_LEN];
+  const char *threat_type;
+  gint64      expires_at;
+} EphyGSBVerdictMatch;
+
+typedef struct _EphyGSBVerdictCache EphyGSBVerdictCache;
+
+GQuark               ephy_gsb_verdict_cache_error_quark (void);
+
+EphyGSBVerdictCache *ephy_gsb_verdict_cache_new         (void);
+void                 ephy_gsb_verdict_cache_free        (EphyGSBVerdictCache       *cache);
+
+void                 ephy_gsb_verdict_cache_insert      (EphyGSBVerdictCache       *cache,
+                                                         const guint8              *prefix,
+                                                         gsize                      prefix_len,
+                                                         gint64                     negative_expires_at,
+                                                         const EphyGSBVerdictMatch *matches,
+                                                         guint                      n_matches,
+                                                         gint64                     now);
+EphyGSBVerdict       ephy_gsb_verdict_cache_lookup      (EphyGSBVerdictCache       *cache,
+                                                         const guint8              *hash,
+                                                         gint64                     now,
+                                                         GList                    **threats);
+guint                ephy_gsb_verdict_cache_get_size    (EphyGSBVerdictCache       *cache);
+void                 ephy_gsb_verdict_cache_clear       (EphyGSBVerdictCache       *cache);
+
+gboolean             ephy_gsb_verdict_cache_load        (EphyGSBVerdictCache       *cache,
+                                                         const char                *path,
+                                                         guint64                    serial,
+                                                         gint64                     now,
+                                                         GError                   **error);
+gboolean             ephy_gsb_verdict_cache_save        (EphyGSBVerdictCache       *cache,
+                                                         const char                *path,
+                                                         guint64                    serial,
+                                                         gint64                     now,
+                                                         GError                   **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EphyGSBVerdictCache, ephy_gsb_verdict_cache_free)
+
+G_END_DECLS
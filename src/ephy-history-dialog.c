@@ -42,6 +42,9 @@
 
 #define NUM_FETCH_LIMIT 15
 
+/* The list holds at most this many rows, however far it is scrolled. */
+#define MAX_ROWS (NUM_FETCH_LIMIT * 6)
+
 struct _EphyHistoryDialog {
   GtkWindow parent_instance;
 
@@ -49,6 +52,7 @@ struct _EphyHistoryDialog {
   EphyHistoryService *history_service;
   GCancellable *cancellable;
 
+  GtkWidget *scrolled_window;
   GtkWidget *listbox;
   GtkWidget *forget_all_button;
   GtkWidget *popup_menu;
@@ -57,13 +61,16 @@ struct _EphyHistoryDialog {
 
   GActionGroup *action_group;
 
-  GList *urls;
-  guint sorter_source;
+  GCancellable *query_cancellable;
+  EphyHistoryQuery *query;
+  GQueue rows;
+  GPtrArray *spare_rows;
+  gboolean fetching_page;
+  gboolean has_older_pages;
+  gboolean has_newer_pages;
 
   char *search_text;
 
-  gint num_fetch;
-
   GtkWidget *confirmation_dialog;
 };
 
@@ -77,30 +84,136 @@ enum {
 
 static GParamSpec *obj_properties[LAST_PROP];
 
-static gboolean add_urls_source (EphyHistoryDialog *self);
+static GtkWidget *create_row (EphyHistoryDialog *self);
 
 static EphyHistoryURL *
 get_url_from_row (GtkListBoxRow *row)
 {
-  return ephy_history_url_new (g_object_get_data (G_OBJECT (row), "url"),
-                               g_object_get_data (G_OBJECT (row), "title"),
-                               0,
-                               0,
-                               0);
+  return ephy_history_url_copy (g_object_get_data (G_OBJECT (row), "history-url"));
+}
+
+static void
+bind_row (GtkWidget      *row,
+          EphyHistoryURL *url)
+{
+  g_autofree char *date = NULL;
+
+  g_object_set_data_full (G_OBJECT (row), "history-url",
+                          ephy_history_url_copy (url),
+                          (GDestroyNotify)ephy_history_url_free);
+
+  date = ephy_time_helpers_utf_friendly_time (url->last_visit_time / 1000000);
+
+  gtk_widget_set_tooltip_text (g_object_get_data (G_OBJECT (row), "grid"), url->url);
+  gtk_label_set_text (g_object_get_data (G_OBJECT (row), "title-label"), url->title);
+  gtk_label_set_text (g_object_get_data (G_OBJECT (row), "address-label"), url->url);
+  gtk_label_set_text (g_object_get_data (G_OBJECT (row), "date-label"), date);
+}
+
+static GtkWidget *
+take_row (EphyHistoryDialog *self)
+{
+  if (self->spare_rows->len > 0)
+    return g_ptr_array_remove_index (self->spare_rows, self->spare_rows->len - 1);
+
+  return g_object_ref_sink (create_row (self));
 }
 
 static void
-clear_listbox (GtkWidget *listbox)
+recycle_row (EphyHistoryDialog *self,
+             GtkWidget         *row)
 {
-  GList *children, *iter;
+  g_ptr_array_add (self->spare_rows, g_object_ref (row));
+  gtk_container_remove (GTK_CONTAINER (self->listbox), row);
+}
+
+static void
+insert_row (EphyHistoryDialog *self,
+            EphyHistoryURL    *url,
+            int                position)
+{
+  GtkWidget *row = take_row (self);
+
+  bind_row (row, url);
+  gtk_list_box_insert (GTK_LIST_BOX (self->listbox), row, position);
+
+  if (position == 0)
+    g_queue_push_head (&self->rows, row);
+  else
+    g_queue_push_tail (&self->rows, row);
 
-  children = gtk_container_get_children (GTK_CONTAINER (listbox));
+  g_object_unref (row);
+}
+
+static double
+get_row_height (EphyHistoryDialog *self)
+{
+  GtkAdjustment *adjustment;
+
+  if (self->rows.length == 0)
+    return 0;
+
+  adjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (self->scrolled_window));
+  return gtk_adjustment_get_upper (adjustment) / self->rows.length;
+}
 
-  for (iter = children; iter != NULL; iter = g_list_next (iter)) {
-    gtk_widget_destroy (GTK_WIDGET (iter->data));
+static void
+scroll_by (EphyHistoryDialog *self,
+           double             delta)
+{
+  GtkAdjustment *adjustment;
+
+  adjustment = gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (self->scrolled_window));
+  gtk_adjustment_set_value (adjustment, gtk_adjustment_get_value (adjustment) + delta);
+}
+
+/* Rows that scroll out of the window at one end are reused for the page that
+ * comes in at the other one, and the scroll position is moved by as much, so
+ * that the visible rows stay in place.
+ */
+static void
+append_urls (EphyHistoryDialog *self,
+             GList             *urls)
+{
+  double row_height = get_row_height (self);
+  guint n_dropped = 0;
+
+  for (GList *l = urls; l; l = l->next)
+    insert_row (self, l->data, -1);
+
+  while (self->rows.length > MAX_ROWS) {
+    recycle_row (self, g_queue_pop_head (&self->rows));
+    n_dropped++;
   }
 
-  g_list_free (children);
+  if (n_dropped > 0) {
+    self->has_newer_pages = TRUE;
+    scroll_by (self, -(n_dropped * row_height));
+  }
+
+  self->has_older_pages = g_list_length (urls) == NUM_FETCH_LIMIT;
+}
+
+static void
+prepend_urls (EphyHistoryDialog *self,
+              GList             *urls)
+{
+  double row_height = get_row_height (self);
+  guint n_added = 0;
+
+  /* These come oldest first, the one right above the window first. */
+  for (GList *l = urls; l; l = l->next) {
+    insert_row (self, l->data, 0);
+    n_added++;
+  }
+
+  while (self->rows.length > MAX_ROWS) {
+    recycle_row (self, g_queue_pop_tail (&self->rows));
+    self->has_older_pages = TRUE;
+  }
+
+  self->has_newer_pages = n_added == NUM_FETCH_LIMIT;
+  scroll_by (self, n_added * row_height);
 }
 
 static void
@@ -110,17 +223,89 @@ on_find_urls_cb (gpointer service,
                  gpointer user_data)
 {
   EphyHistoryDialog *self = EPHY_HISTORY_DIALOG (user_data);
+  GList *urls = (GList *)result_data;
+  GtkWidget *row;
+
+  self->fetching_page = FALSE;
+
+  if (success != TRUE)
+    return;
+
+  /* The rows are replaced once the first page of new results is there. */
+  while ((row = g_queue_pop_head (&self->rows)))
+    recycle_row (self, row);
+
+  self->has_newer_pages = FALSE;
+  append_urls (self, urls);
+  gtk_adjustment_set_value (gtk_scrolled_window_get_vadjustment (GTK_SCROLLED_WINDOW (self->scrolled_window)), 0);
+
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+}
+
+static void
+on_find_older_urls_cb (gpointer service,
+                       gboolean success,
+                       gpointer result_data,
+                       gpointer user_data)
+{
+  EphyHistoryDialog *self = EPHY_HISTORY_DIALOG (user_data);
+  GList *urls = (GList *)result_data;
+
+  self->fetching_page = FALSE;
+
+  if (success != TRUE)
+    return;
+
+  append_urls (self, urls);
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+}
+
+static void
+on_find_newer_urls_cb (gpointer service,
+                       gboolean success,
+                       gpointer result_data,
+                       gpointer user_data)
+{
+  EphyHistoryDialog *self = EPHY_HISTORY_DIALOG (user_data);
+  GList *urls = (GList *)result_data;
+
+  self->fetching_page = FALSE;
 
   if (success != TRUE)
     return;
 
+  prepend_urls (self, urls);
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+}
 
-  self->urls = (GList *)result_data;
+static void
+fetch_page (EphyHistoryDialog *self,
+            gboolean           newer)
+{
+  EphyHistoryQuery *query;
+  EphyHistoryURL *url;
 
-  clear_listbox (self->listbox);
+  /* Pages above the window are read in the opposite order, starting from
+   * its first row, and pages below it from its last row.
+   */
+  query = ephy_history_query_copy (self->query);
+  if (newer) {
+    url = g_object_get_data (g_queue_peek_head (&self->rows), "history-url");
+    query->sort_type = EPHY_HISTORY_SORT_LEAST_RECENTLY_VISITED;
+  } else {
+    url = g_object_get_data (g_queue_peek_tail (&self->rows), "history-url");
+  }
+  query->after_last_visit_time = url->last_visit_time;
+  query->after_id = url->id;
 
-  self->num_fetch = NUM_FETCH_LIMIT;
-  self->sorter_source = g_idle_add ((GSourceFunc)add_urls_source, self);
+  self->fetching_page = TRUE;
+  ephy_history_service_query_urls (self->history_service,
+                                   query,
+                                   self->query_cancellable,
+                                   newer ? (EphyHistoryJobCallback)on_find_newer_urls_cb
+                                         : (EphyHistoryJobCallback)on_find_older_urls_cb,
+                                   self);
+  ephy_history_query_free (query);
 }
 
 static GList *
@@ -144,41 +329,39 @@ substrings_filter (EphyHistoryDialog *self)
 }
 
 static void
-remove_pending_sorter_source (EphyHistoryDialog *self,
-                              gboolean           free_urls)
+cancel_pending_query (EphyHistoryDialog *self)
 {
-  if (self->sorter_source != 0) {
-    g_source_remove (self->sorter_source);
-    self->sorter_source = 0;
+  if (self->query_cancellable) {
+    g_cancellable_cancel (self->query_cancellable);
+    g_clear_object (&self->query_cancellable);
   }
 
-  if (free_urls && self->urls != NULL) {
-    g_list_free_full (self->urls, (GDestroyNotify)ephy_history_url_free);
-    self->urls = NULL;
-  }
+  g_clear_pointer (&self->query, ephy_history_query_free);
+  self->fetching_page = FALSE;
+  self->has_older_pages = FALSE;
+  self->has_newer_pages = FALSE;
 }
 
 static void
 filter_now (EphyHistoryDialog *self)
 {
-  gint64 from, to;
-  GList *substrings;
-  EphyHistorySortType type;
-  substrings = substrings_filter (self);
+  cancel_pending_query (self);
 
-  from = to = -1;       /* all */
+  /* Only a page of the history is fetched at a time, the next one when the
+   * list is scrolled to either of its ends, and the list never holds more
+   * than MAX_ROWS rows.
+   */
+  self->query = ephy_history_query_new ();
+  self->query->substring_list = substrings_filter (self);
+  self->query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+  self->query->limit = NUM_FETCH_LIMIT;
+  self->query_cancellable = g_cancellable_new ();
 
-  type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
-
-  remove_pending_sorter_source (self, TRUE);
-
-  ephy_history_service_find_urls (self->history_service,
-                                  from, to,
-                                  -1, 0,
-                                  substrings,
-                                  type,
-                                  self->cancellable,
-                                  (EphyHistoryJobCallback)on_find_urls_cb, self);
+  self->fetching_page = TRUE;
+  ephy_history_service_query_urls (self->history_service,
+                                   self->query,
+                                   self->query_cancellable,
+                                   (EphyHistoryJobCallback)on_find_urls_cb, self);
 }
 
 static GList *
@@ -241,8 +424,7 @@ forget_clicked (GtkButton *button,
 }
 
 static GtkWidget *
-create_row (EphyHistoryDialog *self,
-            EphyHistoryURL    *url)
+create_row (EphyHistoryDialog *self)
 {
   EphyEmbedShell *shell = ephy_embed_shell_get_default ();
   GtkWidget *grid;
@@ -257,8 +439,6 @@ create_row (EphyHistoryDialog *self,
 
   /* Row */
   row = gtk_list_box_row_new ();
-  g_object_set_data (G_OBJECT (row), "title", g_strdup (url->title));
-  g_object_set_data (G_OBJECT (row), "url", g_strdup (url->url));
 
   /* Grid */
   grid = gtk_grid_new ();
@@ -268,10 +448,11 @@ create_row (EphyHistoryDialog *self,
   gtk_widget_set_margin_bottom (grid, 6);
   gtk_grid_set_column_spacing (GTK_GRID(grid), 12);
   gtk_grid_set_row_spacing (GTK_GRID(grid), 6);
-  gtk_widget_set_tooltip_text (grid, url->url);
+  g_object_set_data (G_OBJECT (row), "grid", grid);
 
   /* Title */
-  title = gtk_label_new (url->title);
+  title = gtk_label_new (NULL);
+  g_object_set_data (G_OBJECT (row), "title-label", title);
   gtk_label_set_ellipsize (GTK_LABEL(title), PANGO_ELLIPSIZE_END);
   gtk_widget_set_hexpand (title, TRUE);
   gtk_label_set_xalign (GTK_LABEL(title), 0);
@@ -285,7 +466,8 @@ create_row (EphyHistoryDialog *self,
   gtk_grid_attach (GTK_GRID (grid), title, 0, 0, 1, 1);
 
   /* Address */
-  address = gtk_label_new (url->url);
+  address = gtk_label_new (NULL);
+  g_object_set_data (G_OBJECT (row), "address-label", address);
   gtk_label_set_ellipsize (GTK_LABEL(address), PANGO_ELLIPSIZE_END);
   gtk_label_set_xalign (GTK_LABEL(address), 0);
   gtk_widget_set_sensitive (address, FALSE);
@@ -293,7 +475,8 @@ create_row (EphyHistoryDialog *self,
   gtk_grid_attach (GTK_GRID (grid), address, 0, 1, 1, 1);
 
   /* Date */
-  date = gtk_label_new (ephy_time_helpers_utf_friendly_time (url->last_visit_time / 1000000));
+  date = gtk_label_new (NULL);
+  g_object_set_data (G_OBJECT (row), "date-label", date);
   gtk_label_set_ellipsize (GTK_LABEL(date), PANGO_ELLIPSIZE_END);
   gtk_label_set_xalign (GTK_LABEL (date), 0);
 
@@ -320,39 +503,6 @@ create_row (EphyHistoryDialog *self,
   return row;
 }
 
-static gboolean
-add_urls_source (EphyHistoryDialog *self)
-{
-  EphyHistoryURL *url;
-  GList *element;
-  GtkWidget *row;
-
-  if (self->urls == NULL || !self->num_fetch) {
-    self->sorter_source = 0;
-    gtk_widget_queue_draw (self->listbox);
-    return G_SOURCE_REMOVE;
-  }
-
-  element = self->urls;
-  url = element->data;
-
-  row = create_row (self, url);
-  gtk_list_box_insert (GTK_LIST_BOX(self->listbox), row, -1);
-
-  self->urls = g_list_remove_link (self->urls, element);
-  ephy_history_url_free (url);
-  g_list_free_1 (element);
-
-  self->num_fetch--;
-
-  if (!self->num_fetch) {
-    self->sorter_source = 0;
-    return G_SOURCE_REMOVE;
-  }
-
-  return G_SOURCE_CONTINUE;
-}
-
 static void
 confirmation_dialog_response_cb (GtkWidget         *dialog,
                                  int                response,
@@ -704,7 +854,19 @@ ephy_history_dialog_dispose (GObject *object)
                                           self);
   g_clear_object (&self->history_service);
 
-  remove_pending_sorter_source (self, TRUE);
+  cancel_pending_query (self);
+
+  /* The rows in the list go away with it, only the spare ones are left. */
+  g_queue_clear (&self->rows);
+  if (self->spare_rows) {
+    for (guint i = 0; i < self->spare_rows->len; i++) {
+      GtkWidget *row = g_ptr_array_index (self->spare_rows, i);
+
+      gtk_widget_destroy (row);
+      g_object_unref (row);
+    }
+    g_clear_pointer (&self->spare_rows, g_ptr_array_unref);
+  }
 
   G_OBJECT_CLASS (ephy_history_dialog_parent_class)->dispose (object);
 }
@@ -736,12 +898,13 @@ on_edge_reached (GtkScrolledWindow *scrolled,
 {
   EphyHistoryDialog *self = EPHY_HISTORY_DIALOG (user_data);
 
-  if (pos == GTK_POS_BOTTOM) {
-    remove_pending_sorter_source (self, FALSE);
+  if (self->fetching_page)
+    return;
 
-    self->num_fetch += NUM_FETCH_LIMIT;
-    self->sorter_source = g_idle_add ((GSourceFunc)add_urls_source, self);
-  }
+  if (pos == GTK_POS_BOTTOM && self->has_older_pages)
+    fetch_page (self, FALSE);
+  else if (pos == GTK_POS_TOP && self->has_newer_pages)
+    fetch_page (self, TRUE);
 }
 
 static void
@@ -765,6 +928,7 @@ ephy_history_dialog_class_init (EphyHistoryDialogClass *klass)
 
   gtk_widget_class_set_template_from_resource (widget_class,
                                                "/org/gnome/epiphany/gtk/history-dialog.ui");
+  gtk_widget_class_bind_template_child (widget_class, EphyHistoryDialog, scrolled_window);
   gtk_widget_class_bind_template_child (widget_class, EphyHistoryDialog, listbox);
   gtk_widget_class_bind_template_child (widget_class, EphyHistoryDialog, forget_all_button);
   gtk_widget_class_bind_template_child (widget_class, EphyHistoryDialog, popup_menu);
@@ -822,9 +986,7 @@ ephy_history_dialog_init (EphyHistoryDialog *self)
 
   self->snapshot_service = ephy_snapshot_service_get_default ();
   self->cancellable = g_cancellable_new ();
-
-  self->urls = NULL;
-  self->sorter_source = 0;
+  self->spare_rows = g_ptr_array_new ();
 
   gtk_list_box_set_header_func (GTK_LIST_BOX (self->listbox), box_header_func, NULL, NULL);
   ephy_gui_ensure_window_group (GTK_WINDOW (self));
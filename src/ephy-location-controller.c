@@ -304,7 +304,7 @@ ephy_location_controller_constructed (GObject *object)
 {
   EphyLocationController *controller = EPHY_LOCATION_CONTROLLER (object);
   EphyHistoryService *history_service;
-  EphyBookmarksManager *bookmarks_manager;
+  EphySuggestionIndex *suggestion_index;
   EphySuggestionModel *model;
   GtkWidget *notebook, *widget, *reader_mode, *entry;
 
@@ -331,8 +331,8 @@ ephy_location_controller_constructed (GObject *object)
   g_signal_connect (controller->longpress_gesture, "pressed", G_CALLBACK (longpress_gesture_cb), entry);
 
   history_service = ephy_embed_shell_get_global_history_service (ephy_embed_shell_get_default ());
-  bookmarks_manager = ephy_shell_get_bookmarks_manager (ephy_shell_get_default ());
-  model = ephy_suggestion_model_new (history_service, bookmarks_manager);
+  suggestion_index = ephy_shell_get_suggestion_index (ephy_shell_get_default ());
+  model = ephy_suggestion_model_new (history_service, suggestion_index);
   dzl_suggestion_entry_set_model (DZL_SUGGESTION_ENTRY (entry), G_LIST_MODEL (model));
   g_object_unref (model);
 
@@ -57,6 +57,7 @@ struct _EphyShell {
   EphyBookmarksManager *bookmarks_manager;
   EphyHistoryManager *history_manager;
   EphyOpenTabsManager *open_tabs_manager;
+  EphySuggestionIndex *suggestion_index;
   GNetworkMonitor *network_monitor;
   GtkWidget *history_dialog;
   GObject *prefs_dialog;
@@ -685,6 +686,7 @@ ephy_shell_dispose (GObject *object)
   g_clear_object (&shell->prefs_dialog);
   g_clear_object (&shell->network_monitor);
   g_clear_object (&shell->sync_service);
+  g_clear_object (&shell->suggestion_index);
   g_clear_object (&shell->bookmarks_manager);
   g_clear_object (&shell->history_manager);
   g_clear_object (&shell->open_tabs_manager);
@@ -914,6 +916,32 @@ ephy_shell_get_history_manager (EphyShell *shell)
   return shell->history_manager;
 }
 
+/**
+ * ephy_shell_get_suggestion_index:
+ * @shell: the #EphyShell
+ *
+ * Returns the index of history and bookmarks that the address bars of all
+ * the windows complete from.
+ *
+ * Return value: (transfer none): An #EphySuggestionIndex.
+ */
+EphySuggestionIndex *
+ephy_shell_get_suggestion_index (EphyShell *shell)
+{
+  EphyEmbedShell *embed_shell;
+  EphyHistoryService *service;
+
+  g_assert (EPHY_IS_SHELL (shell));
+
+  if (shell->suggestion_index == NULL) {
+    embed_shell = ephy_embed_shell_get_default ();
+    service = ephy_embed_shell_get_global_history_service (embed_shell);
+    shell->suggestion_index = ephy_suggestion_index_new (service, ephy_shell_get_bookmarks_manager (shell));
+  }
+
+  return shell->suggestion_index;
+}
+
 EphyOpenTabsManager *
 ephy_shell_get_open_tabs_manager (EphyShell *shell)
 {
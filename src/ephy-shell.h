@@ -29,6 +29,7 @@
 #include "ephy-open-tabs-manager.h"
 #include "ephy-password-manager.h"
 #include "ephy-session.h"
+#include "ephy-suggestion-index.h"
 #include "ephy-sync-service.h"
 #include "ephy-window.h"
 
@@ -99,6 +100,7 @@ GNetworkMonitor         *ephy_shell_get_net_monitor       (EphyShell        *she
 EphyBookmarksManager    *ephy_shell_get_bookmarks_manager (EphyShell        *shell);
 EphyHistoryManager      *ephy_shell_get_history_manager   (EphyShell        *shell);
 EphyOpenTabsManager     *ephy_shell_get_open_tabs_manager (EphyShell        *shell);
+EphySuggestionIndex     *ephy_shell_get_suggestion_index  (EphyShell        *shell);
 EphySyncService         *ephy_shell_get_sync_service      (EphyShell        *shell);
 
 GtkWidget               *ephy_shell_get_history_dialog    (EphyShell        *shell);
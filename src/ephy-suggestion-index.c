@@ -0,0 +1,348 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-suggestion-index.h"
+
+/* Keeps an #EphyHistoryIndex of the whole history and of the bookmarks in
+ * step with them, so that address bar suggestions are answered without the
+ * database. There is one for all the windows, see
+ * ephy_shell_get_suggestion_index().
+ */
+
+struct _EphySuggestionIndex {
+  GObject               parent_instance;
+
+  EphyHistoryService   *history_service;
+  EphyBookmarksManager *bookmarks_manager;
+
+  EphyHistoryIndex     *index;
+  GCancellable         *cancellable;
+  gint64                time;
+  gboolean              loaded;
+};
+
+enum {
+  PROP_0,
+  PROP_BOOKMARKS_MANAGER,
+  PROP_HISTORY_SERVICE,
+  N_PROPS
+};
+
+static GParamSpec *properties[N_PROPS];
+
+G_DEFINE_TYPE (EphySuggestionIndex, ephy_suggestion_index, G_TYPE_OBJECT)
+
+static void
+ephy_suggestion_index_dispose (GObject *object)
+{
+  EphySuggestionIndex *self = EPHY_SUGGESTION_INDEX (object);
+
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
+
+  g_clear_object (&self->bookmarks_manager);
+  g_clear_object (&self->history_service);
+
+  G_OBJECT_CLASS (ephy_suggestion_index_parent_class)->dispose (object);
+}
+
+static void
+ephy_suggestion_index_finalize (GObject *object)
+{
+  EphySuggestionIndex *self = EPHY_SUGGESTION_INDEX (object);
+
+  ephy_history_index_free (self->index);
+
+  G_OBJECT_CLASS (ephy_suggestion_index_parent_class)->finalize (object);
+}
+
+static void
+ephy_suggestion_index_set_property (GObject      *object,
+                                    guint         prop_id,
+                                    const GValue *value,
+                                    GParamSpec   *pspec)
+{
+  EphySuggestionIndex *self = EPHY_SUGGESTION_INDEX (object);
+
+  switch (prop_id) {
+    case PROP_HISTORY_SERVICE:
+      self->history_service = g_value_dup_object (value);
+      break;
+    case PROP_BOOKMARKS_MANAGER:
+      self->bookmarks_manager = g_value_dup_object (value);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+  }
+}
+
+static void
+urls_updated_cb (EphyHistoryService  *service,
+                 gboolean             success,
+                 gpointer             result_data,
+                 EphySuggestionIndex *self)
+{
+  GList *urls = (GList *)result_data;
+  gint64 now = g_get_real_time ();
+
+  if (!success)
+    return;
+
+  for (GList *l = urls; l; l = l->next)
+    ephy_history_index_add_url (self->index, l->data, now);
+
+  ephy_history_url_list_free (urls);
+}
+
+static void
+history_loaded_cb (EphyHistoryService  *service,
+                   gboolean             success,
+                   gpointer             result_data,
+                   EphySuggestionIndex *self)
+{
+  urls_updated_cb (service, success, result_data, self);
+  self->loaded = success;
+}
+
+static void
+load_history (EphySuggestionIndex *self)
+{
+  EphyHistoryQuery *query;
+
+  g_cancellable_cancel (self->cancellable);
+  g_clear_object (&self->cancellable);
+  self->cancellable = g_cancellable_new ();
+
+  ephy_history_index_clear_urls (self->index);
+  self->loaded = FALSE;
+  self->time = g_get_real_time ();
+
+  query = ephy_history_query_new ();
+  query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+  ephy_history_service_query_urls (self->history_service,
+                                   query,
+                                   self->cancellable,
+                                   (EphyHistoryJobCallback)history_loaded_cb,
+                                   self);
+  ephy_history_query_free (query);
+}
+
+static void
+urls_visited_cb (EphyHistoryService  *service,
+                 EphySuggestionIndex *self)
+{
+  EphyHistoryQuery *query;
+
+  /* Only the URLs visited since the last update are read again. The signal
+   * comes once the visits have been committed, so none of them is missed.
+   */
+  query = ephy_history_query_new ();
+  query->from = self->time;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+  self->time = g_get_real_time ();
+
+  ephy_history_service_query_urls (self->history_service,
+                                   query,
+                                   self->cancellable,
+                                   (EphyHistoryJobCallback)urls_updated_cb,
+                                   self);
+  ephy_history_query_free (query);
+}
+
+static void
+url_title_changed_cb (EphyHistoryService  *service,
+                      const char          *url,
+                      const char          *title,
+                      EphySuggestionIndex *self)
+{
+  ephy_history_index_set_url_title (self->index, url, title);
+}
+
+static void
+url_deleted_cb (EphyHistoryService  *service,
+                EphyHistoryURL      *url,
+                EphySuggestionIndex *self)
+{
+  ephy_history_index_remove_url (self->index, url->url);
+}
+
+static void
+history_cleared_cb (EphyHistoryService  *service,
+                    EphySuggestionIndex *self)
+{
+  ephy_history_index_clear_urls (self->index);
+}
+
+static void
+host_deleted_cb (EphyHistoryService  *service,
+                 const char          *host,
+                 EphySuggestionIndex *self)
+{
+  /* There is no signal for each of the URLs that went with the host. */
+  load_history (self);
+}
+
+static void
+load_bookmarks (EphySuggestionIndex *self)
+{
+  GSequence *bookmarks;
+
+  ephy_history_index_clear_bookmarks (self->index);
+
+  bookmarks = ephy_bookmarks_manager_get_bookmarks (self->bookmarks_manager);
+  for (GSequenceIter *iter = g_sequence_get_begin_iter (bookmarks);
+       !g_sequence_iter_is_end (iter);
+       iter = g_sequence_iter_next (iter)) {
+    EphyBookmark *bookmark = g_sequence_get (iter);
+
+    ephy_history_index_add_bookmark (self->index,
+                                     ephy_bookmark_get_url (bookmark),
+                                     ephy_bookmark_get_title (bookmark));
+  }
+}
+
+static void
+bookmarks_changed_cb (EphyBookmarksManager *manager,
+                      EphyBookmark         *bookmark,
+                      EphySuggestionIndex  *self)
+{
+  /* The old URL of a changed bookmark is gone already, and there are few
+   * enough bookmarks to add them all again.
+   */
+  load_bookmarks (self);
+}
+
+static void
+ephy_suggestion_index_constructed (GObject *object)
+{
+  EphySuggestionIndex *self = EPHY_SUGGESTION_INDEX (object);
+
+  G_OBJECT_CLASS (ephy_suggestion_index_parent_class)->constructed (object);
+
+  g_signal_connect_object (self->history_service, "urls-visited",
+                           G_CALLBACK (urls_visited_cb), self, 0);
+  g_signal_connect_object (self->history_service, "url-title-changed",
+                           G_CALLBACK (url_title_changed_cb), self, 0);
+  g_signal_connect_object (self->history_service, "url-deleted",
+                           G_CALLBACK (url_deleted_cb), self, 0);
+  g_signal_connect_object (self->history_service, "cleared",
+                           G_CALLBACK (history_cleared_cb), self, 0);
+  g_signal_connect_object (self->history_service, "host-deleted",
+                           G_CALLBACK (host_deleted_cb), self, 0);
+
+  g_signal_connect_object (self->bookmarks_manager, "bookmark-added",
+                           G_CALLBACK (bookmarks_changed_cb), self, 0);
+  g_signal_connect_object (self->bookmarks_manager, "bookmark-removed",
+                           G_CALLBACK (bookmarks_changed_cb), self, 0);
+  g_signal_connect_object (self->bookmarks_manager, "bookmark-title-changed",
+                           G_CALLBACK (bookmarks_changed_cb), self, 0);
+  g_signal_connect_object (self->bookmarks_manager, "bookmark-url-changed",
+                           G_CALLBACK (bookmarks_changed_cb), self, 0);
+
+  load_bookmarks (self);
+  load_history (self);
+}
+
+static void
+ephy_suggestion_index_class_init (EphySuggestionIndexClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = ephy_suggestion_index_dispose;
+  object_class->finalize = ephy_suggestion_index_finalize;
+  object_class->constructed = ephy_suggestion_index_constructed;
+  object_class->set_property = ephy_suggestion_index_set_property;
+
+  properties[PROP_BOOKMARKS_MANAGER] =
+    g_param_spec_object ("bookmarks-manager",
+                         "Bookmarks Manager",
+                         "The bookmarks manager to index",
+                         EPHY_TYPE_BOOKMARKS_MANAGER,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  properties[PROP_HISTORY_SERVICE] =
+    g_param_spec_object ("history-service",
+                         "History Service",
+                         "The history service to index",
+                         EPHY_TYPE_HISTORY_SERVICE,
+                         G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  g_object_class_install_properties (object_class, N_PROPS, properties);
+}
+
+static void
+ephy_suggestion_index_init (EphySuggestionIndex *self)
+{
+  self->index = ephy_history_index_new ();
+}
+
+EphySuggestionIndex *
+ephy_suggestion_index_new (EphyHistoryService   *history_service,
+                           EphyBookmarksManager *bookmarks_manager)
+{
+  g_assert (EPHY_IS_HISTORY_SERVICE (history_service));
+  g_assert (EPHY_IS_BOOKMARKS_MANAGER (bookmarks_manager));
+
+  return g_object_new (EPHY_TYPE_SUGGESTION_INDEX,
+                       "history-service", history_service,
+                       "bookmarks-manager", bookmarks_manager,
+                       NULL);
+}
+
+/**
+ * ephy_suggestion_index_is_loaded:
+ * @self: an #EphySuggestionIndex
+ *
+ * Until the whole history has been read, queries only find part of it and
+ * should go to the database instead.
+ *
+ * Returns: whether the index has the whole history
+ **/
+gboolean
+ephy_suggestion_index_is_loaded (EphySuggestionIndex *self)
+{
+  g_assert (EPHY_IS_SUGGESTION_INDEX (self));
+
+  return self->loaded;
+}
+
+/**
+ * ephy_suggestion_index_query:
+ * @self: an #EphySuggestionIndex
+ * @text: what the user typed
+ * @kind: whether to look for history or bookmark entries
+ * @max_results: the maximum number of matches, or 0 for all of them
+ *
+ * See ephy_history_index_query().
+ *
+ * Returns: (transfer container) (element-type EphyHistoryIndexMatch): the
+ * matches, valid until the main loop runs again
+ **/
+GPtrArray *
+ephy_suggestion_index_query (EphySuggestionIndex  *self,
+                             const char           *text,
+                             EphyHistoryIndexKind  kind,
+                             guint                 max_results)
+{
+  g_assert (EPHY_IS_SUGGESTION_INDEX (self));
+
+  return ephy_history_index_query (self->index, text, kind, max_results);
+}
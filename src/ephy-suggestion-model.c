@@ -31,16 +31,15 @@
 struct _EphySuggestionModel {
   GObject               parent;
   EphyHistoryService   *history_service;
-  EphyBookmarksManager *bookmarks_manager;
+  EphySuggestionIndex  *index;
   GSequence            *items;
-  gchar               **search_terms;
   GCancellable         *icon_cancellable;
 };
 
 enum {
   PROP_0,
-  PROP_BOOKMARKS_MANAGER,
   PROP_HISTORY_SERVICE,
+  PROP_INDEX,
   N_PROPS
 };
 
@@ -56,15 +55,13 @@ ephy_suggestion_model_finalize (GObject *object)
 {
   EphySuggestionModel *self = (EphySuggestionModel *)object;
 
-  g_clear_object (&self->bookmarks_manager);
+  g_clear_object (&self->index);
   g_clear_object (&self->history_service);
   g_clear_pointer (&self->items, g_sequence_free);
 
   g_cancellable_cancel (self->icon_cancellable);
   g_clear_object (&self->icon_cancellable);
 
-  g_strfreev (self->search_terms);
-
   G_OBJECT_CLASS (ephy_suggestion_model_parent_class)->finalize (object);
 }
 
@@ -80,8 +77,8 @@ ephy_suggestion_model_get_property (GObject    *object,
     case PROP_HISTORY_SERVICE:
       g_value_set_object (value, self->history_service);
       break;
-    case PROP_BOOKMARKS_MANAGER:
-      g_value_set_object (value, self->bookmarks_manager);
+    case PROP_INDEX:
+      g_value_set_object (value, self->index);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -100,8 +97,8 @@ ephy_suggestion_model_set_property (GObject      *object,
     case PROP_HISTORY_SERVICE:
       self->history_service = g_value_dup_object (value);
       break;
-    case PROP_BOOKMARKS_MANAGER:
-      self->bookmarks_manager = g_value_dup_object (value);
+    case PROP_INDEX:
+      self->index = g_value_dup_object (value);
       break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
@@ -117,13 +114,6 @@ ephy_suggestion_model_class_init (EphySuggestionModelClass *klass)
   object_class->get_property = ephy_suggestion_model_get_property;
   object_class->set_property = ephy_suggestion_model_set_property;
 
-  properties [PROP_BOOKMARKS_MANAGER] =
-    g_param_spec_object ("bookmarks-manager",
-                         "Bookmarks Manager",
-                         "The bookmarks manager for suggestions",
-                         EPHY_TYPE_BOOKMARKS_MANAGER,
-                         (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
-
   properties [PROP_HISTORY_SERVICE] =
     g_param_spec_object ("history-service",
                          "History Service",
@@ -131,6 +121,13 @@ ephy_suggestion_model_class_init (EphySuggestionModelClass *klass)
                          EPHY_TYPE_HISTORY_SERVICE,
                          (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  properties [PROP_INDEX] =
+    g_param_spec_object ("index",
+                         "Index",
+                         "The index of history and bookmarks for suggestions",
+                         EPHY_TYPE_SUGGESTION_INDEX,
+                         (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   g_object_class_install_properties (object_class, N_PROPS, properties);
 }
 
@@ -177,54 +174,18 @@ list_model_iface_init (GListModelInterface *iface)
 }
 
 EphySuggestionModel *
-ephy_suggestion_model_new (EphyHistoryService   *history_service,
-                           EphyBookmarksManager *bookmarks_manager)
+ephy_suggestion_model_new (EphyHistoryService  *history_service,
+                           EphySuggestionIndex *index)
 {
   g_assert (EPHY_IS_HISTORY_SERVICE (history_service));
-  g_assert (EPHY_IS_BOOKMARKS_MANAGER (bookmarks_manager));
+  g_assert (EPHY_IS_SUGGESTION_INDEX (index));
 
   return g_object_new (EPHY_TYPE_SUGGESTION_MODEL,
                        "history-service", history_service,
-                       "bookmarks-manager", bookmarks_manager,
+                       "index", index,
                        NULL);
 }
 
-static void
-update_search_terms (EphySuggestionModel *self,
-                     const char          *text)
-{
-  g_assert (EPHY_IS_SUGGESTION_MODEL (self));
-
-  g_strfreev (self->search_terms);
-
-  self->search_terms = g_strsplit (text, " ", -1);
-}
-
-static gboolean
-should_add_bookmark_to_model (EphySuggestionModel *self,
-                              const char          *search_string,
-                              const char          *title,
-                              const char          *location)
-{
-  gboolean ret = TRUE;
-
-  if (self->search_terms) {
-    guint len = g_strv_length (self->search_terms);
-    guint i;
-
-    for (i = 0; i < len; i++) {
-      gchar *str = self->search_terms[i];
-
-      if (!strstr (str, title ? title : "") && !strstr (str, location ? location : "")) {
-        ret = FALSE;
-        break;
-      }
-    }
-  }
-
-  return ret;
-}
-
 static void
 icon_loaded_cb (GObject      *source,
                 GAsyncResult *result,
@@ -271,60 +232,22 @@ load_favicon (EphySuggestionModel *model,
 }
 
 static guint
-add_bookmarks (EphySuggestionModel *self,
-               const char          *query)
-{
-  GSequence *bookmarks;
-  guint added = 0;
-
-  bookmarks = ephy_bookmarks_manager_get_bookmarks (self->bookmarks_manager);
-
-  for (GSequenceIter *iter = g_sequence_get_begin_iter (bookmarks);
-       !g_sequence_iter_is_end (iter);
-       iter = g_sequence_iter_next (iter)) {
-    EphyBookmark *bookmark;
-    const char *url, *title;
-
-    bookmark = g_sequence_get (iter);
-
-    url = ephy_bookmark_get_url (bookmark);
-    title = ephy_bookmark_get_title (bookmark);
-
-    if (should_add_bookmark_to_model (self, query, title, url)) {
-      EphySuggestion *suggestion;
-      g_autofree gchar *escaped_title = NULL;
-      g_autofree gchar *markup = NULL;
-
-      escaped_title = g_markup_escape_text (title, -1);
-      markup = dzl_fuzzy_highlight (escaped_title, query, FALSE);
-      suggestion = ephy_suggestion_new (markup, url);
-      load_favicon (self, suggestion, url);
-
-      g_sequence_append (self->items, suggestion);
-      added++;
-    }
-  }
-
-  return added;
-}
-
-static guint
-add_history (EphySuggestionModel *self,
-             GList               *urls,
+add_matches (EphySuggestionModel *self,
+             GPtrArray           *matches,
              const char          *query)
 {
   guint added = 0;
 
-  for (const GList *p = urls; p != NULL; p = p->next) {
-    EphyHistoryURL *url = (EphyHistoryURL *)p->data;
+  for (guint i = 0; i < matches->len; i++) {
+    EphyHistoryIndexMatch *match = g_ptr_array_index (matches, i);
     EphySuggestion *suggestion;
     g_autofree gchar *escaped_title = NULL;
     g_autofree gchar *markup = NULL;
 
-    escaped_title = g_markup_escape_text (url->title, -1);
+    escaped_title = g_markup_escape_text (match->title, -1);
     markup = dzl_fuzzy_highlight (escaped_title, query, FALSE);
-    suggestion = ephy_suggestion_new (markup, url->url);
-    load_favicon (self, suggestion, url->url);
+    suggestion = ephy_suggestion_new (markup, match->url);
+    load_favicon (self, suggestion, match->url);
 
     g_sequence_append (self->items, suggestion);
     added++;
@@ -370,22 +293,13 @@ add_search_engines (EphySuggestionModel *self,
 }
 
 static void
-query_completed_cb (EphyHistoryService *service,
-                    gboolean            success,
-                    gpointer            result_data,
-                    gpointer            user_data)
+update_items (EphySuggestionModel *self,
+              const char          *query,
+              GPtrArray           *history)
 {
-  GTask *task = user_data;
-  EphySuggestionModel *self;
-  const gchar *query;
-  GList *urls;
   guint removed;
   guint added = 0;
 
-  self = g_task_get_source_object (task);
-  query = g_task_get_task_data (task);
-  urls = (GList *)result_data;
-
   g_cancellable_cancel (self->icon_cancellable);
   g_clear_object (&self->icon_cancellable);
 
@@ -397,12 +311,45 @@ query_completed_cb (EphyHistoryService *service,
   self->items = g_sequence_new (g_object_unref);
 
   if (strlen (query) > 0) {
-    added = add_bookmarks (self, query);
-    added += add_history (self, urls, query);
+    g_autoptr(GPtrArray) bookmarks = NULL;
+
+    bookmarks = ephy_suggestion_index_query (self->index, query, EPHY_HISTORY_INDEX_BOOKMARKS, 0);
+    added = add_matches (self, bookmarks, query);
+    added += add_matches (self, history, query);
     added += add_search_engines (self, query);
   }
 
   g_list_model_items_changed (G_LIST_MODEL (self), 0, removed, added);
+}
+
+static void
+query_completed_cb (EphyHistoryService *service,
+                    gboolean            success,
+                    gpointer            result_data,
+                    gpointer            user_data)
+{
+  GTask *task = user_data;
+  EphySuggestionModel *self;
+  const gchar *query;
+  g_autoptr(GPtrArray) history = NULL;
+  GList *urls;
+
+  self = g_task_get_source_object (task);
+  query = g_task_get_task_data (task);
+  urls = (GList *)result_data;
+
+  history = g_ptr_array_new_with_free_func (g_free);
+  for (GList *l = urls; l; l = l->next) {
+    EphyHistoryURL *url = l->data;
+    EphyHistoryIndexMatch *match = g_new (EphyHistoryIndexMatch, 1);
+
+    match->url = url->url;
+    match->title = url->title;
+    g_ptr_array_add (history, match);
+  }
+
+  update_items (self, query, history);
+  ephy_history_url_list_free (urls);
 
   g_task_return_boolean (task, TRUE);
   g_object_unref (task);
@@ -427,13 +374,25 @@ ephy_suggestion_model_query_async (EphySuggestionModel *self,
   g_task_set_source_tag (task, ephy_suggestion_model_query_async);
   g_task_set_task_data (task, g_strdup (query), g_free);
 
+  /* Until the index has the whole history, ask the database. */
+  if (ephy_suggestion_index_is_loaded (self->index)) {
+    g_autoptr(GPtrArray) history = NULL;
+
+    history = ephy_suggestion_index_query (self->index, query,
+                                           EPHY_HISTORY_INDEX_HISTORY,
+                                           MAX_COMPLETION_HISTORY_URLS);
+    update_items (self, query, history);
+
+    g_task_return_boolean (task, TRUE);
+    g_object_unref (task);
+    return;
+  }
+
   /* Split the search string. */
   strings = g_strsplit (query, " ", -1);
   for (guint i = 0; strings[i]; i++)
     qlist = g_list_append (qlist, g_strdup (strings[i]));
 
-  update_search_terms (self, query);
-
   ephy_history_service_find_urls (self->history_service,
                                   0, 0,
                                   MAX_COMPLETION_HISTORY_URLS, 0,
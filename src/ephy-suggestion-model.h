@@ -20,9 +20,9 @@
 
 #include <gio/gio.h>
 
-#include "ephy-bookmarks-manager.h"
 #include "ephy-history-service.h"
 #include "ephy-suggestion.h"
+#include "ephy-suggestion-index.h"
 
 G_BEGIN_DECLS
 
@@ -31,7 +31,7 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE (EphySuggestionModel, ephy_suggestion_model, EPHY, SUGGESTION_MODEL, GObject)
 
 EphySuggestionModel *ephy_suggestion_model_new                     (EphyHistoryService    *history_service,
-                                                                    EphyBookmarksManager  *bookmarks_manager);
+                                                                    EphySuggestionIndex   *index);
 void                 ephy_suggestion_model_query_async             (EphySuggestionModel   *self,
                                                                     const gchar           *query,
                                                                     GCancellable          *cancellable,
@@ -44,6 +44,7 @@ struct _EphySearchProvider {
 
   GSettings                *settings;
   EphyBookmarksManager     *bookmarks_manager;
+  EphySuggestionIndex      *suggestion_index;
   EphySuggestionModel      *model;
 };
 
@@ -341,8 +342,10 @@ ephy_search_provider_init (EphySearchProvider *self)
 
   filename = g_build_filename (ephy_profile_dir (), EPHY_HISTORY_FILE, NULL);
   self->bookmarks_manager = ephy_bookmarks_manager_new ();
+  self->suggestion_index = ephy_suggestion_index_new (ephy_embed_shell_get_global_history_service (shell),
+                                                      self->bookmarks_manager);
   self->model = ephy_suggestion_model_new (ephy_embed_shell_get_global_history_service (shell),
-                                           self->bookmarks_manager);
+                                           self->suggestion_index);
   g_free (filename);
 
   self->cancellable = g_cancellable_new ();
@@ -401,6 +404,7 @@ ephy_search_provider_dispose (GObject *object)
   g_clear_object (&self->settings);
   g_clear_object (&self->cancellable);
   g_clear_object (&self->model);
+  g_clear_object (&self->suggestion_index);
   g_clear_object (&self->bookmarks_manager);
 
   G_OBJECT_CLASS (ephy_search_provider_parent_class)->dispose (object);
@@ -0,0 +1,352 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Replays a corpus of requests against compiled filter lists, the way the
+ * web process does for every request it sends, and reports how long that
+ * takes. The corpus has one request per line: the request URL and the URL
+ * of the page that made it, separated by a tab. Lines starting with '#'
+ * are comments.
+ *
+ * With --write-verdicts, the verdict for every request is saved, so that
+ * they can be compared with --compare-verdicts against the verdicts of
+ * another build. That validates a change of the matching engine offline.
+ * The verdicts of the matcher with and without the verdict cache of the
+ * web process are always compared.
+ */
+
+#include "config.h"
+#include "ephy-adblock-cache.h"
+#include "ephy-adblock-compiler.h"
+#include "ephy-adblock-image.h"
+#include "ephy-adblock-matcher.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* Same as the web process. */
+#define VERDICT_CACHE_SIZE 4096
+
+typedef struct {
+  char *request_uri;
+  char *page_uri;
+} CorpusEntry;
+
+static int iterations = 10;
+static char *write_verdicts;
+static char *compare_verdicts;
+static char **arguments;
+
+static const GOptionEntry option_entries[] =
+{
+  { "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+    "Number of times the corpus is replayed", "N" },
+  { "write-verdicts", 0, 0, G_OPTION_ARG_FILENAME, &write_verdicts,
+    "Save the verdict for every request of the corpus", "FILE" },
+  { "compare-verdicts", 0, 0, G_OPTION_ARG_FILENAME, &compare_verdicts,
+    "Compare the verdicts with the ones saved by another build", "FILE" },
+  { G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_FILENAME_ARRAY, &arguments,
+    "", "CORPUS FILTER-LIST…" },
+  { NULL }
+};
+
+static guint64
+get_time_ns (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (guint64)now.tv_sec * G_GUINT64_CONSTANT (1000000000) + now.tv_nsec;
+}
+
+static void
+corpus_entry_free (CorpusEntry *entry)
+{
+  g_free (entry->request_uri);
+  g_free (entry->page_uri);
+  g_free (entry);
+}
+
+static GPtrArray *
+load_corpus (const char  *path,
+             GError     **error)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GPtrArray *corpus;
+
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    return NULL;
+
+  corpus = g_ptr_array_new_with_free_func ((GDestroyNotify)corpus_entry_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i]; i++) {
+    CorpusEntry *entry;
+    char *separator;
+
+    g_strchomp (lines[i]);
+    if (!lines[i][0] || lines[i][0] == '#')
+      continue;
+
+    entry = g_new0 (CorpusEntry, 1);
+    separator = strchr (lines[i], '\t');
+    if (separator) {
+      *separator = '\0';
+      entry->page_uri = g_strdup (separator + 1);
+    }
+    entry->request_uri = g_strdup (lines[i]);
+    g_ptr_array_add (corpus, entry);
+  }
+
+  return corpus;
+}
+
+static gboolean
+block_uri (EphyAdblockMatcher *matcher,
+           const CorpusEntry  *entry)
+{
+  /* Same as ephy_uri_tester_block_uri(). */
+  return !ephy_adblock_matcher_match (matcher, entry->request_uri, entry->page_uri, TRUE) &&
+         ephy_adblock_matcher_match (matcher, entry->request_uri, entry->page_uri, FALSE);
+}
+
+static gboolean
+block_uri_cached (EphyAdblockMatcher *matcher,
+                  EphyAdblockCache   *cache,
+                  const CorpusEntry  *entry)
+{
+  guint64 key;
+  gboolean blocked;
+
+  key = ephy_adblock_cache_get_key (entry->request_uri, entry->page_uri);
+  if (ephy_adblock_cache_lookup (cache, key, &blocked))
+    return blocked;
+
+  blocked = block_uri (matcher, entry);
+  ephy_adblock_cache_insert (cache, key, blocked);
+
+  return blocked;
+}
+
+static int
+compare_durations (gconstpointer a,
+                   gconstpointer b)
+{
+  guint64 duration_a = *(const guint64 *)a;
+  guint64 duration_b = *(const guint64 *)b;
+
+  return duration_a < duration_b ? -1 : duration_a > duration_b;
+}
+
+static guint64
+get_percentile (GArray *durations,
+                guint   percentile)
+{
+  return g_array_index (durations, guint64, (durations->len - 1) * percentile / 100);
+}
+
+static char *
+format_verdicts (GPtrArray      *corpus,
+                 const gboolean *verdicts)
+{
+  GString *string = g_string_new (NULL);
+
+  for (guint i = 0; i < corpus->len; i++) {
+    CorpusEntry *entry = g_ptr_array_index (corpus, i);
+
+    g_string_append_printf (string, "%s\t%s\n", verdicts[i] ? "block" : "allow", entry->request_uri);
+  }
+
+  return g_string_free (string, FALSE);
+}
+
+static guint
+print_verdict_differences (const char *label,
+                           const char *expected,
+                           const char *actual)
+{
+  g_auto(GStrv) expected_lines = g_strsplit (expected, "\n", -1);
+  g_auto(GStrv) actual_lines = g_strsplit (actual, "\n", -1);
+  guint n_differences = 0;
+  guint i;
+
+  for (i = 0; expected_lines[i] && actual_lines[i]; i++) {
+    if (strcmp (expected_lines[i], actual_lines[i]) != 0) {
+      g_print ("%s: expected \"%s\", got \"%s\"\n", label, expected_lines[i], actual_lines[i]);
+      n_differences++;
+    }
+  }
+
+  if (expected_lines[i] || actual_lines[i]) {
+    g_print ("%s: the verdicts are for a different corpus\n", label);
+    n_differences++;
+  }
+
+  return n_differences;
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(EphyAdblockMatcher) matcher = NULL;
+  g_autoptr(EphyAdblockCache) cache = NULL;
+  g_autoptr(GPtrArray) corpus = NULL;
+  g_autoptr(GPtrArray) files = NULL;
+  g_autoptr(GArray) durations = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree gboolean *verdicts = NULL;
+  g_autofree char *verdicts_text = NULL;
+  struct rusage usage;
+  guint64 start;
+  guint64 compile_time;
+  guint64 load_time;
+  guint64 total_time = 0;
+  guint64 cached_time;
+  guint n_blocked = 0;
+  guint n_differences = 0;
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, option_entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("Failed to parse arguments: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (!arguments || g_strv_length (arguments) < 2 || iterations < 1) {
+    g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+
+    g_printerr ("%s", help);
+    return EXIT_FAILURE;
+  }
+
+  corpus = load_corpus (arguments[0], &error);
+  if (!corpus) {
+    g_printerr ("Failed to load corpus: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  /* Rule load time: what the UI process does when the lists change, and
+   * what every web process does when the image changes. */
+  files = g_ptr_array_new_with_free_func (g_object_unref);
+  for (guint i = 1; arguments[i]; i++)
+    g_ptr_array_add (files, g_file_new_for_commandline_arg (arguments[i]));
+
+  start = get_time_ns ();
+  compiler = ephy_adblock_compiler_new ();
+  if (!ephy_adblock_compiler_set_files (compiler, files, NULL, NULL, &error)) {
+    g_printerr ("Failed to compile the filter lists: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  bytes = ephy_adblock_compiler_build (compiler);
+  compile_time = get_time_ns () - start;
+
+  start = get_time_ns ();
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  if (!image) {
+    g_printerr ("Failed to load the compiled filters: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+  matcher = ephy_adblock_matcher_new (image);
+  load_time = get_time_ns () - start;
+
+  /* Per-request latency of the matcher itself. */
+  verdicts = g_new0 (gboolean, corpus->len);
+  durations = g_array_sized_new (FALSE, FALSE, sizeof (guint64), corpus->len * iterations);
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    for (guint i = 0; i < corpus->len; i++) {
+      guint64 duration;
+
+      start = get_time_ns ();
+      verdicts[i] = block_uri (matcher, g_ptr_array_index (corpus, i));
+      duration = get_time_ns () - start;
+
+      g_array_append_val (durations, duration);
+      total_time += duration;
+    }
+  }
+  g_array_sort (durations, compare_durations);
+
+  /* Throughput of the whole path of the web process, verdict cache included.
+   * The cache must never change a verdict. */
+  cache = ephy_adblock_cache_new (VERDICT_CACHE_SIZE);
+  start = get_time_ns ();
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    for (guint i = 0; i < corpus->len; i++) {
+      CorpusEntry *entry = g_ptr_array_index (corpus, i);
+
+      if (block_uri_cached (matcher, cache, entry) != verdicts[i]) {
+        g_print ("verdict cache: wrong verdict for %s\n", entry->request_uri);
+        n_differences++;
+      }
+    }
+  }
+  cached_time = get_time_ns () - start;
+
+  for (guint i = 0; i < corpus->len; i++)
+    n_blocked += verdicts[i];
+
+  getrusage (RUSAGE_SELF, &usage);
+
+  g_print ("Rules:             %u\n", ephy_adblock_image_get_n_rules (image));
+  g_print ("Image size:        %" G_GSIZE_FORMAT " bytes\n", g_bytes_get_size (bytes));
+  g_print ("Compile time:      %.3f ms\n", compile_time / 1e6);
+  g_print ("Load time:         %.3f ms\n", load_time / 1e6);
+  g_print ("Requests:          %u × %d, %u blocked\n", corpus->len, iterations, n_blocked);
+  if (durations->len > 0) {
+    g_print ("Latency p50:       %" G_GUINT64_FORMAT " ns\n", get_percentile (durations, 50));
+    g_print ("Latency p99:       %" G_GUINT64_FORMAT " ns\n", get_percentile (durations, 99));
+    g_print ("Throughput:        %.0f requests/s\n", durations->len / (total_time / 1e9));
+    g_print ("Cached throughput: %.0f requests/s\n", durations->len / (cached_time / 1e9));
+  }
+  g_print ("Peak RSS:          %ld KiB\n", usage.ru_maxrss);
+
+  verdicts_text = format_verdicts (corpus, verdicts);
+
+  if (write_verdicts && !g_file_set_contents (write_verdicts, verdicts_text, -1, &error)) {
+    g_printerr ("Failed to save verdicts: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (compare_verdicts) {
+    g_autofree char *expected = NULL;
+
+    if (!g_file_get_contents (compare_verdicts, &expected, NULL, &error)) {
+      g_printerr ("Failed to load verdicts: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+    n_differences += print_verdict_differences (compare_verdicts, expected, verdicts_text);
+  }
+
+  if (n_differences > 0) {
+    g_print ("%u different verdicts\n", n_differences);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,570 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+#include "ephy-adblock-cache.h"
+#include "ephy-adblock-compiler.h"
+#include "ephy-adblock-image.h"
+#include "ephy-adblock-image-private.h"
+#include "ephy-adblock-matcher.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <unistd.h>
+
+static EphyAdblockMatcher *
+create_matcher (const char * const *rules)
+{
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  compiler = ephy_adblock_compiler_new ();
+  for (guint i = 0; rules[i]; i++)
+    ephy_adblock_compiler_add_line (compiler, rules[i]);
+
+  bytes = ephy_adblock_compiler_build (compiler);
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+
+  return ephy_adblock_matcher_new (image);
+}
+
+static void
+test_ephy_adblock_parse (void)
+{
+  const char *rules[] = {
+    "[Adblock Plus 2.0]",
+    "! Title: Test list",
+    "",
+    "   ",
+    "||ads.example.com^",
+    "||ads.example.com^",
+    "@@||example.org/ads/",
+    "/banner.gif",
+    "/frame.html$subdocument",
+    "example.org#@#.banner",
+    "example.org##.banner",
+    NULL
+  };
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+
+  compiler = ephy_adblock_compiler_new ();
+  for (guint i = 0; rules[i]; i++)
+    ephy_adblock_compiler_add_line (compiler, rules[i]);
+
+  bytes = ephy_adblock_compiler_build (compiler);
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+
+  /* Headers, comments, blank lines, duplicates and unsupported rules are
+   * dropped, and element hiding rules do not count as network rules. */
+  g_assert_cmpuint (ephy_adblock_image_get_n_rules (image), ==, 3);
+}
+
+static void
+test_ephy_adblock_image_round_trip (void)
+{
+  const char *rules[] = {
+    "||ads.example.com^",
+    "/ads/*",
+    "@@||example.org/ads/",
+    "/^https?:\\/\\/pixel\\./",
+    NULL
+  };
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *path = NULL;
+  g_autofree char *contents = NULL;
+  EphyAdblockMatcher *matcher;
+  gsize length;
+  int fd;
+
+  compiler = ephy_adblock_compiler_new ();
+  for (guint i = 0; rules[i]; i++)
+    ephy_adblock_compiler_add_line (compiler, rules[i]);
+
+  fd = g_file_open_tmp ("ephy-adblock-image-XXXXXX", &path, &error);
+  g_assert_no_error (error);
+  close (fd);
+
+  g_assert_true (ephy_adblock_compiler_write (compiler, path, &error));
+  g_assert_no_error (error);
+
+  /* The file holds exactly the image that was built. */
+  bytes = ephy_adblock_compiler_build (compiler);
+  g_assert_true (g_file_get_contents (path, &contents, &length, &error));
+  g_assert_no_error (error);
+  g_assert_cmpmem (contents, length, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+
+  image = ephy_adblock_image_new_from_file (path, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (ephy_adblock_image_get_n_rules (image), ==, 4);
+
+  matcher = ephy_adblock_matcher_new (image);
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://ads.example.com/x.js", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.com/ads/1.png", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.org/ads/1.png", NULL, TRUE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "http://example.com/ads/1.png", NULL, TRUE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://pixel.example.net/p.gif", NULL, FALSE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "https://example.net/index.html", NULL, FALSE));
+  ephy_adblock_matcher_free (matcher);
+
+  g_unlink (path);
+}
+
+static void
+test_ephy_adblock_match (void)
+{
+  struct {
+    const char *rule;
+    const char *uri;
+    gboolean blocked;
+  } const items[] = {
+    /* Rules indexed by one of their tokens. */
+    { "||ads.example.com^", "https://ads.example.com/banner.js", TRUE },
+    { "||ads.example.com^", "https://cdn.ads.example.com/banner.js", TRUE },
+    { "||ads.example.com^", "https://badads.example.com/banner.js", FALSE },
+    { "||ads.example.com^", "https://ads.example.company/banner.js", FALSE },
+    { "|http://tracker.", "http://tracker.example.org/", TRUE },
+    { "|http://tracker.", "https://example.org/?u=http://tracker.", FALSE },
+    { "/advertisement/*/img^", "http://example.org/advertisement/1/img?x", TRUE },
+    { "/advertisement/*/img^", "http://example.org/advertisement/1/imgx", FALSE },
+    { "/banner.gif", "http://example.org/banner.gifv", TRUE },
+    { "/banner.gif", "http://example.org/topbanner.gif", FALSE },
+    /* Rules without a whole token, matched through the automaton. */
+    { "/ads/*", "http://example.org/ads/1.png", TRUE },
+    { "/ads/*", "http://example.org/loads/1.png", FALSE },
+    { ".swf|", "http://example.org/movie.swf", TRUE },
+    { ".swf|", "http://example.org/movie.swf?autoplay", FALSE },
+    { "?ad=*&z^", "http://example.org/?ad=1&z", TRUE },
+    { "?ad=*&z^", "http://example.org/?ad=1&zz", FALSE },
+    /* Regex rules. */
+    { "/^https?:\\/\\/pixel\\./", "https://pixel.example.org/p.gif", TRUE },
+    { "/^https?:\\/\\/pixel\\./", "https://example.org/pixel.gif", FALSE },
+    /* Ignored rules. */
+    { "! /comment/", "http://example.org/comment/", FALSE },
+    { "example.org##.banner", "http://example.org/", FALSE },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (items); i++) {
+    const char *rules[] = { items[i].rule, NULL };
+    EphyAdblockMatcher *matcher = create_matcher (rules);
+
+    g_assert_cmpint (ephy_adblock_matcher_match (matcher, items[i].uri, NULL, FALSE), ==, items[i].blocked);
+    g_assert_false (ephy_adblock_matcher_match (matcher, items[i].uri, NULL, TRUE));
+
+    ephy_adblock_matcher_free (matcher);
+  }
+}
+
+static void
+test_ephy_adblock_whitelist (void)
+{
+  const char *rules[] = {
+    "/ads/*",
+    "@@||example.org/ads/",
+    "/ads/*$third-party",
+    NULL
+  };
+  EphyAdblockMatcher *matcher = create_matcher (rules);
+
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.org/ads/1.png", NULL, TRUE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "http://example.com/ads/1.png", NULL, TRUE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.com/ads/1.png", NULL, FALSE));
+
+  ephy_adblock_matcher_free (matcher);
+}
+
+static void
+test_ephy_adblock_options (void)
+{
+  struct {
+    const char *rule;
+    const char *uri;
+    const char *page_uri;
+    gboolean blocked;
+  } const items[] = {
+    { "/ads/*$third-party", "https://cdn.example.net/ads/1.png", "https://www.example.com/", TRUE },
+    { "/ads/*$third-party", "https://cdn.example.com/ads/1.png", "https://www.example.com/", FALSE },
+    { "/ads/*$third-party", "https://cdn.example.net/ads/1.png", NULL, FALSE },
+    { "/ads/*$~third-party", "https://cdn.example.com/ads/1.png", "https://www.example.com/", TRUE },
+    { "/ads/*$~third-party", "https://cdn.example.net/ads/1.png", "https://www.example.com/", FALSE },
+    { "/ads/*$domain=example.com", "https://cdn.example.net/ads/1.png", "https://www.example.com/", TRUE },
+    { "/ads/*$domain=example.com", "https://cdn.example.net/ads/1.png", "https://example.com/", TRUE },
+    { "/ads/*$domain=example.com", "https://cdn.example.net/ads/1.png", "https://notexample.com/", FALSE },
+    { "/ads/*$domain=example.com", "https://cdn.example.net/ads/1.png", NULL, FALSE },
+    { "/ads/*$domain=~example.com", "https://cdn.example.net/ads/1.png", "https://www.example.com/", FALSE },
+    { "/ads/*$domain=~example.com", "https://cdn.example.net/ads/1.png", "https://example.org/", TRUE },
+    { "/ads/*$domain=example.com|~www.example.com", "https://cdn.example.net/ads/1.png", "https://www.example.com/", FALSE },
+    { "/ads/*$domain=example.com|~www.example.com", "https://cdn.example.net/ads/1.png", "https://mail.example.com/", TRUE },
+    { "/ads/*$domain=Example.COM,third-party", "https://cdn.example.net/ads/1.png", "https://example.com/", TRUE },
+    { "/ads/*$domain=example.com,third-party", "https://example.com/ads/1.png", "https://example.com/", FALSE },
+    { "/ads/*$script,image", "https://cdn.example.net/ads/1.png", "https://example.com/", TRUE },
+  };
+
+  for (guint i = 0; i < G_N_ELEMENTS (items); i++) {
+    const char *rules[] = { items[i].rule, NULL };
+    EphyAdblockMatcher *matcher = create_matcher (rules);
+
+    g_assert_cmpint (ephy_adblock_matcher_match (matcher, items[i].uri, items[i].page_uri, FALSE), ==, items[i].blocked);
+
+    ephy_adblock_matcher_free (matcher);
+  }
+}
+
+static void
+test_ephy_adblock_many_rules (void)
+{
+  g_autoptr(GPtrArray) rules = g_ptr_array_new_with_free_func (g_free);
+  EphyAdblockMatcher *matcher;
+
+  /* Overlapping fragments exercise the fail and output links. */
+  for (guint i = 0; i < 100; i++)
+    g_ptr_array_add (rules, g_strdup_printf ("/a%u/*", i));
+  g_ptr_array_add (rules, g_strdup ("a1/"));
+  g_ptr_array_add (rules, NULL);
+
+  matcher = create_matcher ((const char * const *)rules->pdata);
+
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.org/a42/x", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.org/xa1/", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "http://example.org/a/a99/", NULL, FALSE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "http://example.org/a100x", NULL, FALSE));
+
+  ephy_adblock_matcher_free (matcher);
+}
+
+static void
+test_ephy_adblock_set_files (void)
+{
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(EphyAdblockMatcher) matcher = NULL;
+  g_autoptr(GPtrArray) files = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *dir = NULL;
+  g_autofree char *changed_path = NULL;
+  gboolean changed;
+  const char *lists[] = {
+    "[Adblock Plus 2.0]\r\n! Title: first\r\n||ads.example.com^\r\n/banner/*\r\n",
+    "@@||ads.example.com/allowed^\n/tracker.js",
+    "",
+  };
+
+  dir = g_dir_make_tmp ("ephy-adblock-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  files = g_ptr_array_new_with_free_func (g_object_unref);
+  for (guint i = 0; i < G_N_ELEMENTS (lists); i++) {
+    g_autofree char *name = g_strdup_printf ("list-%u.txt", i);
+    g_autofree char *path = g_build_filename (dir, name, NULL);
+
+    g_file_set_contents (path, lists[i], -1, &error);
+    g_assert_no_error (error);
+    g_ptr_array_add (files, g_file_new_for_path (path));
+  }
+
+  /* Lists that were not downloaded are skipped. */
+  g_ptr_array_add (files, g_file_new_build_filename (dir, "missing.txt", NULL));
+
+  compiler = ephy_adblock_compiler_new ();
+  g_assert_true (ephy_adblock_compiler_set_files (compiler, files, &changed, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (changed);
+
+  bytes = ephy_adblock_compiler_build (compiler);
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (ephy_adblock_image_get_n_rules (image), ==, 4);
+
+  matcher = ephy_adblock_matcher_new (image);
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://ads.example.com/x.js", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://example.org/banner/1.png", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://example.org/tracker.js", NULL, FALSE));
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://ads.example.com/allowed/x.js", NULL, TRUE));
+
+  /* Nothing to do when the lists are refreshed with the same contents. */
+  g_assert_true (ephy_adblock_compiler_set_files (compiler, files, &changed, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_false (changed);
+
+  /* Only the list that changed is parsed again, the others are reused. */
+  changed_path = g_file_get_path (g_ptr_array_index (files, 1));
+  g_file_set_contents (changed_path, "/tracker.js", -1, &error);
+  g_assert_no_error (error);
+  g_assert_true (ephy_adblock_compiler_set_files (compiler, files, &changed, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_true (changed);
+
+  g_clear_pointer (&matcher, ephy_adblock_matcher_free);
+  g_clear_pointer (&image, ephy_adblock_image_unref);
+  g_bytes_unref (bytes);
+  bytes = ephy_adblock_compiler_build (compiler);
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (ephy_adblock_image_get_n_rules (image), ==, 3);
+
+  matcher = ephy_adblock_matcher_new (image);
+  g_assert_true (ephy_adblock_matcher_match (matcher, "https://example.org/banner/1.png", NULL, FALSE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "https://ads.example.com/allowed/x", NULL, TRUE));
+
+  for (guint i = 0; i < files->len; i++)
+    g_file_delete (g_ptr_array_index (files, i), NULL, NULL);
+  g_rmdir (dir);
+}
+
+static void
+test_ephy_adblock_element_hiding (void)
+{
+  const char *rules[] = {
+    "||ads.example.com^",
+    "##.ad-banner",
+    "###ad-banner",
+    "##.ad-banner",
+    "example.com##div.sponsor",
+    "example.com,~shop.example.com##.skyscraper",
+    "EXAMPLE.org##.promo",
+    "example.org,example.com##.promo",
+    "~example.net##.skyscraper",
+    "example.com#@#.ad-banner",
+    "##.a { color: red }",
+    NULL
+  };
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *generic = NULL;
+  g_autofree char *example_com = NULL;
+  g_autofree char *example_org = NULL;
+
+  compiler = ephy_adblock_compiler_new ();
+  for (guint i = 0; rules[i]; i++)
+    ephy_adblock_compiler_add_line (compiler, rules[i]);
+
+  bytes = ephy_adblock_compiler_build (compiler);
+  image = ephy_adblock_image_new_from_bytes (bytes, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (ephy_adblock_image_get_n_rules (image), ==, 1);
+
+  generic = ephy_adblock_image_get_style_sheet (image, NULL, NULL);
+  g_assert_cmpstr (generic, ==,
+                   ".ad-banner { display: none !important; }\n"
+                   "#ad-banner { display: none !important; }\n");
+
+  g_assert_cmpuint (ephy_adblock_image_get_n_cosmetic_hosts (image), ==, 2);
+  g_assert_cmpstr (ephy_adblock_image_get_cosmetic_host (image, 0), ==, "example.com");
+  g_assert_cmpstr (ephy_adblock_image_get_cosmetic_host (image, 1), ==, "example.org");
+
+  example_com = ephy_adblock_image_get_style_sheet (image, "example.com", NULL);
+  g_assert_cmpstr (example_com, ==,
+                   "div.sponsor { display: none !important; }\n"
+                   ".promo { display: none !important; }\n");
+  example_org = ephy_adblock_image_get_style_sheet (image, "example.org", NULL);
+  g_assert_cmpstr (example_org, ==, ".promo { display: none !important; }\n");
+  g_assert_null (ephy_adblock_image_get_style_sheet (image, "example.net", NULL));
+}
+
+static void
+test_ephy_adblock_element_hiding_exceptions (void)
+{
+  const char *rules[] = {
+    "##.ad",
+    "##.banner",
+    "##.sponsor",
+    "example.com##.promo",
+    "example.com##.skyscraper",
+    "#@#.banner",
+    "example.com#@#.ad",
+    "shop.example.com#@#.promo",
+    "~example.org#@#.sponsor",
+    "@@||nohide.example.net^$elemhide",
+    "@@||nogeneric.example.com^$generichide",
+    NULL
+  };
+  EphyAdblockMatcher *matcher = create_matcher (rules);
+  g_autofree char *other = NULL;
+  g_autofree char *example_com = NULL;
+  g_autofree char *shop = NULL;
+  g_autofree char *nogeneric = NULL;
+
+  /* Generic exceptions apply everywhere, and exceptions with excluded
+   * domains are applied everywhere too. Host exceptions also apply to the
+   * generic rules and to the rules of the parent domains. */
+  other = ephy_adblock_matcher_get_style_sheet (matcher, "https://example.org/");
+  g_assert_cmpstr (other, ==, ".ad { display: none !important; }\n");
+
+  example_com = ephy_adblock_matcher_get_style_sheet (matcher, "https://www.example.com/");
+  g_assert_cmpstr (example_com, ==,
+                   ".promo { display: none !important; }\n"
+                   ".skyscraper { display: none !important; }\n");
+
+  shop = ephy_adblock_matcher_get_style_sheet (matcher, "https://shop.example.com/");
+  g_assert_cmpstr (shop, ==, ".skyscraper { display: none !important; }\n");
+
+  /* $generichide leaves out the generic rules, $elemhide all of them. */
+  nogeneric = ephy_adblock_matcher_get_style_sheet (matcher, "https://nogeneric.example.com/page");
+  g_assert_cmpstr (nogeneric, ==,
+                   ".promo { display: none !important; }\n"
+                   ".skyscraper { display: none !important; }\n");
+  g_assert_null (ephy_adblock_matcher_get_style_sheet (matcher, "https://nohide.example.net/"));
+
+  /* Neither lets any request through. */
+  g_assert_false (ephy_adblock_matcher_match (matcher, "https://nohide.example.net/ad.js", NULL, TRUE));
+  g_assert_false (ephy_adblock_matcher_match (matcher, "https://nogeneric.example.com/ad.js", NULL, TRUE));
+
+  ephy_adblock_matcher_free (matcher);
+}
+
+static void
+test_ephy_adblock_invalid_image (void)
+{
+  const char *rules[] = { "||ads.example.com^", NULL };
+  g_autoptr(EphyAdblockCompiler) compiler = NULL;
+  g_autoptr(EphyAdblockImage) image = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GBytes) truncated = NULL;
+  g_autoptr(GBytes) full = NULL;
+  g_autoptr(GError) error = NULL;
+  EphyAdblockImageHeader *header;
+  EphyAdblockTable *table;
+  EphyAdblockBucket *buckets;
+  guint8 *data;
+  gsize size;
+
+  compiler = ephy_adblock_compiler_new ();
+  ephy_adblock_compiler_add_line (compiler, rules[0]);
+  bytes = ephy_adblock_compiler_build (compiler);
+
+  truncated = g_bytes_new_from_bytes (bytes, 0, g_bytes_get_size (bytes) - 8);
+  image = ephy_adblock_image_new_from_bytes (truncated, &error);
+  g_assert_null (image);
+  g_assert_error (error, EPHY_ADBLOCK_IMAGE_ERROR, EPHY_ADBLOCK_IMAGE_ERROR_INVALID);
+  g_clear_error (&error);
+
+  /* Without an empty bucket, looking up a missing token would never end. */
+  data = g_bytes_unref_to_data (g_steal_pointer (&bytes), &size);
+  header = (EphyAdblockImageHeader *)data;
+  table = &header->tables[EPHY_ADBLOCK_TABLE_BLOCK];
+  g_assert_cmpuint (table->n_buckets, >, 0);
+  buckets = (EphyAdblockBucket *)(data + table->buckets);
+  for (guint32 i = 0; i < table->n_buckets; i++) {
+    buckets[i].rules = 0;
+    buckets[i].n_rules = 1;
+  }
+  full = g_bytes_new_take (data, size);
+  image = ephy_adblock_image_new_from_bytes (full, &error);
+  g_assert_null (image);
+  g_assert_error (error, EPHY_ADBLOCK_IMAGE_ERROR, EPHY_ADBLOCK_IMAGE_ERROR_INVALID);
+}
+
+static void
+test_ephy_adblock_cache_key (void)
+{
+  guint64 key;
+
+  key = ephy_adblock_cache_get_key ("http://example.org/ads.js", "https://example.com/index.html");
+  g_assert_cmpuint (key, ==, ephy_adblock_cache_get_key ("http://example.org/ads.js", "https://example.com/other?x#y"));
+  g_assert_cmpuint (key, !=, ephy_adblock_cache_get_key ("http://example.org/ads.js", "https://example.com:8080/"));
+  g_assert_cmpuint (key, !=, ephy_adblock_cache_get_key ("http://example.org/ads.js", "http://example.com/"));
+  g_assert_cmpuint (key, !=, ephy_adblock_cache_get_key ("http://example.org/ads.js", NULL));
+  g_assert_cmpuint (key, !=, ephy_adblock_cache_get_key ("http://example.org/ads.jsx", "https://example.com/"));
+}
+
+static void
+test_ephy_adblock_cache_eviction (void)
+{
+  g_autoptr(EphyAdblockCache) cache = ephy_adblock_cache_new (8);
+  guint64 hits;
+  guint64 misses;
+  guint64 evictions;
+  gboolean blocked;
+  guint found = 0;
+
+  g_assert_cmpuint (ephy_adblock_cache_get_size (cache), ==, 8);
+
+  for (guint64 key = 0; key < 8; key++)
+    ephy_adblock_cache_insert (cache, key, key % 2);
+
+  g_assert_true (ephy_adblock_cache_lookup (cache, 3, &blocked));
+  g_assert_true (blocked);
+  g_assert_true (ephy_adblock_cache_lookup (cache, 4, &blocked));
+  g_assert_false (blocked);
+
+  /* The entries used since they were inserted survive the eviction. */
+  ephy_adblock_cache_insert (cache, 8, TRUE);
+  g_assert_true (ephy_adblock_cache_lookup (cache, 3, &blocked));
+  g_assert_true (ephy_adblock_cache_lookup (cache, 4, &blocked));
+  g_assert_true (ephy_adblock_cache_lookup (cache, 8, &blocked));
+
+  for (guint64 key = 0; key < 9; key++)
+    found += ephy_adblock_cache_lookup (cache, key, &blocked);
+  g_assert_cmpuint (found, ==, 8);
+
+  ephy_adblock_cache_get_stats (cache, &hits, &misses, &evictions);
+  g_assert_cmpuint (hits, ==, 13);
+  g_assert_cmpuint (misses, ==, 1);
+  g_assert_cmpuint (evictions, ==, 1);
+
+  ephy_adblock_cache_clear (cache);
+  g_assert_false (ephy_adblock_cache_lookup (cache, 3, &blocked));
+}
+
+int
+main (int argc, char *argv[])
+{
+  gtk_test_init (&argc, &argv);
+
+  g_test_add_func ("/lib/adblock/parse",
+                   test_ephy_adblock_parse);
+  g_test_add_func ("/lib/adblock/image_round_trip",
+                   test_ephy_adblock_image_round_trip);
+  g_test_add_func ("/lib/adblock/match",
+                   test_ephy_adblock_match);
+  g_test_add_func ("/lib/adblock/whitelist",
+                   test_ephy_adblock_whitelist);
+  g_test_add_func ("/lib/adblock/options",
+                   test_ephy_adblock_options);
+  g_test_add_func ("/lib/adblock/many_rules",
+                   test_ephy_adblock_many_rules);
+  g_test_add_func ("/lib/adblock/set_files",
+                   test_ephy_adblock_set_files);
+  g_test_add_func ("/lib/adblock/element_hiding",
+                   test_ephy_adblock_element_hiding);
+  g_test_add_func ("/lib/adblock/element_hiding_exceptions",
+                   test_ephy_adblock_element_hiding_exceptions);
+  g_test_add_func ("/lib/adblock/invalid_image",
+                   test_ephy_adblock_invalid_image);
+  g_test_add_func ("/lib/adblock/cache_key",
+                   test_ephy_adblock_cache_key);
+  g_test_add_func ("/lib/adblock/cache_eviction",
+                   test_ephy_adblock_cache_eviction);
+
+  return g_test_run ();
+}
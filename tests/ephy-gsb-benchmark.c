@@ -0,0 +1,701 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs the Safe Browsing service against a local stand-in of the API and
+ * reports how long a full and an incremental update of the threat lists
+ * take, how much memory they need, and how long verifying a URL takes right
+ * after the update and once the verdicts are cached.
+ *
+ * By default, the updates and the full hashes are synthesized: a full
+ * update with --prefixes random hash prefixes, and a partial update that
+ * removes and adds --changes of them. Some of the --urls URLs are made
+ * unsafe, and some others share a hash prefix with the lists without being
+ * unsafe, so that every path of the verification is taken.
+ *
+ * Responses recorded from the real API can be served instead with
+ * --full-update, --partial-update and --full-hashes. The URLs to verify then
+ * come from --urls-file, one per line, as "safe" or "unsafe" and the URL
+ * separated by a tab.
+ */
+
+#include "config.h"
+#include "ephy-debug.h"
+#include "ephy-file-helpers.h"
+#include "ephy-gsb-service.h"
+#include "ephy-gsb-storage.h"
+#include "ephy-gsb-test-server.h"
+#include "ephy-gsb-utils.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/* One of every UNSAFE_URL_INTERVAL URLs is unsafe, and one other shares a
+ * hash prefix with the lists without being unsafe.
+ */
+#define UNSAFE_URL_INTERVAL 20
+
+typedef struct {
+  char *url;
+  gboolean unsafe;
+} BenchmarkURL;
+
+typedef struct {
+  GMainLoop *loop;
+  GList *threats;
+} VerifyData;
+
+static int n_prefixes = 200000;
+static int n_changes = 2000;
+static int n_urls = 1000;
+static char *full_update_path;
+static char *partial_update_path;
+static char *full_hashes_path;
+static char *urls_path;
+
+static const GOptionEntry option_entries[] =
+{
+  { "prefixes", 'p', 0, G_OPTION_ARG_INT, &n_prefixes,
+    "Number of hash prefixes of the synthesized full update", "N" },
+  { "changes", 'c', 0, G_OPTION_ARG_INT, &n_changes,
+    "Number of hash prefixes removed and added by the synthesized partial update", "N" },
+  { "urls", 'u', 0, G_OPTION_ARG_INT, &n_urls,
+    "Number of synthesized URLs to verify", "N" },
+  { "full-update", 0, 0, G_OPTION_ARG_FILENAME, &full_update_path,
+    "Serve this threatListUpdates:fetch response for the full update", "FILE" },
+  { "partial-update", 0, 0, G_OPTION_ARG_FILENAME, &partial_update_path,
+    "Serve this threatListUpdates:fetch response for the incremental update", "FILE" },
+  { "full-hashes", 0, 0, G_OPTION_ARG_FILENAME, &full_hashes_path,
+    "Serve this fullHashes:find response", "FILE" },
+  { "urls-file", 0, 0, G_OPTION_ARG_FILENAME, &urls_path,
+    "Verify the URLs of this file", "FILE" },
+  { NULL }
+};
+
+static guint64
+get_time_ns (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (guint64)now.tv_sec * G_GUINT64_CONSTANT (1000000000) + now.tv_nsec;
+}
+
+static long
+get_peak_rss (void)
+{
+  struct rusage usage;
+
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+static void
+benchmark_url_free (BenchmarkURL *url)
+{
+  g_free (url->url);
+  g_free (url);
+}
+
+static int
+compare_uint32 (gconstpointer a,
+                gconstpointer b)
+{
+  guint32 value_a = *(const guint32 *)a;
+  guint32 value_b = *(const guint32 *)b;
+
+  return value_a < value_b ? -1 : value_a > value_b;
+}
+
+static void
+sort_unique (GArray *values)
+{
+  guint length = 0;
+
+  g_array_sort (values, compare_uint32);
+  for (guint i = 0; i < values->len; i++) {
+    if (i == 0 || g_array_index (values, guint32, i) != g_array_index (values, guint32, length - 1))
+      g_array_index (values, guint32, length++) = g_array_index (values, guint32, i);
+  }
+  g_array_set_size (values, length);
+}
+
+/* The prefixes are kept as big endian integers, so that their numeric order
+ * is the order of the blobs that the checksum is computed over.
+ */
+static guint32
+hash_to_prefix (GBytes *hash)
+{
+  const guint8 *data = g_bytes_get_data (hash, NULL);
+
+  return ((guint32)data[0] << 24) | ((guint32)data[1] << 16) | ((guint32)data[2] << 8) | data[3];
+}
+
+static char *
+compute_checksum (GArray *prefixes)
+{
+  GChecksum *checksum;
+  guint8 digest[GSB_HASH_LEN];
+  gsize digest_len = GSB_HASH_LEN;
+
+  checksum = g_checksum_new (GSB_HASH_TYPE);
+  for (guint i = 0; i < prefixes->len; i++) {
+    guint32 blob = GUINT32_TO_BE (g_array_index (prefixes, guint32, i));
+
+    g_checksum_update (checksum, (const guint8 *)&blob, sizeof (blob));
+  }
+  g_checksum_get_digest (checksum, digest, &digest_len);
+  g_checksum_free (checksum);
+
+  return g_base64_encode (digest, digest_len);
+}
+
+typedef struct {
+  GByteArray *data;
+  guint64 bits;
+  guint count;
+} BitWriter;
+
+/* The inverse of the bit reader of ephy-gsb-utils.c: least significant bits
+ * first.
+ */
+static void
+bit_writer_write (BitWriter *writer,
+                  guint32    value,
+                  guint      num_bits)
+{
+  writer->bits |= (guint64)value << writer->count;
+  writer->count += num_bits;
+
+  while (writer->count >= 8) {
+    guint8 byte = writer->bits & 0xff;
+
+    g_byte_array_append (writer->data, &byte, 1);
+    writer->bits >>= 8;
+    writer->count -= 8;
+  }
+}
+
+static void
+bit_writer_write_unary (BitWriter *writer,
+                        guint32    value)
+{
+  for (; value >= 32; value -= 32)
+    bit_writer_write (writer, G_MAXUINT32, 32);
+  bit_writer_write (writer, ((guint64)1 << value) - 1, value + 1);
+}
+
+/* Appends the prefixes as a Rice-encoded ThreatEntrySet. The API encodes the
+ * prefixes read as little endian integers, in their numeric order.
+ */
+static void
+append_rice_hashes (GString *json,
+                    GArray  *prefixes)
+{
+  g_autoptr(GArray) values = NULL;
+  g_autofree char *encoded = NULL;
+  BitWriter writer = { NULL, 0, 0 };
+  guint32 mean_delta;
+  guint parameter;
+
+  values = g_array_sized_new (FALSE, FALSE, sizeof (guint32), prefixes->len);
+  for (guint i = 0; i < prefixes->len; i++) {
+    guint32 value = GUINT32_SWAP_LE_BE (g_array_index (prefixes, guint32, i));
+
+    g_array_append_val (values, value);
+  }
+  g_array_sort (values, compare_uint32);
+
+  mean_delta = values->len > 1 ? (g_array_index (values, guint32, values->len - 1) - g_array_index (values, guint32, 0)) / (values->len - 1) : 0;
+  parameter = CLAMP (g_bit_storage (mean_delta) - 1, 2, 28);
+
+  writer.data = g_byte_array_new ();
+  for (guint i = 1; i < values->len; i++) {
+    guint32 delta = g_array_index (values, guint32, i) - g_array_index (values, guint32, i - 1);
+
+    bit_writer_write_unary (&writer, delta >> parameter);
+    bit_writer_write (&writer, delta & ((1u << parameter) - 1), parameter);
+  }
+  if (writer.count > 0)
+    bit_writer_write (&writer, 0, 8 - writer.count);
+
+  encoded = g_base64_encode (writer.data->data, writer.data->len);
+  g_byte_array_unref (writer.data);
+
+  g_string_append_printf (json,
+                          "{\"compressionType\":\"RICE\",\"riceHashes\":{"
+                          "\"firstValue\":\"%u\",\"riceParameter\":%u,\"numEntries\":%u,\"encodedData\":\"%s\"}}",
+                          g_array_index (values, guint32, 0), parameter, values->len - 1, encoded);
+}
+
+static GBytes *
+make_list_updates_response (const char *response_type,
+                            const char *client_state,
+                            GArray     *removals,
+                            GArray     *additions,
+                            GArray     *prefixes)
+{
+  g_autofree char *checksum = compute_checksum (prefixes);
+  GString *json = g_string_new (NULL);
+
+  g_string_append_printf (json,
+                          "{\"listUpdateResponses\":[{"
+                          "\"threatType\":\"" GSB_THREAT_TYPE_MALWARE "\",\"platformType\":\"LINUX\","
+                          "\"threatEntryType\":\"URL\",\"responseType\":\"%s\",",
+                          response_type);
+
+  if (removals && removals->len > 0) {
+    g_string_append (json, "\"removals\":[{\"compressionType\":\"RAW\",\"rawIndices\":{\"indices\":[");
+    for (guint i = 0; i < removals->len; i++)
+      g_string_append_printf (json, "%s%u", i > 0 ? "," : "", g_array_index (removals, guint32, i));
+    g_string_append (json, "]}}],");
+  }
+
+  if (additions->len > 0) {
+    g_string_append (json, "\"additions\":[");
+    append_rice_hashes (json, additions);
+    g_string_append (json, "],");
+  }
+
+  g_string_append_printf (json,
+                          "\"newClientState\":\"%s\",\"checksum\":{\"sha256\":\"%s\"}}],"
+                          "\"minimumWaitDuration\":\"1800s\"}",
+                          client_state, checksum);
+
+  return g_string_free_to_bytes (json);
+}
+
+static GBytes *
+make_full_hashes_response (GPtrArray *unsafe_hashes)
+{
+  GString *json = g_string_new ("{\"matches\":[");
+
+  for (guint i = 0; i < unsafe_hashes->len; i++) {
+    GBytes *hash = g_ptr_array_index (unsafe_hashes, i);
+    g_autofree char *hash_b64 = g_base64_encode (g_bytes_get_data (hash, NULL), g_bytes_get_size (hash));
+
+    g_string_append_printf (json,
+                            "%s{\"threatType\":\"" GSB_THREAT_TYPE_MALWARE "\",\"platformType\":\"LINUX\","
+                            "\"threatEntryType\":\"URL\",\"threat\":{\"hash\":\"%s\"},\"cacheDuration\":\"300s\"}",
+                            i > 0 ? "," : "", hash_b64);
+  }
+  g_string_append (json, "],\"negativeCacheDuration\":\"300s\"}");
+
+  return g_string_free_to_bytes (json);
+}
+
+/* Makes up URLs and the responses that make some of them unsafe. */
+static GPtrArray *
+synthesize (GBytes **full_update,
+            GBytes **partial_update,
+            GBytes **full_hashes)
+{
+  g_autoptr(GPtrArray) unsafe_hashes = NULL;
+  g_autoptr(GArray) prefixes = NULL;
+  g_autoptr(GArray) url_prefixes = NULL;
+  g_autoptr(GArray) removals = NULL;
+  g_autoptr(GArray) additions = NULL;
+  g_autoptr(GHashTable) kept = NULL;
+  GPtrArray *urls;
+  GRand *rand;
+  guint length;
+
+  rand = g_rand_new_with_seed (42);
+  urls = g_ptr_array_new_with_free_func ((GDestroyNotify)benchmark_url_free);
+  unsafe_hashes = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  url_prefixes = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (int i = 0; i < n_urls; i++) {
+    BenchmarkURL *url = g_new0 (BenchmarkURL, 1);
+
+    url->url = g_strdup_printf ("http://www.site-%08x.example/%08x/page-%d.html?q=%d",
+                                g_rand_int (rand), g_rand_int (rand), i, i);
+    url->unsafe = i % UNSAFE_URL_INTERVAL == 0;
+    g_ptr_array_add (urls, url);
+
+    /* The hash prefix of a URL that is not unsafe sends its verification to
+     * the server, which does not know its full hash.
+     */
+    if (url->unsafe || i % UNSAFE_URL_INTERVAL == UNSAFE_URL_INTERVAL / 2) {
+      GList *hashes = ephy_gsb_utils_compute_hashes (url->url);
+      guint32 prefix = hash_to_prefix (hashes->data);
+
+      g_array_append_val (url_prefixes, prefix);
+      if (url->unsafe)
+        g_ptr_array_add (unsafe_hashes, g_bytes_ref (hashes->data));
+      g_list_free_full (hashes, (GDestroyNotify)g_bytes_unref);
+    }
+  }
+
+  prefixes = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_prefixes + url_prefixes->len);
+  for (int i = 0; i < n_prefixes; i++) {
+    guint32 prefix = g_rand_int (rand);
+
+    g_array_append_val (prefixes, prefix);
+  }
+  g_array_append_vals (prefixes, url_prefixes->data, url_prefixes->len);
+  sort_unique (prefixes);
+
+  *full_update = make_list_updates_response ("FULL_UPDATE", "full", NULL, prefixes, prefixes);
+  *full_hashes = make_full_hashes_response (unsafe_hashes);
+
+  /* The partial update must keep the hash prefixes of the URLs. */
+  kept = g_hash_table_new (NULL, NULL);
+  for (guint i = 0; i < url_prefixes->len; i++)
+    g_hash_table_add (kept, GUINT_TO_POINTER (g_array_index (url_prefixes, guint32, i)));
+
+  removals = g_array_new (FALSE, FALSE, sizeof (guint32));
+  for (int i = 0; i < n_changes && prefixes->len > 0; i++) {
+    guint32 index = g_rand_int_range (rand, 0, prefixes->len);
+
+    if (!g_hash_table_contains (kept, GUINT_TO_POINTER (g_array_index (prefixes, guint32, index))))
+      g_array_append_val (removals, index);
+  }
+  sort_unique (removals);
+
+  /* Removals are indices into the list before the update. */
+  length = 0;
+  for (guint i = 0, r = 0; i < prefixes->len; i++) {
+    if (r < removals->len && g_array_index (removals, guint32, r) == i)
+      r++;
+    else
+      g_array_index (prefixes, guint32, length++) = g_array_index (prefixes, guint32, i);
+  }
+  g_array_set_size (prefixes, length);
+
+  additions = g_array_sized_new (FALSE, FALSE, sizeof (guint32), n_changes);
+  for (int i = 0; i < n_changes; i++) {
+    guint32 prefix = g_rand_int (rand);
+
+    g_array_append_val (additions, prefix);
+  }
+  sort_unique (additions);
+  g_array_append_vals (prefixes, additions->data, additions->len);
+  sort_unique (prefixes);
+
+  *partial_update = make_list_updates_response ("PARTIAL_UPDATE", "partial", removals, additions, prefixes);
+
+  g_rand_free (rand);
+
+  return urls;
+}
+
+static GBytes *
+load_response (const char  *path,
+               GError     **error)
+{
+  char *contents;
+  gsize length;
+
+  if (!g_file_get_contents (path, &contents, &length, error))
+    return NULL;
+
+  return g_bytes_new_take (contents, length);
+}
+
+static GPtrArray *
+load_urls (const char  *path,
+           GError     **error)
+{
+  g_autofree char *contents = NULL;
+  g_auto(GStrv) lines = NULL;
+  GPtrArray *urls;
+
+  if (!g_file_get_contents (path, &contents, NULL, error))
+    return NULL;
+
+  urls = g_ptr_array_new_with_free_func ((GDestroyNotify)benchmark_url_free);
+  lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i]; i++) {
+    BenchmarkURL *url;
+    char *separator;
+
+    g_strchomp (lines[i]);
+    if (!lines[i][0] || lines[i][0] == '#')
+      continue;
+
+    separator = strchr (lines[i], '\t');
+    if (!separator)
+      continue;
+    *separator = '\0';
+
+    url = g_new0 (BenchmarkURL, 1);
+    url->url = g_strdup (separator + 1);
+    url->unsafe = strcmp (lines[i], "unsafe") == 0;
+    g_ptr_array_add (urls, url);
+  }
+
+  return urls;
+}
+
+static void
+update_finished_cb (EphyGSBService *service,
+                    GMainLoop      *loop)
+{
+  g_main_loop_quit (loop);
+}
+
+static EphyGSBService *
+update (EphyGSBStorage    *storage,
+        EphyGSBTestServer *server,
+        guint64           *duration)
+{
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  EphyGSBService *service;
+  guint64 start;
+
+  /* Makes the service update the lists as soon as it is created. */
+  ephy_gsb_storage_set_metadata (storage, "next_list_updates_time", 0);
+
+  start = get_time_ns ();
+  service = g_object_new (EPHY_TYPE_GSB_SERVICE,
+                          "api-key", "benchmark",
+                          "api-prefix", ephy_gsb_test_server_get_api_prefix (server),
+                          "gsb-storage", storage,
+                          NULL);
+  g_signal_connect (service, "update-finished", G_CALLBACK (update_finished_cb), loop);
+  g_main_loop_run (loop);
+  *duration = get_time_ns () - start;
+
+  g_signal_handlers_disconnect_by_func (service, update_finished_cb, loop);
+
+  return service;
+}
+
+static void
+verify_url_cb (EphyGSBService *service,
+               GAsyncResult   *result,
+               VerifyData     *data)
+{
+  data->threats = ephy_gsb_service_verify_url_finish (service, result);
+  g_main_loop_quit (data->loop);
+}
+
+static int
+compare_durations (gconstpointer a,
+                   gconstpointer b)
+{
+  guint64 duration_a = *(const guint64 *)a;
+  guint64 duration_b = *(const guint64 *)b;
+
+  return duration_a < duration_b ? -1 : duration_a > duration_b;
+}
+
+static guint64
+get_percentile (GArray *durations,
+                guint   percentile)
+{
+  return g_array_index (durations, guint64, (durations->len - 1) * percentile / 100);
+}
+
+/* Verifies the URLs one at a time, as a user browsing would. */
+static guint
+verify_urls (EphyGSBService *service,
+             GPtrArray      *urls,
+             const char     *label)
+{
+  g_autoptr(GMainLoop) loop = g_main_loop_new (NULL, FALSE);
+  g_autoptr(GArray) durations = NULL;
+  guint n_differences = 0;
+
+  durations = g_array_sized_new (FALSE, FALSE, sizeof (guint64), urls->len);
+  for (guint i = 0; i < urls->len; i++) {
+    BenchmarkURL *url = g_ptr_array_index (urls, i);
+    VerifyData data = { loop, NULL };
+    guint64 start;
+    guint64 duration;
+
+    start = get_time_ns ();
+    ephy_gsb_service_verify_url (service, url->url, (GAsyncReadyCallback)verify_url_cb, &data);
+    g_main_loop_run (loop);
+    duration = get_time_ns () - start;
+    g_array_append_val (durations, duration);
+
+    if (!!data.threats != url->unsafe) {
+      g_print ("%s: wrong verdict for %s\n", label, url->url);
+      n_differences++;
+    }
+    g_list_free_full (data.threats, g_free);
+  }
+
+  if (durations->len > 0) {
+    g_array_sort (durations, compare_durations);
+    g_print ("%s latency p50:     %.3f ms\n", label, get_percentile (durations, 50) / 1e6);
+    g_print ("%s latency p90:     %.3f ms\n", label, get_percentile (durations, 90) / 1e6);
+    g_print ("%s latency p99:     %.3f ms\n", label, get_percentile (durations, 99) / 1e6);
+    g_print ("%s latency max:     %.3f ms\n", label, get_percentile (durations, 100) / 1e6);
+  }
+
+  return n_differences;
+}
+
+static void
+remove_directory (const char *path)
+{
+  g_autoptr(GDir) dir = NULL;
+  const char *name;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (!dir)
+    return;
+
+  while ((name = g_dir_read_name (dir))) {
+    g_autofree char *child = g_build_filename (path, name, NULL);
+
+    g_unlink (child);
+  }
+  g_rmdir (path);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  g_autoptr(GOptionContext) context = NULL;
+  g_autoptr(EphyGSBTestServer) server = NULL;
+  g_autoptr(EphyGSBStorage) storage = NULL;
+  g_autoptr(EphyGSBService) service = NULL;
+  g_autoptr(GPtrArray) urls = NULL;
+  g_autoptr(GBytes) full_update = NULL;
+  g_autoptr(GBytes) partial_update = NULL;
+  g_autoptr(GBytes) full_hashes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmp_dir = NULL;
+  g_autofree char *db_path = NULL;
+  guint64 full_update_time;
+  guint64 partial_update_time;
+  guint n_unsafe = 0;
+  guint n_differences = 0;
+  long setup_rss;
+  long update_rss;
+
+  context = g_option_context_new (NULL);
+  g_option_context_add_main_entries (context, option_entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("Failed to parse arguments: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (n_prefixes < 1 || n_changes < 0 || n_urls < 0 ||
+      (full_update_path && !urls_path) || (!full_update_path && (partial_update_path || full_hashes_path || urls_path))) {
+    g_autofree char *help = g_option_context_get_help (context, TRUE, NULL);
+
+    g_printerr ("%s", help);
+    return EXIT_FAILURE;
+  }
+
+  ephy_debug_init ();
+
+  if (!ephy_file_helpers_init (NULL, EPHY_FILE_HELPERS_TESTING_MODE, &error)) {
+    g_printerr ("Failed to initialize file helpers: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  if (full_update_path) {
+    if (!(full_update = load_response (full_update_path, &error)) ||
+        (partial_update_path && !(partial_update = load_response (partial_update_path, &error))) ||
+        (full_hashes_path && !(full_hashes = load_response (full_hashes_path, &error))) ||
+        !(urls = load_urls (urls_path, &error))) {
+      g_printerr ("Failed to load responses: %s\n", error->message);
+      return EXIT_FAILURE;
+    }
+  } else {
+    urls = synthesize (&full_update, &partial_update, &full_hashes);
+  }
+
+  for (guint i = 0; i < urls->len; i++)
+    n_unsafe += ((BenchmarkURL *)g_ptr_array_index (urls, i))->unsafe;
+
+  server = ephy_gsb_test_server_new (&error);
+  if (!server) {
+    g_printerr ("Failed to start the server: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  ephy_gsb_test_server_queue_list_updates_response (server, full_update);
+  if (partial_update)
+    ephy_gsb_test_server_queue_list_updates_response (server, partial_update);
+  if (full_hashes && !ephy_gsb_test_server_set_full_hashes_response (server, full_hashes, &error)) {
+    g_printerr ("Failed to load the full hashes response: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  tmp_dir = g_dir_make_tmp ("ephy-gsb-benchmark-XXXXXX", &error);
+  if (!tmp_dir) {
+    g_printerr ("Failed to create temporary directory: %s\n", error->message);
+    return EXIT_FAILURE;
+  }
+
+  db_path = g_build_filename (tmp_dir, "gsb-threats.db", NULL);
+  storage = ephy_gsb_storage_new (db_path);
+  if (!ephy_gsb_storage_is_operable (storage)) {
+    g_printerr ("Failed to open the database %s\n", db_path);
+    remove_directory (tmp_dir);
+    return EXIT_FAILURE;
+  }
+
+  /* The responses are already in memory, so count them out of the update. */
+  setup_rss = get_peak_rss ();
+
+  /* The full update starts with an empty database, as on first run. */
+  service = update (storage, server, &full_update_time);
+  update_rss = get_peak_rss ();
+  g_clear_object (&service);
+
+  /* The next update applies the partial update, if any, to the lists on
+   * disk, as on the next start.
+   */
+  service = update (storage, server, &partial_update_time);
+
+  g_print ("Full update:          %.3f ms, %" G_GSIZE_FORMAT " bytes\n",
+           full_update_time / 1e6, g_bytes_get_size (full_update));
+  if (partial_update)
+    g_print ("Incremental update:   %.3f ms, %" G_GSIZE_FORMAT " bytes\n",
+             partial_update_time / 1e6, g_bytes_get_size (partial_update));
+  else
+    g_print ("Empty update:         %.3f ms\n", partial_update_time / 1e6);
+  g_print ("URLs:                 %u, %u unsafe\n", urls->len, n_unsafe);
+
+  /* The first time, the URLs that share a hash prefix with the lists need a
+   * fullHashes:find request. The second time, their verdicts are cached.
+   */
+  n_differences += verify_urls (service, urls, "Cold");
+  g_print ("Full hashes requests: %u\n", ephy_gsb_test_server_get_n_full_hashes_requests (server));
+  n_differences += verify_urls (service, urls, "Warm");
+
+  g_print ("Peak RSS at start:    %ld KiB\n", setup_rss);
+  g_print ("Peak RSS full update: %ld KiB\n", update_rss);
+  g_print ("Peak RSS:             %ld KiB\n", get_peak_rss ());
+
+  g_clear_object (&service);
+  g_clear_object (&storage);
+  remove_directory (tmp_dir);
+  ephy_file_helpers_shutdown ();
+
+  if (n_differences > 0) {
+    g_print ("%u wrong verdicts\n", n_differences);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
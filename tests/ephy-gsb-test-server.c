@@ -0,0 +1,399 @@
+/* -*- Mode: C; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/*
+ *  Copyright © 2019 Igalia S.L.
+ *
+ *  This file is part of Epiphany.
+ *
+ *  Epiphany is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Epiphany is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Epiphany.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A local stand-in for the two methods of the Safe Browsing API that the
+ * service calls. It answers threatListUpdates:fetch with the queued
+ * responses, one per request and in order, and fullHashes:find with the
+ * matches of a single response that the request asks for. The responses
+ * can be recorded from the real API or synthesized.
+ *
+ * The server runs in a thread of its own, so that it answers even while
+ * the thread that drives the service is busy.
+ */
+
+#include "config.h"
+#include "ephy-gsb-test-server.h"
+
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
+#include <string.h>
+
+#define API_PATH "/v4/"
+
+/* What the API answers when there is nothing new. */
+#define EMPTY_LIST_UPDATES_RESPONSE "{\"listUpdateResponses\":[],\"minimumWaitDuration\":\"1800s\"}"
+#define EMPTY_FULL_HASHES_RESPONSE  "{\"negativeCacheDuration\":\"300s\"}"
+
+struct _EphyGSBTestServer {
+  GThread *thread;
+  GMainContext *context;
+  GMainLoop *loop;
+  SoupServer *server;
+  char *api_prefix;
+  GError *error;
+
+  GMutex lock;
+  GCond ready_cond;
+  gboolean ready;
+  GQueue list_updates_responses;
+  JsonNode *full_hashes_response;
+  guint n_full_hashes_requests;
+};
+
+static void
+send_response (SoupMessage *msg,
+               GBytes      *response)
+{
+  soup_message_set_status (msg, SOUP_STATUS_OK);
+  soup_message_headers_set_content_type (msg->response_headers, "application/json", NULL);
+  soup_message_body_append_bytes (msg->response_body, response);
+  soup_message_body_complete (msg->response_body);
+}
+
+static gboolean
+hash_is_requested (const char *hash_b64,
+                   GPtrArray  *prefixes)
+{
+  g_autofree guint8 *hash = NULL;
+  gsize hash_len;
+
+  hash = g_base64_decode (hash_b64, &hash_len);
+  for (guint i = 0; i < prefixes->len; i++) {
+    GBytes *prefix = g_ptr_array_index (prefixes, i);
+    gsize prefix_len = g_bytes_get_size (prefix);
+
+    if (prefix_len <= hash_len && memcmp (hash, g_bytes_get_data (prefix, NULL), prefix_len) == 0)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+/* Keeps the matches of the full hashes response whose hashes start with one
+ * of the requested hash prefixes, as the API does.
+ */
+static GBytes *
+make_full_hashes_response (EphyGSBTestServer *server,
+                           SoupMessage       *msg)
+{
+  g_autoptr(GPtrArray) prefixes = NULL;
+  JsonNode *request_node;
+  JsonNode *body_node;
+  JsonObject *response_obj;
+  JsonObject *body_obj;
+  JsonArray *matches;
+  GList *members;
+  char *body;
+
+  prefixes = g_ptr_array_new_with_free_func ((GDestroyNotify)g_bytes_unref);
+  request_node = json_from_string (msg->request_body->data, NULL);
+  if (request_node && JSON_NODE_HOLDS_OBJECT (request_node)) {
+    JsonObject *threat_info = json_object_get_object_member (json_node_get_object (request_node), "threatInfo");
+    JsonArray *entries = threat_info ? json_object_get_array_member (threat_info, "threatEntries") : NULL;
+
+    for (guint i = 0; entries && i < json_array_get_length (entries); i++) {
+      JsonObject *entry = json_array_get_object_element (entries, i);
+      guint8 *prefix;
+      gsize prefix_len;
+
+      prefix = g_base64_decode (json_object_get_string_member (entry, "hash"), &prefix_len);
+      g_ptr_array_add (prefixes, g_bytes_new_take (prefix, prefix_len));
+    }
+  }
+
+  response_obj = json_node_get_object (server->full_hashes_response);
+  body_obj = json_object_new ();
+  matches = json_array_new ();
+
+  members = json_object_get_members (response_obj);
+  for (GList *l = members; l; l = l->next) {
+    if (strcmp (l->data, "matches") != 0)
+      json_object_set_member (body_obj, l->data, json_node_copy (json_object_get_member (response_obj, l->data)));
+  }
+  g_list_free (members);
+
+  if (json_object_has_member (response_obj, "matches")) {
+    JsonArray *all_matches = json_object_get_array_member (response_obj, "matches");
+
+    for (guint i = 0; i < json_array_get_length (all_matches); i++) {
+      JsonObject *match = json_array_get_object_element (all_matches, i);
+      JsonObject *threat = json_object_get_object_member (match, "threat");
+
+      if (hash_is_requested (json_object_get_string_member (threat, "hash"), prefixes))
+        json_array_add_element (matches, json_node_copy (json_array_get_element (all_matches, i)));
+    }
+  }
+  json_object_set_array_member (body_obj, "matches", matches);
+
+  body_node = json_node_new (JSON_NODE_OBJECT);
+  json_node_take_object (body_node, body_obj);
+  body = json_to_string (body_node, FALSE);
+
+  json_node_unref (body_node);
+  if (request_node)
+    json_node_unref (request_node);
+
+  return g_bytes_new_take (body, strlen (body));
+}
+
+static void
+server_callback_cb (SoupServer        *soup_server,
+                    SoupMessage       *msg,
+                    const char        *path,
+                    GHashTable        *query,
+                    SoupClientContext *client,
+                    EphyGSBTestServer *server)
+{
+  g_autoptr(GBytes) response = NULL;
+  const char *method;
+
+  if (msg->method != SOUP_METHOD_POST) {
+    soup_message_set_status (msg, SOUP_STATUS_METHOD_NOT_ALLOWED);
+    return;
+  }
+
+  if (!g_str_has_prefix (path, API_PATH)) {
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+    return;
+  }
+
+  method = path + strlen (API_PATH);
+
+  g_mutex_lock (&server->lock);
+  if (strcmp (method, "threatListUpdates:fetch") == 0) {
+    response = g_queue_pop_head (&server->list_updates_responses);
+    if (!response)
+      response = g_bytes_new_static (EMPTY_LIST_UPDATES_RESPONSE, strlen (EMPTY_LIST_UPDATES_RESPONSE));
+  } else if (strcmp (method, "fullHashes:find") == 0) {
+    if (server->full_hashes_response)
+      response = make_full_hashes_response (server, msg);
+    else
+      response = g_bytes_new_static (EMPTY_FULL_HASHES_RESPONSE, strlen (EMPTY_FULL_HASHES_RESPONSE));
+    server->n_full_hashes_requests++;
+  }
+  g_mutex_unlock (&server->lock);
+
+  if (response)
+    send_response (msg, response);
+  else
+    soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+}
+
+static gboolean
+server_ready_cb (EphyGSBTestServer *server)
+{
+  g_mutex_lock (&server->lock);
+  server->ready = TRUE;
+  g_cond_signal (&server->ready_cond);
+  g_mutex_unlock (&server->lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gpointer
+server_thread (EphyGSBTestServer *server)
+{
+  GSList *uris;
+
+  /* The listening socket belongs to the thread-default context of the
+   * thread that starts listening.
+   */
+  g_main_context_push_thread_default (server->context);
+
+  server->server = soup_server_new (NULL, NULL);
+  soup_server_add_handler (server->server, API_PATH,
+                           (SoupServerCallback)server_callback_cb,
+                           server, NULL);
+
+  if (soup_server_listen_local (server->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &server->error)) {
+    uris = soup_server_get_uris (server->server);
+    server->api_prefix = g_strdup_printf ("http://127.0.0.1:%u" API_PATH, soup_uri_get_port (uris->data));
+    g_slist_free_full (uris, (GDestroyNotify)soup_uri_free);
+  }
+
+  /* Only report that the server is ready from inside the loop, so that it
+   * can be quit right away.
+   */
+  if (server->api_prefix) {
+    GSource *source = g_idle_source_new ();
+
+    g_source_set_callback (source, (GSourceFunc)server_ready_cb, server, NULL);
+    g_source_attach (source, server->context);
+    g_source_unref (source);
+
+    g_main_loop_run (server->loop);
+  } else {
+    server_ready_cb (server);
+  }
+
+  g_clear_object (&server->server);
+  g_main_context_pop_thread_default (server->context);
+
+  return NULL;
+}
+
+/**
+ * ephy_gsb_test_server_new:
+ * @error: return location for a #GError
+ *
+ * Starts a server listening on a free port of the loopback interface. Pass
+ * the result of ephy_gsb_test_server_get_api_prefix() as the "api-prefix"
+ * property of #EphyGSBService to talk to it.
+ *
+ * Returns: (transfer full): a new #EphyGSBTestServer, or %NULL on error
+ **/
+EphyGSBTestServer *
+ephy_gsb_test_server_new (GError **error)
+{
+  EphyGSBTestServer *server;
+
+  server = g_new0 (EphyGSBTestServer, 1);
+  server->context = g_main_context_new ();
+  server->loop = g_main_loop_new (server->context, FALSE);
+  g_mutex_init (&server->lock);
+  g_cond_init (&server->ready_cond);
+  g_queue_init (&server->list_updates_responses);
+
+  server->thread = g_thread_new ("EphyGSBTestServer", (GThreadFunc)server_thread, server);
+
+  g_mutex_lock (&server->lock);
+  while (!server->ready)
+    g_cond_wait (&server->ready_cond, &server->lock);
+  g_mutex_unlock (&server->lock);
+
+  if (server->error) {
+    g_propagate_error (error, server->error);
+    server->error = NULL;
+    ephy_gsb_test_server_free (server);
+    return NULL;
+  }
+
+  return server;
+}
+
+void
+ephy_gsb_test_server_free (EphyGSBTestServer *server)
+{
+  g_assert (server);
+
+  g_main_loop_quit (server->loop);
+  g_thread_join (server->thread);
+
+  g_queue_foreach (&server->list_updates_responses, (GFunc)g_bytes_unref, NULL);
+  g_queue_clear (&server->list_updates_responses);
+  g_clear_pointer (&server->full_hashes_response, json_node_unref);
+  g_main_loop_unref (server->loop);
+  g_main_context_unref (server->context);
+  g_mutex_clear (&server->lock);
+  g_cond_clear (&server->ready_cond);
+  g_free (server->api_prefix);
+  g_free (server);
+}
+
+const char *
+ephy_gsb_test_server_get_api_prefix (EphyGSBTestServer *server)
+{
+  g_assert (server);
+
+  return server->api_prefix;
+}
+
+/**
+ * ephy_gsb_test_server_queue_list_updates_response:
+ * @server: an #EphyGSBTestServer
+ * @response: the body of a threatListUpdates:fetch response
+ *
+ * Queues @response to answer the next threatListUpdates:fetch request that
+ * is not answered by a previously queued response. Once the queue is empty,
+ * requests are answered with an update without changes.
+ **/
+void
+ephy_gsb_test_server_queue_list_updates_response (EphyGSBTestServer *server,
+                                                  GBytes            *response)
+{
+  g_assert (server);
+  g_assert (response);
+
+  g_mutex_lock (&server->lock);
+  g_queue_push_tail (&server->list_updates_responses, g_bytes_ref (response));
+  g_mutex_unlock (&server->lock);
+}
+
+/**
+ * ephy_gsb_test_server_set_full_hashes_response:
+ * @server: an #EphyGSBTestServer
+ * @response: the body of a fullHashes:find response
+ * @error: return location for a #GError
+ *
+ * Sets the response that fullHashes:find requests are answered from. Every
+ * request gets the matches of @response for the hash prefixes it asks for,
+ * so one response with the full hashes of all unsafe URLs serves them all.
+ * Without a response, the requests are answered without any match.
+ *
+ * Returns: %TRUE if @response is a valid JSON object
+ **/
+gboolean
+ephy_gsb_test_server_set_full_hashes_response (EphyGSBTestServer  *server,
+                                               GBytes             *response,
+                                               GError            **error)
+{
+  JsonParser *parser;
+  JsonNode *root;
+
+  g_assert (server);
+  g_assert (response);
+
+  parser = json_parser_new ();
+  if (!json_parser_load_from_data (parser, g_bytes_get_data (response, NULL), g_bytes_get_size (response), error)) {
+    g_object_unref (parser);
+    return FALSE;
+  }
+
+  root = json_parser_get_root (parser);
+  if (!root || !JSON_NODE_HOLDS_OBJECT (root)) {
+    g_set_error_literal (error, JSON_PARSER_ERROR, JSON_PARSER_ERROR_INVALID_DATA,
+                         "The response is not a JSON object");
+    g_object_unref (parser);
+    return FALSE;
+  }
+
+  g_mutex_lock (&server->lock);
+  g_clear_pointer (&server->full_hashes_response, json_node_unref);
+  server->full_hashes_response = json_node_copy (root);
+  g_mutex_unlock (&server->lock);
+
+  g_object_unref (parser);
+
+  return TRUE;
+}
+
+guint
+ephy_gsb_test_server_get_n_full_hashes_requests (EphyGSBTestServer *server)
+{
+  guint n_requests;
+
+  g_assert (server);
+
+  g_mutex_lock (&server->lock);
+  n_requests = server->n_full_hashes_requests;
+  g_mutex_unlock (&server->lock);
+
+  return n_requests;
+}
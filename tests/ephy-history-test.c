@@ -21,10 +21,12 @@
 #include "config.h"
 #include "ephy-debug.h"
 #include "ephy-file-helpers.h"
+#include "ephy-history-index.h"
 #include "ephy-history-service.h"
 
 #include <glib/gstdio.h>
 #include <gtk/gtk.h>
+#include <string.h>
 
 static const char *
 test_db_filename (void)
@@ -38,8 +40,18 @@ test_db_filename (void)
 static EphyHistoryService *
 ensure_empty_history (const char *filename)
 {
+  char *wal = g_strconcat (filename, "-wal", NULL);
+  char *shm = g_strconcat (filename, "-shm", NULL);
+
   if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
     g_unlink (filename);
+  if (g_file_test (wal, G_FILE_TEST_IS_REGULAR))
+    g_unlink (wal);
+  if (g_file_test (shm, G_FILE_TEST_IS_REGULAR))
+    g_unlink (shm);
+
+  g_free (wal);
+  g_free (shm);
 
   return ephy_history_service_new (filename, EPHY_SQLITE_CONNECTION_MODE_READWRITE);
 }
@@ -435,6 +447,59 @@ test_complex_url_query_with_time_range (void)
   gtk_main ();
 }
 
+static void
+perform_title_substring_url_query (EphyHistoryService *service,
+                                   gboolean            success,
+                                   gpointer            result_data,
+                                   gpointer            user_data)
+{
+  EphyHistoryQuery *query;
+  EphyHistoryURL *url;
+
+  g_assert_true (success);
+
+  /* Get the most visited site with both substrings in its address or title,
+   * one of them too short for the full-text index.
+   */
+  query = ephy_history_query_new ();
+  query->substring_list = g_list_prepend (query->substring_list, (gpointer)"FOUNDATION");
+  query->substring_list = g_list_prepend (query->substring_list, (gpointer)"gn");
+  query->limit = 10;
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+
+  /* The expected result. */
+  url = ephy_history_url_new ("http://www.gnome.org",
+                              "The GNOME Foundation",
+                              10, 10, 0);
+
+  ephy_history_service_query_urls (service, query, NULL, verify_complex_url_query, url);
+}
+
+static void
+set_title_for_substring_url_query (EphyHistoryService *service,
+                                   gboolean            success,
+                                   gpointer            result_data,
+                                   gpointer            user_data)
+{
+  g_assert_true (success);
+
+  ephy_history_service_set_url_title (service, "http://www.gnome.org", "The GNOME Foundation",
+                                      NULL, perform_title_substring_url_query, NULL);
+}
+
+static void
+test_substring_url_query (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits;
+
+  visits = create_visits_for_complex_tests ();
+
+  ephy_history_service_add_visits (service, visits, NULL, set_title_for_substring_url_query, NULL);
+
+  gtk_main ();
+}
+
 static void
 verify_query_after_clear (EphyHistoryService *service,
                           gboolean            success,
@@ -482,6 +547,540 @@ test_clear (void)
   gtk_main ();
 }
 
+static void
+test_query_after_clear (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits = create_test_page_visit_list ();
+  EphyHistoryQuery *query;
+
+  /* The query is sent right away, like the history dialog does, and must
+   * not see the history from before it was cleared.
+   */
+  ephy_history_service_add_visits (service, visits, NULL, NULL, NULL);
+  ephy_history_page_visit_list_free (visits);
+  ephy_history_service_clear (service, NULL, NULL, NULL);
+
+  query = ephy_history_query_new ();
+  query->sort_type = EPHY_HISTORY_SORT_MOST_VISITED;
+  ephy_history_service_query_urls (service, query, NULL, verify_query_after_clear, NULL);
+  ephy_history_query_free (query);
+
+  gtk_main ();
+}
+
+static void
+verify_query_after_visit (EphyHistoryService *service,
+                          gboolean            success,
+                          gpointer            result_data,
+                          gpointer            user_data)
+{
+  GList *urls = (GList *)result_data;
+
+  g_assert_true (success);
+  g_assert_cmpint (g_list_length (urls), ==, 1);
+  g_assert_cmpstr (((EphyHistoryURL *)urls->data)->url, ==, "http://www.gnome.org");
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+
+  g_object_unref (service);
+
+  gtk_main_quit ();
+}
+
+static void
+test_query_after_visit (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  EphyHistoryQuery *query;
+
+  ephy_history_service_visit_url (service, "http://www.gnome.org", NULL, g_get_real_time (),
+                                  EPHY_PAGE_VISIT_TYPED, TRUE);
+
+  query = ephy_history_query_new ();
+  query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+  ephy_history_service_query_urls (service, query, NULL, verify_query_after_visit, NULL);
+  ephy_history_query_free (query);
+
+  gtk_main ();
+}
+
+static char *
+get_query_plan (EphySQLiteConnection *connection,
+                const char           *sql)
+{
+  EphySQLiteStatement *statement;
+  GString *plan = g_string_new (NULL);
+  GError *error = NULL;
+  char *explain;
+
+  explain = g_strconcat ("EXPLAIN QUERY PLAN ", sql, NULL);
+  statement = ephy_sqlite_connection_create_statement (connection, explain, &error);
+  g_assert_no_error (error);
+  g_free (explain);
+
+  /* The fourth column describes each step of the plan. */
+  while (ephy_sqlite_statement_step (statement, &error))
+    g_string_append_printf (plan, "%s\n", ephy_sqlite_statement_get_column_as_string (statement, 3));
+  g_assert_no_error (error);
+
+  g_object_unref (statement);
+
+  return g_string_free (plan, FALSE);
+}
+
+static gboolean
+query_plan_scans_table (const char *plan,
+                        const char *table)
+{
+  char **steps = g_strsplit (plan, "\n", -1);
+  gboolean scans = FALSE;
+
+  /* Older SQLite versions say "SCAN TABLE". */
+  for (guint i = 0; steps[i] && !scans; i++) {
+    char **words = g_strsplit (steps[i], " ", 4);
+
+    if (g_strv_length (words) >= 2 && strcmp (words[0], "SCAN") == 0)
+      scans = strcmp (words[1], table) == 0 || (strcmp (words[1], "TABLE") == 0 && g_strcmp0 (words[2], table) == 0);
+    g_strfreev (words);
+  }
+  g_strfreev (steps);
+
+  return scans;
+}
+
+static void
+assert_query_uses_index (EphySQLiteConnection *connection,
+                         const char           *sql,
+                         const char           *table,
+                         const char           *index)
+{
+  char *plan = get_query_plan (connection, sql);
+
+  if (!strstr (plan, index) || query_plan_scans_table (plan, table))
+    g_error ("Unexpected query plan for %s:\n%s", sql, plan);
+
+  g_free (plan);
+}
+
+static void
+assert_history_query_plans (void)
+{
+  EphySQLiteConnection *connection;
+  GError *error = NULL;
+
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READ_ONLY, test_db_filename ());
+  ephy_sqlite_connection_open (connection, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (ephy_sqlite_connection_get_user_version (connection, &error), ==, 3);
+  g_assert_no_error (error);
+
+  /* ephy_history_service_get_url_row() */
+  assert_query_uses_index (connection,
+                           "SELECT id, url, title, visit_count, typed_count, last_visit_time, hidden_from_overview, sync_id FROM urls "
+                           "WHERE url=?",
+                           "urls", "urls_url_index");
+  /* Deleting a host deletes its URLs. */
+  assert_query_uses_index (connection,
+                           "SELECT id FROM urls WHERE host=?",
+                           "urls", "urls_host_index");
+  /* Deleting a URL deletes its visits. */
+  assert_query_uses_index (connection,
+                           "SELECT id FROM visits WHERE url=?",
+                           "visits", "visits_url_time_index");
+  /* ephy_history_service_find_visit_rows() */
+  assert_query_uses_index (connection,
+                           "SELECT visits.url, visits.visit_time, visits.visit_type FROM visits "
+                           "WHERE visits.visit_time >= ? AND visits.visit_time <= ? AND 1",
+                           "visits", "visits_time_index");
+  /* ephy_history_service_find_url_rows() */
+  assert_query_uses_index (connection,
+                           "SELECT DISTINCT urls.id, urls.url, urls.title FROM urls "
+                           "JOIN visits ON visits.url = urls.id WHERE visits.visit_time >= ? AND visits.visit_time <= ? AND "
+                           "urls.hidden_from_overview = 0 AND 1 ORDER BY urls.visit_count DESC LIMIT ?",
+                           "visits", "visits_time_index");
+  /* ephy_history_service_find_url_rows() for the next page of history. */
+  assert_query_uses_index (connection,
+                           "SELECT DISTINCT urls.id, urls.url, urls.title FROM urls "
+                           "WHERE urls.hidden_from_overview = 0 AND urls.last_visit_time <= ? AND "
+                           "(urls.last_visit_time < ? OR urls.id < ?) AND 1 "
+                           "ORDER BY urls.last_visit_time DESC, urls.id DESC LIMIT ?",
+                           "urls", "urls_last_visit_time_index");
+  /* ephy_history_service_get_host_row() */
+  assert_query_uses_index (connection,
+                           "SELECT id, url, title, visit_count, zoom_level FROM hosts WHERE url=?",
+                           "hosts", "hosts_url_index");
+  /* ephy_history_service_find_url_rows() with substrings, if SQLite can
+   * index them.
+   */
+  if (ephy_sqlite_connection_table_exists (connection, "urls_fts"))
+    assert_query_uses_index (connection,
+                             "SELECT DISTINCT urls.id, urls.url, urls.title FROM urls "
+                             "WHERE urls.id IN (SELECT rowid FROM urls_fts WHERE urls_fts MATCH ?) AND "
+                             "(urls.url LIKE ? OR urls.title LIKE ?) AND 1 ORDER BY urls.visit_count DESC LIMIT ?",
+                             "urls", "urls_fts");
+
+  g_object_unref (connection);
+}
+
+#define N_PAGED_URLS 40
+#define PAGE_SIZE 7
+
+typedef struct {
+  EphyHistoryQuery *query;
+  guint n_urls;
+} PagedQuery;
+
+static void
+verify_url_page (EphyHistoryService *service,
+                 gboolean            success,
+                 gpointer            result_data,
+                 gpointer            user_data)
+{
+  PagedQuery *paged_query = user_data;
+  EphyHistoryQuery *query = paged_query->query;
+  GList *urls = (GList *)result_data;
+
+  g_assert_true (success);
+  g_assert_cmpuint (g_list_length (urls), <=, PAGE_SIZE);
+
+  /* Each page carries on from the previous one, without gaps or repeats. */
+  for (GList *l = urls; l; l = l->next) {
+    EphyHistoryURL *url = l->data;
+
+    if (query->after_id > 0) {
+      g_assert_cmpint (url->last_visit_time, <=, query->after_last_visit_time);
+      if (url->last_visit_time == query->after_last_visit_time)
+        g_assert_cmpint (url->id, <, query->after_id);
+    }
+
+    query->after_last_visit_time = url->last_visit_time;
+    query->after_id = url->id;
+    paged_query->n_urls++;
+  }
+
+  if (g_list_length (urls) < PAGE_SIZE) {
+    g_assert_cmpuint (paged_query->n_urls, ==, N_PAGED_URLS);
+    ephy_history_query_free (query);
+    g_free (paged_query);
+    g_object_unref (service);
+    gtk_main_quit ();
+  } else {
+    ephy_history_service_query_urls (service, query, NULL, verify_url_page, paged_query);
+  }
+
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+}
+
+static void
+perform_paged_url_query (EphyHistoryService *service,
+                         gboolean            success,
+                         gpointer            result_data,
+                         gpointer            user_data)
+{
+  PagedQuery *paged_query = g_new0 (PagedQuery, 1);
+
+  g_assert_true (success);
+
+  paged_query->query = ephy_history_query_new ();
+  paged_query->query->sort_type = EPHY_HISTORY_SORT_MOST_RECENTLY_VISITED;
+  paged_query->query->limit = PAGE_SIZE;
+
+  ephy_history_service_query_urls (service, paged_query->query, NULL, verify_url_page, paged_query);
+}
+
+static void
+test_paged_url_query (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  GList *visits = NULL;
+
+  /* Some URLs share their last visit time, so that pages end within ties. */
+  for (int i = 0; i < N_PAGED_URLS; i++) {
+    char *url = g_strdup_printf ("http://www.example.com/%d", i);
+
+    visits = g_list_prepend (visits, ephy_history_page_visit_new (url, i / 3 + 1, EPHY_PAGE_VISIT_TYPED));
+    g_free (url);
+  }
+
+  ephy_history_service_add_visits (service, visits, NULL, perform_paged_url_query, NULL);
+  ephy_history_page_visit_list_free (visits);
+
+  gtk_main ();
+}
+
+#define N_BATCHED_VISITS 1000
+
+static void
+verify_batched_writes (EphyHistoryService *service,
+                       gboolean            success,
+                       gpointer            result_data,
+                       gpointer            user_data)
+{
+  GList *visits = (GList *)result_data;
+
+  g_assert_true (success);
+  g_assert_cmpuint (g_list_length (visits), ==, N_BATCHED_VISITS);
+  ephy_history_page_visit_list_free (visits);
+
+  g_object_unref (service);
+
+  gtk_main_quit ();
+}
+
+static void
+batched_visit_added (EphyHistoryService *service,
+                     gboolean            success,
+                     gpointer            result_data,
+                     gpointer            user_data)
+{
+  int *pending_visits = user_data;
+
+  g_assert_true (success);
+
+  if (--*pending_visits == 0)
+    ephy_history_service_find_visits_in_time (service, 0, N_BATCHED_VISITS, NULL, verify_batched_writes, NULL);
+}
+
+static void
+test_batched_writes (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  int pending_visits = N_BATCHED_VISITS;
+
+  /* These are committed in a few transactions, but each one still gets its
+   * own callback.
+   */
+  for (int i = 1; i <= N_BATCHED_VISITS; i++) {
+    EphyHistoryPageVisit *visit = ephy_history_page_visit_new ("http://www.gnome.org", i, EPHY_PAGE_VISIT_TYPED);
+
+    ephy_history_service_add_visit (service, visit, NULL, batched_visit_added, &pending_visits);
+    ephy_history_page_visit_free (visit);
+  }
+
+  gtk_main ();
+}
+
+static void
+test_query_plans (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+
+  assert_history_query_plans ();
+
+  g_object_unref (service);
+}
+
+static void
+test_schema_migration (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  EphySQLiteConnection *connection;
+  GError *error = NULL;
+
+  g_object_unref (service);
+
+  /* Turn the database back into one from before the schema was versioned. */
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READWRITE, test_db_filename ());
+  ephy_sqlite_connection_open (connection, &error);
+  g_assert_no_error (error);
+  ephy_sqlite_connection_execute (connection,
+                                  "DROP INDEX urls_url_index;"
+                                  "DROP INDEX urls_host_index;"
+                                  "DROP INDEX visits_url_time_index;"
+                                  "DROP INDEX visits_time_index;"
+                                  "DROP INDEX hosts_url_index;"
+                                  "DROP INDEX urls_last_visit_time_index;"
+                                  "DROP TRIGGER IF EXISTS urls_fts_insert;"
+                                  "DROP TRIGGER IF EXISTS urls_fts_delete;"
+                                  "DROP TRIGGER IF EXISTS urls_fts_update;"
+                                  "DROP TABLE IF EXISTS urls_fts;", &error);
+  g_assert_no_error (error);
+  ephy_sqlite_connection_set_user_version (connection, 0, &error);
+  g_assert_no_error (error);
+  g_object_unref (connection);
+
+  service = ephy_history_service_new (test_db_filename (), EPHY_SQLITE_CONNECTION_MODE_READWRITE);
+
+  assert_history_query_plans ();
+
+  g_object_unref (service);
+}
+
+static void
+reads_during_writes_visits_added (EphyHistoryService *service,
+                                  gboolean            success,
+                                  gpointer            result_data,
+                                  gpointer            user_data)
+{
+  int *pending_jobs = user_data;
+
+  g_assert_true (success);
+
+  if (--*pending_jobs == 0)
+    gtk_main_quit ();
+}
+
+static void
+reads_during_writes_query_done (EphyHistoryService *service,
+                                gboolean            success,
+                                gpointer            result_data,
+                                gpointer            user_data)
+{
+  GList *urls = (GList *)result_data;
+  int *pending_jobs = user_data;
+  guint n_urls = g_list_length (urls);
+
+  g_assert_true (success);
+
+  /* The query sees the visits that were sent before it. */
+  g_assert_cmpuint (n_urls, ==, 2);
+  g_list_free_full (urls, (GDestroyNotify)ephy_history_url_free);
+
+  if (--*pending_jobs == 0)
+    gtk_main_quit ();
+}
+
+static void
+test_reads_during_writes (void)
+{
+  EphyHistoryService *service = ensure_empty_history (test_db_filename ());
+  EphySQLiteConnection *connection;
+  EphySQLiteStatement *statement;
+  EphyHistoryQuery *query;
+  GError *error = NULL;
+  int pending_jobs = 0;
+
+  /* Reads do not hold up writes because the database is in WAL mode. */
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READ_ONLY, test_db_filename ());
+  ephy_sqlite_connection_open (connection, &error);
+  g_assert_no_error (error);
+  statement = ephy_sqlite_connection_create_statement (connection, "PRAGMA journal_mode", &error);
+  g_assert_no_error (error);
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (ephy_sqlite_statement_get_column_as_string (statement, 0), ==, "wal");
+  g_object_unref (statement);
+  g_object_unref (connection);
+
+  query = ephy_history_query_new ();
+
+  for (guint i = 0; i < 10; i++) {
+    GList *visits = create_test_page_visit_list ();
+
+    ephy_history_service_add_visits (service, visits, NULL,
+                                     reads_during_writes_visits_added, &pending_jobs);
+    ephy_history_page_visit_list_free (visits);
+    ephy_history_service_query_urls (service, query, NULL,
+                                     reads_during_writes_query_done, &pending_jobs);
+    pending_jobs += 2;
+  }
+
+  ephy_history_query_free (query);
+
+  gtk_main ();
+
+  g_object_unref (service);
+}
+
+static const char *
+index_match_url (GPtrArray *matches,
+                 guint      i)
+{
+  return ((EphyHistoryIndexMatch *)g_ptr_array_index (matches, i))->url;
+}
+
+static void
+test_history_index (void)
+{
+  g_autoptr(EphyHistoryIndex) index = ephy_history_index_new ();
+  gint64 now = g_get_real_time ();
+  GPtrArray *matches;
+  EphyHistoryURL *url;
+
+  url = ephy_history_url_new ("https://www.gnome.org/", "GNOME", 5, 0, now);
+  ephy_history_index_add_url (index, url, now);
+  ephy_history_url_free (url);
+
+  /* Visited more often, but long ago. */
+  url = ephy_history_url_new ("https://wiki.gnome.org/Apps/Web", "Web - GNOME Wiki", 20, 0, now - 200 * G_TIME_SPAN_DAY);
+  ephy_history_index_add_url (index, url, now);
+  ephy_history_url_free (url);
+
+  url = ephy_history_url_new ("http://example.com/", "Example Domain", 1, 0, now);
+  ephy_history_index_add_url (index, url, now);
+  ephy_history_url_free (url);
+
+  ephy_history_index_add_bookmark (index, "https://www.gnome.org/", "GNOME bookmark");
+  g_assert_cmpuint (ephy_history_index_get_size (index), ==, 4);
+
+  /* Trigram lookups are case insensitive and ranked by frecency. */
+  matches = ephy_history_index_query (index, "gnOME", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 2);
+  g_assert_cmpstr (index_match_url (matches, 0), ==, "https://www.gnome.org/");
+  g_assert_cmpstr (index_match_url (matches, 1), ==, "https://wiki.gnome.org/Apps/Web");
+  g_ptr_array_unref (matches);
+
+  /* All the terms have to match, in the title or the URL. */
+  matches = ephy_history_index_query (index, "wiki apps", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (index_match_url (matches, 0), ==, "https://wiki.gnome.org/Apps/Web");
+  g_ptr_array_unref (matches);
+
+  matches = ephy_history_index_query (index, "gnome nowhere", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 0);
+  g_ptr_array_unref (matches);
+
+  /* Short terms match the beginning of the URL, after the scheme and www. */
+  matches = ephy_history_index_query (index, "gn", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (index_match_url (matches, 0), ==, "https://www.gnome.org/");
+  g_ptr_array_unref (matches);
+
+  matches = ephy_history_index_query (index, "e", EPHY_HISTORY_INDEX_HISTORY, 1);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (index_match_url (matches, 0), ==, "http://example.com/");
+  g_ptr_array_unref (matches);
+
+  matches = ephy_history_index_query (index, "bookmark", EPHY_HISTORY_INDEX_BOOKMARKS, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (((EphyHistoryIndexMatch *)g_ptr_array_index (matches, 0))->title, ==, "GNOME bookmark");
+  g_ptr_array_unref (matches);
+
+  /* Changing a title replaces its trigrams. */
+  ephy_history_index_set_url_title (index, "http://example.com/", "Illustration");
+  matches = ephy_history_index_query (index, "domain", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 0);
+  g_ptr_array_unref (matches);
+  matches = ephy_history_index_query (index, "illustr", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+
+  ephy_history_index_remove_url (index, "https://www.gnome.org/");
+  matches = ephy_history_index_query (index, "gnome", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_assert_cmpstr (index_match_url (matches, 0), ==, "https://wiki.gnome.org/Apps/Web");
+  g_ptr_array_unref (matches);
+
+  /* Clearing the history keeps the bookmarks. */
+  ephy_history_index_clear_urls (index);
+  g_assert_cmpuint (ephy_history_index_get_size (index), ==, 1);
+  matches = ephy_history_index_query (index, "gnome", EPHY_HISTORY_INDEX_BOOKMARKS, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+
+  /* URLs added after clearing share trigrams with the bookmark that is left. */
+  url = ephy_history_url_new ("https://www.gnome.org/", "GNOME", 1, 0, now);
+  ephy_history_index_add_url (index, url, now);
+  ephy_history_url_free (url);
+  matches = ephy_history_index_query (index, "gnome", EPHY_HISTORY_INDEX_HISTORY, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+  matches = ephy_history_index_query (index, "gnome", EPHY_HISTORY_INDEX_BOOKMARKS, 0);
+  g_assert_cmpuint (matches->len, ==, 1);
+  g_ptr_array_unref (matches);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -510,7 +1109,16 @@ main (int argc, char *argv[])
   g_test_add_func ("/embed/history/test_get_url_not_existent", test_get_url_not_existent);
   g_test_add_func ("/embed/history/test_complex_url_query", test_complex_url_query);
   g_test_add_func ("/embed/history/test_complex_url_query_with_time_range", test_complex_url_query_with_time_range);
+  g_test_add_func ("/embed/history/test_substring_url_query", test_substring_url_query);
   g_test_add_func ("/embed/history/test_clear", test_clear);
+  g_test_add_func ("/embed/history/test_query_after_clear", test_query_after_clear);
+  g_test_add_func ("/embed/history/test_query_after_visit", test_query_after_visit);
+  g_test_add_func ("/embed/history/test_paged_url_query", test_paged_url_query);
+  g_test_add_func ("/embed/history/test_reads_during_writes", test_reads_during_writes);
+  g_test_add_func ("/embed/history/test_batched_writes", test_batched_writes);
+  g_test_add_func ("/embed/history/test_query_plans", test_query_plans);
+  g_test_add_func ("/embed/history/test_schema_migration", test_schema_migration);
+  g_test_add_func ("/embed/history/test_history_index", test_history_index);
 
   ret = g_test_run ();
 
@@ -217,6 +217,86 @@ test_table_exists (void)
   g_free (temporary_file);
 }
 
+static void
+test_statement_cache (void)
+{
+  gchar *temporary_file;
+  EphySQLiteConnection *connection;
+  GError *error = NULL;
+  EphySQLiteStatement *statement = NULL;
+  EphySQLiteStatement *other_statement = NULL;
+  guint hits, prepares;
+
+  temporary_file = g_build_filename (g_get_tmp_dir (), "epiphany-sqlite-test.db", NULL);
+  connection = ephy_sqlite_connection_new (EPHY_SQLITE_CONNECTION_MODE_READWRITE, temporary_file);
+  g_assert_true (ephy_sqlite_connection_open (connection, &error));
+  g_assert_no_error (error);
+
+  ephy_sqlite_connection_execute (connection, "CREATE TABLE test (id INTEGER, text LONGVARCHAR)", &error);
+  g_assert_no_error (error);
+
+  statement = ephy_sqlite_connection_create_statement (connection, "INSERT INTO test (id, text) VALUES (?, ?)", &error);
+  g_assert_no_error (error);
+  g_assert_true (ephy_sqlite_statement_bind_int (statement, 0, 3, &error));
+  g_assert_true (ephy_sqlite_statement_bind_string (statement, 1, "foo", &error));
+  g_assert_false (ephy_sqlite_statement_step (statement, &error));
+  g_assert_no_error (error);
+  g_object_unref (statement);
+
+  /* The statement is reused, without the values bound to it before. */
+  statement = ephy_sqlite_connection_create_statement (connection, "INSERT INTO test (id, text) VALUES (?, ?)", &error);
+  g_assert_no_error (error);
+  g_assert_false (ephy_sqlite_statement_step (statement, &error));
+  g_assert_no_error (error);
+  g_object_unref (statement);
+
+  ephy_sqlite_connection_get_statement_cache_stats (connection, &hits, &prepares);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (prepares, ==, 1);
+
+  /* A statement that is in use is not handed out twice. */
+  statement = ephy_sqlite_connection_create_statement (connection, "SELECT id, text FROM test ORDER BY rowid", &error);
+  g_assert_no_error (error);
+  other_statement = ephy_sqlite_connection_create_statement (connection, "SELECT id, text FROM test ORDER BY rowid", &error);
+  g_assert_no_error (error);
+
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  g_assert_cmpint (ephy_sqlite_statement_get_column_as_int (statement, 0), ==, 3);
+  g_assert_true (ephy_sqlite_statement_step (other_statement, &error));
+  g_assert_cmpint (ephy_sqlite_statement_get_column_as_int (other_statement, 0), ==, 3);
+  g_assert_true (ephy_sqlite_statement_step (statement, &error));
+  g_assert_cmpint (ephy_sqlite_statement_get_column_type (statement, 0), ==, EPHY_SQLITE_COLUMN_TYPE_NULL);
+  g_assert_no_error (error);
+  g_object_unref (statement);
+  g_object_unref (other_statement);
+
+  ephy_sqlite_connection_get_statement_cache_stats (connection, &hits, &prepares);
+  g_assert_cmpuint (hits, ==, 1);
+  g_assert_cmpuint (prepares, ==, 3);
+
+  /* A statement left over from before closing the connection is not kept. */
+  statement = ephy_sqlite_connection_create_statement (connection, "SELECT id, text FROM test ORDER BY rowid", &error);
+  g_assert_no_error (error);
+  ephy_sqlite_connection_close (connection);
+  g_object_unref (statement);
+
+  g_assert_true (ephy_sqlite_connection_open (connection, &error));
+  g_assert_no_error (error);
+  statement = ephy_sqlite_connection_create_statement (connection, "SELECT id, text FROM test ORDER BY rowid", &error);
+  g_assert_no_error (error);
+  g_object_unref (statement);
+
+  ephy_sqlite_connection_get_statement_cache_stats (connection, &hits, &prepares);
+  g_assert_cmpuint (hits, ==, 2);
+  g_assert_cmpuint (prepares, ==, 4);
+
+  ephy_sqlite_connection_close (connection);
+  ephy_sqlite_connection_delete_database (connection);
+
+  g_object_unref (connection);
+  g_free (temporary_file);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -227,6 +307,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/lib/sqlite/ephy-sqlite/create_table_and_insert_row", test_create_table_and_insert_row);
   g_test_add_func ("/lib/sqlite/ephy-sqlite/bind_data", test_bind_data);
   g_test_add_func ("/lib/sqlite/ephy-sqlite/table_exists", test_table_exists);
+  g_test_add_func ("/lib/sqlite/ephy-sqlite/statement_cache", test_statement_cache);
 
   return g_test_run ();
 }